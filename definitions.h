@@ -34,7 +34,8 @@
  */
 #define PCI_CLASS_STORAGE_EXPRESS    0x010802
 
-#define NVME_MINORS            16
+/* register_chrdev() reserves minors 0 to 255 of the dynamic major */
+#define NVME_MINORS            256
 
 /**
  * @def MAX_PCI_EXPRESS_CFG
@@ -20,12 +20,16 @@
 #include <linux/kernel.h>
 #include <linux/pci.h>
 #include <linux/types.h>
+#include <linux/vmalloc.h>
+#include <linux/pagemap.h>
+#include <linux/workqueue.h>
 
 #include "sysdnvme.h"
 #include "definitions.h"
 #include "dnvme_reg.h"
 #include "dnvme_ds.h"
 #include "dnvme_cmds.h"
+#include "dnvme_trace.h"
 
 
 
@@ -33,7 +37,16 @@
 static int data_buf_to_prp(struct nvme_device *nvme_dev,
     struct metrics_sq *pmetrics_sq, struct nvme_64b_send *nvme_64b_send,
     struct nvme_prps *prps, u8 opcode, u16 persist_q_id,
-    enum data_buf_type data_buf_type, u16 cmd_id);
+    enum data_buf_type data_buf_type, u16 cmd_id,
+    struct metrics_reg_buf *reg_buf);
+static int reg_buf_to_prp(struct nvme_device *nvme_dev,
+    struct metrics_reg_buf *reg_buf, struct nvme_64b_send *nvme_64b_send,
+    struct nvme_prps *prps);
+static int reg_buf_to_sg(struct metrics_reg_buf *reg_buf, u32 buf_offset,
+    u32 buf_len, struct scatterlist **sg_list, u32 *sg_offset,
+    struct nvme_prps *prps);
+static void sync_reg_buf_sg(struct device *dev, struct nvme_prps *prps,
+    u8 for_device);
 static int map_user_pg_to_dma(struct nvme_device *nvme_dev,
     enum dma_data_direction kernel_dir, unsigned long buf_addr,
     unsigned total_buf_len, struct scatterlist **sg_list,
@@ -41,7 +54,7 @@ static int map_user_pg_to_dma(struct nvme_device *nvme_dev,
 static int pages_to_sg(struct page **pages, int num_pages, int buf_offset,
     unsigned len, struct scatterlist **sg_list);
 static int setup_prps(struct nvme_device *nvme_dev, struct scatterlist *sg,
-    s32 buf_len, struct nvme_prps *prps, u8 cr_io_q,
+    u32 sg_offset, s32 buf_len, struct nvme_prps *prps, u8 cr_io_q,
     enum send_64b_bitmask prp_mask);
 static void unmap_user_pg_to_dma(struct nvme_device *nvme_dev,
     struct nvme_prps *prps);
@@ -57,7 +70,8 @@ static void free_prp_pool(struct nvme_device *nvme_dev,
 int prep_send64b_cmd(struct nvme_device *nvme_dev, struct metrics_sq
     *pmetrics_sq, struct nvme_64b_send *nvme_64b_send, struct nvme_prps *prps,
     struct nvme_gen_cmd *nvme_gen_cmd, u16 persist_q_id,
-    enum data_buf_type data_buf_type, u8 gen_prp)
+    enum data_buf_type data_buf_type, u8 gen_prp,
+    struct metrics_reg_buf *reg_buf)
 {
     int ret_code;
 
@@ -65,7 +79,7 @@ int prep_send64b_cmd(struct nvme_device *nvme_dev, struct metrics_sq
         /* Create PRP and add the node inside the command track list */
         ret_code = data_buf_to_prp(nvme_dev, pmetrics_sq, nvme_64b_send, prps,
             nvme_gen_cmd->opcode, persist_q_id, data_buf_type,
-            nvme_gen_cmd->command_id);
+            nvme_gen_cmd->command_id, reg_buf);
         if (ret_code < 0) {
             LOG_ERR("Data buffer to PRP generation failed");
             return ret_code;
@@ -93,9 +107,102 @@ int prep_send64b_cmd(struct nvme_device *nvme_dev, struct metrics_sq
     return 0;
 }
 
+/*
+ * alloc_cmd_track_slots:
+ * Preallocate one cmd_track per SQ element so the submit path never has to
+ * allocate, the cmd ID of an outstanding cmd is the index of its slot.
+ */
+int alloc_cmd_track_slots(struct metrics_sq *pmetrics_sq)
+{
+    u32 num_slots = pmetrics_sq->public_sq.elements;
+
+    if ((num_slots == 0) || (num_slots > (USHRT_MAX + 1))) {
+        LOG_ERR("SQ of %d elements can't be tracked", num_slots);
+        return -EINVAL;
+    }
+
+    /* Large IOSQ's need more than kmalloc can reliably provide */
+    pmetrics_sq->private_sq.cmd_slots =
+        vmalloc(num_slots * sizeof(struct cmd_track));
+    pmetrics_sq->private_sq.cmd_id_bmap =
+        kmalloc(BITS_TO_LONGS(num_slots) * sizeof(unsigned long),
+        GFP_KERNEL | __GFP_ZERO);
+    if ((pmetrics_sq->private_sq.cmd_slots == NULL) ||
+        (pmetrics_sq->private_sq.cmd_id_bmap == NULL)) {
+
+        LOG_ERR("Failed to alloc memory for the command track slots");
+        free_cmd_track_slots(pmetrics_sq);
+        return -ENOMEM;
+    }
+    memset(pmetrics_sq->private_sq.cmd_slots, 0,
+        num_slots * sizeof(struct cmd_track));
+
+    pmetrics_sq->private_sq.num_slots = num_slots;
+    pmetrics_sq->private_sq.unique_cmd_id = 0;
+    return 0;
+}
+
+/*
+ * free_cmd_track_slots:
+ * Free the slots and cmd ID bitmap, the cmd track list must be empty
+ */
+void free_cmd_track_slots(struct metrics_sq *pmetrics_sq)
+{
+    if (pmetrics_sq->private_sq.cmd_slots != NULL) {
+        vfree(pmetrics_sq->private_sq.cmd_slots);
+        pmetrics_sq->private_sq.cmd_slots = NULL;
+    }
+    if (pmetrics_sq->private_sq.cmd_id_bmap != NULL) {
+        kfree(pmetrics_sq->private_sq.cmd_id_bmap);
+        pmetrics_sq->private_sq.cmd_id_bmap = NULL;
+    }
+    pmetrics_sq->private_sq.num_slots = 0;
+}
+
+/*
+ * get_unique_cmd_id:
+ * Hand out the next free cmd ID at or after the last one handed out, IDs
+ * keep increasing like the former counter did until they wrap at the size
+ * of the SQ.
+ */
+int get_unique_cmd_id(struct metrics_sq *pmetrics_sq, u16 *cmd_id)
+{
+    unsigned long id;
+    u32 num_slots = pmetrics_sq->private_sq.num_slots;
+    unsigned long *bmap = pmetrics_sq->private_sq.cmd_id_bmap;
+
+    id = find_next_zero_bit(bmap, num_slots,
+        pmetrics_sq->private_sq.unique_cmd_id);
+    if (id >= num_slots) {
+        id = find_first_zero_bit(bmap, num_slots);
+        if (id >= num_slots) {
+            LOG_ERR("All %d cmd ID's of SQ %d are outstanding", num_slots,
+                pmetrics_sq->public_sq.sq_id);
+            return -EBUSY;
+        }
+    }
+
+    __set_bit(id, bmap);
+    pmetrics_sq->private_sq.unique_cmd_id = (u16)((id + 1) % num_slots);
+    *cmd_id = (u16)id;
+    return 0;
+}
+
+/*
+ * put_unique_cmd_id:
+ * Return a reserved cmd ID back to the pool
+ */
+void put_unique_cmd_id(struct metrics_sq *pmetrics_sq, u16 cmd_id)
+{
+    if (cmd_id < pmetrics_sq->private_sq.num_slots) {
+        __clear_bit(cmd_id, pmetrics_sq->private_sq.cmd_id_bmap);
+    }
+}
+
 /*
  * add_cmd_track_node:
- * Create and add the node inside command track list
+ * Fill the slot of the already reserved cmd_id and add it inside the
+ * command track list
  */
 int add_cmd_track_node(struct  metrics_sq  *pmetrics_sq,
     u16 persist_q_id, struct nvme_prps *prps, u8 opcode, u16 cmd_id)
@@ -103,14 +210,18 @@ int add_cmd_track_node(struct  metrics_sq  *pmetrics_sq,
     /* pointer to cmd track linked list node */
     struct cmd_track  *pcmd_track_list;
 
-    /* Fill the cmd_track structure */
-    pcmd_track_list = kmalloc(sizeof(struct cmd_track),
-        GFP_ATOMIC | __GFP_ZERO);
-    if (pcmd_track_list == NULL) {
-        LOG_ERR("Failed to alloc memory for the command track list");
-        return -ENOMEM;
+    if ((cmd_id >= pmetrics_sq->private_sq.num_slots) ||
+        !test_bit(cmd_id, pmetrics_sq->private_sq.cmd_id_bmap)) {
+
+        LOG_ERR("Cmd ID %d was not reserved for SQ %d", cmd_id,
+            pmetrics_sq->public_sq.sq_id);
+        return -EBADSLT;
     }
 
+    /* Fill the cmd_track structure */
+    pcmd_track_list = &pmetrics_sq->private_sq.cmd_slots[cmd_id];
+    memset(pcmd_track_list, 0, sizeof(struct cmd_track));
+
     /* Fill the node */
     pcmd_track_list->unique_id = cmd_id;
     pcmd_track_list->persist_q_id = persist_q_id;
@@ -128,6 +239,17 @@ int add_cmd_track_node(struct  metrics_sq  *pmetrics_sq,
     return 0;
 }
 
+/*
+ * del_cmd_track_node:
+ * Remove the node from command track list, its slot becomes free for reuse
+ */
+void del_cmd_track_node(struct metrics_sq *pmetrics_sq,
+    struct cmd_track *pcmd_node)
+{
+    list_del(&pcmd_node->cmd_list_hd);
+    put_unique_cmd_id(pmetrics_sq, pcmd_node->unique_id);
+}
+
 /*
  * empty_cmd_track_list:
  * Delete command track list completely per SQ
@@ -143,8 +265,14 @@ void empty_cmd_track_list(struct nvme_device *nvme_device,
         pcmd_track_element = list_entry(pos, struct cmd_track, cmd_list_hd);
         del_prps(nvme_device, &pcmd_track_element->prp_nonpersist);
         list_del(pos);
-        kfree(pcmd_track_element);
     }
+
+    /* No cmd is outstanding any longer, every ID is free */
+    if (pmetrics_sq->private_sq.cmd_id_bmap != NULL) {
+        bitmap_zero(pmetrics_sq->private_sq.cmd_id_bmap,
+            pmetrics_sq->private_sq.num_slots);
+    }
+    pmetrics_sq->private_sq.unique_cmd_id = 0;
 }
 
 /*
@@ -159,6 +287,123 @@ void del_prps(struct nvme_device *nvme_device, struct nvme_prps *prps)
     free_prp_pool(nvme_device, prps, prps->npages);
 }
 
+/*
+ * defer_del_prps:
+ * Releasing the pinned pages of large transfers dominates the time of a
+ * reap, so the PRP's are gathered into the reap's reclaim node, *ppreclaim,
+ * for the reclaim worker instead. Only the unmap is done right away, it
+ * syncs the data for the CPU and user space reads it as soon as the CE is
+ * reaped. A node is allocated once the first PRP's need it and is queued
+ * when full. Registered buffers have nothing to release and are handed back
+ * right away, as is everything if no node can be allocated.
+ */
+void defer_del_prps(struct metrics_device_list *pmetrics_device,
+    struct reclaim_prps **ppreclaim, struct nvme_prps *prps)
+{
+    struct reclaim_prps *preclaim = *ppreclaim;
+
+    if ((prps->type == NO_PRP) || (prps->reg_buf != NULL)) {
+        del_prps(pmetrics_device->metrics_device, prps);
+        return;
+    }
+
+    if ((preclaim != NULL) && (preclaim->num_prps == RECLAIM_BATCH_CMDS)) {
+        queue_reclaim_prps(pmetrics_device, preclaim);
+        preclaim = NULL;
+    }
+    if (preclaim == NULL) {
+        preclaim = kmalloc(sizeof(struct reclaim_prps), GFP_KERNEL);
+        *ppreclaim = preclaim;
+        if (preclaim == NULL) {
+            del_prps(pmetrics_device->metrics_device, prps);
+            return;
+        }
+        preclaim->num_prps = 0;
+    }
+
+    if (prps->vir_kern_addr != NULL) {
+        vunmap(prps->vir_kern_addr);
+        prps->vir_kern_addr = NULL;
+    }
+    dma_unmap_sg(&pmetrics_device->metrics_device->private_dev.pdev->dev,
+        prps->sg, prps->num_map_pgs, prps->data_dir);
+    memcpy(&preclaim->prps[preclaim->num_prps++], prps,
+        sizeof(struct nvme_prps));
+}
+
+/*
+ * queue_reclaim_prps:
+ * Hands the reclaim node of a reap to the reclaim worker, a node which
+ * gathered nothing is freed right away.
+ */
+void queue_reclaim_prps(struct metrics_device_list *pmetrics_device,
+    struct reclaim_prps *preclaim)
+{
+    if (preclaim == NULL) {
+        return;
+    } else if (preclaim->num_prps == 0) {
+        kfree(preclaim);
+        return;
+    }
+
+    spin_lock(&pmetrics_device->reclaim_lock);
+    list_add_tail(&preclaim->reclaim_hd, &pmetrics_device->reclaim_list);
+    spin_unlock(&pmetrics_device->reclaim_lock);
+    schedule_work(&pmetrics_device->reclaim_work);
+}
+
+/*
+ * reclaim_prps_work:
+ * Takes the whole reclaim list at once, dirties the pages the device wrote
+ * and releases the pinned pages of all its PRP's, already unmapped by
+ * defer_del_prps, with release_pages, RECLAIM_BATCH_PGS pages per call.
+ * No device lock is taken, so flushing it with the device held is safe.
+ */
+void reclaim_prps_work(struct work_struct *work)
+{
+    u32 i, j;
+    int num_pgs = 0;
+    struct page *pgs[RECLAIM_BATCH_PGS];
+    struct nvme_prps *prps;
+    struct reclaim_prps *preclaim, *pnext;
+    struct metrics_device_list *pmetrics_device =
+        container_of(work, struct metrics_device_list, reclaim_work);
+    struct nvme_device *nvme_dev = pmetrics_device->metrics_device;
+    LIST_HEAD(batch);
+
+    spin_lock(&pmetrics_device->reclaim_lock);
+    list_splice_init(&pmetrics_device->reclaim_list, &batch);
+    spin_unlock(&pmetrics_device->reclaim_lock);
+
+    list_for_each_entry_safe(preclaim, pnext, &batch, reclaim_hd) {
+        for (j = 0; j < preclaim->num_prps; j++) {
+            prps = &preclaim->prps[j];
+
+            for (i = 0; i < prps->num_map_pgs; i++) {
+                if ((prps->data_dir == DMA_FROM_DEVICE) ||
+                    (prps->data_dir == DMA_BIDIRECTIONAL)) {
+
+                    set_page_dirty_lock(sg_page(&prps->sg[i]));
+                }
+                pgs[num_pgs++] = sg_page(&prps->sg[i]);
+                if (num_pgs == RECLAIM_BATCH_PGS) {
+                    release_pages(pgs, num_pgs, 0);
+                    num_pgs = 0;
+                }
+            }
+            kfree(prps->sg);
+            free_prp_pool(nvme_dev, prps, prps->npages);
+        }
+
+        list_del(&preclaim->reclaim_hd);
+        kfree(preclaim);
+    }
+
+    if (num_pgs != 0) {
+        release_pages(pgs, num_pgs, 0);
+    }
+}
+
 /*
  * destroy_dma_pool:
  * Destroy's the dma pool
@@ -178,7 +423,8 @@ void destroy_dma_pool(struct nvme_device *nvme_dev)
 static int data_buf_to_prp(struct nvme_device *nvme_dev,
     struct metrics_sq *pmetrics_sq, struct nvme_64b_send *nvme_64b_send,
     struct nvme_prps *prps, u8 opcode, u16 persist_q_id,
-    enum data_buf_type data_buf_type, u16 cmd_id)
+    enum data_buf_type data_buf_type, u16 cmd_id,
+    struct metrics_reg_buf *reg_buf)
 {
     int err;
     unsigned long addr;
@@ -192,7 +438,11 @@ static int data_buf_to_prp(struct nvme_device *nvme_dev,
 
 
     /* Catch common mistakes */
-    addr = (unsigned long)nvme_64b_send->data_buf_ptr;
+    if (reg_buf != NULL) {
+        addr = reg_buf->buf_addr + nvme_64b_send->reg_buf_offset;
+    } else {
+        addr = (unsigned long)nvme_64b_send->data_buf_ptr;
+    }
     if ((addr & 3) || (addr == 0) ||
         (nvme_64b_send->data_buf_size == 0) || (nvme_dev == NULL)) {
 
@@ -205,19 +455,30 @@ static int data_buf_to_prp(struct nvme_device *nvme_dev,
      * 0=none; 1=to_device, 2=from_device, 3=bidirectional, others illegal */
     kernel_dir = (enum dma_data_direction)nvme_64b_send->data_dir;
 
-    /* Mapping user pages to dma memory */
-    err = map_user_pg_to_dma(nvme_dev, kernel_dir, addr,
-        nvme_64b_send->data_buf_size, &sg_list, prps, data_buf_type);
-    if (err < 0) {
-        return err;
-    }
+    if (reg_buf != NULL) {
+        /* Registered pages are already pinned and mapped to dma memory */
+        err = reg_buf_to_prp(nvme_dev, reg_buf, nvme_64b_send, prps);
+        if (err < 0) {
+            return err;
+        }
+    } else {
+        /* Mapping user pages to dma memory */
+        err = map_user_pg_to_dma(nvme_dev, kernel_dir, addr,
+            nvme_64b_send->data_buf_size, &sg_list, prps, data_buf_type);
+        if (err < 0) {
+            return err;
+        }
 
-    err = setup_prps(nvme_dev, sg_list, nvme_64b_send->data_buf_size, prps,
-        data_buf_type, nvme_64b_send->bit_mask);
-    if (err < 0) {
-        unmap_user_pg_to_dma(nvme_dev, prps);
-        return err;
+        err = setup_prps(nvme_dev, sg_list, 0, nvme_64b_send->data_buf_size,
+            prps, data_buf_type, nvme_64b_send->bit_mask);
+        if (err < 0) {
+            unmap_user_pg_to_dma(nvme_dev, prps);
+            return err;
+        }
     }
+    trace_dnvme_setup_prps(pmetrics_sq->public_sq.sq_id, cmd_id, opcode,
+        prps->type, nvme_64b_send->data_buf_size, prps->npages,
+        (reg_buf != NULL));
 
 #ifdef TEST_PRP_DEBUG
     last_prp = PAGE_SIZE / PRP_Size - 1;
@@ -228,12 +489,9 @@ static int data_buf_to_prp(struct nvme_device *nvme_dev,
         num_prps = DIV_ROUND_UP(nvme_64b_send->data_buf_size, PAGE_SIZE);
     }
 
-    if (prps->type == (PRP1 | PRP_List) || prps->type == (PRP2 | PRP_List)) {
-        if (!(prps->vir_prp_list)) {
-            LOG_ERR("Creation of PRP failed");
-            err = -ENOMEM;
-            goto err_unmap_prp_pool;
-        }
+    /* Cmds sharing the cached PRP's of a registered buffer hold no list */
+    if ((prps->vir_prp_list != NULL) && (prps->type == (PRP1 | PRP_List) ||
+        prps->type == (PRP2 | PRP_List))) {
         prp_vlist = prps->vir_prp_list[0];
         if (prps->type == (PRP2 | PRP_List)) {
             LOG_DBG("P1 Entry: %llx", (unsigned long long) prps->prp1);
@@ -276,6 +534,271 @@ err_unmap_prp_pool:
     return err;
 }
 
+/*
+ * find_prp_cache:
+ * Looks up the cached PRP's of a registered buffer built for the same data
+ * and bit_mask, a hit is moved to the front as it is likely reused soon.
+ */
+static struct metrics_prp_cache *find_prp_cache(
+    struct metrics_reg_buf *reg_buf, u32 buf_offset, u32 buf_len,
+    u32 bit_mask)
+{
+    struct metrics_prp_cache *prp_cache;
+
+    list_for_each_entry(prp_cache, &reg_buf->prp_cache_list, prp_cache_hd) {
+        if ((prp_cache->buf_offset == buf_offset) &&
+            (prp_cache->buf_len == buf_len) &&
+            (prp_cache->bit_mask == bit_mask)) {
+
+            list_move(&prp_cache->prp_cache_hd, &reg_buf->prp_cache_list);
+            return prp_cache;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * sync_reg_buf_sg:
+ * Syncs the sg entries of a registered buffer holding the data of a cmd, for
+ * the device or back for the CPU. They are a run in the middle of the mapped
+ * list, so each entry is synced by its dma address rather than the list.
+ */
+static void sync_reg_buf_sg(struct device *dev, struct nvme_prps *prps,
+    u8 for_device)
+{
+    u32 i;
+    struct scatterlist *sg = prps->sg;
+
+    for (i = 0; i < prps->num_map_pgs; i++, sg = sg_next(sg)) {
+        if (for_device) {
+            dma_sync_single_range_for_device(dev, sg_dma_address(sg), 0,
+                sg_dma_len(sg), prps->data_dir);
+        } else {
+            dma_sync_single_range_for_cpu(dev, sg_dma_address(sg), 0,
+                sg_dma_len(sg), prps->data_dir);
+        }
+    }
+}
+
+/*
+ * reg_buf_to_prp:
+ * Generates the PRP's of a cmd whose data lies within a registered buffer.
+ * The PRP's of an offset/length are built once and cached with the buffer,
+ * cmds share the cached PRP list pages and never free them. Once the cache
+ * is full the PRP's are owned by the cmd and freed at reap as usual.
+ */
+static int reg_buf_to_prp(struct nvme_device *nvme_dev,
+    struct metrics_reg_buf *reg_buf, struct nvme_64b_send *nvme_64b_send,
+    struct nvme_prps *prps)
+{
+    int err;
+    u32 sg_offset;
+    struct scatterlist *sg_list;
+    struct nvme_prps *new_prps;
+    struct metrics_prp_cache *prp_cache;
+
+
+    mutex_lock(&reg_buf->buf_mtx);
+    prp_cache = find_prp_cache(reg_buf, nvme_64b_send->reg_buf_offset,
+        nvme_64b_send->data_buf_size, nvme_64b_send->bit_mask);
+    if (prp_cache == NULL) {
+        if (reg_buf->num_prp_cache < MAX_PRP_CACHE) {
+            prp_cache = kmalloc(sizeof(struct metrics_prp_cache),
+                GFP_KERNEL | __GFP_ZERO);
+        }
+        new_prps = (prp_cache != NULL) ? &prp_cache->prps : prps;
+
+        err = reg_buf_to_sg(reg_buf, nvme_64b_send->reg_buf_offset,
+            nvme_64b_send->data_buf_size, &sg_list, &sg_offset, new_prps);
+        if (err == 0) {
+            err = setup_prps(nvme_dev, sg_list, sg_offset,
+                nvme_64b_send->data_buf_size, new_prps, DATA_BUF,
+                nvme_64b_send->bit_mask);
+        }
+        if (err < 0) {
+            if (prp_cache != NULL) {
+                kfree(prp_cache);
+            }
+            mutex_unlock(&reg_buf->buf_mtx);
+            return err;
+        }
+
+        if (prp_cache != NULL) {
+            prp_cache->buf_offset = nvme_64b_send->reg_buf_offset;
+            prp_cache->buf_len = nvme_64b_send->data_buf_size;
+            prp_cache->bit_mask = nvme_64b_send->bit_mask;
+            list_add(&prp_cache->prp_cache_hd, &reg_buf->prp_cache_list);
+            reg_buf->num_prp_cache++;
+        }
+    }
+
+    if (prp_cache != NULL) {
+        memcpy(prps, &prp_cache->prps, sizeof(struct nvme_prps));
+        prps->vir_prp_list = NULL;
+        prps->npages = 0;
+    }
+
+    /* Only the sg entries holding the data are synced */
+    sync_reg_buf_sg(&nvme_dev->private_dev.pdev->dev, prps, 1);
+    prps->reg_buf = reg_buf;
+    reg_buf->users++;
+    mutex_unlock(&reg_buf->buf_mtx);
+    return 0;
+}
+
+/*
+ * reg_buf_to_sg:
+ * Locates the data of a cmd within a registered buffer, returns the sg entry
+ * holding the 1st byte of data and the offset of that byte within the entry.
+ * Nothing is pinned nor mapped, the sg is borrowed from the buffer.
+ */
+static int reg_buf_to_sg(struct metrics_reg_buf *reg_buf, u32 buf_offset,
+    u32 buf_len, struct scatterlist **sg_list, u32 *sg_offset,
+    struct nvme_prps *prps)
+{
+    int i, nents = 0;
+    u32 remain;
+    struct scatterlist *sg = reg_buf->sg;
+
+    prps->data_buf_addr = reg_buf->buf_addr + buf_offset;
+
+    /* Skip the sg entries which lie entirely before the data */
+    for (i = 0; i < reg_buf->num_map_sg; i++, sg = sg_next(sg)) {
+        if (buf_offset < sg_dma_len(sg)) {
+            break;
+        }
+        buf_offset -= sg_dma_len(sg);
+    }
+    if (i == reg_buf->num_map_sg) {
+        LOG_ERR("Data lies outside of registered buffer ID = %d",
+            reg_buf->buf_id);
+        return -EINVAL;
+    }
+    *sg_list = sg;
+    *sg_offset = buf_offset;
+
+    /* Count the sg entries holding the data */
+    remain = buf_offset + buf_len;
+    for (; i < reg_buf->num_map_sg; i++, sg = sg_next(sg)) {
+        nents++;
+        if (remain <= sg_dma_len(sg)) {
+            break;
+        }
+        remain -= sg_dma_len(sg);
+    }
+
+    /* Fill in nvme_prps */
+    prps->sg = *sg_list;
+    prps->num_map_pgs = nents;
+    prps->vir_kern_addr = NULL;
+    prps->data_dir = reg_buf->data_dir;
+    prps->data_buf_size = buf_len;
+    return 0;
+}
+
+/*
+ * map_reg_buf:
+ * Pins down the user pages of a registered buffer and maps them to DMA,
+ * they stay this way until unmap_reg_buf.
+ */
+int map_reg_buf(struct nvme_device *nvme_dev, struct metrics_reg_buf *reg_buf)
+{
+    int i, err, buf_pg_offset, buf_pg_count, num_sg_entries;
+    struct page **pages;
+
+
+    buf_pg_offset = offset_in_page(reg_buf->buf_addr);
+    buf_pg_count = DIV_ROUND_UP(buf_pg_offset + reg_buf->buf_size, PAGE_SIZE);
+    LOG_DBG("Registering user buf addr = 0x%016lx", reg_buf->buf_addr);
+    LOG_DBG("User buf pg count = 0x%08x", buf_pg_count);
+
+    pages = kcalloc(buf_pg_count, sizeof(*pages), GFP_KERNEL);
+    if (pages  == NULL) {
+        LOG_ERR("Memory alloc for describing user pages failed");
+        return -ENOMEM;
+    }
+
+    /* Pinning user pages in memory, always assuming writing in case user space
+     * specifies an incorrect direction of data xfer */
+    err = get_user_pages_fast(reg_buf->buf_addr, buf_pg_count, WRITE_PG, pages);
+    if (err < buf_pg_count) {
+        buf_pg_count = err;
+        err = -EFAULT;
+        LOG_ERR("Pinning down user pages failed");
+        goto error;
+    }
+
+    err = pages_to_sg(pages, buf_pg_count, buf_pg_offset, reg_buf->buf_size,
+        &reg_buf->sg);
+    if (err < 0) {
+        LOG_ERR("Generation of sg lists failed");
+        goto error;
+    }
+
+    num_sg_entries = dma_map_sg(&nvme_dev->private_dev.pdev->dev, reg_buf->sg,
+        buf_pg_count, reg_buf->data_dir);
+    if (num_sg_entries == 0) {
+        LOG_ERR("Unable to map the sg list into dma addr space");
+        kfree(reg_buf->sg);
+        reg_buf->sg = NULL;
+        err = -ENOMEM;
+        goto error;
+    }
+    kfree(pages);
+
+    reg_buf->num_pages = buf_pg_count;
+    reg_buf->num_map_sg = num_sg_entries;
+    return 0;
+
+error:
+    for (i = 0; i < buf_pg_count; i++) {
+        put_page(pages[i]);
+    }
+    kfree(pages);
+    return err;
+}
+
+/*
+ * unmap_reg_buf:
+ * Unmaps the DMA pages of a registered buffer and frees the pinned pages
+ */
+void unmap_reg_buf(struct nvme_device *nvme_dev,
+    struct metrics_reg_buf *reg_buf)
+{
+    int i;
+    struct page *pg;
+    struct metrics_prp_cache *prp_cache, *prp_cache_next;
+
+    /* Cached PRP's reference the DMA pages, they go first */
+    list_for_each_entry_safe(prp_cache, prp_cache_next,
+        &reg_buf->prp_cache_list, prp_cache_hd) {
+
+        free_prp_pool(nvme_dev, &prp_cache->prps, prp_cache->prps.npages);
+        list_del(&prp_cache->prp_cache_hd);
+        kfree(prp_cache);
+    }
+    reg_buf->num_prp_cache = 0;
+
+    if (reg_buf->sg == NULL) {
+        return;
+    }
+
+    dma_unmap_sg(&nvme_dev->private_dev.pdev->dev, reg_buf->sg,
+        reg_buf->num_pages, reg_buf->data_dir);
+
+    for (i = 0; i < reg_buf->num_pages; i++) {
+        pg = sg_page(&reg_buf->sg[i]);
+        if ((reg_buf->data_dir == DMA_FROM_DEVICE) ||
+            (reg_buf->data_dir == DMA_BIDIRECTIONAL)) {
+
+            set_page_dirty_lock(pg);
+        }
+        put_page(pg);
+    }
+    kfree(reg_buf->sg);
+    reg_buf->sg = NULL;
+}
+
 static int map_user_pg_to_dma(struct nvme_device *nvme_dev,
     enum dma_data_direction kernel_dir, unsigned long buf_addr,
     unsigned total_buf_len, struct scatterlist **sg_list,
@@ -416,7 +939,7 @@ static int pages_to_sg(struct page **pages, int num_pages, int buf_offset,
  * Returns Error codes
  */
 static int setup_prps(struct nvme_device *nvme_dev, struct scatterlist *sg,
-    s32 buf_len, struct nvme_prps *prps, u8 cr_io_q,
+    u32 sg_offset, s32 buf_len, struct nvme_prps *prps, u8 cr_io_q,
     enum send_64b_bitmask prp_mask)
 {
     dma_addr_t prp_dma, dma_addr;
@@ -427,8 +950,9 @@ static int setup_prps(struct nvme_device *nvme_dev, struct scatterlist *sg,
     int index, err;
     struct dma_pool *prp_page_pool;
 
-    dma_addr = sg_dma_address(sg);
-    dma_len = sg_dma_len(sg);
+    /* The data may start part way into the 1st sg entry */
+    dma_addr = sg_dma_address(sg) + sg_offset;
+    dma_len = sg_dma_len(sg) - sg_offset;
     offset = offset_in_page(dma_addr);
 
     /* Create IO CQ/SQ's */
@@ -598,6 +1122,16 @@ static void unmap_user_pg_to_dma(struct nvme_device *nvme_dev,
         return;
     }
 
+    /* Registered buffers stay pinned and mapped, only hand the data back */
+    if (prps->reg_buf != NULL) {
+        sync_reg_buf_sg(&nvme_dev->private_dev.pdev->dev, prps, 0);
+        mutex_lock(&prps->reg_buf->buf_mtx);
+        prps->reg_buf->users--;
+        mutex_unlock(&prps->reg_buf->buf_mtx);
+        prps->reg_buf = NULL;
+        return;
+    }
+
     /* Unammping Kernel Virtual Address */
     if (prps->vir_kern_addr && prps->type != NO_PRP) {
         vunmap(prps->vir_kern_addr);
@@ -22,6 +22,9 @@
 /* define's for unique QID creation */
 #define UNIQUE_QID_FLAG         0x01
 
+/* Max pages handed to release_pages at once by the reclaim worker */
+#define RECLAIM_BATCH_PGS       64
+
 
 enum {
     PRP_PRESENT = 1, /* Specifies to generate PRP's for a particular command */
@@ -69,12 +72,69 @@ enum data_buf_type {
  * @param persist_q_id
  * @param data_buf_type
  * @param gen_prp
+ * @param reg_buf registered buffer holding the data, NULL if none
  * @return Error Codes
  */
 int prep_send64b_cmd(struct nvme_device *nvme_dev, struct metrics_sq
     *pmetrics_sq, struct nvme_64b_send *nvme_64b_send, struct nvme_prps *prps,
     struct nvme_gen_cmd *nvme_gen_cmd, u16 persist_q_id,
-    enum data_buf_type data_buf_type, u8 gen_prp);
+    enum data_buf_type data_buf_type, u8 gen_prp,
+    struct metrics_reg_buf *reg_buf);
+
+/**
+ * map_reg_buf:
+ * Pin down the user pages of a registered buffer and map them to DMA
+ * @param nvme_dev
+ * @param reg_buf with buf_addr, buf_size and data_dir filled in
+ * @return Error Codes
+ */
+int map_reg_buf(struct nvme_device *nvme_dev, struct metrics_reg_buf *reg_buf);
+
+/**
+ * unmap_reg_buf:
+ * Unmap the DMA pages of a registered buffer and release the pinned pages
+ * @param nvme_dev
+ * @param reg_buf
+ * @return void
+ */
+void unmap_reg_buf(struct nvme_device *nvme_dev,
+    struct metrics_reg_buf *reg_buf);
+
+/**
+ * alloc_cmd_track_slots:
+ * Allocate the cmd_track slots and cmd ID bitmap of a SQ, one slot per
+ * element of the SQ. The public_sq.elements must already be set.
+ * @param pmetrics_sq
+ * @return Error codes
+ */
+int alloc_cmd_track_slots(struct metrics_sq *pmetrics_sq);
+
+/**
+ * free_cmd_track_slots:
+ * Free the cmd_track slots and cmd ID bitmap of a SQ
+ * @param pmetrics_sq
+ * @return void
+ */
+void free_cmd_track_slots(struct metrics_sq *pmetrics_sq);
+
+/**
+ * get_unique_cmd_id:
+ * Reserve a cmd ID which is not in use by any outstanding cmd of the SQ
+ * @param pmetrics_sq
+ * @param cmd_id returns the reserved ID
+ * @return Error codes
+ */
+int get_unique_cmd_id(struct metrics_sq *pmetrics_sq, u16 *cmd_id);
+
+/**
+ * put_unique_cmd_id:
+ * Release a cmd ID reserved by get_unique_cmd_id for which no node was
+ * added inside the cmd track list
+ * @param pmetrics_sq
+ * @param cmd_id
+ * @return void
+ */
+void put_unique_cmd_id(struct metrics_sq *pmetrics_sq, u16 cmd_id);
 
 /**
  * add_cmd_track_node:
@@ -90,6 +150,16 @@ int prep_send64b_cmd(struct nvme_device *nvme_dev, struct metrics_sq
 int add_cmd_track_node(struct  metrics_sq  *pmetrics_sq,
     u16 persist_q_id, struct nvme_prps *prps, u8 opcode, u16 cmd_id);
 
+/**
+ * del_cmd_track_node:
+ * Remove the node from the cmd track list and release its cmd ID
+ * @param pmetrics_sq
+ * @param pcmd_node
+ * @return void
+ */
+void del_cmd_track_node(struct metrics_sq *pmetrics_sq,
+    struct cmd_track *pcmd_node);
+
 /**
  * empty_cmd_track_list:
  * Delete command track list completley per SQ
@@ -117,5 +187,38 @@ void destroy_dma_pool(struct nvme_device *nvme_dev);
  */
 void del_prps(struct nvme_device *nvme_device, struct nvme_prps *prps);
 
+/**
+ * defer_del_prps:
+ * Deletes the PRP structures of a retired cmd, the user pages it pinned are
+ * unmapped right away and released later by the reclaim worker of the device.
+ * They are gathered in *ppreclaim, which starts out NULL for each reap and is
+ * handed to queue_reclaim_prps once the reap is done.
+ * @param pmetrics_device
+ * @param ppreclaim
+ * @param prps
+ * @return void
+ */
+void defer_del_prps(struct metrics_device_list *pmetrics_device,
+    struct reclaim_prps **ppreclaim, struct nvme_prps *prps);
+
+/**
+ * queue_reclaim_prps:
+ * Queues the PRP's gathered by defer_del_prps for the reclaim worker
+ * @param pmetrics_device
+ * @param preclaim may be NULL
+ * @return void
+ */
+void queue_reclaim_prps(struct metrics_device_list *pmetrics_device,
+    struct reclaim_prps *preclaim);
+
+/**
+ * reclaim_prps_work:
+ * Work function of the reclaim worker, releases the PRP's queued by
+ * defer_del_prps in one batch
+ * @param work
+ * @return void
+ */
+void reclaim_prps_work(struct work_struct *work);
+
 
 #endif
@@ -0,0 +1,561 @@
+/*
+ * NVM Express Compliance Suite
+ * Copyright (c) 2011, Intel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/pci.h>
+
+#include "definitions.h"
+#include "sysdnvme.h"
+#include "dnvme_queue.h"
+#include "dnvme_cmds.h"
+#include "dnvme_debugfs.h"
+#include "sysfuncproto.h"
+
+/* Directory dnvme in debugfs, NULL without debugfs */
+static struct dentry *dbgfs_root;
+
+/*
+ * State of a seq_file iterating over the Q's or the cmds of a device. The
+ * locks are taken by start and dropped by stop, thus they are never held
+ * while user space consumes the output.
+ */
+struct dbgfs_iter {
+    int minor;                              /* Minor no. of the device */
+    struct metrics_device_list *pmetrics_device;    /* Locked shared */
+    struct metrics_sq *pmetrics_sq;         /* SQ whose q_mtx is held */
+    u8 is_sq;                               /* Q iterated is a SQ */
+};
+
+/* Static function declarations used for the debugfs files. */
+static struct metrics_device_list *dbgfs_lock_device(int minor);
+static void dbgfs_unlock_device(struct metrics_device_list *pmetrics_device);
+static int dbgfs_seq_open(struct inode *inode, struct file *file,
+    const struct seq_operations *ops);
+static int device_show(struct seq_file *m, void *v);
+static int device_open(struct inode *inode, struct file *file);
+static void *queues_start(struct seq_file *m, loff_t *pos);
+static void *queues_next(struct seq_file *m, void *v, loff_t *pos);
+static void queues_stop(struct seq_file *m, void *v);
+static int queues_show(struct seq_file *m, void *v);
+static int queues_open(struct inode *inode, struct file *file);
+static void *cmds_at(struct dbgfs_iter *iter, loff_t *pos);
+static void *cmds_start(struct seq_file *m, loff_t *pos);
+static void *cmds_next(struct seq_file *m, void *v, loff_t *pos);
+static void cmds_stop(struct seq_file *m, void *v);
+static int cmds_show(struct seq_file *m, void *v);
+static int cmds_open(struct inode *inode, struct file *file);
+static int irqs_show(struct seq_file *m, void *v);
+static int irqs_open(struct inode *inode, struct file *file);
+static int meta_show(struct seq_file *m, void *v);
+static int meta_open(struct inode *inode, struct file *file);
+
+static const struct seq_operations queues_seq_ops = {
+    .start = queues_start,
+    .next  = queues_next,
+    .stop  = queues_stop,
+    .show  = queues_show,
+};
+
+static const struct seq_operations cmds_seq_ops = {
+    .start = cmds_start,
+    .next  = cmds_next,
+    .stop  = cmds_stop,
+    .show  = cmds_show,
+};
+
+static const struct file_operations device_fops = {
+    .owner   = THIS_MODULE,
+    .open    = device_open,
+    .read    = seq_read,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
+static const struct file_operations queues_fops = {
+    .owner   = THIS_MODULE,
+    .open    = queues_open,
+    .read    = seq_read,
+    .llseek  = seq_lseek,
+    .release = seq_release_private,
+};
+
+static const struct file_operations cmds_fops = {
+    .owner   = THIS_MODULE,
+    .open    = cmds_open,
+    .read    = seq_read,
+    .llseek  = seq_lseek,
+    .release = seq_release_private,
+};
+
+static const struct file_operations irqs_fops = {
+    .owner   = THIS_MODULE,
+    .open    = irqs_open,
+    .read    = seq_read,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
+static const struct file_operations meta_fops = {
+    .owner   = THIS_MODULE,
+    .open    = meta_open,
+    .read    = seq_read,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
+
+void dbgfs_init(void)
+{
+    dbgfs_root = debugfs_create_dir(APPNAME, NULL);
+    if (IS_ERR_OR_NULL(dbgfs_root)) {
+        LOG_NRM("debugfs not available, no metrics will be found there");
+        dbgfs_root = NULL;
+    }
+}
+
+
+void dbgfs_exit(void)
+{
+    debugfs_remove_recursive(dbgfs_root);
+    dbgfs_root = NULL;
+}
+
+
+void dbgfs_add_device(struct metrics_device_list *pmetrics_device)
+{
+    char name[16];
+    struct dentry *dir;
+    /* The files only know the minor, the device is looked up by each read */
+    void *minor = (void *)(long)
+        pmetrics_device->metrics_device->private_dev.minor_no;
+
+    if (dbgfs_root == NULL) {
+        return;
+    }
+    snprintf(name, sizeof(name), "nvme%ld", (long)minor);
+    dir = debugfs_create_dir(name, dbgfs_root);
+    if (IS_ERR_OR_NULL(dir)) {
+        LOG_ERR("Unable to create debugfs directory %s", name);
+        return;
+    }
+    /* DMA addresses are shown, so only root may read them */
+    debugfs_create_file("device", S_IRUSR, dir, minor, &device_fops);
+    debugfs_create_file("queues", S_IRUSR, dir, minor, &queues_fops);
+    debugfs_create_file("commands", S_IRUSR, dir, minor, &cmds_fops);
+    debugfs_create_file("irqs", S_IRUSR, dir, minor, &irqs_fops);
+    debugfs_create_file("meta", S_IRUSR, dir, minor, &meta_fops);
+    pmetrics_device->dbgfs_dir = dir;
+}
+
+
+void dbgfs_del_device(struct metrics_device_list *pmetrics_device)
+{
+    debugfs_remove_recursive(pmetrics_device->dbgfs_dir);
+    pmetrics_device->dbgfs_dir = NULL;
+}
+
+
+/*
+ * Find the device by its minor and lock it shared. The ref taken keeps it
+ * allocated while the registry mutex is not held, thus a device locked
+ * exclusively never stalls the lookup of any other. Returns NULL if the
+ * device is gone.
+ */
+static struct metrics_device_list *dbgfs_lock_device(int minor)
+{
+    struct metrics_device_list *pmetrics_device;
+
+    pmetrics_device = get_device_ref(minor);
+    if (pmetrics_device == NULL) {
+        return NULL;
+    }
+    down_read(&pmetrics_device->metrics_sem);
+    if (pmetrics_device->metrics_device->private_dev.removed) {
+        up_read(&pmetrics_device->metrics_sem);
+        put_device_ref(pmetrics_device);
+        return NULL;
+    }
+    return pmetrics_device;
+}
+
+
+static void dbgfs_unlock_device(struct metrics_device_list *pmetrics_device)
+{
+    if (pmetrics_device != NULL) {
+        up_read(&pmetrics_device->metrics_sem);
+        put_device_ref(pmetrics_device);
+    }
+}
+
+
+static int dbgfs_seq_open(struct inode *inode, struct file *file,
+    const struct seq_operations *ops)
+{
+    struct dbgfs_iter *iter;
+
+    iter = __seq_open_private(file, ops, sizeof(struct dbgfs_iter));
+    if (iter == NULL) {
+        return -ENOMEM;
+    }
+    iter->minor = (long)inode->i_private;
+    return SUCCESS;
+}
+
+
+/*
+ * The device itself and its active irq scheme.
+ */
+static int device_show(struct seq_file *m, void *v)
+{
+    struct metrics_device_list *pmetrics_device;
+    struct private_metrics_dev *pdev;
+    struct public_metrics_dev *pub;
+
+    pmetrics_device = dbgfs_lock_device((long)m->private);
+    if (pmetrics_device == NULL) {
+        return SUCCESS;
+    }
+    pdev = &pmetrics_device->metrics_device->private_dev;
+    pub = &pmetrics_device->metrics_device->public_dev;
+
+    seq_printf(m, "minor_no = %d\n", pdev->minor_no);
+    seq_printf(m, "open_cnt = %d\n", pdev->open_cnt);
+    seq_printf(m, "shared = %d\n", pdev->shared);
+    seq_printf(m, "pci = %s\n", pci_name(pdev->pdev));
+    seq_printf(m, "bar1 = %d\n", (pdev->bar1 != NULL));
+    seq_printf(m, "bar2 = %d\n", (pdev->bar2 != NULL));
+    seq_printf(m, "irq_type (S=0/M=1/X=2/N=3) = %d\n",
+        pub->irq_active.irq_type);
+    seq_printf(m, "num_irqs = %d\n", pub->irq_active.num_irqs);
+    seq_printf(m, "lat_enabled = %d\n", pmetrics_device->lat_enabled);
+
+    dbgfs_unlock_device(pmetrics_device);
+    return SUCCESS;
+}
+
+
+static int device_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, device_show, inode->i_private);
+}
+
+
+/*
+ * The Q's are iterated CQ's first, then SQ's, in the order of their lists.
+ */
+static void *queues_start(struct seq_file *m, loff_t *pos)
+{
+    struct dbgfs_iter *iter = m->private;
+    struct metrics_cq *pmetrics_cq;
+    struct metrics_sq *pmetrics_sq;
+    loff_t i = 0;
+
+    iter->pmetrics_device = dbgfs_lock_device(iter->minor);
+    if (iter->pmetrics_device == NULL) {
+        return NULL;
+    }
+
+    iter->is_sq = 0;
+    list_for_each_entry(pmetrics_cq, &iter->pmetrics_device->metrics_cq_list,
+        cq_list_hd) {
+
+        if (i++ == *pos) {
+            return pmetrics_cq;
+        }
+    }
+    iter->is_sq = 1;
+    list_for_each_entry(pmetrics_sq, &iter->pmetrics_device->metrics_sq_list,
+        sq_list_hd) {
+
+        if (i++ == *pos) {
+            return pmetrics_sq;
+        }
+    }
+    return NULL;
+}
+
+
+static void *queues_next(struct seq_file *m, void *v, loff_t *pos)
+{
+    struct dbgfs_iter *iter = m->private;
+    struct metrics_device_list *pmetrics_device = iter->pmetrics_device;
+    struct metrics_cq *pmetrics_cq = v;
+    struct metrics_sq *pmetrics_sq = v;
+
+    (*pos)++;
+    if (!iter->is_sq) {
+        if (pmetrics_cq->cq_list_hd.next != &pmetrics_device->metrics_cq_list) {
+            return list_entry(pmetrics_cq->cq_list_hd.next, struct metrics_cq,
+                cq_list_hd);
+        }
+        iter->is_sq = 1;
+        if (list_empty(&pmetrics_device->metrics_sq_list)) {
+            return NULL;
+        }
+        return list_first_entry(&pmetrics_device->metrics_sq_list,
+            struct metrics_sq, sq_list_hd);
+    }
+    if (pmetrics_sq->sq_list_hd.next != &pmetrics_device->metrics_sq_list) {
+        return list_entry(pmetrics_sq->sq_list_hd.next, struct metrics_sq,
+            sq_list_hd);
+    }
+    return NULL;
+}
+
+
+static void queues_stop(struct seq_file *m, void *v)
+{
+    struct dbgfs_iter *iter = m->private;
+
+    dbgfs_unlock_device(iter->pmetrics_device);
+    iter->pmetrics_device = NULL;
+}
+
+
+/*
+ * One line per Q. The fast paths move the Q pointers without locking the
+ * device exclusively, they may be in flux.
+ */
+static int queues_show(struct seq_file *m, void *v)
+{
+    struct dbgfs_iter *iter = m->private;
+    struct metrics_cq *pmetrics_cq = v;
+    struct metrics_sq *pmetrics_sq = v;
+    struct nvme_prps *prps;
+
+    if (!iter->is_sq) {
+        prps = &pmetrics_cq->private_cq.prp_persist;
+        seq_printf(m, "cq q_id=%d elements=%d head_ptr=%d tail_ptr=%d "
+            "pbit_new_entry=%d irq_enabled=%d irq_no=%d contig=%d size=%d "
+            "dma_addr=0x%llx",
+            pmetrics_cq->public_cq.q_id, pmetrics_cq->public_cq.elements,
+            pmetrics_cq->public_cq.head_ptr, pmetrics_cq->public_cq.tail_ptr,
+            pmetrics_cq->public_cq.pbit_new_entry,
+            pmetrics_cq->public_cq.irq_enabled,
+            pmetrics_cq->public_cq.irq_no, pmetrics_cq->private_cq.contig,
+            pmetrics_cq->private_cq.size,
+            (u64)pmetrics_cq->private_cq.cq_dma_addr);
+    } else {
+        prps = &pmetrics_sq->private_sq.prp_persist;
+        seq_printf(m, "sq sq_id=%d cq_id=%d elements=%d head_ptr=%d "
+            "tail_ptr=%d tail_ptr_virt=%d contig=%d size=%d dma_addr=0x%llx",
+            pmetrics_sq->public_sq.sq_id, pmetrics_sq->public_sq.cq_id,
+            pmetrics_sq->public_sq.elements, pmetrics_sq->public_sq.head_ptr,
+            pmetrics_sq->public_sq.tail_ptr,
+            pmetrics_sq->public_sq.tail_ptr_virt,
+            pmetrics_sq->private_sq.contig, pmetrics_sq->private_sq.size,
+            (u64)pmetrics_sq->private_sq.sq_dma_addr);
+    }
+    if (prps->type != NO_PRP) {
+        seq_printf(m, " prp_type=%d npages=%d prp1=0x%llx prp2=0x%llx "
+            "data_buf_size=%d num_map_pgs=%d", prps->type, prps->npages,
+            (u64)le64_to_cpu(prps->prp1), (u64)le64_to_cpu(prps->prp2),
+            prps->data_buf_size, prps->num_map_pgs);
+    }
+    seq_putc(m, '\n');
+    return SUCCESS;
+}
+
+
+static int queues_open(struct inode *inode, struct file *file)
+{
+    return dbgfs_seq_open(inode, file, &queues_seq_ops);
+}
+
+
+/*
+ * Find the 1st cmd at or after pos, which is (SQ ID << 16) | cmd ID, and
+ * lock its SQ, dropping the SQ locked before. The SQ's are visited in the
+ * order of their ID's and the cmds through the cmd ID bitmap, so reading
+ * on from any pos costs no walk over the cmds before it.
+ */
+static void *cmds_at(struct dbgfs_iter *iter, loff_t *pos)
+{
+    u32 q_id = (u32)(*pos >> 16);
+    u32 cmd_id = (u32)(*pos & 0xFFFF);
+    struct metrics_sq *pmetrics_sq;
+
+    for (; q_id <= USHRT_MAX; q_id++, cmd_id = 0) {
+        pmetrics_sq = find_sq(iter->pmetrics_device, (u16)q_id);
+        if (pmetrics_sq == NULL) {
+            continue;
+        }
+        if (pmetrics_sq != iter->pmetrics_sq) {
+            if (iter->pmetrics_sq != NULL) {
+                mutex_unlock(&iter->pmetrics_sq->q_mtx);
+            }
+            mutex_lock(&pmetrics_sq->q_mtx);
+            iter->pmetrics_sq = pmetrics_sq;
+        }
+
+        cmd_id = find_next_bit(pmetrics_sq->private_sq.cmd_id_bmap,
+            pmetrics_sq->private_sq.num_slots, cmd_id);
+        if (cmd_id < pmetrics_sq->private_sq.num_slots) {
+            *pos = ((loff_t)q_id << 16) | cmd_id;
+            return &pmetrics_sq->private_sq.cmd_slots[cmd_id];
+        }
+    }
+    *pos = (loff_t)(USHRT_MAX + 1) << 16;
+    return NULL;
+}
+
+
+static void *cmds_start(struct seq_file *m, loff_t *pos)
+{
+    struct dbgfs_iter *iter = m->private;
+
+    iter->pmetrics_sq = NULL;
+    iter->pmetrics_device = dbgfs_lock_device(iter->minor);
+    if (iter->pmetrics_device == NULL) {
+        return NULL;
+    }
+    return cmds_at(iter, pos);
+}
+
+
+static void *cmds_next(struct seq_file *m, void *v, loff_t *pos)
+{
+    (*pos)++;
+    return cmds_at(m->private, pos);
+}
+
+
+static void cmds_stop(struct seq_file *m, void *v)
+{
+    struct dbgfs_iter *iter = m->private;
+
+    if (iter->pmetrics_sq != NULL) {
+        mutex_unlock(&iter->pmetrics_sq->q_mtx);
+        iter->pmetrics_sq = NULL;
+    }
+    dbgfs_unlock_device(iter->pmetrics_device);
+    iter->pmetrics_device = NULL;
+}
+
+
+/*
+ * One line per cmd outstanding.
+ */
+static int cmds_show(struct seq_file *m, void *v)
+{
+    struct dbgfs_iter *iter = m->private;
+    struct cmd_track *pcmd_node = v;
+    struct nvme_prps *prps = &pcmd_node->prp_nonpersist;
+
+    seq_printf(m, "sq_id=%d cmd_id=%d persist_q_id=%d opcode=0x%02x "
+        "prp_type=%d npages=%d prp1=0x%llx prp2=0x%llx data_buf_size=%d "
+        "num_map_pgs=%d data_dir=%d\n",
+        iter->pmetrics_sq->public_sq.sq_id, pcmd_node->unique_id,
+        pcmd_node->persist_q_id, pcmd_node->opcode, prps->type, prps->npages,
+        (u64)le64_to_cpu(prps->prp1), (u64)le64_to_cpu(prps->prp2),
+        prps->data_buf_size, prps->num_map_pgs, prps->data_dir);
+    return SUCCESS;
+}
+
+
+static int cmds_open(struct inode *inode, struct file *file)
+{
+    return dbgfs_seq_open(inode, file, &cmds_seq_ops);
+}
+
+
+/*
+ * One line per irq vector with the CQ's it serves.
+ */
+static int irqs_show(struct seq_file *m, void *v)
+{
+    struct metrics_device_list *pmetrics_device;
+    struct irq_processing *pirq_process;
+    struct irq_track *pirq_node;
+    struct irq_cq_track *pirq_cq_node;
+    struct irq_vec_stat *pvec_stat;
+
+    pmetrics_device = dbgfs_lock_device((long)m->private);
+    if (pmetrics_device == NULL) {
+        return SUCCESS;
+    }
+    pirq_process = &pmetrics_device->irq_process;
+    mutex_lock(&pirq_process->irq_track_mtx);
+
+    seq_printf(m, "irq_type = %d\n", pirq_process->irq_type);
+    list_for_each_entry(pirq_node, &pirq_process->irq_track_list,
+        irq_list_hd) {
+
+        seq_printf(m, "irq_no=%d int_vec=%d", pirq_node->irq_no,
+            pirq_node->int_vec);
+        if (pirq_node->irq_no < pirq_process->num_vec_stats) {
+            pvec_stat = &pirq_process->vec_stats[pirq_node->irq_no];
+            seq_printf(m, " isr_fired=%d isr_count=%d",
+                atomic_read(&pvec_stat->isr_fired),
+                atomic_read(&pvec_stat->isr_count));
+        }
+        list_for_each_entry(pirq_cq_node, &pirq_node->irq_cq_track,
+            irq_cq_head) {
+
+            seq_printf(m, " cq_id=%d", pirq_cq_node->cq_id);
+        }
+        seq_putc(m, '\n');
+    }
+
+    mutex_unlock(&pirq_process->irq_track_mtx);
+    dbgfs_unlock_device(pmetrics_device);
+    return SUCCESS;
+}
+
+
+static int irqs_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, irqs_show, inode->i_private);
+}
+
+
+/*
+ * One line per meta data buffer.
+ */
+static int meta_show(struct seq_file *m, void *v)
+{
+    struct metrics_device_list *pmetrics_device;
+    struct metrics_meta *pmetrics_meta;
+
+    pmetrics_device = dbgfs_lock_device((long)m->private);
+    if (pmetrics_device == NULL) {
+        return SUCCESS;
+    }
+
+    seq_printf(m, "meta_buf_size = %d\n",
+        pmetrics_device->metrics_meta.meta_buf_size);
+    list_for_each_entry(pmetrics_meta,
+        &pmetrics_device->metrics_meta.meta_trk_list, meta_list_hd) {
+
+        seq_printf(m, "meta_id=%d dma_addr=0x%llx\n",
+            pmetrics_meta->meta_id, (u64)pmetrics_meta->meta_dma_addr);
+    }
+
+    dbgfs_unlock_device(pmetrics_device);
+    return SUCCESS;
+}
+
+
+static int meta_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, meta_show, inode->i_private);
+}
@@ -0,0 +1,49 @@
+/*
+ * NVM Express Compliance Suite
+ * Copyright (c) 2011, Intel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _DNVME_DEBUGFS_H_
+#define _DNVME_DEBUGFS_H_
+
+#include "dnvme_ds.h"
+
+/*
+ * dbgfs_init creates the dnvme directory in debugfs which holds a directory
+ * per device. debugfs is optional, failing to create it is not an error.
+ */
+void dbgfs_init(void);
+
+/*
+ * dbgfs_exit removes the dnvme directory from debugfs.
+ */
+void dbgfs_exit(void);
+
+/*
+ * dbgfs_add_device creates the directory nvme<minor> of the device holding
+ * the files device, queues, commands, irqs and meta. Each streams its part
+ * of the device's metrics through a seq_file, locking the device shared only
+ * while a chunk of the output is generated.
+ */
+void dbgfs_add_device(struct metrics_device_list *pmetrics_device);
+
+/*
+ * dbgfs_del_device removes the directory of the device. Files still open
+ * find the device gone and return no more data.
+ */
+void dbgfs_del_device(struct metrics_device_list *pmetrics_device);
+
+#endif
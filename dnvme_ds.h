@@ -22,8 +22,15 @@
 #include <linux/cdev.h>
 #include <linux/list.h>
 #include <linux/mutex.h>
+#include <linux/rwsem.h>
 #include <linux/workqueue.h>
 #include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/cache.h>
+#include <linux/idr.h>
+#include <linux/kref.h>
+#include <linux/ktime.h>
+#include <linux/percpu.h>
 
 #include "dnvme_interface.h"
 
@@ -33,6 +40,17 @@
 
 /* To store the max vector locations */
 #define    MAX_VEC_SLT              2048
+
+/*
+ * Q ID lookup tables are two level; the upper bits of the 16 bit Q ID index
+ * the root array and the lower QID_TBL_SHIFT bits index a leaf which is only
+ * allocated once a Q within its range is created.
+ */
+#define    QID_TBL_SHIFT            8
+#define    QID_TBL_LEAF_SZ          (1 << QID_TBL_SHIFT)
+#define    QID_TBL_ROOT_SZ          (0x10000 >> QID_TBL_SHIFT)
+struct metrics_reg_buf;
+
 /*
  * Strucutre used to define all the essential parameters
  * related to PRP1, PRP2 and PRP List
@@ -55,6 +73,8 @@ struct nvme_prps {
     /* Address of data buffer for the specific command */
     u64 data_buf_addr;
     enum dma_data_direction data_dir;
+    /* Registered buffer the sg belongs to, not owned when != NULL */
+    struct metrics_reg_buf *reg_buf;
 };
 
 /*
@@ -68,6 +88,8 @@ struct nvme_trk_cq {
     u8           contig;         /* Indicates if prp list is contig or not */
     u8           bit_mask;       /* bitmask added for unique ID creation */
     struct nvme_prps  prp_persist; /* PRP element in CQ */
+    u64          poll_wait_ns;   /* Avg. wait for the head CE when polled */
+    u32          num_scanned;    /* CE's from head_ptr on known as posted */
 };
 
 /*
@@ -79,6 +101,9 @@ struct cmd_track {
     u8  opcode;         /* command opcode as per spec */
     struct list_head cmd_list_hd; /* link-list using the kernel list */
     struct nvme_prps prp_nonpersist; /* Non persistent PRP entries */
+    u64 user_tag;       /* nvme_ring_sqe.user_tag when submitted by a ring */
+    ktime_t submit_time;/* When a ring or a recorded send put it into SQ */
+    ktime_t ring_time;  /* When its doorbell was rung, if recorded */
 };
 
 /*
@@ -89,11 +114,48 @@ struct nvme_trk_sq {
     dma_addr_t   sq_dma_addr;       /* dma mapped address using dma_alloc */
     u32          size;              /* len in bytes of allocated Q in kernel */
     u32 __iomem *dbs;               /* Door Bell stride */
-    u16          unique_cmd_id;     /* unique counter for each comand in SQ */
+    u16          unique_cmd_id;     /* next cmd ID to try when allocating */
     u8           contig;            /* Indicates if prp list is contig or not */
     u8           bit_mask;          /* bitmask added for unique ID creation */
     struct nvme_prps prp_persist;   /* PRP element in CQ */
     struct list_head cmd_track_list;/* link-list head for cmd_track list */
+    struct cmd_track *cmd_slots;    /* cmd_track per cmd ID, [0 -> elements) */
+    unsigned long *cmd_id_bmap;     /* bit set for each cmd ID in use */
+    u32          num_slots;         /* no. of elements in cmd_slots */
+};
+
+/*
+ * Per CPU share of the perf counters, see nvme_perf_counters. Bumped with
+ * PERF_ADD, summed over all CPU's when read.
+ */
+struct perf_counters {
+    u64 cmds_sent;
+    u64 bytes_sent;
+    u64 dbs_rung;
+    u64 sq_full;
+    u64 ces_reaped;
+    u64 latent_errs;
+};
+
+/* Add n to a counter of a perf_counters __percpu pointer, if allocated */
+#define PERF_ADD(pperf, field, n)               \
+    do {                                        \
+        if ((pperf) != NULL) {                  \
+            this_cpu_add((pperf)->field, (n));  \
+        }                                       \
+    } while (0)
+
+/*
+ * Contiguous memory of a Q once it got mmap'ed to user space. Held by the Q
+ * and by each VMA mapping it, the last put frees the memory, thus user
+ * space never keeps pages which went back.
+ */
+struct mapped_q {
+    struct device        *dev;          /* Device the memory is mapped for */
+    void                 *vir_kern_addr;
+    dma_addr_t            dma_addr;
+    u32                   size;
+    struct kref           ref;
 };
 
 /*
@@ -104,6 +166,10 @@ struct metrics_cq {
     struct list_head    cq_list_hd; /* link-list using the kernel list  */
     struct nvme_gen_cq  public_cq;  /* parameters in nvme_gen_cq */
     struct nvme_trk_cq  private_cq; /* parameters in nvme_trk_cq */
+    struct mutex        q_mtx;      /* Serializes reaping of this CQ */
+    struct file        *owner;      /* File which prepared it, or NULL */
+    struct mapped_q    *mapped;     /* Set once mmap'ed */
+    struct perf_counters __percpu *perf;    /* CE's reaped from the CQ */
 };
 
 /*
@@ -114,6 +180,46 @@ struct metrics_sq {
     struct list_head    sq_list_hd;  /* link-list using the kernel list */
     struct nvme_gen_sq  public_sq;   /* parameters in nvme_gen_sq */
     struct nvme_trk_sq  private_sq;  /* parameters in nvme_trk_sq */
+    struct mutex        q_mtx;       /* Serializes send/ring/cmd tracking */
+    struct file        *owner;       /* File which prepared it, or NULL */
+    struct mapped_q    *mapped;      /* Set once mmap'ed */
+    struct metrics_rings *rings;     /* Shared memory rings, or NULL */
+    struct lat_hists   *lat_hists;   /* Allocated on 1st recorded reap */
+    struct perf_counters __percpu *perf;    /* cmds sent to the SQ */
+};
+
+/*
+ * Latency histograms of a SQ, see nvme_lat_stats for the buckets.
+ */
+struct lat_hists {
+    u32 hist[LAT_HIST_MAX][LAT_HIST_BUCKETS];
+};
+
+/*
+ * Pair of shared memory rings set up for an IO SQ. Both rings live in one
+ * page allocation which is mmap'ed to user space, see nvme_rings_setup for
+ * the layout. sq_head and cq_tail are dnvme's private copies of the
+ * counters it owns, the copies in the shared headers are never read back.
+ */
+struct metrics_rings {
+    void                 *vir_kern_addr; /* __get_free_pages allocation */
+    u32                   order;         /* Allocation order */
+    u32                   size;          /* Bytes used by hdrs and rings */
+    struct nvme_ring_hdr *sq_hdr;        /* Header of submission ring */
+    struct nvme_ring_sqe *sqes;          /* Submission ring */
+    u32                   sq_entries;
+    u32                   sq_head;       /* Next SQE to consume */
+    struct nvme_ring_hdr *cq_hdr;        /* Header of completion ring */
+    struct nvme_ring_cqe *cqes;          /* Completion ring */
+    u32                   cq_entries;
+    u32                   cq_tail;       /* Next CQE to produce */
+    struct metrics_sq    *pmetrics_sq;   /* SQ the rings feed */
+    struct metrics_device_list *pmetrics_device;
+    struct task_struct   *kthread;       /* Draining thread, or NULL */
+    /* Held by the SQ and by each VMA mapping the rings, the last put frees
+     * the pages, thus user space never keeps pages which went back
+     */
+    struct kref           ref;
 };
 
 /*
@@ -123,6 +229,19 @@ struct metrics_sq {
 struct irq_cq_track {
     struct list_head irq_cq_head;    /* linked list head for irq CQ trk */
     u16              cq_id;          /* Completion Q id */
+    struct list_head reap_waiters;   /* reap_waiter's sleeping on this CQ */
+    struct eventfd_ctx *efd_ctx;     /* eventfd signalled by ISR, or NULL */
+};
+
+/*
+ * Structure for a thread sleeping in NVME_IOCTL_REAP_WAIT until the IRQ of
+ * its CQ fires, it lives on the stack of the sleeping thread.
+ */
+struct reap_waiter {
+    struct list_head  waiter_hd;     /* linked in irq_cq_track.reap_waiters */
+    wait_queue_head_t wait_q;
+    u8                woken;         /* set by the ISR when the irq fired */
+    u8                isr_fired;     /* irq was already fired and masked */
 };
 
 /*
@@ -133,8 +252,8 @@ struct irq_track {
     struct  list_head irq_cq_track;   /* linked list of IRQ CQ nodes */
     u16               irq_no;         /* idx in list; always 0 based */
     u32               int_vec;        /* vec number; assigned by OS */
-    u8                isr_fired;      /* flag to indicate if irq has fired */
-    u32               isr_count;      /* total no. of times irq fired */
+    /* Irq processing of the device, the node is the dev_id of its vector */
+    struct  irq_processing *pirq_process;
 };
 
 /*
@@ -154,6 +273,57 @@ struct metrics_meta {
     u32              meta_id;
     void *           vir_kern_addr;
     dma_addr_t       meta_dma_addr;
+    struct file *    owner;         /* File which allocated it */
+};
+
+/*
+ * Max number of cached PRP's per registered buffer.
+ */
+#define    MAX_PRP_CACHE            32
+
+/*
+ * Structure for the PRP's of one offset/length within a registered buffer.
+ */
+struct metrics_prp_cache {
+    struct list_head prp_cache_hd;
+    u32              buf_offset;    /* Offset of the data within the buffer */
+    u32              buf_len;       /* Length of the data */
+    u32              bit_mask;      /* bit_mask the PRP's were built for */
+    struct nvme_prps prps;          /* PRP's and list pages owned by cache */
+};
+
+/*
+ * Max number of retired cmds' PRP's gathered by one reclaim_prps node.
+ */
+#define    RECLAIM_BATCH_CMDS       32
+
+/*
+ * PRP's of the cmds retired by one reap, waiting on the reclaim list of the
+ * device for their pinned user pages to be dirtied and released.
+ */
+struct reclaim_prps {
+    struct list_head reclaim_hd;    /* linked in reclaim_list of the device */
+    u32              num_prps;      /* no. of prps filled */
+    struct nvme_prps prps[RECLAIM_BATCH_CMDS]; /* copies of prp_nonpersist */
+};
+
+/*
+ * Structure for a user data buffer pinned and mapped by NVME_IOCTL_REG_BUF.
+ */
+struct metrics_reg_buf {
+    u32              buf_id;        /* Handle given to user space */
+    unsigned long    buf_addr;      /* User space address of the buffer */
+    u32              buf_size;      /* Size of the buffer in bytes */
+    enum dma_data_direction data_dir;
+    struct scatterlist *sg;         /* One entry per pinned page */
+    u32              num_pages;     /* No. of pinned pages inside sg */
+    u32              num_map_sg;    /* No. of sg entries mapped to DMA */
+    u32              users;         /* No. of outstanding cmds using it */
+    struct list_head prp_cache_list;/* Cached PRP's, most recent first */
+    u32              num_prp_cache; /* No. of nodes in prp_cache_list */
+    /* Guards users and the PRP cache, cmds of any SQ may share the buffer */
+    struct mutex     buf_mtx;
+    struct file     *owner;         /* File which registered it, or NULL */
 };
 
 /*
@@ -171,7 +341,13 @@ struct private_metrics_dev {
     struct dma_pool *prp_page_pool; /* Mem for PRP List */
     struct device *dmadev;          /* Pointer to the dma device from pdev */
     int minor_no;                   /* Minor no. of the device being used */
-    u8 open_flag;                   /* Allows device opening only once */
+    u8 removed;                     /* Hot removed, freed by last release */
+    u32 open_cnt;                   /* No. of files open on the device */
+    u8 shared;                      /* Allows more opens, only when set */
+    /* The 1st file opened, the only one allowed to change device wide state.
+     * NULL once closed while other files are still open.
+     */
+    struct file *ctrl_filp;
 };
 
 /*
@@ -183,16 +359,16 @@ struct nvme_device {
 };
 
 /*
- * Work container which holds vectors and scheduled work queue item
+ * Per vector irq accounting, written by the ISR and read or cleared by the
+ * reap path without any lock. Each vector has a cache line to itself so
+ * that vectors firing on different cores don't share it.
  */
-struct work_container {
-    struct list_head wrk_list_hd;
-    struct work_struct sched_wq; /* Work Struct item used in bh */
-    u16 irq_no; /* 0 based irq_no */
-    u32 int_vec; /* Interrupt vectors assigned by the kernel */
-    /* Pointer to the IRQ_processing strucutre of the device */
-    struct irq_processing *pirq_process;
-};
+struct irq_vec_stat {
+    atomic_t isr_fired;                 /* flag to indicate if irq has fired */
+    atomic_t isr_count;                 /* total no. of times irq fired */
+    atomic64_t isr_ns;                  /* ktime of last irq, if recorded */
+    u32 isr_count_base;                 /* isr_count at last perf reset */
+} ____cacheline_aligned_in_smp;
 
 /*
  * Irq Processing structure to hold all the irq parameters per device.
@@ -204,22 +380,26 @@ struct irq_processing {
     struct list_head irq_track_list; /* IRQ list; sorted by irq_no */
     struct mutex irq_track_mtx; /* Mutex for access to irq_track_list */
 
-    /* To resolve contention for ISR's getting scheduled on different cores */
+    /* Woken by the ISR whenever an irq fires, used by poll() */
+    wait_queue_head_t poll_wq;
+
+    /* Taken by the ISR while it updates its irq node and walks the CQ nodes
+     * of it, so editing the irq_cq_track lists, their reap_waiters or
+     * eventfd's also needs it with irq's disabled besides irq_track_mtx.
+     */
     spinlock_t isr_spin_lock;
 
-    /* Mask pointer for ISR (read both in ISR and BH) */
+    /* Mask pointer for ISR (read both in ISR and reap) */
     /* Pointer to MSI-X table offset or INTMS register */
     u8 __iomem *mask_ptr;
     /* Will only be read by ISR and set once per SET/DISABLE of IRQ scheme */
     u8 irq_type; /* Type of IRQ set */
 
-    /* Used by ISR to enqueue work to BH */
-    struct workqueue_struct *wq; /* Wq per device */
-
-    /* Used by BH to dequeue work and process on it */
-    /* Head of work_container's list */
-    /* Remains static throughout the lifetime of the interrupts */
-    struct list_head wrk_item_list;
+    /* Array of per vector accounting indexed by irq_no, set along with the
+     * IRQ scheme and freed with the irq nodes under irq_track_mtx.
+     */
+    struct irq_vec_stat *vec_stats;
+    u16 num_vec_stats;                  /* No. of entries in vec_stats */
 };
 
 /*
@@ -227,16 +407,39 @@ struct irq_processing {
  * that are defined.
  */
 struct metrics_device_list {
-    struct  list_head    metrics_device_hd; /* metrics linked list head */
     struct  list_head    metrics_cq_list;   /* CQ linked list */
     struct  list_head    metrics_sq_list;   /* SQ linked list */
+    void  **cq_tbl[QID_TBL_ROOT_SZ];        /* CQ lookup by Q ID */
+    void  **sq_tbl[QID_TBL_ROOT_SZ];        /* SQ lookup by Q ID */
     struct  nvme_device *metrics_device;    /* Pointer to this nvme device */
-    struct  mutex        metrics_mtx;       /* Mutex for locking per device */
+    /* Held shared by the send/ring/reap fast paths of IO Q's, which lock the
+     * SQ or CQ they touch, and exclusively by any other access of the device
+     */
+    struct  rw_semaphore metrics_sem;
+    struct  task_struct *metrics_sem_owner; /* Task holding it exclusively */
     struct  metrics_meta_data metrics_meta; /* Pointer to meta data buff */
+    /* Registered data buffers, handle N is at index N - 1 */
+    struct  metrics_reg_buf *reg_bufs[MAX_REG_BUFS];
     struct  irq_processing irq_process;     /* IRQ processing structure */
+    struct  list_head    reclaim_list;      /* reclaim_prps to release */
+    spinlock_t           reclaim_lock;      /* Guards reclaim_list */
+    struct  work_struct  reclaim_work;      /* Drains reclaim_list */
+    u8                   lat_enabled;       /* Record cmd latencies */
+    struct  perf_counters __percpu *perf;   /* Sum of all Q's counters */
+    struct  dentry       *dbgfs_dir;        /* debugfs dir, or NULL */
+    /* Held by the registry until hot remove, by each open file and by any
+     * lookup in progress; the last put frees the device
+     */
+    struct  kref         ref;
 };
 
-/* Global linked list for the entire data structure for all devices. */
-extern struct list_head metrics_dev_ll;
+/* Global registry of all devices keyed by minor no., guarded by the mutex.
+ * Open files reference their device through filp->private_data instead.
+ * The mutex is never held while sleeping on the metrics_sem of a device,
+ * lookups take a ref on the device with get_device_ref() and drop the
+ * mutex before they lock it.
+ */
+extern struct idr metrics_dev_idr;
+extern struct mutex metrics_dev_mtx;
 
 #endif
@@ -32,7 +32,7 @@
  * this file to adhere to the new modification and requirements of the API.
  * tnvme refuses to execute when it detects a API version mismatch to dnvme.
  */
-#define    API_VERSION          0x00010402          /* 1.4.2 */
+#define    API_VERSION          0x00010413          /* 1.4.19 */
 
 
 /**
@@ -127,6 +127,250 @@ struct nvme_64b_send {
     uint32_t data_buf_size; /* Size of Data Buffer */
     uint16_t unique_id;     /* Value returned back to user space */
     uint16_t q_id;          /* Queue ID where the cmd_buf command should go */
+    /* Registered buffer handle, 0 = use data_buf_ptr; when used the data is
+     * data_buf_size bytes at reg_buf_offset within the registered buffer */
+    uint32_t reg_buf_id;
+    uint32_t reg_buf_offset;
+};
+
+/**
+ * Max number of user buffers which can be registered at any time per device.
+ */
+#define    MAX_REG_BUFS     1024
+
+/**
+ * Interface structure for NVME_IOCTL_REG_BUF. The user space buffer is pinned
+ * and mapped for DMA once, until it is unregistered or the device is disabled,
+ * so cmds referencing it by buf_id skip all per cmd pinning and mapping.
+ */
+struct nvme_reg_buf {
+    uint8_t const *buf_ptr; /* User space address of the buffer, DWORD align */
+    uint32_t buf_size;      /* Size of the buffer in bytes */
+    /* 0=none; 1=to_device, 2=from_device, 3=bidirectional, others illegal */
+    uint8_t  data_dir;
+    uint32_t buf_id;        /* Handle returned back to user space */
+};
+
+/**
+ * Max number of cmds accepted by a single NVME_IOCTL_SEND_64B_BATCH.
+ */
+#define    MAX_64B_BATCH_CMDS   1024
+
+/**
+ * Per cmd result of a batched submission, returned in the same order as the
+ * cmds were passed in.
+ */
+struct nvme_64b_status {
+    int32_t  err;           /* 0 = cmd placed in SQ, otherwise -errno */
+    uint16_t unique_id;     /* Value assigned to the cmd when err == 0 */
+    uint16_t q_id;          /* SQ ID the cmd was targeting */
+};
+
+/**
+ * Interface structure for sending a batch of 64B cmds, to one or more SQ's,
+ * with a single ioctl. Each element of cmds is handled exactly like a single
+ * NVME_IOCTL_SEND_64B_CMD, except the unique_id is returned through status.
+ */
+struct nvme_64b_batch {
+    uint32_t num_cmds;              /* Elements in cmds and status arrays */
+    uint8_t  ring_dbl;              /* 1 = ring doorbell of every SQ used */
+    struct nvme_64b_send *cmds;     /* Array of cmds to send */
+    struct nvme_64b_status *status; /* Array to return per cmd results */
+};
+
+/**
+ * Interface structure for committing 64B cmds which user space wrote in
+ * place into a contiguous IO SQ mmap'ed from the device. The cmds occupy the
+ * slots from the SQ's tail_ptr_virt, see NVME_IOCTL_GET_Q_METRICS, up to
+ * new_tail. Each one is handled like a NVME_IOCTL_SEND_64B_CMD, its unique
+ * ID is written into its command ID field. The cmds must not be modified
+ * by user space until they are reaped. The ASQ can't be committed to.
+ */
+struct nvme_sq_commit {
+    uint16_t q_id;                  /* Contiguous SQ holding the cmds */
+    uint16_t new_tail;              /* Slot following the last cmd */
+    uint8_t  ring_dbl;              /* 1 = ring doorbell once committed */
+    /* Data, meta and registered buffers of the cmds, one element per cmd in
+     * SQ order, cmd_buf_ptr and q_id are ignored. NULL if no cmd has any */
+    struct nvme_64b_send *cmds;
+    uint16_t num_committed;         /* Returned, cmds which were committed */
+};
+
+/**
+ * Max number of entries in either ring of a SQ's submission/completion ring
+ * pair, see NVME_IOCTL_SETUP_RINGS.
+ */
+#define MAX_RING_ENTRIES    1024
+
+/**
+ * Header shared by user space and dnvme in front of each ring. Head and tail
+ * are free running counters, the slot of a counter is (x & (entries - 1)).
+ * The producer only writes tail, the consumer only writes head. The ring is
+ * empty when head == tail and full when (tail - head) == entries.
+ */
+struct nvme_ring_hdr {
+    uint32_t head;          /* Written by the consumer */
+    uint32_t tail;          /* Written by the producer */
+    uint32_t entries;       /* Power of 2, fixed at setup */
+    uint32_t rsvd;
+};
+
+/**
+ * Submission descriptor pushed by user space into the submission ring. It
+ * carries the 64B cmd and what a nvme_64b_send would describe, except that
+ * data must live in a registered buffer; dnvme may submit from a kernel
+ * thread which cannot pin user pages.
+ */
+struct nvme_ring_sqe {
+    uint8_t  cmd[64];           /* The 64B cmd, the cmd ID is assigned */
+    uint64_t user_tag;          /* Opaque, echoed back in the completion */
+    uint32_t bit_mask;          /* enum send_64b_bitmask */
+    uint32_t meta_buf_id;       /* Meta buffer ID when MASK_MPTR is set */
+    uint32_t reg_buf_id;        /* Registered buffer handle, 0 = no data */
+    uint32_t reg_buf_offset;    /* Offset of the data in the reg buffer */
+    uint32_t data_buf_size;     /* Size of the data */
+    uint8_t  data_dir;          /* As nvme_64b_send.data_dir */
+    uint8_t  rsvd[3];
+};
+
+/**
+ * Completion pushed by dnvme into the completion ring. Either a CE reaped
+ * from the CQ of the SQ, with err != 0 if dnvme could not retire its cmd,
+ * or a submission which was rejected before it reached the SQ, in which
+ * case cqe is zeroed.
+ */
+struct nvme_ring_cqe {
+    uint8_t  cqe[16];           /* The CE as posted by the controller */
+    uint64_t user_tag;          /* user_tag of the cmd's submission */
+    uint64_t submit_ns;         /* ktime when the cmd was put into the SQ */
+    uint64_t complete_ns;       /* ktime when the CE was reaped */
+    int32_t  err;               /* 0, or -errno */
+    uint32_t rsvd;
+};
+
+/**
+ * Interface structure for NVME_IOCTL_SETUP_RINGS. Rings are set up for an
+ * IO SQ and receive the CE's of its CQ, that CQ must then only be reaped
+ * through the rings. sq_entries == 0 tears the rings down. The returned
+ * offsets are relative to the mmap of the rings, whose offset argument is
+ * ((0x3 << 0x12) | sq_id) * PAGE_SIZE.
+ */
+struct nvme_rings_setup {
+    uint16_t sq_id;             /* IO SQ the rings feed */
+    uint8_t  use_kthread;       /* 1 = a kernel thread drains the rings */
+    uint32_t sq_entries;        /* Power of 2, MAX_RING_ENTRIES at most */
+    uint32_t cq_entries;        /* Power of 2, MAX_RING_ENTRIES at most */
+    uint32_t mmap_size;         /* Returned, bytes to mmap */
+    uint32_t sq_hdr_off;        /* Returned, offset of submission header */
+    uint32_t sq_ring_off;       /* Returned, offset of nvme_ring_sqe array */
+    uint32_t cq_hdr_off;        /* Returned, offset of completion header */
+    uint32_t cq_ring_off;       /* Returned, offset of nvme_ring_cqe array */
+};
+
+/**
+ * No. of buckets of each latency histogram, see nvme_lat_stats.
+ */
+#define LAT_HIST_BUCKETS    256
+
+/**
+ * The latency histograms kept per SQ while recording is on.
+ */
+enum nvme_lat_hist {
+    LAT_SUBMIT_REAP,    /* cmd put into the SQ until its CE is reaped */
+    LAT_RING_ISR,       /* SQ doorbell rung until the irq of the CQ fired */
+    LAT_ISR_REAP,       /* irq of the CQ fired until the CE is reaped */
+    LAT_HIST_MAX
+};
+
+/**
+ * Recording control of NVME_IOCTL_LAT_STATS.
+ */
+enum nvme_lat_ctl {
+    LAT_CTL_KEEP,       /* Leave recording as it is */
+    LAT_CTL_OFF,        /* Stop recording, costs nothing while off */
+    LAT_CTL_ON          /* Start recording for all Q's of the device */
+};
+
+/**
+ * Interface structure for NVME_IOCTL_LAT_STATS. The histograms are log-
+ * linear in ns; bucket b counts latencies of at least b ns for b < 8, else
+ * of at least (8 + (b % 8)) << ((b / 8) - 1) ns, up to the lower bound of
+ * bucket b + 1. The last bucket counts everything longer as well. Only cmds
+ * sent while recording is on are counted. The ISR times are those of the
+ * last irq of the CQ's vector before the CE is reaped.
+ */
+struct nvme_lat_stats {
+    uint16_t sq_id;         /* SQ to read or reset the histograms of */
+    uint8_t  ctl;           /* enum nvme_lat_ctl, applied first */
+    uint8_t  reset;         /* 1 = clear the SQ's histograms after reading */
+    uint8_t  enabled;       /* Returned, 1 if recording is on */
+    /* NULL, or LAT_HIST_MAX * LAT_HIST_BUCKETS counts to read into, one
+     * histogram after the other in enum nvme_lat_hist order */
+    uint32_t *buffer;
+};
+
+/**
+ * Layout version of the data returned by NVME_IOCTL_PERF_STATS, bumped
+ * whenever counters are added; new counters are only ever appended.
+ */
+#define NVME_PERF_VERSION   1
+
+/**
+ * Counters kept at all times for the device, every SQ and every CQ. The
+ * SQ counters count the cmds sent to and doorbells rung of the SQ, the CQ
+ * counters the CE's reaped from the CQ, and the device counters all of it.
+ */
+struct nvme_perf_counters {
+    uint64_t cmds_sent;     /* cmds put into the SQ */
+    uint64_t bytes_sent;    /* data_buf_size of the cmds put into the SQ */
+    uint64_t dbs_rung;      /* SQ tail doorbell writes */
+    uint64_t sq_full;       /* sends/commits rejected because SQ is full */
+    uint64_t ces_reaped;    /* CE's reaped to user space or a ring */
+    uint64_t latent_errs;   /* CE's reaped which had a latent error */
+};
+
+/**
+ * What NVME_IOCTL_PERF_STATS reads or resets.
+ */
+enum nvme_perf_scope {
+    PERF_DEVICE,            /* Device counters and irq counts per vector */
+    PERF_SQ,                /* Counters of the SQ q_id */
+    PERF_CQ                 /* Counters of the CQ q_id */
+};
+
+/**
+ * Data returned by NVME_IOCTL_PERF_STATS. For PERF_DEVICE num_vecs irq
+ * counts (uint64_t) follow, one per vector of the active irq scheme;
+ * num_vecs is 0 for the Q scopes.
+ */
+struct nvme_perf_data {
+    struct nvme_perf_counters counters;
+    uint32_t num_vecs;      /* No. of irq counts following */
+    uint32_t rsvd;
+};
+
+/**
+ * Interface structure for NVME_IOCTL_PERF_STATS. The data is truncated to
+ * the size of the buffer, size returns what was written; a buffer which is
+ * too small therefore still yields the counters known to older layouts.
+ */
+struct nvme_perf_stats {
+    uint32_t version;       /* Returned, NVME_PERF_VERSION of the data */
+    uint8_t  scope;         /* enum nvme_perf_scope */
+    uint8_t  reset;         /* 1 = zero the counters after reading */
+    uint16_t q_id;          /* Q ID for PERF_SQ and PERF_CQ */
+    uint32_t size;          /* Size of buffer, returned bytes written */
+    uint8_t  *buffer;       /* NULL, or buffer for struct nvme_perf_data */
+};
+
+/**
+ * Interface structure for NVME_IOCTL_RING_ENTER, which drains both rings of
+ * a SQ from the calling thread.
+ */
+struct nvme_ring_enter {
+    uint16_t sq_id;             /* IO SQ the rings feed */
+    uint32_t num_submitted;     /* Returned, SQE's moved into the SQ */
+    uint32_t num_reaped;        /* Returned, CE's moved into the CQ ring */
 };
 
 /**
@@ -168,6 +412,124 @@ struct nvme_gen_sq {
     uint32_t elements;      /* total number of elements in this Q */
 };
 
+/**
+ * Layout version of the snapshot returned by NVME_IOCTL_SNAPSHOT, bumped
+ * whenever any of the nvme_snap_* structures change.
+ */
+#define NVME_SNAPSHOT_VERSION   1
+
+/**
+ * PRP's of a Q or cmd within a snapshot.
+ */
+struct nvme_snap_prps {
+    uint64_t prp1;
+    uint64_t prp2;
+    uint64_t data_buf_addr;     /* User space address of the data buffer */
+    uint32_t type;              /* Bits PRP1 = 1, PRP2 = 2, PRP_List = 4 */
+    uint32_t npages;            /* No. of PRP list pages */
+    uint32_t data_buf_size;
+    uint32_t num_map_pgs;       /* No. of pages mapped for DMA */
+    uint32_t data_dir;          /* enum dma_data_direction */
+    uint32_t rsvd;
+};
+
+/**
+ * A CQ within a snapshot.
+ */
+struct nvme_snap_cq {
+    struct nvme_gen_cq public_cq;
+    uint64_t dma_addr;          /* Q memory if contig */
+    uint64_t poll_wait_ns;      /* Avg. wait for the head CE when polled */
+    uint32_t size;              /* Bytes of Q memory */
+    uint32_t dbs_offset;        /* Offset of the head doorbell into BAR0 */
+    uint32_t num_scanned;       /* CE's from head_ptr known as posted */
+    uint8_t  contig;
+    uint8_t  rsvd[3];
+    struct nvme_snap_prps prp_persist;  /* Q memory if discontig */
+};
+
+/**
+ * A SQ within a snapshot.
+ */
+struct nvme_snap_sq {
+    struct nvme_gen_sq public_sq;
+    uint64_t dma_addr;          /* Q memory if contig */
+    uint32_t size;              /* Bytes of Q memory */
+    uint32_t dbs_offset;        /* Offset of the tail doorbell into BAR0 */
+    uint32_t num_cmds;          /* No. of cmds outstanding */
+    uint16_t unique_cmd_id;     /* Next cmd ID to try */
+    uint8_t  contig;
+    uint8_t  rings;             /* 1 if shared memory rings feed it */
+    struct nvme_snap_prps prp_persist;  /* Q memory if discontig */
+};
+
+/**
+ * A cmd outstanding within a snapshot.
+ */
+struct nvme_snap_cmd {
+    uint64_t user_tag;          /* nvme_ring_sqe.user_tag if sent by ring */
+    uint16_t sq_id;
+    uint16_t cmd_id;
+    uint16_t persist_q_id;      /* Q created/deleted by the cmd, else 0 */
+    uint8_t  opcode;
+    uint8_t  rsvd;
+    struct nvme_snap_prps prp_nonpersist;
+};
+
+/**
+ * An irq vector within a snapshot.
+ */
+struct nvme_snap_irq {
+    uint32_t int_vec;           /* Vector no. assigned by the OS */
+    uint16_t irq_no;
+    uint16_t num_cqs;           /* No. of CQ's served by the vector */
+    uint32_t isr_fired;
+    uint32_t isr_count;
+};
+
+/**
+ * A meta data buffer within a snapshot.
+ */
+struct nvme_snap_meta {
+    uint64_t dma_addr;
+    uint32_t meta_id;
+    uint32_t rsvd;
+};
+
+/**
+ * Start of a snapshot. Following it are num_cqs nvme_snap_cq, num_sqs
+ * nvme_snap_sq, num_cmds nvme_snap_cmd grouped by SQ in SQ order, num_irqs
+ * nvme_snap_irq and num_metas nvme_snap_meta, each array right after the
+ * one before.
+ */
+struct nvme_snap_hdr {
+    uint32_t version;           /* NVME_SNAPSHOT_VERSION */
+    uint32_t size;              /* Bytes of the whole snapshot */
+    uint32_t num_cqs;
+    uint32_t num_sqs;
+    uint32_t num_cmds;
+    uint32_t num_irqs;
+    uint32_t num_metas;
+    uint32_t meta_buf_size;
+    uint32_t irq_type;          /* enum nvme_irq_type active */
+    uint16_t num_irqs_active;   /* No. of irqs of the active scheme */
+    uint16_t minor_no;
+    uint16_t open_cnt;
+    uint8_t  shared;
+    uint8_t  lat_enabled;
+    uint32_t rsvd;
+};
+
+/**
+ * Interface structure for NVME_IOCTL_SNAPSHOT. If size is too small for
+ * the snapshot nothing is written, the ioctl fails with ENOSPC and size
+ * returns the bytes needed.
+ */
+struct nvme_snapshot {
+    uint32_t size;              /* Size of buffer, returned bytes written */
+    uint8_t  *buffer;           /* Buffer for the snapshot */
+};
+
 /**
  * enum for metrics type. These enums are used when returning the device
  * metrics.
@@ -219,15 +581,6 @@ struct nvme_prep_cq {
     uint8_t     contig;     /* Indicates if SQ is contig or not, 1 = contig */
 };
 
-/**
- * Interface structure for getting the metrics structure into a user file.
- * The filename and location are specified thought file_name parameter.
- */
-struct nvme_file {
-    uint16_t    flen;       /* Length of file name, it is not the total bytes */
-    const char *file_name;  /* location and file name to copy metrics */
-};
-
 /**
  * Interface structure for reap inquiry ioctl. It works well for both admin
  * and IO Q's.
@@ -240,8 +593,55 @@ struct nvme_reap_inquiry {
     uint32_t isr_count;
 };
 
+/**
+ * Interface structure for reap wait ioctl. The calling thread sleeps until
+ * at least min_elements CE's are waiting in the CQ or timeout_ms expires.
+ * It is woken by the IRQ of the CQ, so only CQ's with IRQ's enabled apply.
+ */
+struct nvme_reap_wait {
+    uint16_t q_id;           /* CQ ID to wait on */
+    uint32_t min_elements;   /* No. of CE's to wait for, 0 is treated as 1 */
+    uint32_t timeout_ms;     /* Max time to sleep, 0 = only check once */
+    uint32_t num_remaining;  /* return no of cmds waiting to be reaped */
+
+    /* no of times isr was fired which is associated with cq waited on */
+    uint32_t isr_count;
+};
+
+/**
+ * Interface structure for ready CQ's ioctl. Reports the IRQ enabled CQ's
+ * whose irq has fired and which still hold CE's waiting to be reaped.
+ */
+struct nvme_ready_cqs {
+    uint32_t num_cq_ids;    /* CQ ID's covered by bitmap, i.e. max CQ ID + 1 */
+    uint32_t num_ready;     /* return no. of CQ's set in bitmap */
+    uint8_t  *bitmap;       /* CQ ID n is bit (n % 8) of byte (n / 8) */
+};
+
+/**
+ * Interface structure for attaching an eventfd to an IRQ enabled CQ. The
+ * eventfd is signalled every time the irq of the CQ fires, fd < 0 detaches
+ * the eventfd attached before. Deleting the CQ or changing the irq scheme
+ * detaches it as well.
+ */
+struct nvme_cq_eventfd {
+    uint16_t q_id;          /* CQ ID to signal for */
+    int32_t  fd;            /* eventfd from eventfd(2), < 0 to detach */
+};
+
+/**
+ * Max time a reap may busy-poll for the head CE of a CQ, see nvme_reap. The
+ * CQ stays locked meanwhile, longer waits belong to NVME_IOCTL_REAP_WAIT or
+ * to a loop in user space.
+ */
+#define MAX_REAP_POLL_US    1000
+
 /**
  * Interface structure for reap ioctl. Admin Q and all IO Q's are supported.
+ * For CQ's without IRQ's the reap can busy-poll for the CE at the head of
+ * the CQ before reaping, which detects a completion faster than looping on
+ * NVME_IOCTL_REAP_INQUIRY. A hybrid poll first sleeps for half the wait seen
+ * by previous polls of the CQ, saving CPU when the device latency is long.
  */
 struct nvme_reap {
     uint16_t q_id;          /* CQ ID to reap commands for */
@@ -252,6 +652,8 @@ struct nvme_reap {
     /* no of times isr was fired which is associated with cq reaped on */
     uint32_t isr_count;
     uint32_t size;          /* Size of buffer to fill data to */
+    uint32_t poll_us;       /* Max time to poll, 0 = don't poll */
+    uint8_t  poll_hybrid;   /* 1 = sleep before polling */
 };
 
 /**
@@ -25,6 +25,7 @@
 #include <linux/unistd.h>
 #include <linux/uaccess.h>
 #include <linux/delay.h>
+#include <linux/sched.h>
 
 #include "dnvme_ioctls.h"
 #include "dnvme_interface.h"
@@ -37,6 +38,9 @@
 #include "dnvme_cmds.h"
 #include "dnvme_ds.h"
 #include "dnvme_irq.h"
+#include "dnvme_ring.h"
+#include "dnvme_stats.h"
+#include "dnvme_trace.h"
 
 
 int device_status_chk(struct  metrics_device_list *pmetrics_device, int *status)
@@ -409,6 +413,7 @@ int driver_create_asq(struct nvme_create_admn_q *create_admn_q,
         goto fail_out;
     }
     memset(pmetrics_sq_list, 0, sizeof(struct metrics_sq));
+    mutex_init(&pmetrics_sq_list->q_mtx);
 
     /* Set Admin Q Id. */
     pmetrics_sq_list->public_sq.sq_id = admn_id;
@@ -428,8 +433,15 @@ int driver_create_asq(struct nvme_create_admn_q *create_admn_q,
     }
 
     LOG_DBG("Adding node for ASQ to the list.");
-    list_add_tail(&pmetrics_sq_list->sq_list_hd,
-        &pmetrics_device->metrics_sq_list);
+    err = add_sq_node(pmetrics_device, pmetrics_sq_list);
+    if (err < 0) {
+        free_cmd_track_slots(pmetrics_sq_list);
+        dma_free_coherent(&pnvme_dev->private_dev.pdev->dev,
+            pmetrics_sq_list->private_sq.size,
+            pmetrics_sq_list->private_sq.vir_kern_addr,
+            pmetrics_sq_list->private_sq.sq_dma_addr);
+        goto fail_out;
+    }
     return err;
 
 fail_out:
@@ -469,6 +481,7 @@ int driver_create_acq(struct nvme_create_admn_q *create_admn_q,
         goto fail_out;
     }
     memset(pmetrics_cq_list, 0, sizeof(struct metrics_cq));
+    mutex_init(&pmetrics_cq_list->q_mtx);
 
     /* Set Admin CQ Id. */
     pmetrics_cq_list->public_cq.q_id = admn_id;
@@ -488,8 +501,14 @@ int driver_create_acq(struct nvme_create_admn_q *create_admn_q,
     pmetrics_cq_list->public_cq.pbit_new_entry = 1;
 
     LOG_DBG("Adding node for ACQ to the list.");
-    list_add_tail(&pmetrics_cq_list->cq_list_hd,
-        &pmetrics_device->metrics_cq_list);
+    err = add_cq_node(pmetrics_device, pmetrics_cq_list);
+    if (err < 0) {
+        dma_free_coherent(&pnvme_dev->private_dev.pdev->dev,
+            pmetrics_cq_list->private_cq.size,
+            pmetrics_cq_list->private_cq.vir_kern_addr,
+            pmetrics_cq_list->private_cq.cq_dma_addr);
+        goto fail_out;
+    }
     return err;
 
 fail_out:
@@ -519,9 +538,11 @@ int driver_ioctl_init(struct pci_dev *pdev, void __iomem *bar0,
     INIT_LIST_HEAD(&(pmetrics_device_list->metrics_cq_list));
     INIT_LIST_HEAD(&(pmetrics_device_list->metrics_meta.meta_trk_list));
     INIT_LIST_HEAD(&(pmetrics_device_list->irq_process.irq_track_list));
-    INIT_LIST_HEAD(&(pmetrics_device_list->irq_process.wrk_item_list));
 
     mutex_init(&pmetrics_device_list->irq_process.irq_track_mtx);
+    init_waitqueue_head(&pmetrics_device_list->irq_process.poll_wq);
+    pmetrics_device_list->irq_process.vec_stats = NULL;
+    pmetrics_device_list->irq_process.num_vec_stats = 0;
     pmetrics_device_list->metrics_device->private_dev.pdev = pdev;
     pmetrics_device_list->metrics_device->private_dev.bar0 = bar0;
     pmetrics_device_list->metrics_device->private_dev.bar1 = bar1;
@@ -544,7 +565,7 @@ int driver_ioctl_init(struct pci_dev *pdev, void __iomem *bar0,
         goto fail_out;
      }
 
-    /* Spinlock to protect from kernel preemption in ISR handler */
+    /* Spinlock to protect the irq nodes against the ISR handler */
     spin_lock_init(&pmetrics_device_list->irq_process.isr_spin_lock);
 
     /* Initialize irq scheme to INT_NONE and perform cleanup of all lists */
@@ -605,7 +626,7 @@ int metabuff_create(struct metrics_device_list *pmetrics_device_elem,
  * linked list.
  */
 int metabuff_alloc(struct metrics_device_list *pmetrics_device_elem,
-    u32 meta_id)
+    u32 meta_id, struct file *filp)
 {
     struct metrics_meta *pmeta_data = NULL;
     int err = SUCCESS;
@@ -634,6 +655,7 @@ int metabuff_alloc(struct metrics_device_list *pmetrics_device_elem,
 
     /* Allocate DMA memory for the meta data buffer */
     pmeta_data->meta_id = meta_id;
+    pmeta_data->owner = filp;
     pmeta_data->vir_kern_addr = dma_pool_alloc(pmetrics_device_elem->
         metrics_meta.meta_dmapool_ptr, GFP_ATOMIC, &pmeta_data->meta_dma_addr);
     if (pmeta_data->vir_kern_addr == NULL) {
@@ -661,7 +683,7 @@ fail_out:
  * linked list and finally free the node memory from the kernel.
  */
 int metabuff_del(struct metrics_device_list *pmetrics_device,
-    u32 meta_id)
+    u32 meta_id, struct file *filp)
 {
     struct metrics_meta *pmeta_data;
 
@@ -676,6 +698,9 @@ int metabuff_del(struct metrics_device_list *pmetrics_device,
     if (pmeta_data == NULL) {
         LOG_DBG("Meta ID does not exists, it is already deleted");
         return SUCCESS;
+    } else if (!file_may_use(pmetrics_device, pmeta_data->owner, filp)) {
+        LOG_ERR("Meta ID = %d belongs to another file", meta_id);
+        return -EACCES;
     }
 
     /* Free the DMA memory if exists */
@@ -730,6 +755,213 @@ void deallocate_mb(struct  metrics_device_list *pmetrics_device)
 }
 
 
+/*
+ * release_file_mb - Free the meta buffers allocated by the given file. Which
+ * cmd transfers to which buffer isn't tracked, so while the file leaves SQ's
+ * with cmds on the controller any of them may still be in use; then they are
+ * handed to the controlling file and deallocate_mb frees them once the
+ * controller is disabled.
+ */
+void release_file_mb(struct metrics_device_list *pmetrics_device,
+    struct file *filp, u8 in_use)
+{
+    struct metrics_meta *pmeta_data;
+    struct metrics_meta *pmeta_next;
+
+    list_for_each_entry_safe(pmeta_data, pmeta_next,
+        &(pmetrics_device->metrics_meta.meta_trk_list), meta_list_hd) {
+
+        if (pmeta_data->owner != filp) {
+            continue;
+        } else if (in_use) {
+            pmeta_data->owner =
+                pmetrics_device->metrics_device->private_dev.ctrl_filp;
+            continue;
+        }
+        if (pmeta_data->vir_kern_addr != NULL) {
+            dma_pool_free(pmetrics_device->metrics_meta.meta_dmapool_ptr,
+                pmeta_data->vir_kern_addr, pmeta_data->meta_dma_addr);
+        }
+        list_del(&pmeta_data->meta_list_hd);
+        kfree(pmeta_data);
+    }
+}
+
+
+/*
+ * Pin down and map a user data buffer for DMA once, store it in the first
+ * free slot of the device and return its handle back to user space.
+ */
+int driver_reg_buf(struct metrics_device_list *pmetrics_device,
+    struct nvme_reg_buf *reg_buf_request, struct file *filp)
+{
+    int err = SUCCESS;
+    u32 idx;
+    struct nvme_reg_buf *user_data = NULL;
+    struct metrics_reg_buf *reg_buf = NULL;
+
+
+    /* Allocating memory for user struct in kernel space */
+    user_data = kmalloc(sizeof(struct nvme_reg_buf), GFP_KERNEL);
+    if (user_data == NULL) {
+        LOG_ERR("Unable to alloc kernel memory to copy user data");
+        err = -ENOMEM;
+        goto fail_out;
+    }
+    if (copy_from_user(user_data, reg_buf_request,
+        sizeof(struct nvme_reg_buf))) {
+
+        LOG_ERR("Unable to copy from user space");
+        err = -EFAULT;
+        goto fail_out;
+    }
+
+    /* Same contract as nvme_64b_send.data_dir, see data_buf_to_prp */
+    if ((user_data->buf_ptr == NULL) || ((unsigned long)user_data->buf_ptr & 3)
+        || (user_data->buf_size == 0) ||
+        !valid_dma_direction((enum dma_data_direction)user_data->data_dir)) {
+
+        LOG_ERR("Invalid Arguments");
+        err = -EINVAL;
+        goto fail_out;
+    }
+
+    for (idx = 0; idx < MAX_REG_BUFS; idx++) {
+        if (pmetrics_device->reg_bufs[idx] == NULL) {
+            break;
+        }
+    }
+    if (idx == MAX_REG_BUFS) {
+        LOG_ERR("All %d registered buffers are in use", MAX_REG_BUFS);
+        err = -ENOSPC;
+        goto fail_out;
+    }
+
+    reg_buf = kmalloc(sizeof(struct metrics_reg_buf), GFP_KERNEL | __GFP_ZERO);
+    if (reg_buf == NULL) {
+        LOG_ERR("Allocation to contain registered buffer node failed");
+        err = -ENOMEM;
+        goto fail_out;
+    }
+    INIT_LIST_HEAD(&reg_buf->prp_cache_list);
+    mutex_init(&reg_buf->buf_mtx);
+    reg_buf->buf_id = idx + 1;
+    reg_buf->buf_addr = (unsigned long)user_data->buf_ptr;
+    reg_buf->buf_size = user_data->buf_size;
+    reg_buf->data_dir = (enum dma_data_direction)user_data->data_dir;
+    reg_buf->owner = filp;
+
+    err = map_reg_buf(pmetrics_device->metrics_device, reg_buf);
+    if (err < 0) {
+        goto fail_out;
+    }
+
+    /* Return the handle back to user space */
+    user_data->buf_id = reg_buf->buf_id;
+    if (copy_to_user(reg_buf_request, user_data,
+        sizeof(struct nvme_reg_buf))) {
+
+        LOG_ERR("Unable to copy to user space");
+        err = -EFAULT;
+        goto fail_out;
+    }
+
+    pmetrics_device->reg_bufs[idx] = reg_buf;
+    kfree(user_data);
+    return SUCCESS;
+
+fail_out:
+    if (reg_buf != NULL) {
+        unmap_reg_buf(pmetrics_device->metrics_device, reg_buf);
+        kfree(reg_buf);
+    }
+    if (user_data != NULL) {
+        kfree(user_data);
+    }
+    return err;
+}
+
+
+/*
+ * Unpin and unmap the registered buffer of the given handle, refused while
+ * outstanding cmds still reference it.
+ */
+int driver_unreg_buf(struct metrics_device_list *pmetrics_device,
+    u32 buf_id, struct file *filp)
+{
+    struct metrics_reg_buf *reg_buf;
+
+    reg_buf = find_reg_buf(pmetrics_device, buf_id);
+    if (reg_buf == NULL) {
+        LOG_DBG("Registered buffer ID does not exist, it is already deleted");
+        return SUCCESS;
+    } else if (!file_may_use(pmetrics_device, reg_buf->owner, filp)) {
+        LOG_ERR("Registered buffer ID = %d belongs to another file", buf_id);
+        return -EACCES;
+    }
+
+    if (reg_buf->users != 0) {
+        LOG_ERR("Registered buffer ID = %d is used by %d outstanding cmds",
+            buf_id, reg_buf->users);
+        return -EBUSY;
+    }
+
+    pmetrics_device->reg_bufs[buf_id - 1] = NULL;
+    unmap_reg_buf(pmetrics_device->metrics_device, reg_buf);
+    kfree(reg_buf);
+    return SUCCESS;
+}
+
+
+/*
+ * deallocate_reg_bufs - Unpin, unmap and free all the registered buffers of
+ * the device. All cmds must have been removed from the cmd track lists.
+ */
+void deallocate_reg_bufs(struct metrics_device_list *pmetrics_device)
+{
+    u32 idx;
+
+    for (idx = 0; idx < MAX_REG_BUFS; idx++) {
+        if (pmetrics_device->reg_bufs[idx] != NULL) {
+            unmap_reg_buf(pmetrics_device->metrics_device,
+                pmetrics_device->reg_bufs[idx]);
+            kfree(pmetrics_device->reg_bufs[idx]);
+            pmetrics_device->reg_bufs[idx] = NULL;
+        }
+    }
+}
+
+
+/*
+ * deallocate_file_reg_bufs - Unpin, unmap and free the registered buffers of
+ * the given file. A buffer still used by outstanding cmds, which includes
+ * those on the file's own SQ's, is handed to the device, it goes with
+ * device_cleanup.
+ */
+void deallocate_file_reg_bufs(struct metrics_device_list *pmetrics_device,
+    struct file *filp)
+{
+    u32 idx;
+    struct metrics_reg_buf *reg_buf;
+
+    for (idx = 0; idx < MAX_REG_BUFS; idx++) {
+        reg_buf = pmetrics_device->reg_bufs[idx];
+        if ((reg_buf == NULL) || (reg_buf->owner != filp)) {
+            continue;
+        }
+        if (reg_buf->users != 0) {
+            LOG_DBG("Registered buffer ID = %d still used by %d cmds",
+                reg_buf->buf_id, reg_buf->users);
+            reg_buf->owner = NULL;
+            continue;
+        }
+        unmap_reg_buf(pmetrics_device->metrics_device, reg_buf);
+        kfree(reg_buf);
+        pmetrics_device->reg_bufs[idx] = NULL;
+    }
+}
+
+
 int driver_toxic_dword(struct metrics_device_list *pmetrics_device,
     struct backdoor_inject *err_inject)
 {
@@ -872,21 +1104,27 @@ fail_out:
 }
 
 
-int driver_send_64b(struct metrics_device_list *pmetrics_device,
-    struct nvme_64b_send *cmd_request)
+/*
+ * track_64b_cmd - Assign a unique ID to the 64B cmd and set up everything
+ * it references; meta buffer, PRP's and the bookkeeping of Q creation and
+ * deletion. The cmd is modified where it resides, which is either a kernel
+ * copy or its slot in a contiguous SQ. The caller holds the lock of the SQ.
+ * If cmd_request is not NULL the assigned unique ID is copied back to that
+ * user space descriptor. Whatever the cmd references must be usable by filp.
+ */
+int track_64b_cmd(struct metrics_device_list *pmetrics_device,
+    struct metrics_sq *pmetrics_sq, struct nvme_64b_send *user_data,
+    struct nvme_64b_send *cmd_request, void *nvme_cmd_ker, struct file *filp)
 {
     int err = -EINVAL;
-    u32 cmd_buf_size = 0;
-    /* Particular SQ from linked list of SQ's for device */
-    struct metrics_sq *pmetrics_sq;
     /* SQ represented by the CMD.QID */
     struct metrics_sq *p_cmd_sq;
     /* Particular CQ (within CMD) from linked list of Q's for device */
     struct metrics_cq *p_cmd_cq;
     /* struct describing the meta buf */
     struct metrics_meta *meta_buf;
-    /* Kernel space memory for passed in command */
-    void *nvme_cmd_ker = NULL;
+    /* Registered buffer holding the data, if any */
+    struct metrics_reg_buf *reg_buf = NULL;
     /* Pointer to passed in command DW0-DW9 */
     struct nvme_gen_cmd *nvme_gen_cmd;
     /* Pointer to Gen IOSQ command */
@@ -895,78 +1133,34 @@ int driver_send_64b(struct metrics_device_list *pmetrics_device,
     struct nvme_create_cq *nvme_create_cq;
     /* Pointer to Delete IO Q command */
     struct nvme_del_q *nvme_del_q;
-    /* void * pointer to check validity of Queues */
-    void *q_ptr = NULL;
     struct nvme_prps prps; /* Pointer to PRP List */
-    struct nvme_64b_send *user_data = NULL;
 
 
-    /* Allocating memory for user struct in kernel space */
-    user_data = kmalloc(sizeof(struct nvme_64b_send), GFP_KERNEL);
-    if (user_data == NULL) {
-        LOG_ERR("Unable to alloc kernel memory to copy user data");
-        err = -ENOMEM;
-        goto free_out;
-    }
-    if (copy_from_user(user_data, cmd_request, sizeof(struct nvme_64b_send))) {
-        LOG_ERR("Unable to copy from user space");
-        err = -EFAULT;
-        goto free_out;
-    }
-
     /* Initial invalid arguments checking */
-    if (NULL == user_data->cmd_buf_ptr) {
-        LOG_ERR("Command Buffer does not exist");
-        goto free_out;
-    } else if (
+    if ((user_data->reg_buf_id != 0) &&
+        (user_data->data_buf_size == 0 || NULL != user_data->data_buf_ptr)) {
+
+        LOG_ERR("Registered buffer and data buffer inconsistent");
+        return err;
+    } else if ((user_data->reg_buf_id == 0) && (
         (user_data->data_buf_size != 0 && NULL == user_data->data_buf_ptr) ||
-        (user_data->data_buf_size == 0 && NULL != user_data->data_buf_ptr)) {
+        (user_data->data_buf_size == 0 && NULL != user_data->data_buf_ptr))) {
 
         LOG_ERR("Data buffer size and data buffer inconsistent");
-        goto free_out;
-    }
-
-    /* Get the required SQ through which command should be sent */
-    pmetrics_sq = find_sq(pmetrics_device, user_data->q_id);
-    if (pmetrics_sq == NULL) {
-        LOG_ERR("SQ ID = %d does not exist", user_data->q_id);
-        err = -EPERM;
-        goto free_out;
-    }
-    /* Learn the command size */
-    cmd_buf_size =
-        (pmetrics_sq->private_sq.size / pmetrics_sq->public_sq.elements);
-
-    /* Check for SQ is full */
-    if ((((u32)pmetrics_sq->public_sq.tail_ptr_virt + 1UL) %
-        pmetrics_sq->public_sq.elements) ==
-        (u32)pmetrics_sq->public_sq.head_ptr) {
-
-        LOG_ERR("SQ is full");
-        err = -EPERM;
-        goto free_out;
-    }
-
-    /* Allocating memory for the command in kernel space */
-    nvme_cmd_ker = kmalloc(cmd_buf_size, GFP_ATOMIC | __GFP_ZERO);
-    if (nvme_cmd_ker == NULL) {
-        LOG_ERR("Unable to allocate kernel memory");
-        err = -ENOMEM;
-        goto free_out;
-    }
-    if (copy_from_user(nvme_cmd_ker, user_data->cmd_buf_ptr, cmd_buf_size)) {
-        LOG_ERR("Invalid copy from user space");
-        err = -EFAULT;
-        goto free_out;
+        return err;
     }
 
     nvme_gen_cmd = (struct nvme_gen_cmd *)nvme_cmd_ker;
     memset(&prps, 0, sizeof(prps));
 
-    /* Copy and Increment the CMD ID, copy back to user space so can see ID */
-    user_data->unique_id = pmetrics_sq->private_sq.unique_cmd_id++;
+    /* Reserve a free CMD ID, copy back to user space so can see ID */
+    err = get_unique_cmd_id(pmetrics_sq, &user_data->unique_id);
+    if (err < 0) {
+        return err;
+    }
     nvme_gen_cmd->command_id = user_data->unique_id;
-    if (copy_to_user(cmd_request, user_data, sizeof(struct nvme_64b_send))) {
+    if ((cmd_request != NULL) &&
+        copy_to_user(cmd_request, user_data, sizeof(struct nvme_64b_send))) {
         LOG_ERR("Unable to copy to user space");
         err = -EFAULT;
         goto fail_out;
@@ -979,6 +1173,11 @@ int driver_send_64b(struct metrics_device_list *pmetrics_device,
             LOG_ERR("Meta Buff ID not found");
             err = -EINVAL;
             goto fail_out;
+        } else if (!file_may_use(pmetrics_device, meta_buf->owner, filp)) {
+            LOG_ERR("Meta Buff ID = %d belongs to another file",
+                user_data->meta_buf_id);
+            err = -EACCES;
+            goto fail_out;
         }
         /* Add the required information to the command */
         nvme_gen_cmd->metadata = cpu_to_le64(meta_buf->meta_dma_addr);
@@ -990,18 +1189,16 @@ int driver_send_64b(struct metrics_device_list *pmetrics_device,
         /* Create IOSQ command */
         nvme_create_sq = (struct nvme_create_sq *) nvme_cmd_ker;
 
-        /* Get the required SQ from the global linked list from CMD.DW10.QID */
-        list_for_each_entry(p_cmd_sq, &pmetrics_device->metrics_sq_list,
-            sq_list_hd) {
-            if (nvme_create_sq->sqid == p_cmd_sq->public_sq.sq_id) {
-                q_ptr = (struct  metrics_sq  *)p_cmd_sq;
-                break;
-            }
-        }
-        if (q_ptr == NULL) {
+        /* Get the required SQ represented by CMD.DW10.QID */
+        p_cmd_sq = find_sq(pmetrics_device, nvme_create_sq->sqid);
+        if (p_cmd_sq == NULL) {
             err = -EPERM;
             LOG_ERR("SQID node present in create SQ, but lookup found nothing");
             goto fail_out;
+        } else if (!file_may_use(pmetrics_device, p_cmd_sq->owner, filp)) {
+            LOG_ERR("SQ ID = %d belongs to another file", nvme_create_sq->sqid);
+            err = -EACCES;
+            goto fail_out;
         }
 
         /* Sanity Checks */
@@ -1034,7 +1231,7 @@ int driver_send_64b(struct metrics_device_list *pmetrics_device,
             }
             err = prep_send64b_cmd(pmetrics_device->metrics_device,
                 pmetrics_sq, user_data, &prps, nvme_gen_cmd,
-                nvme_create_sq->sqid, DISCONTG_IO_Q, PRP_PRESENT);
+                nvme_create_sq->sqid, DISCONTG_IO_Q, PRP_PRESENT, NULL);
             if (err < 0) {
                 LOG_ERR("Failure to prepare 64 byte command");
                 goto fail_out;
@@ -1043,7 +1240,7 @@ int driver_send_64b(struct metrics_device_list *pmetrics_device,
             /* Contig IOSQ creation */
             err = prep_send64b_cmd(pmetrics_device->metrics_device,
                 pmetrics_sq, user_data, &prps, nvme_gen_cmd,
-                nvme_create_sq->sqid, CONTG_IO_Q, PRP_ABSENT);
+                nvme_create_sq->sqid, CONTG_IO_Q, PRP_ABSENT, NULL);
             if (err < 0) {
                 LOG_ERR("Failure to prepare 64 byte command");
                 goto fail_out;
@@ -1061,20 +1258,16 @@ int driver_send_64b(struct metrics_device_list *pmetrics_device,
         /* Create IOCQ command */
         nvme_create_cq = (struct nvme_create_cq *) nvme_cmd_ker;
 
-        /* Get the required CQ from the global linked list
-         * represented by CMD.DW10.QID */
-        list_for_each_entry(p_cmd_cq, &pmetrics_device->metrics_cq_list,
-            cq_list_hd) {
-
-            if (nvme_create_cq->cqid == p_cmd_cq->public_cq.q_id) {
-                q_ptr = (struct  metrics_cq  *)p_cmd_cq;
-                break;
-            }
-        }
-        if (q_ptr == NULL) {
+        /* Get the required CQ represented by CMD.DW10.QID */
+        p_cmd_cq = find_cq(pmetrics_device, nvme_create_cq->cqid);
+        if (p_cmd_cq == NULL) {
             err = -EPERM;
             LOG_ERR("CQID node present in create CQ, but lookup found nothing");
             goto fail_out;
+        } else if (!file_may_use(pmetrics_device, p_cmd_cq->owner, filp)) {
+            LOG_ERR("CQ ID = %d belongs to another file", nvme_create_cq->cqid);
+            err = -EACCES;
+            goto fail_out;
         }
 
         /* Sanity Checks */
@@ -1130,7 +1323,7 @@ int driver_send_64b(struct metrics_device_list *pmetrics_device,
             }
             err = prep_send64b_cmd(pmetrics_device->metrics_device,
                 pmetrics_sq, user_data, &prps, nvme_gen_cmd,
-                nvme_create_cq->cqid, DISCONTG_IO_Q, PRP_PRESENT);
+                nvme_create_cq->cqid, DISCONTG_IO_Q, PRP_PRESENT, NULL);
             if (err < 0) {
                 LOG_ERR("Failure to prepare 64 byte command");
                 goto fail_out;
@@ -1139,7 +1332,7 @@ int driver_send_64b(struct metrics_device_list *pmetrics_device,
             /* Contig IOCQ creation */
             err = prep_send64b_cmd(pmetrics_device->metrics_device,
                 pmetrics_sq, user_data, &prps, nvme_gen_cmd,
-                nvme_create_cq->cqid, CONTG_IO_Q, PRP_ABSENT);
+                nvme_create_cq->cqid, CONTG_IO_Q, PRP_ABSENT, NULL);
             if (err < 0) {
                 LOG_ERR("Failure to prepare 64 byte command");
                 goto fail_out;
@@ -1162,10 +1355,19 @@ int driver_send_64b(struct metrics_device_list *pmetrics_device,
             LOG_ERR("Invalid argument for opcode 0x00");
             goto fail_out;
         }
+        /* Deleting a Q which doesn't exist is left to the controller */
+        p_cmd_sq = find_sq(pmetrics_device, nvme_del_q->qid);
+        if ((p_cmd_sq != NULL) &&
+            !file_may_use(pmetrics_device, p_cmd_sq->owner, filp)) {
+
+            LOG_ERR("SQ ID = %d belongs to another file", nvme_del_q->qid);
+            err = -EACCES;
+            goto fail_out;
+        }
 
         err = prep_send64b_cmd(pmetrics_device->metrics_device,
             pmetrics_sq, user_data, &prps, nvme_gen_cmd, nvme_del_q->qid,
-             0, PRP_ABSENT);
+             0, PRP_ABSENT, NULL);
 
         if (err < 0) {
             LOG_ERR("Failure to prepare 64 byte command");
@@ -1180,10 +1382,18 @@ int driver_send_64b(struct metrics_device_list *pmetrics_device,
             LOG_ERR("Invalid argument for opcode 0x00");
             goto fail_out;
         }
+        p_cmd_cq = find_cq(pmetrics_device, nvme_del_q->qid);
+        if ((p_cmd_cq != NULL) &&
+            !file_may_use(pmetrics_device, p_cmd_cq->owner, filp)) {
+
+            LOG_ERR("CQ ID = %d belongs to another file", nvme_del_q->qid);
+            err = -EACCES;
+            goto fail_out;
+        }
 
         err = prep_send64b_cmd(pmetrics_device->metrics_device,
             pmetrics_sq, user_data, &prps, nvme_gen_cmd, nvme_del_q->qid,
-            0, PRP_ABSENT);
+            0, PRP_ABSENT, NULL);
 
         if (err < 0) {
             LOG_ERR("Failure to prepare 64 byte command");
@@ -1191,18 +1401,147 @@ int driver_send_64b(struct metrics_device_list *pmetrics_device,
         }
 
     } else {
-        /* For rest of the commands */
-        if (user_data->data_buf_ptr != NULL) {
-            err = prep_send64b_cmd(pmetrics_device->metrics_device,
-                pmetrics_sq, user_data, &prps, nvme_gen_cmd,
-                PERSIST_QID_0, DATA_BUF, PRP_PRESENT);
-            if (err < 0) {
-                LOG_ERR("Failure to prepare 64 byte command");
+        /* For rest of the commands; track even those without data so the
+         * cmd ID is released when the cmd is reaped */
+        if (user_data->reg_buf_id != 0) {
+            reg_buf = find_reg_buf(pmetrics_device, user_data->reg_buf_id);
+            if (reg_buf == NULL) {
+                LOG_ERR("Registered buffer ID = %d does not exist",
+                    user_data->reg_buf_id);
+                err = -EINVAL;
+                goto fail_out;
+            } else if (!file_may_use(pmetrics_device, reg_buf->owner, filp)) {
+                LOG_ERR("Registered buffer ID = %d belongs to another file",
+                    user_data->reg_buf_id);
+                err = -EACCES;
                 goto fail_out;
             }
+            if ((user_data->reg_buf_offset >= reg_buf->buf_size) ||
+                (user_data->data_buf_size >
+                (reg_buf->buf_size - user_data->reg_buf_offset))) {
+
+                LOG_ERR("Data lies outside of registered buffer ID = %d",
+                    user_data->reg_buf_id);
+                err = -EINVAL;
+                goto fail_out;
+            }
+        }
+        err = prep_send64b_cmd(pmetrics_device->metrics_device,
+            pmetrics_sq, user_data, &prps, nvme_gen_cmd, PERSIST_QID_0,
+            DATA_BUF, ((user_data->data_buf_ptr != NULL) ||
+            (reg_buf != NULL)) ? PRP_PRESENT : PRP_ABSENT, reg_buf);
+        if (err < 0) {
+            LOG_ERR("Failure to prepare 64 byte command");
+            goto fail_out;
         }
     }
 
+    if (pmetrics_device->lat_enabled) {
+        lat_stamp_send(pmetrics_sq, user_data->unique_id);
+    }
+    PERF_ADD(pmetrics_sq->perf, cmds_sent, 1);
+    PERF_ADD(pmetrics_sq->perf, bytes_sent, user_data->data_buf_size);
+    PERF_ADD(pmetrics_device->perf, cmds_sent, 1);
+    PERF_ADD(pmetrics_device->perf, bytes_sent, user_data->data_buf_size);
+    trace_dnvme_send(pmetrics_sq->public_sq.sq_id, user_data->unique_id,
+        nvme_gen_cmd->opcode, prps.type, user_data->data_buf_size);
+    return SUCCESS;
+
+fail_out:
+    put_unique_cmd_id(pmetrics_sq, user_data->unique_id);
+    /* Some sanity checks above bail out with err still being SUCCESS */
+    return (err < 0) ? err : -EINVAL;
+}
+
+
+/*
+ * send_64b_cmd - Place a single 64B cmd into its SQ. The cmd descriptor must
+ * already reside in kernel space. If cmd_request is not NULL the assigned
+ * unique ID is copied back to that user space descriptor, otherwise the
+ * caller is responsible for returning user_data->unique_id to user space.
+ * Any file may send to the ASQ, an IO SQ must be usable by filp. SQ entries
+ * up to SQ_ENTRY_STACK_SIZE bytes are staged on the stack, only larger ones
+ * need an allocation, and it is made before the SQ is locked.
+ */
+static int send_64b_cmd(struct metrics_device_list *pmetrics_device,
+    struct nvme_64b_send *user_data, struct nvme_64b_send *cmd_request,
+    struct file *filp)
+{
+    int err = -EINVAL;
+    u32 cmd_buf_size = 0;
+    /* Particular SQ from linked list of SQ's for device */
+    struct metrics_sq *pmetrics_sq;
+    /* Kernel space memory for passed in command */
+    u8 cmd_stack[SQ_ENTRY_STACK_SIZE];
+    void *nvme_cmd_ker = cmd_stack;
+
+
+    /* Initial invalid arguments checking */
+    if (NULL == user_data->cmd_buf_ptr) {
+        LOG_ERR("Command Buffer does not exist");
+        goto free_out;
+    }
+
+    /* Admin cmds create and delete Q's, only allowed with exclusive access */
+    if ((user_data->q_id == 0) &&
+        (pmetrics_device->metrics_sem_owner != current)) {
+
+        LOG_ERR("Cmds to ASQ require exclusive access to the device");
+        err = -EAGAIN;
+        goto free_out;
+    }
+
+    /* Get the required SQ through which command should be sent */
+    pmetrics_sq = find_sq(pmetrics_device, user_data->q_id);
+    if (pmetrics_sq == NULL) {
+        LOG_ERR("SQ ID = %d does not exist", user_data->q_id);
+        err = -EPERM;
+        goto free_out;
+    } else if ((user_data->q_id != 0) &&
+        !file_may_use(pmetrics_device, pmetrics_sq->owner, filp)) {
+
+        LOG_ERR("SQ ID = %d belongs to another file", user_data->q_id);
+        err = -EACCES;
+        goto free_out;
+    }
+
+    /* Learn the command size, it is fixed for the life of the SQ */
+    cmd_buf_size =
+        (pmetrics_sq->private_sq.size / pmetrics_sq->public_sq.elements);
+    if (cmd_buf_size > SQ_ENTRY_STACK_SIZE) {
+        nvme_cmd_ker = kmalloc(cmd_buf_size, GFP_KERNEL);
+        if (nvme_cmd_ker == NULL) {
+            LOG_ERR("Unable to allocate kernel memory");
+            err = -ENOMEM;
+            goto free_out;
+        }
+    }
+    mutex_lock(&pmetrics_sq->q_mtx);
+
+    /* Check for SQ is full */
+    if ((((u32)pmetrics_sq->public_sq.tail_ptr_virt + 1UL) %
+        pmetrics_sq->public_sq.elements) ==
+        (u32)pmetrics_sq->public_sq.head_ptr) {
+
+        LOG_ERR("SQ is full");
+        PERF_ADD(pmetrics_sq->perf, sq_full, 1);
+        PERF_ADD(pmetrics_device->perf, sq_full, 1);
+        err = -EPERM;
+        goto sq_unlk;
+    }
+
+    if (copy_from_user(nvme_cmd_ker, user_data->cmd_buf_ptr, cmd_buf_size)) {
+        LOG_ERR("Invalid copy from user space");
+        err = -EFAULT;
+        goto sq_unlk;
+    }
+
+    err = track_64b_cmd(pmetrics_device, pmetrics_sq, user_data, cmd_request,
+        nvme_cmd_ker, filp);
+    if (err < 0) {
+        goto sq_unlk;
+    }
+
     /* Copying the command in to appropriate SQ and handling sync issues */
     if (pmetrics_sq->private_sq.contig) {
         memcpy((pmetrics_sq->private_sq.vir_kern_addr +
@@ -1224,25 +1563,291 @@ int driver_send_64b(struct metrics_device_list *pmetrics_device,
         (u16)(((u32)pmetrics_sq->public_sq.tail_ptr_virt + 1UL) %
         pmetrics_sq->public_sq.elements);
 
-    kfree(nvme_cmd_ker);
-    kfree(user_data);
+    mutex_unlock(&pmetrics_sq->q_mtx);
+    if (nvme_cmd_ker != cmd_stack) {
+        kfree(nvme_cmd_ker);
+    }
     LOG_DBG("Command sent successfully");
     return 0;
 
-fail_out:
-    pmetrics_sq->private_sq.unique_cmd_id--;
+sq_unlk:
+    mutex_unlock(&pmetrics_sq->q_mtx);
 free_out:
-    if (nvme_cmd_ker != NULL) {
+    if (nvme_cmd_ker != cmd_stack) {
         kfree(nvme_cmd_ker);
     }
-    if (user_data != NULL) {
-        kfree(user_data);
-    }
     LOG_DBG("Sending of command failed");
     return err;
 }
 
 
+int driver_send_64b(struct metrics_device_list *pmetrics_device,
+    struct nvme_64b_send *cmd_request, struct file *filp)
+{
+    int err;
+    struct nvme_64b_send *user_data = NULL;
+
+
+    /* Allocating memory for user struct in kernel space */
+    user_data = kmalloc(sizeof(struct nvme_64b_send), GFP_KERNEL);
+    if (user_data == NULL) {
+        LOG_ERR("Unable to alloc kernel memory to copy user data");
+        return -ENOMEM;
+    }
+    if (copy_from_user(user_data, cmd_request, sizeof(struct nvme_64b_send))) {
+        LOG_ERR("Unable to copy from user space");
+        err = -EFAULT;
+        goto fail_out;
+    }
+
+    err = send_64b_cmd(pmetrics_device, user_data, cmd_request, filp);
+
+fail_out:
+    kfree(user_data);
+    return err;
+}
+
+
+/*
+ * driver_send_64b_batch - Place an array of 64B cmds into their SQ's under a
+ * single acquisition of the device lock. Each cmd is processed exactly as
+ * NVME_IOCTL_SEND_64B_CMD would, but a failing cmd does not stop the rest of
+ * the batch. The assigned unique ID's and per cmd error codes are returned to
+ * user space in one copy once the whole batch has been processed.
+ */
+int driver_send_64b_batch(struct metrics_device_list *pmetrics_device,
+    struct nvme_64b_batch *batch_request, struct file *filp)
+{
+    int err = SUCCESS;
+    u32 i;
+    struct nvme_64b_batch user_data;
+    struct nvme_64b_send *cmds = NULL;
+    struct nvme_64b_status *sts = NULL;
+    /* One bit per SQ ID, set once that SQ's doorbell has been rung */
+    unsigned long *rung = NULL;
+
+
+    if (copy_from_user(&user_data, batch_request,
+        sizeof(struct nvme_64b_batch))) {
+
+        LOG_ERR("Unable to copy from user space");
+        return -EFAULT;
+    }
+
+    /* Initial invalid arguments checking */
+    if ((user_data.num_cmds == 0) ||
+        (user_data.num_cmds > MAX_64B_BATCH_CMDS)) {
+
+        LOG_ERR("Batch of %d cmds not within [1, %d]", user_data.num_cmds,
+            MAX_64B_BATCH_CMDS);
+        return -EINVAL;
+    } else if ((user_data.cmds == NULL) || (user_data.status == NULL)) {
+        LOG_ERR("Batch cmd or status array does not exist");
+        return -EINVAL;
+    }
+
+    /* Allocating memory for user arrays in kernel space */
+    cmds = kmalloc(user_data.num_cmds * sizeof(struct nvme_64b_send),
+        GFP_KERNEL);
+    sts = kmalloc(user_data.num_cmds * sizeof(struct nvme_64b_status),
+        GFP_KERNEL | __GFP_ZERO);
+    if (user_data.ring_dbl) {
+        rung = kzalloc(BITS_TO_LONGS(MAX_SQ_IDS) * sizeof(unsigned long),
+            GFP_KERNEL);
+    }
+    if ((cmds == NULL) || (sts == NULL) || (user_data.ring_dbl && !rung)) {
+        LOG_ERR("Unable to alloc kernel memory to copy user data");
+        err = -ENOMEM;
+        goto fail_out;
+    }
+    if (copy_from_user(cmds, user_data.cmds,
+        user_data.num_cmds * sizeof(struct nvme_64b_send))) {
+
+        LOG_ERR("Unable to copy from user space");
+        err = -EFAULT;
+        goto fail_out;
+    }
+
+    for (i = 0; i < user_data.num_cmds; i++) {
+        sts[i].q_id = cmds[i].q_id;
+        sts[i].err = send_64b_cmd(pmetrics_device, &cmds[i], NULL, filp);
+        if (sts[i].err == SUCCESS) {
+            sts[i].unique_id = cmds[i].unique_id;
+        } else if (err == SUCCESS) {
+            /* Report the 1st failure, the status array reports the rest */
+            err = sts[i].err;
+        }
+    }
+
+    /* Ring each SQ which received cmds once, tail_ptr_virt is final now */
+    if (user_data.ring_dbl) {
+        for (i = 0; i < user_data.num_cmds; i++) {
+            if ((sts[i].err == SUCCESS) &&
+                !__test_and_set_bit(sts[i].q_id, rung)) {
+
+                nvme_ring_sqx_dbl(sts[i].q_id, pmetrics_device);
+            }
+        }
+    }
+
+    if (copy_to_user(user_data.status, sts,
+        user_data.num_cmds * sizeof(struct nvme_64b_status))) {
+
+        LOG_ERR("Unable to copy to user space");
+        err = -EFAULT;
+    }
+
+fail_out:
+    if (cmds != NULL) {
+        kfree(cmds);
+    }
+    if (sts != NULL) {
+        kfree(sts);
+    }
+    if (rung != NULL) {
+        kfree(rung);
+    }
+    return err;
+}
+
+
+/*
+ * driver_commit_sq - The cmds user space wrote into the slots of the SQ from
+ * tail_ptr_virt up to new_tail are copied out of the slot one at a time,
+ * tracked from that kernel copy and the final cmd is written back into the
+ * slot, so user space can't alter a cmd while it is being parsed. The per
+ * cmd descriptors are copied in all at once. The ASQ is mapped as well and
+ * its cmds create and delete Q's, it is never committed to.
+ */
+int driver_commit_sq(struct metrics_device_list *pmetrics_device,
+    struct nvme_sq_commit *commit_request, struct file *filp)
+{
+    int err = SUCCESS;
+    u32 i, num_cmds, num_used, cmd_buf_size;
+    struct nvme_sq_commit user_data;
+    struct nvme_64b_send *cmds = NULL;
+    struct nvme_64b_send no_data;
+    struct nvme_64b_send *cmd;
+    struct metrics_sq *pmetrics_sq;
+    u8 *cmd_slot;
+    void *nvme_cmd_ker = NULL;
+
+
+    if (copy_from_user(&user_data, commit_request,
+        sizeof(struct nvme_sq_commit))) {
+
+        LOG_ERR("Unable to copy from user space");
+        return -EFAULT;
+    }
+    user_data.num_committed = 0;
+
+    /* Admin cmds create and delete Q's, they must be sent from kernel copies */
+    if (user_data.q_id == 0) {
+        LOG_ERR("Cmds to ASQ can't be committed, send them instead");
+        return -EINVAL;
+    }
+
+    pmetrics_sq = find_sq(pmetrics_device, user_data.q_id);
+    if (pmetrics_sq == NULL) {
+        LOG_ERR("SQ ID = %d does not exist", user_data.q_id);
+        return -EPERM;
+    } else if (!file_may_use(pmetrics_device, pmetrics_sq->owner, filp)) {
+        LOG_ERR("SQ ID = %d belongs to another file", user_data.q_id);
+        return -EACCES;
+    } else if (pmetrics_sq->private_sq.contig == 0) {
+        LOG_ERR("Only contig SQ's can be mmap'ed and committed");
+        return -EINVAL;
+    }
+    mutex_lock(&pmetrics_sq->q_mtx);
+
+    /* The cmds must fit into the free slots, 1 slot always stays empty */
+    if (user_data.new_tail >= pmetrics_sq->public_sq.elements) {
+        LOG_ERR("New tail = %d is outside of SQ ID = %d", user_data.new_tail,
+            user_data.q_id);
+        err = -EINVAL;
+        goto sq_unlk;
+    }
+    num_cmds = ((u32)user_data.new_tail + pmetrics_sq->public_sq.elements -
+        pmetrics_sq->public_sq.tail_ptr_virt) % pmetrics_sq->public_sq.elements;
+    num_used = ((u32)pmetrics_sq->public_sq.tail_ptr_virt +
+        pmetrics_sq->public_sq.elements - pmetrics_sq->public_sq.head_ptr) %
+        pmetrics_sq->public_sq.elements;
+    if (num_cmds > (pmetrics_sq->public_sq.elements - 1 - num_used)) {
+        LOG_ERR("SQ is full");
+        PERF_ADD(pmetrics_sq->perf, sq_full, 1);
+        PERF_ADD(pmetrics_device->perf, sq_full, 1);
+        err = -EPERM;
+        goto sq_unlk;
+    }
+
+    if ((user_data.cmds != NULL) && (num_cmds != 0)) {
+        cmds = kmalloc(num_cmds * sizeof(struct nvme_64b_send), GFP_KERNEL);
+        if (cmds == NULL) {
+            LOG_ERR("Unable to alloc kernel memory to copy user data");
+            err = -ENOMEM;
+            goto sq_unlk;
+        }
+        if (copy_from_user(cmds, user_data.cmds,
+            num_cmds * sizeof(struct nvme_64b_send))) {
+
+            LOG_ERR("Unable to copy from user space");
+            err = -EFAULT;
+            goto sq_unlk;
+        }
+    }
+    memset(&no_data, 0, sizeof(struct nvme_64b_send));
+
+    cmd_buf_size =
+        (pmetrics_sq->private_sq.size / pmetrics_sq->public_sq.elements);
+    nvme_cmd_ker = kmalloc(cmd_buf_size, GFP_KERNEL);
+    if (nvme_cmd_ker == NULL) {
+        LOG_ERR("Unable to alloc kernel memory to copy the cmds");
+        err = -ENOMEM;
+        goto sq_unlk;
+    }
+    for (i = 0; i < num_cmds; i++) {
+        cmd = (cmds != NULL) ? &cmds[i] : &no_data;
+        cmd->q_id = user_data.q_id;
+        cmd_slot = pmetrics_sq->private_sq.vir_kern_addr +
+            ((u32)pmetrics_sq->public_sq.tail_ptr_virt * cmd_buf_size);
+        memcpy(nvme_cmd_ker, cmd_slot, cmd_buf_size);
+        err = track_64b_cmd(pmetrics_device, pmetrics_sq, cmd, NULL,
+            nvme_cmd_ker, filp);
+        if (err < 0) {
+            LOG_ERR("Committing cmd %d of SQ ID = %d failed", i,
+                user_data.q_id);
+            break;
+        }
+        memcpy(cmd_slot, nvme_cmd_ker, cmd_buf_size);
+        pmetrics_sq->public_sq.tail_ptr_virt =
+            (u16)(((u32)pmetrics_sq->public_sq.tail_ptr_virt + 1UL) %
+            pmetrics_sq->public_sq.elements);
+        user_data.num_committed++;
+    }
+    /* Fall through is intended */
+
+sq_unlk:
+    mutex_unlock(&pmetrics_sq->q_mtx);
+    if (user_data.ring_dbl && (user_data.num_committed != 0)) {
+        nvme_ring_sqx_dbl(user_data.q_id, pmetrics_device);
+    }
+
+    if (copy_to_user(commit_request, &user_data,
+        sizeof(struct nvme_sq_commit))) {
+
+        LOG_ERR("Unable to copy to user space");
+        err = (err == SUCCESS) ? -EFAULT : err;
+    }
+    if (cmds != NULL) {
+        kfree(cmds);
+    }
+    if (nvme_cmd_ker != NULL) {
+        kfree(nvme_cmd_ker);
+    }
+    return err;
+}
+
+
 /*
  * get_public_qmetrics will return the q metrics from the global data
  * structures if the q_id send down matches any q_id for this device.
@@ -1363,7 +1968,7 @@ int identify_unique(u16 q_id, enum metrics_type type,
  * available then fail and return NOMEM error code.
  */
 int driver_nvme_prep_sq(struct nvme_prep_sq *prep_sq,
-    struct  metrics_device_list *pmetrics_device)
+    struct  metrics_device_list *pmetrics_device, struct file *filp)
 {
     int err;
     struct nvme_prep_sq *user_data = NULL;
@@ -1388,6 +1993,11 @@ int driver_nvme_prep_sq(struct nvme_prep_sq *prep_sq,
     if (err != SUCCESS) {
         LOG_ERR("SQ ID is not unique.");
         goto fail_out;
+    } else if (cq_feeds_rings(pmetrics_device, user_data->cq_id)) {
+        /* The rings would reap the CE's of the new SQ as well */
+        LOG_ERR("CQ ID = %d is drained by rings", user_data->cq_id);
+        err = -EBUSY;
+        goto fail_out;
     }
 
     if (READQ(&pnvme_dev->private_dev.ctrlr_regs->cap) & REGMASK_CAP_CQR) {
@@ -1408,10 +2018,12 @@ int driver_nvme_prep_sq(struct nvme_prep_sq *prep_sq,
 
     /* Filling the data elements of sq metrics. */
     memset(pmetrics_sq_node, 0, sizeof(struct metrics_sq));
+    mutex_init(&pmetrics_sq_node->q_mtx);
     pmetrics_sq_node->public_sq.sq_id = user_data->sq_id;
     pmetrics_sq_node->public_sq.cq_id = user_data->cq_id;
     pmetrics_sq_node->public_sq.elements = user_data->elements;
     pmetrics_sq_node->private_sq.contig = user_data->contig;
+    pmetrics_sq_node->owner = filp;
 
     err = nvme_prepare_sq(pmetrics_sq_node, pnvme_dev);
     if (err < 0) {
@@ -1423,8 +2035,17 @@ int driver_nvme_prep_sq(struct nvme_prep_sq *prep_sq,
         (pmetrics_sq_node->private_sq.bit_mask | UNIQUE_QID_FLAG);
 
     /* Add this element to the end of the list */
-    list_add_tail(&pmetrics_sq_node->sq_list_hd,
-        &pmetrics_device->metrics_sq_list);
+    err = add_sq_node(pmetrics_device, pmetrics_sq_node);
+    if (err < 0) {
+        free_cmd_track_slots(pmetrics_sq_node);
+        if (pmetrics_sq_node->private_sq.contig != 0) {
+            dma_free_coherent(&pnvme_dev->private_dev.pdev->dev,
+                pmetrics_sq_node->private_sq.size,
+                pmetrics_sq_node->private_sq.vir_kern_addr,
+                pmetrics_sq_node->private_sq.sq_dma_addr);
+        }
+        goto fail_out;
+    }
 
     kfree(user_data);
     return SUCCESS;
@@ -1447,7 +2068,7 @@ fail_out:
  * available then fail and return NOMEM error code.
  */
 int driver_nvme_prep_cq(struct nvme_prep_cq *prep_cq,
-    struct  metrics_device_list *pmetrics_device)
+    struct  metrics_device_list *pmetrics_device, struct file *filp)
 {
     int err;
     struct nvme_prep_cq *user_data = NULL;
@@ -1492,10 +2113,12 @@ int driver_nvme_prep_cq(struct nvme_prep_cq *prep_cq,
 
     /* Filling the data elements of sq metrics. */
     memset(pmetrics_cq_node, 0, sizeof(struct metrics_cq));
+    mutex_init(&pmetrics_cq_node->q_mtx);
     pmetrics_cq_node->public_cq.q_id = user_data->cq_id;
     pmetrics_cq_node->public_cq.elements = user_data->elements;
     pmetrics_cq_node->public_cq.irq_enabled = 0;
     pmetrics_cq_node->private_cq.contig = user_data->contig;
+    pmetrics_cq_node->owner = filp;
 
     err = nvme_prepare_cq(pmetrics_cq_node, pnvme_dev);
     if (err < 0) {
@@ -1507,8 +2130,16 @@ int driver_nvme_prep_cq(struct nvme_prep_cq *prep_cq,
         (pmetrics_cq_node->private_cq.bit_mask | UNIQUE_QID_FLAG);
 
     /* Add this element to the end of the list */
-    list_add_tail(&pmetrics_cq_node->cq_list_hd,
-        &pmetrics_device->metrics_cq_list);
+    err = add_cq_node(pmetrics_device, pmetrics_cq_node);
+    if (err < 0) {
+        if (pmetrics_cq_node->private_cq.contig != 0) {
+            dma_free_coherent(&pnvme_dev->private_dev.pdev->dev,
+                pmetrics_cq_node->private_cq.size,
+                pmetrics_cq_node->private_cq.vir_kern_addr,
+                pmetrics_cq_node->private_cq.cq_dma_addr);
+        }
+        goto fail_out;
+    }
 
     kfree(user_data);
     return SUCCESS;
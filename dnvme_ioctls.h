@@ -42,7 +42,7 @@ enum {
     NVME_PREPARE_SQ_CREATION,   /** <enum Allocate SQ contig memory */
     NVME_PREPARE_CQ_CREATION,   /** <enum Allocate SQ contig memory */
     NVME_RING_SQ_DOORBELL,      /** <enum Ring SQ Tail doorbell */
-    NVME_DUMP_METRICS,          /** <enum Log data from Metrics structure */
+    NVME_DUMP_METRICS,          /** <enum Retired, see debugfs */
     NVME_REAP_INQUIRY,          /** <enum Invoke Reap inquiry */
     NVME_REAP,                  /** <enum Invoke actual reap algo */
     NVME_GET_DRIVER_METRICS,    /** <enum return driver version */
@@ -51,7 +51,20 @@ enum {
     NVME_METABUF_DEL,           /** <enum meta buffer delete */
     NVME_SET_IRQ,               /** <enum Set desired IRQ scheme */
     NVME_GET_DEVICE_METRICS,    /** <enum Return device metrics to user */
-    NVME_MARK_SYSLOG            /** <enum Inject a marker in the system log */
+    NVME_MARK_SYSLOG,           /** <enum Inject a marker in the system log */
+    NVME_SEND_64B_BATCH,        /** <enum Send an array of 64B commands */
+    NVME_REG_BUF,               /** <enum Pin and map a user data buffer */
+    NVME_UNREG_BUF,             /** <enum Release a registered data buffer */
+    NVME_REAP_WAIT,             /** <enum Sleep until CE's arrive in a CQ */
+    NVME_GET_READY_CQS,         /** <enum Return bitmap of CQ's to reap */
+    NVME_SET_CQ_EVENTFD,        /** <enum Signal eventfd on CQ's irq */
+    NVME_SHARE_DEVICE,          /** <enum Allow more files to open device */
+    NVME_COMMIT_SQ,             /** <enum Commit cmds written to mmap'ed SQ */
+    NVME_SETUP_RINGS,           /** <enum Set up/tear down SQ's rings */
+    NVME_RING_ENTER,            /** <enum Drain the rings of a SQ */
+    NVME_LAT_STATS,             /** <enum Latency histograms of a SQ */
+    NVME_PERF_STATS,            /** <enum Read/reset perf counters */
+    NVME_SNAPSHOT               /** <enum Binary snapshot of the device */
 };
 
 /**
@@ -159,11 +172,6 @@ enum {
  */
 #define NVME_IOCTL_RING_SQ_DOORBELL _IOWR('N', NVME_RING_SQ_DOORBELL, uint16_t)
 
-/**
- * @def NVME_IOCTL_DUMP_METRICS
- * define a unique value to Dump Q metrics.
- */
-#define NVME_IOCTL_DUMP_METRICS _IOWR('N', NVME_DUMP_METRICS, struct nvme_file)
 
 /**
  * @def NVME_IOCTL_REAP_INQUIRY
@@ -223,5 +231,131 @@ enum {
  */
 #define NVME_IOCTL_MARK_SYSLOG _IOW('N', NVME_MARK_SYSLOG, struct nvme_logstr)
 
+/**
+ * @def NVME_IOCTL_SEND_64B_BATCH
+ * Send up to MAX_64B_BATCH_CMDS 64 Byte commands, to any mix of SQ's, with a
+ * single ioctl. Every command is validated and placed in its SQ in order, a
+ * failing command is reported through its status element and does not stop
+ * the remaining commands. Optionally rings the doorbell of every SQ which
+ * received a command once all of them are placed. Commands to the ASQ must
+ * lead the batch, otherwise they fail with -EAGAIN.
+ */
+#define NVME_IOCTL_SEND_64B_BATCH _IOWR('N', NVME_SEND_64B_BATCH, \
+    struct nvme_64b_batch)
+
+/**
+ * @def NVME_IOCTL_REG_BUF
+ * Register a user space data buffer, it is pinned and mapped for DMA once and
+ * a handle is returned in buf_id to be used as nvme_64b_send.reg_buf_id.
+ */
+#define NVME_IOCTL_REG_BUF _IOWR('N', NVME_REG_BUF, struct nvme_reg_buf)
+
+/**
+ * @def NVME_IOCTL_UNREG_BUF
+ * Unregister the data buffer of the handle passed as the 3rd parameter, fails
+ * with EBUSY while any outstanding cmd still references the buffer.
+ */
+#define NVME_IOCTL_UNREG_BUF _IOW('N', NVME_UNREG_BUF, uint32_t)
+
+/**
+ * @def NVME_IOCTL_REAP_WAIT
+ * Sleep until at least the requested no. of CE's are waiting in an IRQ
+ * enabled CQ, or the timeout expires which fails with ETIMEDOUT. In both
+ * cases num_remaining is returned.
+ */
+#define NVME_IOCTL_REAP_WAIT _IOWR('N', NVME_REAP_WAIT, struct nvme_reap_wait)
+
+/**
+ * @def NVME_IOCTL_GET_READY_CQS
+ * Return the bitmap of IRQ enabled CQ's which are ready to be reaped, i.e.
+ * the ones which made poll() on the device report it readable. Only the
+ * CQ's the calling file may reap are reported, for poll() alike.
+ */
+#define NVME_IOCTL_GET_READY_CQS _IOWR('N', NVME_GET_READY_CQS, \
+    struct nvme_ready_cqs)
+
+/**
+ * @def NVME_IOCTL_SET_CQ_EVENTFD
+ * Attach an eventfd to an IRQ enabled CQ, or detach it, which the ISR of the
+ * CQ's irq signals, so that every CQ can be waited on with its own fd.
+ */
+#define NVME_IOCTL_SET_CQ_EVENTFD _IOW('N', NVME_SET_CQ_EVENTFD, \
+    struct nvme_cq_eventfd)
+
+/**
+ * @def NVME_IOCTL_SHARE_DEVICE
+ * Allow (!= 0) or refuse (0) further opens of the device while it is open.
+ * The 1st file to open the device is the controlling file, only it may use
+ * this ioctl, NVME_IOCTL_DEVICE_STATE, NVME_IOCTL_CREATE_ADMN_Q,
+ * NVME_IOCTL_SET_IRQ, NVME_IOCTL_WRITE_GENERIC, NVME_IOCTL_TOXIC_64B_DWORD
+ * and NVME_IOCTL_METABUF_CREATE. Every file owns the IO Q's, meta buffers
+ * and registered buffers it creates. Only the owner and the controlling file
+ * may send to, commit to, ring, reap, mmap, set up rings on or delete them,
+ * any other file fails with EACCES; the admin Q's may be used by all files.
+ * Closing a file doesn't touch the controller. What the file owns is freed,
+ * except for IO Q's created on the controller, and the meta buffers while
+ * such SQ's are left, and registered buffers of outstanding cmds. Those are
+ * handed to the controlling file and freed once the Q's are deleted by cmds
+ * or the device is disabled. Closing the controlling file is handled alike,
+ * what it leaves on the controller belongs to no file and no more opens are
+ * allowed. Once the last file is closed the device is disabled completely.
+ * Q memory mmap'ed by a file stays allocated until it is unmapped, even if
+ * the Q is deleted meanwhile; only the owner may mmap a meta buffer.
+ */
+#define NVME_IOCTL_SHARE_DEVICE _IOW('N', NVME_SHARE_DEVICE, int)
+
+/**
+ * @def NVME_IOCTL_COMMIT_SQ
+ * Commit 64 Byte commands user space wrote directly into a mmap'ed IO SQ,
+ * each command is copied out of its slot, validated and tracked, then
+ * written back and the tail is advanced past it. Stops at the 1st failing
+ * command, num_committed reports how many made it. Optionally rings the
+ * doorbell of the SQ afterwards. Not allowed on the ASQ.
+ */
+#define NVME_IOCTL_COMMIT_SQ _IOWR('N', NVME_COMMIT_SQ, struct nvme_sq_commit)
+
+/**
+ * @def NVME_IOCTL_SETUP_RINGS
+ * Set up, or tear down, a pair of shared memory rings for an IO SQ. User
+ * space pushes nvme_ring_sqe's into the submission ring and pops
+ * nvme_ring_cqe's from the completion ring without any further ioctl when
+ * a kernel thread was requested, otherwise NVME_IOCTL_RING_ENTER drains them.
+ * The rings drain every CE of the SQ's CQ, so the CQ may not be shared with
+ * any other SQ; both setting up the rings and preparing another SQ on that
+ * CQ fail with EBUSY.
+ */
+#define NVME_IOCTL_SETUP_RINGS _IOWR('N', NVME_SETUP_RINGS, \
+    struct nvme_rings_setup)
+
+/**
+ * @def NVME_IOCTL_RING_ENTER
+ * Move the CE's of the SQ's CQ into the completion ring, then the pending
+ * submissions into the SQ and ring its doorbell.
+ */
+#define NVME_IOCTL_RING_ENTER _IOWR('N', NVME_RING_ENTER, \
+    struct nvme_ring_enter)
+
+/**
+ * @def NVME_IOCTL_LAT_STATS
+ * Turn recording of cmd latencies on or off, read the latency histograms
+ * of a SQ and optionally reset them.
+ */
+#define NVME_IOCTL_LAT_STATS _IOWR('N', NVME_LAT_STATS, struct nvme_lat_stats)
+
+/**
+ * @def NVME_IOCTL_PERF_STATS
+ * Read the perf counters of the device, a SQ or a CQ and optionally reset
+ * them.
+ */
+#define NVME_IOCTL_PERF_STATS _IOWR('N', NVME_PERF_STATS, \
+    struct nvme_perf_stats)
+
+/**
+ * @def NVME_IOCTL_SNAPSHOT
+ * Copy a binary snapshot of the device, its Q's, cmds, irqs and meta data
+ * buffers to user space.
+ */
+#define NVME_IOCTL_SNAPSHOT _IOWR('N', NVME_SNAPSHOT, struct nvme_snapshot)
+
 
 #endif
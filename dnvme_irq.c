@@ -23,10 +23,12 @@
 #include <linux/msi.h>
 #include <linux/list.h>
 #include <linux/interrupt.h>
-#include <linux/workqueue.h>
 #include <linux/spinlock.h>
+#include <linux/eventfd.h>
+#include <linux/ktime.h>
 
 #include "dnvme_irq.h"
+#include "dnvme_trace.h"
 
 
 /* Static function declarations used for setting interrupt schemes. */
@@ -39,26 +41,26 @@ static int set_msi_single(struct metrics_device_list *pmetrics_device_elem);
 static int set_msi_multi(struct metrics_device_list *pmetrics_device_elem,
     u16 num_irqs);
 static int add_irq_node(struct  metrics_device_list *pmetrics_device_elem,
-    u32 int_vec, u16 irq_no);
-static void bh_callback(struct work_struct *work);
+    u32 int_vec, u16 irq_no, const char *irq_name);
 static void dealloc_all_icqs(struct  irq_track *pirq_trk_list);
 static int disable_active_irq(struct metrics_device_list
     *pmetrics_device_elem, enum nvme_irq_type  irq_active);
-static void inc_isr_count(struct irq_processing *pirq_process,
-    u16 irq_no);
+static void inc_isr_count(struct irq_track *pirq_node);
+static struct irq_vec_stat *find_vec_stat(struct irq_processing
+    *pirq_process, u16 irq_no);
+static int alloc_vec_stats(struct irq_processing *pirq_process,
+    u16 num_irqs);
+static void wake_icq_waiters(struct irq_cq_track *picq_node);
+static void free_icq_node(struct irq_track *pirq_node,
+    struct irq_cq_track *picq_node);
 static struct irq_track *find_irq_node(
     struct  metrics_device_list *pmetrics_device_elem, u16 irq_no);
 static struct irq_cq_track *find_icq_node(struct  irq_track *pirq_node,
     u16 cq_id);
-static struct work_container *get_work_item(struct  irq_processing
-    *pirq_process, u32 int_vec);
 static void nvme_disable_pin(struct pci_dev *dev);
 static int update_msixptr(struct  metrics_device_list
     *pmetrics_device_elem, u16 offset, struct msix_info *pmsix_tbl_info);
 static void set_msix_mask_bit(u8 __iomem *irq_msixptr, u16 irq_no, u32 flag);
-static int work_queue_init(struct irq_processing *pirq_process);
-static int add_wk_item(struct irq_processing *pirq_process,
-    u32 int_vec, u16 irq_no);
 
 
 /*
@@ -108,11 +110,13 @@ int nvme_set_irq(struct metrics_device_list *pmetrics_device_elem,
         LOG_ERR("Reset of IRQ to INT_NONE failed...");
         goto mutex_unlck;
     }
-    /* initialize work queue */
-    err = work_queue_init(&pmetrics_device_elem->irq_process);
-    if (err < 0) {
-        LOG_ERR("Failed to initialize resources for work queue/items");
-        goto mutex_unlck;
+    /* The vectors' accounting must exist before any irq is requested */
+    if (user_data->irq_type != INT_NONE) {
+        err = alloc_vec_stats(&pmetrics_device_elem->irq_process,
+            (user_data->num_irqs == 0) ? 1 : user_data->num_irqs);
+        if (err < 0) {
+            goto mutex_unlck;
+        }
     }
 
     /* Switch based on new irq type desired */
@@ -158,7 +162,6 @@ fail_out:
 /*
  * Used for Initializing the IRQ lists before any scheme is run
  * Lock on to the mutex and remove all the irq and cq track nodes.
- * Also removes all the enqueued wk items
  * set the current active scheme to INT_NONE.
  * NOTE: This will grab the irq mutex and releases.
  */
@@ -179,31 +182,19 @@ int init_irq_lists(struct metrics_device_list
 
 /*
  * Used for releasing the IRQ lists after any scheme is run
- * Also removes all the enqueued wk items
  * set the current active scheme to INT_NONE.
  */
 void release_irq(struct metrics_device_list *pmetrics_device_elem)
 {
-    /* Disable the IRQ */
+    /* No ISR is left once the irqs are freed, but GET_READY_CQS and poll
+     * of a file sharing the device still walk the irq track list */
+    mutex_lock(&pmetrics_device_elem->irq_process.irq_track_mtx);
+
+    /* Disable the IRQ, free_irq waits for any ISR still running */
     irq_disable(pmetrics_device_elem);
 
-    if (pmetrics_device_elem->irq_process.wq) {
-        LOG_DBG("Wait for the WQ to get flushed");
-        /* Flush the WQ and wait till all BH's are executed */
-        flush_workqueue(pmetrics_device_elem->irq_process.wq);
-        LOG_DBG("Destroy the recently flushed WQ");
-        /* Destroy the WQ */
-        destroy_workqueue(pmetrics_device_elem->irq_process.wq);
-        pmetrics_device_elem->irq_process.wq = NULL;
-    }
-    /* Note Mutex lock and unlock not required
-     * even though we are editing the IRQ track list
-     * since no more ISR's and BH's are pending
-     */
     /* clean up and free all IRQ linked list nodes */
     deallocate_irq_trk(pmetrics_device_elem);
-    /*Dealloc the work list if it exists */
-    dealloc_wk_list(&pmetrics_device_elem->irq_process);
 
     /* Now we can Set IRQ type to INT_NONE */
     pmetrics_device_elem->metrics_device->public_dev.irq_active.
@@ -212,6 +203,7 @@ void release_irq(struct metrics_device_list *pmetrics_device_elem)
       num_irqs = 0;
     /* Will only be read by ISR */
     pmetrics_device_elem->irq_process.irq_type = INT_NONE;
+    mutex_unlock(&pmetrics_device_elem->irq_process.irq_track_mtx);
 }
 /*
  * The function first deallocates the IRQ linked list, then disables IRQ
@@ -238,9 +230,6 @@ static int disable_active_irq(struct metrics_device_list
     /* clean up and free all IRQ linked list nodes */
     deallocate_irq_trk(pmetrics_device_elem);
 
-    /* Dealloc the work list if it exists */
-    dealloc_wk_list(&pmetrics_device_elem->irq_process);
-
     /* Now we can Set IRQ type to INT_NONE */
     pmetrics_device_elem->metrics_device->public_dev.irq_active.
         irq_type = INT_NONE;
@@ -491,33 +480,16 @@ static int set_msix(struct metrics_device_list *pmetrics_device_elem,
     /* Request irq on each interrupt vector */
     for (i = 0; i < num_irqs; i++) {
         /* If request fails on any interrupt vector then fail here */
-        ret_val = request_irq(msix_entries[i].vector, tophalf_isr, IRQF_DISABLED
-            | IRQF_SHARED, "msi-x", &pmetrics_device_elem->irq_process);
+        LOG_DBG("Add Node for Vector = %d", msix_entries[i].vector);
+        ret_val = add_irq_node(pmetrics_device_elem, msix_entries[i].vector,
+            msix_entries[i].entry, "msi-x");
         if (ret_val < 0) {
-            LOG_ERR("MSI-X-Err: request irq failed for ivec= %u",
+            LOG_ERR("MSI-X-Err: can't add irq node for ivec= %u",
                 msix_entries[i].vector);
             /* As we are allocating memory for one node at a time
              * failing here needs freeing up memory previously allocated */
             goto free_msix;
-        }
-
-        /* Add node after determining interrupt vector req is successful */
-        LOG_DBG("Add Node for Vector = %d", msix_entries[i].vector);
-        ret_val = add_irq_node(pmetrics_device_elem, msix_entries[i].vector,
-            msix_entries[i].entry);
-        if (ret_val < 0) {
-            LOG_ERR("MSI-X-Err: can't add irq node");
-            goto free_msix;
         } /* end of if add_irq_node */
-
-        /* Add node after determining interrupt vector req is successful */
-        LOG_DBG("Add Wk item node for Vector = %d", msix_entries[i].vector);
-        ret_val = add_wk_item(&pmetrics_device_elem->irq_process,
-            msix_entries[i].vector, msix_entries[i].entry);
-        if (ret_val < 0) {
-            LOG_ERR("MSI-X-Err: can't add work item node");
-            goto free_msix;
-        } /* end of if add_wk_item */
     } /* end of for num_irqs */
 
     /* fetch the Irq node 0 */
@@ -591,23 +563,10 @@ static int set_msi_single(struct metrics_device_list *pmetrics_device_elem)
         return ret_val; /* exit from here */
     }
     /* request irq with top half handler and int vec stored in pdev->irq. */
-    ret_val = request_irq(pdev->irq, tophalf_isr, IRQF_DISABLED
-            | IRQF_SHARED, "msi-single", &pmetrics_device_elem->irq_process);
-    if (ret_val < 0) {
-        LOG_ERR("Request irq failed for ivec= %i", pdev->irq);
-        return ret_val; /* exit from here */
-    }
     LOG_DBG("MSI-Single Interrupt Vector = %d", pdev->irq);
-    /* Add node after determining interrupt vector is successful */
-    ret_val = add_irq_node(pmetrics_device_elem, pdev->irq, 0);
+    ret_val = add_irq_node(pmetrics_device_elem, pdev->irq, 0, "msi-single");
     if (ret_val < 0) {
-        LOG_ERR("Can't add irq node");
-        goto free_msis;
-    }
-
-    ret_val = add_wk_item(&pmetrics_device_elem->irq_process, pdev->irq, 0);
-    if (ret_val < 0) {
-        LOG_ERR("Can't add work item node");
+        LOG_ERR("Can't add irq node for ivec= %i", pdev->irq);
         goto free_msis;
     }
 
@@ -663,31 +622,15 @@ static int set_msi_multi(struct metrics_device_list *pmetrics_device_elem,
     /* Request irq on each interrupt vector */
     for (i = 0; i < num_irqs; i++) {
         /* If request fails on any interrupt vector then fail here */
-        ret_val = request_irq((pdev->irq + i), tophalf_isr, IRQF_DISABLED
-            | IRQF_SHARED, "msi-multi", &pmetrics_device_elem->irq_process);
+        LOG_DBG("Add Node for Vector = %d", pdev->irq + i);
+        ret_val = add_irq_node(pmetrics_device_elem, (pdev->irq + i), i,
+            "msi-multi");
         if (ret_val < 0) {
-            LOG_ERR("Request IRQ failed ivec = %d", pdev->irq + i);
+            LOG_ERR("Can't add irq node for ivec = %d", pdev->irq + i);
             /* As we are allocating memory for one node at a time
              * failing here needs freeing up memory previously allocated */
             goto free_msim;
-        }
-
-        /* Add node after determining interrupt vector req is successful */
-        LOG_DBG("Add Node for Vector = %d", pdev->irq + i);
-        ret_val = add_irq_node(pmetrics_device_elem, (pdev->irq + i), i);
-        if (ret_val < 0) {
-            LOG_ERR("Can't add irq node");
-            goto free_msim;
         } /* end of if add_irq_node */
-
-        /* Add node after determining interrupt vector req is successful */
-        LOG_DBG("Add Wk item node for Vector = %d", pdev->irq + i);
-        ret_val = add_wk_item(&pmetrics_device_elem->irq_process,
-            (pdev->irq + i), i);
-        if (ret_val < 0) {
-            LOG_ERR("Can't add work item node");
-            goto free_msim;
-        } /* end of if add_wk_item */
     } /* end of for num_irqs */
 
     /* fetch the Irq node 0 */
@@ -865,111 +808,96 @@ void unmask_interrupts(u16 irq_no, struct irq_processing
 
 /*
  * Top half isr responds to the interrupt by masking the corresponding irq
- * vector if required and scheduling the bottom half processing.
+ * vector, which stays masked until its CQ's are reaped, and accounting the
+ * irq in the irq node of the vector right away. The irq node is the dev_id
+ * the vector was requested with, so no lookup is needed.
  */
 irqreturn_t tophalf_isr(int int_vec, void *dev_id)
 {
-    /* Point to the right hardware item using this dev_id */
-    struct  irq_processing *pirq_process =
-        (struct  irq_processing *) dev_id;
-    struct work_container *pwk;
-    irqreturn_t ret_val = IRQ_HANDLED;
-
-    /* Look for the required work_struct */
-    pwk = get_work_item(pirq_process, int_vec);
-    if (pwk == NULL) {
-        LOG_ERR("spurious irq with int_vec = %d", int_vec);
-        return IRQ_NONE;
-    }
-    /* To resolve contention between ISR's getting fired on different cores */
+    /* Point to the right irq node using this dev_id */
+    struct irq_track *pirq_node = (struct irq_track *)dev_id;
+    struct irq_processing *pirq_process = pirq_node->pirq_process;
+
+    /* To resolve contention with the ioctl's editing the CQ nodes */
     spin_lock(&pirq_process->isr_spin_lock);
-    LOG_DBG("TH:IRQNO = %d is serviced", pwk->irq_no);
-    /* Mask the interrupts which was fired till BH */
-    mask_interrupts(pwk->irq_no, pirq_process);
+    LOG_DBG("TH:IRQNO = %d is serviced", pirq_node->irq_no);
+    /* Mask the interrupts which was fired till the CQ's are reaped */
+    mask_interrupts(pirq_node->irq_no, pirq_process);
+
+    /* Set the values of the vector */
+    inc_isr_count(pirq_node);
+    trace_dnvme_isr(int_vec, pirq_node->irq_no);
 
-    if (queue_work(pirq_process->wq, &pwk->sched_wq)
-        == 0) {
-        LOG_ERR("Work item already in Queue");
-    }
     /* unlock as we are done with critical section */
     spin_unlock(&pirq_process->isr_spin_lock);
-    return ret_val;
+
+    /* Let poll() know some CQ may have become ready */
+    wake_up_interruptible(&pirq_process->poll_wq);
+    return IRQ_HANDLED;
 }
 
 /*
  * inc_isr_count:
- * Search the CQ node for which the IRQ is fired and set flag. Increment
+ * Set the flag of the vector for which the IRQ is fired. Increment
  * count by one.
+ * NOTE: Must be called with isr spinlock locked.
  */
-static void inc_isr_count(struct irq_processing *pirq_process,
-    u16 irq_no)
+static void inc_isr_count(struct irq_track *pirq_node)
 {
-    struct  irq_track     *pirq_node;  /* Pointer to irq node     */
-
-    /* Loop for each irq node */
-    list_for_each_entry(pirq_node, &pirq_process->irq_track_list,
-        irq_list_hd) {
-        if (irq_no == pirq_node->irq_no) {
-            pirq_node->isr_fired = 1;
-            pirq_node->isr_count++;
-            LOG_DBG("BH:isr count = %d for irq no = %d",
-                pirq_node->isr_count, pirq_node->irq_no);
-        } /* end of if ivec */
-    } /* end of list for irq */
+    struct  irq_cq_track  *picq_node;  /* Pointer to irq CQ node  */
+    struct  irq_vec_stat  *pvec_stat;  /* Accounting of the vector */
+    struct  metrics_device_list *pmetrics_device = container_of(
+        pirq_node->pirq_process, struct metrics_device_list, irq_process);
+
+    pvec_stat = &pirq_node->pirq_process->vec_stats[pirq_node->irq_no];
+    if (pmetrics_device->lat_enabled) {
+        atomic64_set(&pvec_stat->isr_ns, ktime_to_ns(ktime_get()));
+    }
+    atomic_inc(&pvec_stat->isr_count);
+    /* Count before flag, reap may clear the flag right after seeing it */
+    smp_wmb();
+    atomic_set(&pvec_stat->isr_fired, 1);
+    LOG_DBG("TH:isr count = %d for irq no = %d",
+        atomic_read(&pvec_stat->isr_count), pirq_node->irq_no);
+
+    /* Wake whoever sleeps on the CQ's of this irq */
+    list_for_each_entry(picq_node, &pirq_node->irq_cq_track, irq_cq_head) {
+        wake_icq_waiters(picq_node);
+        if (picq_node->efd_ctx != NULL) {
+            eventfd_signal(picq_node->efd_ctx, 1);
+        }
+    }
 }
 
 /*
- * This is the work item that gets scheduled when the ISR gets fired.
- * The bottom halfs are queued up and we should not worry about multiple
- * interrupts getting fired up as we store them in the array as a lookup
- * table.
+ * wake_icq_waiters:
+ * Wake up and unlink all the threads waiting on the CQ node.
+ * NOTE: Must be called with isr spinlock locked.
  */
-static void bh_callback(struct work_struct *work_element)
+static void wake_icq_waiters(struct irq_cq_track *picq_node)
 {
-    /* Getting the work item from work_struct */
-    struct work_container *pwork =
-        container_of(work_element, struct work_container, sched_wq);
+    struct reap_waiter *pwaiter;
+    struct reap_waiter *pwaiter_next;
 
-    /* lock irq mutex as we will access the irq nodes */
-    mutex_lock(&pwork->pirq_process->irq_track_mtx);
-
-    /* Set the values in the node */
-    inc_isr_count(pwork->pirq_process, pwork->irq_no);
-
-    /* unlock as we are done with updating the irq nodes */
-    mutex_unlock(&pwork->pirq_process->irq_track_mtx);
-
-    LOG_DBG("BH:IRQNO = %d is serviced in Bottom Half", pwork->irq_no);
-}
+    list_for_each_entry_safe(pwaiter, pwaiter_next,
+        &picq_node->reap_waiters, waiter_hd) {
 
-/*
- * work_queue_init:
- * Is used for setting up memory for work queue
- */
-int work_queue_init(struct  irq_processing *pirq_process)
-{
-    if (pirq_process->wq == NULL) {
-        /* If work Queue does not exist from previous run of the IOCTL
-         * then create a new work queue.
-         */
-        pirq_process->wq = create_workqueue("work_queue");
-        if (pirq_process->wq == NULL) {
-            LOG_ERR("Failed work queue creation");
-            return -ENOMEM;
-        }
+        list_del_init(&pwaiter->waiter_hd);
+        pwaiter->woken = 1;
+        wake_up_interruptible(&pwaiter->wait_q);
     }
-
-    return SUCCESS;
 }
 
 /*
  * Add a irq track node in irq_track linked list. Allocates memory for one
  * irq_track node, sets up the values for this node. Initialize the CQ_track
- * node for this irq_node then add the irq_node to the itq_track linked list.
+ * node for this irq_node, request the irq with the node as its dev_id, then
+ * add the irq_node to the itq_track linked list.
  */
 static int add_irq_node(struct  metrics_device_list *pmetrics_device_elem,
-        u32 int_vec, u16 irq_no)
+        u32 int_vec, u16 irq_no, const char *irq_name)
 {
+    int ret_val;
     struct irq_track *irq_trk_node;
 
 #ifdef DEBUG
@@ -991,43 +919,33 @@ static int add_irq_node(struct  metrics_device_list *pmetrics_device_elem,
     /* Fill the irq track node */
     irq_trk_node->int_vec = int_vec; /* int vector number   */
     irq_trk_node->irq_no = irq_no;   /* irq number assigned */
-    irq_trk_node->isr_fired = 0;
-    irq_trk_node->isr_count = 0;
+    irq_trk_node->pirq_process = &pmetrics_device_elem->irq_process;
+
+    /* The ISR indexes the accounting with irq_no, so it must be in range */
+    if (find_vec_stat(irq_trk_node->pirq_process, irq_no) == NULL) {
+        LOG_ERR("No accounting for irq_no = %d", irq_no);
+        kfree(irq_trk_node);
+        return -EINVAL;
+    }
 
     /* Init irq cq linked list */
     INIT_LIST_HEAD(&irq_trk_node->irq_cq_track);
 
+    /* request irq with top half handler, the ISR gets this node back */
+    ret_val = request_irq(int_vec, tophalf_isr, IRQF_DISABLED | IRQF_SHARED,
+        irq_name, irq_trk_node);
+    if (ret_val < 0) {
+        LOG_ERR("Request irq failed for ivec= %u", int_vec);
+        kfree(irq_trk_node);
+        return ret_val;
+    }
+
     /* Add this irq node element to the end of the list */
     list_add_tail(&irq_trk_node->irq_list_hd, &pmetrics_device_elem->
         irq_process.irq_track_list);
     return SUCCESS;
 }
 
-/*
- * Add a wk item node in work item's linked list. Allocates memory for one
- * wk item  node, sets up the values for this node.
- */
-static int add_wk_item(struct irq_processing *pirq_process,
-        u32 int_vec, u16 irq_no)
-{
-    struct work_container *pwork;
-
-    pwork = kmalloc(sizeof(struct work_container), GFP_KERNEL);
-    if (pwork == NULL) {
-        LOG_ERR("Failed mem alloc in work_container creation");
-        return -ENOMEM;
-    }
-    /* Initialize the bottom half call back with the work struct */
-    INIT_WORK(&pwork->sched_wq, bh_callback);
-    /* Update the values */
-    pwork->pirq_process = pirq_process;
-    pwork->int_vec = int_vec;
-    pwork->irq_no = irq_no;
-    /* Add work item to work items list */
-    list_add_tail(&pwork->wrk_list_hd, &pirq_process->wrk_item_list);
-    return SUCCESS;
-}
-
 /*
  * Add a cq node into cq track linked list. Allocate memory for one CQ node
  * in the irq_track node. Assign the CQ id passed and reset other parameters.
@@ -1035,6 +953,7 @@ static int add_wk_item(struct irq_processing *pirq_process,
  */
 int add_icq_node(struct irq_track *pirq_trk_node, u16 cq_id)
 {
+    unsigned long flags;
     struct irq_cq_track *irq_cq_node;
 
     /* Allocate memory for the cq node and check if success */
@@ -1045,9 +964,14 @@ int add_icq_node(struct irq_track *pirq_trk_node, u16 cq_id)
     }
     /* Fill the node with init data */
     irq_cq_node->cq_id = cq_id;
+    INIT_LIST_HEAD(&irq_cq_node->reap_waiters);
+    irq_cq_node->efd_ctx = NULL;
 
-    /* Add this cq node to the end of the list */
+    /* Add this cq node to the end of the list, which the ISR walks */
+    spin_lock_irqsave(&pirq_trk_node->pirq_process->isr_spin_lock, flags);
     list_add_tail(&irq_cq_node->irq_cq_head, &pirq_trk_node->irq_cq_track);
+    spin_unlock_irqrestore(&pirq_trk_node->pirq_process->isr_spin_lock,
+        flags);
     return SUCCESS;
 }
 
@@ -1090,35 +1014,25 @@ exit:
 
 /*
  * reap_inquiry_isr - will process reap inquiry for the given cq using irq_vec
- * and isr_fired flags from two nodes, public cq node and irq_track list node.
- * NOTE: This function should be called with irq mutex locked otherwise it
- * will error out.
+ * and isr_fired flags from the public cq node and the vector's accounting.
+ * NOTE: Needs no irq mutex, the accounting of the vector is read lock free.
  */
 int reap_inquiry_isr(struct metrics_cq  *pmetrics_cq_node,
     struct  metrics_device_list *pmetrics_device_elem,
     u32 *num_remaining, u32 *isr_count)
 {
     u16 irq_no = pmetrics_cq_node->public_cq.irq_no; /* irq_no for CQ   */
-    struct irq_track *pirq_node;
-
-#ifdef DEBUG
-    /* If mutex is not locked then exit here */
-    if (!mutex_is_locked(&pmetrics_device_elem->irq_process.irq_track_mtx)) {
-        LOG_ERR("Mutex should have been locked before this...");
-        /* Mutex is not locked so exiting */
-        return -EINVAL;
-    }
-#endif
+    struct irq_vec_stat *pvec_stat;
 
-    /* Get the Irq node for given irq vector */
-    pirq_node = find_irq_node(pmetrics_device_elem, irq_no);
-    if (pirq_node == NULL) {
+    /* Get the accounting for given irq vector */
+    pvec_stat = find_vec_stat(&pmetrics_device_elem->irq_process, irq_no);
+    if (pvec_stat == NULL) {
         LOG_ERR("Node for IRQ No = %d does not exist in IRQ list!", irq_no);
         return -EINVAL;
     }
 
     /* Check if ISR is really fired for this CQ */
-    if (pirq_node->isr_fired != 0) {
+    if (atomic_read(&pvec_stat->isr_fired) != 0) {
         /* process reap inquiry for isr fired case */
         *num_remaining = reap_inquiry(pmetrics_cq_node,
             &pmetrics_device_elem->metrics_device->private_dev.pdev->dev);
@@ -1128,26 +1042,317 @@ int reap_inquiry_isr(struct metrics_cq  *pmetrics_cq_node,
     }
 
     /* return the isr_count flag */
-    *isr_count = pirq_node->isr_count;
+    *isr_count = atomic_read(&pvec_stat->isr_count);
     return SUCCESS;
 }
 
 /*
- * Gets the required work_container from the list of work items based
- * upon int_vec number else NULL
+ * reap_wait_isr - counts the CE's waiting in the given cq and if fewer than
+ * min_elements queues the waiter on the cq node of its irq node, so that the
+ * ISR wakes it up when the irq fires.
+ * Returns 1 if the waiter got queued, 0 if enough CE's are waiting already.
+ * NOTE: Called with metrics_sem held shared and the q_mtx of the CQ locked,
+ * the irq mutex is taken here. The waiter is queued before both are dropped,
+ * driver_reap_wait releases metrics_sem only while it sleeps, so an irq
+ * firing in between still finds the waiter and wakes it.
+ */
+int reap_wait_isr(struct metrics_cq  *pmetrics_cq_node,
+    struct  metrics_device_list *pmetrics_device_elem,
+    struct reap_waiter *pwaiter, u32 min_elements,
+    u32 *num_remaining, u32 *isr_count)
+{
+    u16 irq_no = pmetrics_cq_node->public_cq.irq_no; /* irq_no for CQ   */
+    struct irq_track *pirq_node;
+    struct irq_cq_track *picq_node;
+    unsigned long flags;
+    int ret_val = 0;
+
+    mutex_lock(&pmetrics_device_elem->irq_process.irq_track_mtx);
+
+    /* Get the Irq node for given irq vector */
+    pirq_node = find_irq_node(pmetrics_device_elem, irq_no);
+    if (pirq_node == NULL) {
+        LOG_ERR("Node for IRQ No = %d does not exist in IRQ list!", irq_no);
+        ret_val = -EINVAL;
+        goto exit;
+    }
+    picq_node = find_icq_node(pirq_node, pmetrics_cq_node->public_cq.q_id);
+    if (picq_node == NULL) {
+        LOG_ERR("CQ node does not exist in the IRQ Tracked node!");
+        ret_val = -EINVAL;
+        goto exit;
+    }
+
+    *num_remaining = reap_inquiry(pmetrics_cq_node,
+        &pmetrics_device_elem->metrics_device->private_dev.pdev->dev);
+    *isr_count = atomic_read(&pmetrics_device_elem->irq_process.
+        vec_stats[irq_no].isr_count);
+    if (*num_remaining < min_elements) {
+        pwaiter->woken = 0;
+        pwaiter->isr_fired = atomic_read(&pmetrics_device_elem->irq_process.
+            vec_stats[irq_no].isr_fired);
+        spin_lock_irqsave(&pmetrics_device_elem->irq_process.isr_spin_lock,
+            flags);
+        list_add_tail(&pwaiter->waiter_hd, &picq_node->reap_waiters);
+        spin_unlock_irqrestore(&pmetrics_device_elem->irq_process.
+            isr_spin_lock, flags);
+        ret_val = 1;
+    }
+
+exit:
+    mutex_unlock(&pmetrics_device_elem->irq_process.irq_track_mtx);
+    return ret_val;
+}
+
+/*
+ * driver_cq_eventfd - attaches the user's eventfd to the cq node of the irq
+ * of the given cq, replacing any eventfd attached before, or detaches it if
+ * the fd is negative.
  */
-static struct work_container *get_work_item(struct  irq_processing
-    *pirq_process, u32 int_vec)
+int driver_cq_eventfd(struct  metrics_device_list *pmetrics_device_elem,
+    struct nvme_cq_eventfd *cq_eventfd, struct file *filp)
 {
-    struct work_container *pwk_item;  /* wk item in the list */
-    /* Loop for each wk item */
-    list_for_each_entry(pwk_item,
-        &pirq_process->wrk_item_list, wrk_list_hd) {
-        if (int_vec == pwk_item->int_vec) {
-            return pwk_item;
+    int err = SUCCESS;
+    unsigned long flags;
+    struct eventfd_ctx *efd_ctx = NULL;
+    struct irq_track *pirq_node;
+    struct irq_cq_track *picq_node;
+    struct metrics_cq *pmetrics_cq_node;
+    struct nvme_cq_eventfd *user_data = NULL;
+
+
+    /* Allocating memory for user struct in kernel space */
+    user_data = kmalloc(sizeof(struct nvme_cq_eventfd), GFP_KERNEL);
+    if (user_data == NULL) {
+        LOG_ERR("Unable to alloc kernel memory to copy user data");
+        err = -ENOMEM;
+        goto fail_out;
+    }
+    if (copy_from_user(user_data, cq_eventfd,
+        sizeof(struct nvme_cq_eventfd))) {
+
+        LOG_ERR("Unable to copy from user space");
+        err = -EFAULT;
+        goto fail_out;
+    }
+
+    pmetrics_cq_node = find_cq(pmetrics_device_elem, user_data->q_id);
+    if (pmetrics_cq_node == NULL) {
+        LOG_ERR("CQ ID = %d is not in list", user_data->q_id);
+        err = -ENODEV;
+        goto fail_out;
+    } else if ((user_data->q_id != 0) && !file_may_use(pmetrics_device_elem,
+        pmetrics_cq_node->owner, filp)) {
+
+        LOG_ERR("CQ ID = %d belongs to another file", user_data->q_id);
+        err = -EACCES;
+        goto fail_out;
+    }
+    if ((pmetrics_device_elem->metrics_device->public_dev.irq_active.irq_type
+        == INT_NONE) || (pmetrics_cq_node->public_cq.irq_enabled == 0)) {
+
+        LOG_ERR("CQ ID = %d has no IRQ to signal", user_data->q_id);
+        err = -EINVAL;
+        goto fail_out;
+    }
+
+    if (user_data->fd >= 0) {
+        efd_ctx = eventfd_ctx_fdget(user_data->fd);
+        if (IS_ERR(efd_ctx)) {
+            LOG_ERR("fd = %d is not an eventfd", user_data->fd);
+            err = PTR_ERR(efd_ctx);
+            efd_ctx = NULL;
+            goto fail_out;
         }
     }
-    return NULL;
+
+    mutex_lock(&pmetrics_device_elem->irq_process.irq_track_mtx);
+    pirq_node = find_irq_node(pmetrics_device_elem,
+        pmetrics_cq_node->public_cq.irq_no);
+    picq_node = (pirq_node == NULL) ? NULL :
+        find_icq_node(pirq_node, user_data->q_id);
+    if (picq_node == NULL) {
+        mutex_unlock(&pmetrics_device_elem->irq_process.irq_track_mtx);
+        LOG_ERR("CQ node does not exist in the IRQ Tracked node!");
+        err = -EINVAL;
+        goto fail_out;
+    }
+    /* Swap in the new eventfd, the old one gets released below */
+    spin_lock_irqsave(&pmetrics_device_elem->irq_process.isr_spin_lock,
+        flags);
+    swap(picq_node->efd_ctx, efd_ctx);
+    spin_unlock_irqrestore(&pmetrics_device_elem->irq_process.isr_spin_lock,
+        flags);
+    mutex_unlock(&pmetrics_device_elem->irq_process.irq_track_mtx);
+    /* Fall through is intended */
+
+fail_out:
+    if (efd_ctx != NULL) {
+        eventfd_ctx_put(efd_ctx);
+    }
+    if (user_data != NULL) {
+        kfree(user_data);
+    }
+    return err;
+}
+
+/*
+ * reap_wait_done - unlinks the waiter unless the ISR or the removal of
+ * its cq node did already.
+ */
+void reap_wait_done(struct  metrics_device_list *pmetrics_device_elem,
+    struct reap_waiter *pwaiter)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&pmetrics_device_elem->irq_process.isr_spin_lock,
+        flags);
+    if (!list_empty(&pwaiter->waiter_hd)) {
+        list_del_init(&pwaiter->waiter_hd);
+    }
+    spin_unlock_irqrestore(&pmetrics_device_elem->irq_process.isr_spin_lock,
+        flags);
+}
+
+/*
+ * Returns 1 if the given file may reap the cq of the irq cq node, any file
+ * may reap the ACQ. Called with the device locked at least shared.
+ */
+static int icq_usable(struct metrics_device_list *pmetrics_device_elem,
+    struct irq_cq_track *picq_node, struct file *filp)
+{
+    struct metrics_cq *pmetrics_cq_node;
+
+    if (picq_node->cq_id == 0) {
+        return 1;
+    }
+    pmetrics_cq_node = find_cq(pmetrics_device_elem, picq_node->cq_id);
+    return ((pmetrics_cq_node != NULL) && file_may_use(pmetrics_device_elem,
+        pmetrics_cq_node->owner, filp));
+}
+
+/*
+ * irq_cqs_ready - returns 1 if the irq of any IRQ enabled cq the file may
+ * reap has fired and not all of its cq's have been reaped yet, otherwise 0.
+ * NOTE: Called with the device locked shared, the irq mutex is taken here.
+ */
+int irq_cqs_ready(struct metrics_device_list *pmetrics_device_elem,
+    struct file *filp)
+{
+    struct irq_processing *pirq_process = &pmetrics_device_elem->irq_process;
+    struct irq_track *pirq_node;
+    struct irq_cq_track *picq_node;
+    int ready = 0;
+
+    mutex_lock(&pirq_process->irq_track_mtx);
+    list_for_each_entry(pirq_node, &pirq_process->irq_track_list,
+        irq_list_hd) {
+        if (atomic_read(&pirq_process->vec_stats[pirq_node->irq_no].
+            isr_fired) == 0) {
+            continue;
+        }
+        list_for_each_entry(picq_node, &pirq_node->irq_cq_track,
+            irq_cq_head) {
+            if (icq_usable(pmetrics_device_elem, picq_node, filp)) {
+                ready = 1;
+                goto unlock_out;
+            }
+        }
+    }
+unlock_out:
+    mutex_unlock(&pirq_process->irq_track_mtx);
+    return ready;
+}
+
+/*
+ * driver_ready_cqs - returns the bitmap of cq's the file may reap whose irq
+ * has fired and which hold CE's to be reaped.
+ */
+int driver_ready_cqs(struct metrics_device_list *pmetrics_device_elem,
+    struct nvme_ready_cqs *ready_cqs, struct file *filp)
+{
+    int err = SUCCESS;
+    u32 bitmap_size;
+    u8 *bitmap = NULL;
+    struct irq_track *pirq_node;
+    struct irq_cq_track *picq_node;
+    struct metrics_cq *pmetrics_cq_node;
+    struct nvme_ready_cqs *user_data = NULL;
+
+
+    /* Allocating memory for user struct in kernel space */
+    user_data = kmalloc(sizeof(struct nvme_ready_cqs), GFP_KERNEL);
+    if (user_data == NULL) {
+        LOG_ERR("Unable to alloc kernel memory to copy user data");
+        err = -ENOMEM;
+        goto fail_out;
+    }
+    if (copy_from_user(user_data, ready_cqs, sizeof(struct nvme_ready_cqs))) {
+        LOG_ERR("Unable to copy from user space");
+        err = -EFAULT;
+        goto fail_out;
+    }
+    if ((user_data->num_cq_ids == 0) || (user_data->num_cq_ids > 0x10000) ||
+        (user_data->bitmap == NULL)) {
+
+        LOG_ERR("Invalid Arguments");
+        err = -EINVAL;
+        goto fail_out;
+    }
+
+    bitmap_size = DIV_ROUND_UP(user_data->num_cq_ids, 8);
+    bitmap = kmalloc(bitmap_size, GFP_KERNEL | __GFP_ZERO);
+    if (bitmap == NULL) {
+        LOG_ERR("Unable to alloc kernel memory for the bitmap");
+        err = -ENOMEM;
+        goto fail_out;
+    }
+
+    user_data->num_ready = 0;
+    mutex_lock(&pmetrics_device_elem->irq_process.irq_track_mtx);
+    list_for_each_entry(pirq_node, &pmetrics_device_elem->irq_process.
+        irq_track_list, irq_list_hd) {
+
+        if (atomic_read(&pmetrics_device_elem->irq_process.
+            vec_stats[pirq_node->irq_no].isr_fired) == 0) {
+            continue;
+        }
+        /* Only the cq's of a fired irq can hold CE's to be reaped */
+        list_for_each_entry(picq_node, &pirq_node->irq_cq_track,
+            irq_cq_head) {
+
+            if ((picq_node->cq_id >= user_data->num_cq_ids) ||
+                !icq_usable(pmetrics_device_elem, picq_node, filp)) {
+                continue;
+            }
+            pmetrics_cq_node = find_cq(pmetrics_device_elem,
+                picq_node->cq_id);
+            if ((pmetrics_cq_node != NULL) && reap_inquiry(pmetrics_cq_node,
+                &pmetrics_device_elem->metrics_device->private_dev.pdev->dev)) {
+
+                bitmap[picq_node->cq_id / 8] |= (1 << (picq_node->cq_id % 8));
+                user_data->num_ready++;
+            }
+        }
+    }
+    mutex_unlock(&pmetrics_device_elem->irq_process.irq_track_mtx);
+
+    if (copy_to_user(user_data->bitmap, bitmap, bitmap_size) ||
+        copy_to_user(ready_cqs, user_data, sizeof(struct nvme_ready_cqs))) {
+
+        LOG_ERR("Unable to copy to user space");
+        err = -EFAULT;
+    }
+    /* Fall through is intended */
+
+fail_out:
+    if (bitmap != NULL) {
+        kfree(bitmap);
+    }
+    if (user_data != NULL) {
+        kfree(user_data);
+    }
+    return err;
 }
 
 /*
@@ -1217,31 +1422,11 @@ int remove_icq_node(struct  metrics_device_list
         return -EINVAL;
     }
     /* remove the cq node from the linked list and free it */
-    list_del(&picq_node->irq_cq_head);
-    kfree(picq_node);
+    free_icq_node(pirq_node, picq_node);
 
     return SUCCESS;
 }
 
-/*
- * Deallocate all the work item nodes within the work items list
- */
-void dealloc_wk_list(struct  irq_processing *pirq_process)
-{
-    struct work_container *pwk_item_next;  /* Next wk item in the list */
-    struct work_container *pwk_item_curr;  /* Current wk item in the list */
-
-    LOG_DBG("Deallocate wk Nodes...");
-    /* Loop for each cq node within this irq node */
-    list_for_each_entry_safe(pwk_item_curr, pwk_item_next,
-        &pirq_process->wrk_item_list, wrk_list_hd) {
-        /* remove the wk node from the linked list */
-        list_del(&pwk_item_curr->wrk_list_hd);
-        /* free up the memory allocated for wk node in irq list */
-        kfree(pwk_item_curr);
-    }
-}
-
 /*
  * deallocate all the cq nodes within this irq node linked list. Remove
  * CQ nodes from the linked list and free up the memory allocated for CQ
@@ -1256,13 +1441,33 @@ static void dealloc_all_icqs(struct  irq_track *pirq_trk_list)
     /* Loop for each cq node within this irq node */
     list_for_each_entry_safe(pirq_cq_list, pirq_cq_next,
             &pirq_trk_list->irq_cq_track, irq_cq_head) {
-        /* remove the cq node from the linked list */
-        list_del(&pirq_cq_list->irq_cq_head);
-        /* free up the memory allocated for cq node in irq list */
-        kfree(pirq_cq_list);
+        /* remove the cq node from the linked list and free it */
+        free_icq_node(pirq_trk_list, pirq_cq_list);
     }
 }
 
+/*
+ * free_icq_node:
+ * Wakes the threads waiting on the cq node, unlinks the node from its irq
+ * node, releases its eventfd and frees it.
+ * NOTE: Must be called with irq mutex locked.
+ */
+static void free_icq_node(struct irq_track *pirq_node,
+    struct irq_cq_track *picq_node)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&pirq_node->pirq_process->isr_spin_lock, flags);
+    wake_icq_waiters(picq_node);
+    list_del(&picq_node->irq_cq_head);
+    spin_unlock_irqrestore(&pirq_node->pirq_process->isr_spin_lock, flags);
+
+    if (picq_node->efd_ctx != NULL) {
+        eventfd_ctx_put(picq_node->efd_ctx);
+    }
+    kfree(picq_node);
+}
+
 /*
  * deallocate all IRQ track nodes from the linked list. Calls free_irq on
  * the interrupt vector that was reserved using request_irq.
@@ -1285,6 +1490,44 @@ void deallocate_irq_trk(struct  metrics_device_list
         list_del(&pirq_trk_list->irq_list_hd);
         kfree(pirq_trk_list);
     }
+
+    /* No ISR is left to account in the vectors */
+    if (pmetrics_device_elem->irq_process.vec_stats != NULL) {
+        kfree(pmetrics_device_elem->irq_process.vec_stats);
+        pmetrics_device_elem->irq_process.vec_stats = NULL;
+    }
+    pmetrics_device_elem->irq_process.num_vec_stats = 0;
+}
+
+/*
+ * alloc_vec_stats:
+ * Allocates the zeroed per vector accounting for num_irqs vectors.
+ */
+static int alloc_vec_stats(struct irq_processing *pirq_process,
+    u16 num_irqs)
+{
+    pirq_process->vec_stats = kcalloc(num_irqs, sizeof(struct irq_vec_stat),
+        GFP_KERNEL);
+    if (pirq_process->vec_stats == NULL) {
+        LOG_ERR("Per vector irq accounting allocation failed");
+        return -ENOMEM;
+    }
+    pirq_process->num_vec_stats = num_irqs;
+    return SUCCESS;
+}
+
+/*
+ * find_vec_stat:
+ * Returns the accounting of the vector for irq_no, else NULL.
+ */
+static struct irq_vec_stat *find_vec_stat(struct irq_processing
+    *pirq_process, u16 irq_no)
+{
+    if ((pirq_process->vec_stats == NULL) ||
+        (irq_no >= pirq_process->num_vec_stats)) {
+        return NULL;
+    }
+    return &pirq_process->vec_stats[irq_no];
 }
 
 /*
@@ -1306,7 +1549,7 @@ void irq_disable(struct  metrics_device_list
     list_for_each_entry(pirq_trk_node,
         &pmetrics_device_elem->irq_process.irq_track_list,
             irq_list_hd) {
-        free_irq(pirq_trk_node->int_vec, &pmetrics_device_elem->irq_process);
+        free_irq(pirq_trk_node->int_vec, pirq_trk_node);
     }
 
     /* Perform setting of IRQ to none based on active scheme of IRQ */
@@ -1328,13 +1571,20 @@ void irq_disable(struct  metrics_device_list
     }
 }
 
-/* Loop through all CQ's associated with irq_no and check whehter
- * they are empty and if empty reset the isr_flag for that particular
- * irq_no
+/* Loop through all CQ's associated with the irq_no of the reaped CQ and
+ * check whehter they are empty and if empty reset the isr_flag for that
+ * particular irq_no
+ * NOTE: The CQ nodes of an irq only change with the device held exclusively,
+ * the caller holds it at least shared, so no irq mutex is needed. The vector
+ * is still masked, the ISR can't set the flag again before it gets unmasked.
+ * The caller holds the lock of the reaped CQ. A sibling CQ being reaped by
+ * another thread is left alone and counted as not empty, that thread checks
+ * the flag again after reaping it.
  */
 int reset_isr_flag(struct metrics_device_list *pmetrics_device,
-    u16 irq_no)
+    struct metrics_cq *preaped_cq)
 {
+    u16 irq_no = preaped_cq->public_cq.irq_no;
     struct irq_track *pirq_node; /* IRQ node inside irq track list */
     struct irq_cq_track *picq_node; /* CQ node inside irq node */
     struct metrics_cq  *pmetrics_cq_node; /* CQ node in metrics_cq_list */
@@ -1356,9 +1606,18 @@ int reset_isr_flag(struct metrics_device_list *pmetrics_device,
             LOG_ERR("CQ ID = %d not found", picq_node->cq_id);
             return -EBADSLT;
         }
-        /* Reap on all CQ's */
-        num_rem = reap_inquiry(pmetrics_cq_node, &pmetrics_device
-            ->metrics_device->private_dev.pdev->dev);
+        if (pmetrics_cq_node == preaped_cq) {
+            /* Reap on the CQ which is locked by the caller */
+            num_rem = reap_inquiry(pmetrics_cq_node, &pmetrics_device
+                ->metrics_device->private_dev.pdev->dev);
+        } else if (mutex_trylock(&pmetrics_cq_node->q_mtx)) {
+            /* Reap on all other CQ's */
+            num_rem = reap_inquiry(pmetrics_cq_node, &pmetrics_device
+                ->metrics_device->private_dev.pdev->dev);
+            mutex_unlock(&pmetrics_cq_node->q_mtx);
+        } else {
+            num_rem = 1;
+        }
         if (num_rem != 0) {
             break;
         }
@@ -1366,7 +1625,8 @@ int reset_isr_flag(struct metrics_device_list *pmetrics_device,
 
     /* reset the isr flag */
     if (num_rem == 0) {
-        pirq_node->isr_fired = 0;
+        atomic_set(&pmetrics_device->irq_process.vec_stats[irq_no].isr_fired,
+            0);
     }
     return 0;
 }
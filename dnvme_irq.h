@@ -83,7 +83,7 @@ int nvme_set_irq(struct metrics_device_list *pmetrics_device_elem,
 
 /*
  * Lock on to the mutex and remove all lists used by IRQ module
- * (the irq ,cq and work item track nodes)
+ * (the irq and cq track nodes)
  * set the current active scheme to INT_NONE.
  */
 int init_irq_lists(struct metrics_device_list
@@ -105,7 +105,6 @@ void unmask_interrupts(u16 irq_no, struct irq_processing
     *pirq_process);
 /*
  * Used for releasing the IRQ lists after any scheme is run
- * Also removes all the enqueued wk items
  * set the current active scheme to INT_NONE.
  */
 void release_irq(struct metrics_device_list *pmetrics_device_elem);
@@ -121,11 +120,6 @@ void irq_disable(struct  metrics_device_list
  */
 void deallocate_irq_trk(struct  metrics_device_list
     *pmetrics_device_elem);
-/*
- * Deallocate all the work item nodes within the work items list
- */
-void dealloc_wk_list(struct irq_processing *pirq_process);
-
 /*
  * add_icq_node : This function will add a Completion Q node into the
  * interrupt linked list with the given cq id.
@@ -163,11 +157,52 @@ int reap_inquiry_isr(struct metrics_cq  *pmetrics_cq_node,
     struct  metrics_device_list *pmetrics_device_elem,
     u32 *num_remaining, u32 *isr_count);
 
-/* Loop through all CQ's associated with irq_no and check whehter
- * they are empty and if empty reset the isr_flag for that particular
- * irq_no
+/*
+ * reap_wait_isr counts the CE's waiting in the given CQ and if there are
+ * fewer than min_elements it queues the waiter to be woken by the ISR once the
+ * irq of the CQ fires. Returns 1 if the waiter is queued, 0 if enough CE's
+ * are already waiting, or an error code.
+ */
+int reap_wait_isr(struct metrics_cq  *pmetrics_cq_node,
+    struct  metrics_device_list *pmetrics_device_elem,
+    struct reap_waiter *pwaiter, u32 min_elements,
+    u32 *num_remaining, u32 *isr_count);
+
+/*
+ * reap_wait_done removes the waiter from the CQ node it was queued on, if the
+ * ISR did not remove it already.
+ */
+void reap_wait_done(struct  metrics_device_list *pmetrics_device_elem,
+    struct reap_waiter *pwaiter);
+
+/*
+ * driver_cq_eventfd attaches an eventfd to an IRQ enabled CQ which is
+ * signalled from the ISR of its irq, or detaches it for a negative fd.
+ * The CQ must be usable by filp.
+ */
+int driver_cq_eventfd(struct  metrics_device_list *pmetrics_device_elem,
+    struct nvme_cq_eventfd *cq_eventfd, struct file *filp);
+
+/*
+ * irq_cqs_ready returns 1 when the irq of at least one IRQ enabled CQ the
+ * file may reap has fired and its CQ's are not all reaped, which makes the
+ * device readable to that file.
+ */
+int irq_cqs_ready(struct metrics_device_list *pmetrics_device_elem,
+    struct file *filp);
+
+/*
+ * driver_ready_cqs fills the user's bitmap with the CQ's the file may reap
+ * whose irq has fired and that still hold CE's waiting to be reaped.
+ */
+int driver_ready_cqs(struct metrics_device_list *pmetrics_device_elem,
+    struct nvme_ready_cqs *ready_cqs, struct file *filp);
+
+/* Loop through all CQ's associated with the irq_no of the reaped CQ and
+ * check whehter they are empty and if empty reset the isr_flag for that
+ * particular irq_no
  */
 int reset_isr_flag(struct metrics_device_list *pmetrics_device,
-    u16 irq_no);
+    struct metrics_cq *preaped_cq);
 
 #endif
@@ -25,6 +25,9 @@
 #include <linux/uaccess.h>
 #include <linux/errno.h>
 #include <linux/interrupt.h>
+#include <linux/sched.h>
+#include <linux/hrtimer.h>
+#include <linux/mm.h>
 
 #include "definitions.h"
 #include "sysdnvme.h"
@@ -33,6 +36,9 @@
 #include "dnvme_ds.h"
 #include "dnvme_cmds.h"
 #include "dnvme_irq.h"
+#include "dnvme_ring.h"
+#include "dnvme_stats.h"
+#include "dnvme_trace.h"
 
 /* Static functions used in this file  */
 static void reinit_admn_sq(struct  metrics_sq  *pmetrics_sq_list,
@@ -44,22 +50,39 @@ static void deallocate_metrics_cq(struct device *dev,
 static void deallocate_metrics_sq(struct device *dev,
     struct  metrics_sq  *pmetrics_sq_list,
     struct  metrics_device_list *pmetrics_device);
-static void pos_cq_head_ptr(struct metrics_cq  *pmetrics_cq_node,
-    u32 num_reaped);
-static int process_reap_algos(struct cq_completion *cq_entry,
-    struct  metrics_device_list *pmetrics_device);
 static int process_algo_q(struct metrics_sq *pmetrics_sq_node,
     struct cmd_track *pcmd_node, u8 free_q_entry,
     struct  metrics_device_list *pmetrics_device,
     enum metrics_type type);
 static int process_algo_gen(struct metrics_sq *pmetrics_sq_node,
-    u16 cmd_id, struct  metrics_device_list *pmetrics_device);
+    u16 cmd_id, struct  metrics_device_list *pmetrics_device,
+    struct reclaim_prps **ppreclaim);
 static int copy_cq_data(struct metrics_cq  *pmetrics_cq_node, u8 *cq_head_ptr,
     u32 comp_entry_size, u32 *num_reaped, u8 *buffer,
     struct  metrics_device_list *pmetrics_device);
 static int process_admin_cmd(struct metrics_sq *pmetrics_sq_node,
     struct cmd_track *pcmd_node, u16 status,
-    struct  metrics_device_list *pmetrics_device);
+    struct  metrics_device_list *pmetrics_device,
+    struct reclaim_prps **ppreclaim);
+static void qid_tbl_free(void **tbl[]);
+static u32 cq_sync_for_cpu(struct metrics_cq *pmetrics_cq_node,
+    struct device *dev, u32 offset);
+static u8 cq_head_posted(struct metrics_cq *pmetrics_cq_node,
+    struct device *dev);
+static void reap_poll(struct metrics_cq *pmetrics_cq_node, struct device *dev,
+    u32 poll_us, u8 hybrid);
+static u32 release_file_queues(struct  metrics_device_list *pmetrics_device,
+    struct file *filp);
+static void free_q_mem(struct device *dev, struct mapped_q **pmapped,
+    void *vir_kern_addr, dma_addr_t dma_addr, u32 size);
+static void release_mapped_q(struct kref *ref);
+static void mapped_q_vm_open(struct vm_area_struct *vma);
+static void mapped_q_vm_close(struct vm_area_struct *vma);
+
+static const struct vm_operations_struct mapped_q_vm_ops = {
+    .open  = mapped_q_vm_open,
+    .close = mapped_q_vm_close,
+};
 
 
 /*
@@ -171,6 +194,29 @@ void device_cleanup(struct metrics_device_list *pmetrics_device,
     deallocate_all_queues(pmetrics_device, new_state);
     /* Clean up meta buffers in all disable cases */
     deallocate_mb(pmetrics_device);
+    /* Registered buffers can only go once no cmd references them */
+    deallocate_reg_bufs(pmetrics_device);
+    /* Nothing may be left pinned once the device is cleaned up */
+    flush_work(&pmetrics_device->reclaim_work);
+}
+
+
+/*
+ * Called to clean up what a file of a shared device owns, the controller,
+ * admin Q's and irq scheme are left as they are for the remaining files.
+ * The controller stays enabled, so whatever it may still DMA to is handed
+ * to the controlling file, everything else is freed.
+ */
+void file_cleanup(struct metrics_device_list *pmetrics_device,
+    struct file *filp)
+{
+    u32 live_sqs;
+
+    live_sqs = release_file_queues(pmetrics_device, filp);
+    /* Only cmds of the file's own SQ's may transfer to its meta buffers */
+    release_file_mb(pmetrics_device, filp, (live_sqs != 0));
+    /* Buffers used by the cmds outstanding on the Q's above are kept */
+    deallocate_file_reg_bufs(pmetrics_device, filp);
 }
 
 
@@ -200,6 +246,12 @@ int create_admn_sq(struct nvme_device *pnvme_dev, u32 qsize,
         goto asq_out;
     }
 
+    /* Preallocate the cmd tracking for every element of the ASQ */
+    ret_code = alloc_cmd_track_slots(pmetrics_sq_list);
+    if (ret_code < 0) {
+        goto asq_out;
+    }
+
     /*
     * As the qsize send is in number of entries this computes the no. of bytes
     * computed.
@@ -262,11 +314,11 @@ int create_admn_sq(struct nvme_device *pnvme_dev, u32 qsize,
 
     /* set private members in sq metrics */
     pmetrics_sq_list->private_sq.size = asq_depth;
-    pmetrics_sq_list->private_sq.unique_cmd_id = 0;
     pmetrics_sq_list->private_sq.contig = 1;
     return ret_code;
 
 asq_out:
+    free_cmd_track_slots(pmetrics_sq_list);
     if (pmetrics_sq_list->private_sq.vir_kern_addr != NULL) {
         /* Admin SQ dma mem allocated, so free the DMA memory */
         dma_free_coherent(&pnvme_dev->private_dev.pdev->dev, asq_depth,
@@ -427,8 +479,11 @@ int nvme_prepare_sq(struct  metrics_sq  *pmetrics_sq_list,
             pmetrics_sq_list->private_sq.size);
     }
 
-    /* Each new IOSQ resets its unique cmd counter, start from a known place */
-    pmetrics_sq_list->private_sq.unique_cmd_id = 0;
+    /* Each new IOSQ starts with every cmd ID free, start from a known place */
+    ret_code = alloc_cmd_track_slots(pmetrics_sq_list);
+    if (ret_code < 0) {
+        goto psq_out;
+    }
 
     // Learn of the doorbell stride
     cap_dstrd = ((READQ(&pnvme_dev->private_dev.ctrlr_regs->cap) >> 32) & 0xF);
@@ -536,6 +591,7 @@ int nvme_ring_sqx_dbl(u16 ring_sqx, struct metrics_device_list *pmetrics_device)
         LOG_ERR("SQ ID = %d does not exist", ring_sqx);
         return -EINVAL;
     }
+    mutex_lock(&pmetrics_sq->q_mtx);
 
     LOG_DBG("SQ_ID= %d found in kernel metrics.",
         pmetrics_sq->public_sq.sq_id);
@@ -545,10 +601,20 @@ int nvme_ring_sqx_dbl(u16 ring_sqx, struct metrics_device_list *pmetrics_device)
     LOG_DBG("\tdbs = %p; bar0 = %p", pmetrics_sq->private_sq.dbs,
         pmetrics_device->metrics_device->private_dev.bar0);
 
+    if (pmetrics_device->lat_enabled) {
+        lat_stamp_ring(pmetrics_sq);
+    }
+
+    trace_dnvme_ring_sq(pmetrics_sq->public_sq.sq_id,
+        pmetrics_sq->public_sq.tail_ptr, pmetrics_sq->public_sq.tail_ptr_virt);
+
     /* Copy tail_prt_virt to tail_prt */
     pmetrics_sq->public_sq.tail_ptr = pmetrics_sq->public_sq.tail_ptr_virt;
     /* Ring the doorbell with tail_prt */
     writel(pmetrics_sq->public_sq.tail_ptr, pmetrics_sq->private_sq.dbs);
+    PERF_ADD(pmetrics_sq->perf, dbs_rung, 1);
+    PERF_ADD(pmetrics_device->perf, dbs_rung, 1);
+    mutex_unlock(&pmetrics_sq->q_mtx);
     return SUCCESS;
 }
 
@@ -570,13 +636,13 @@ static void deallocate_metrics_cq(struct device *dev,
 
     } else {
         /* Contiguous CQ, so free the DMA memory */
-        dma_free_coherent(dev, pmetrics_cq_list->private_cq.size,
-            (void *)pmetrics_cq_list->private_cq.vir_kern_addr,
-            pmetrics_cq_list->private_cq.cq_dma_addr);
-
+        free_q_mem(dev, &pmetrics_cq_list->mapped,
+            pmetrics_cq_list->private_cq.vir_kern_addr,
+            pmetrics_cq_list->private_cq.cq_dma_addr,
+            pmetrics_cq_list->private_cq.size);
     }
     /* Delete the current cq entry from the list, and free it */
-    list_del(&pmetrics_cq_list->cq_list_hd);
+    unlink_cq_node(pmetrics_device, pmetrics_cq_list);
     kfree(pmetrics_cq_list);
 }
 
@@ -591,8 +657,15 @@ static void deallocate_metrics_sq(struct device *dev,
     struct  metrics_sq  *pmetrics_sq_list,
     struct  metrics_device_list *pmetrics_device)
 {
+    /* Stop feeding the SQ before its cmds are dropped */
+    free_rings(pmetrics_sq_list);
+
     /* Clean the Cmd track list */
     empty_cmd_track_list(pmetrics_device->metrics_device, pmetrics_sq_list);
+    free_cmd_track_slots(pmetrics_sq_list);
+    if (pmetrics_sq_list->lat_hists != NULL) {
+        kfree(pmetrics_sq_list->lat_hists);
+    }
 
     if (pmetrics_sq_list->private_sq.contig == 0) {
         /* Deletes the PRP persist entry */
@@ -600,17 +673,93 @@ static void deallocate_metrics_sq(struct device *dev,
             &pmetrics_sq_list->private_sq.prp_persist);
     } else {
         /* Contiguous SQ, so free the DMA memory */
-        dma_free_coherent(dev, pmetrics_sq_list->private_sq.size,
-            (void *)pmetrics_sq_list->private_sq.vir_kern_addr,
-            pmetrics_sq_list->private_sq.sq_dma_addr);
+        free_q_mem(dev, &pmetrics_sq_list->mapped,
+            pmetrics_sq_list->private_sq.vir_kern_addr,
+            pmetrics_sq_list->private_sq.sq_dma_addr,
+            pmetrics_sq_list->private_sq.size);
     }
 
     /* Delete the current sq entry from the list */
-    list_del(&pmetrics_sq_list->sq_list_hd);
+    unlink_sq_node(pmetrics_device, pmetrics_sq_list);
     kfree(pmetrics_sq_list);
 }
 
 
+/*
+ * Give back the contiguous memory of a Q, unless user space still maps it;
+ * then it goes with the last VMA.
+ */
+static void free_q_mem(struct device *dev, struct mapped_q **pmapped,
+    void *vir_kern_addr, dma_addr_t dma_addr, u32 size)
+{
+    if (*pmapped != NULL) {
+        kref_put(&(*pmapped)->ref, release_mapped_q);
+        *pmapped = NULL;
+    } else {
+        dma_free_coherent(dev, size, vir_kern_addr, dma_addr);
+    }
+}
+
+
+static void release_mapped_q(struct kref *ref)
+{
+    struct mapped_q *mapped = container_of(ref, struct mapped_q, ref);
+
+    dma_free_coherent(mapped->dev, mapped->size, mapped->vir_kern_addr,
+        mapped->dma_addr);
+    put_device(mapped->dev);
+    kfree(mapped);
+}
+
+
+static void mapped_q_vm_open(struct vm_area_struct *vma)
+{
+    struct mapped_q *mapped = vma->vm_private_data;
+
+    kref_get(&mapped->ref);
+}
+
+
+/*
+ * Runs from munmap or exit without the device locked, the memory is only
+ * freed here once the Q let go of it.
+ */
+static void mapped_q_vm_close(struct vm_area_struct *vma)
+{
+    struct mapped_q *mapped = vma->vm_private_data;
+
+    kref_put(&mapped->ref, release_mapped_q);
+}
+
+
+int mmap_q(struct device *dev, struct mapped_q **pmapped,
+    void *vir_kern_addr, dma_addr_t dma_addr, u32 size,
+    struct vm_area_struct *vma)
+{
+    struct mapped_q *mapped = *pmapped;
+
+    if (mapped == NULL) {
+        mapped = kzalloc(sizeof(struct mapped_q), GFP_KERNEL);
+        if (mapped == NULL) {
+            LOG_ERR("Unable to alloc kernel memory to track the mapping");
+            return -ENOMEM;
+        }
+        /* The memory may outlive the device, hold on to what it needs */
+        mapped->dev = get_device(dev);
+        mapped->vir_kern_addr = vir_kern_addr;
+        mapped->dma_addr = dma_addr;
+        mapped->size = size;
+        kref_init(&mapped->ref);
+        *pmapped = mapped;
+    }
+    vma->vm_ops = &mapped_q_vm_ops;
+    vma->vm_private_data = mapped;
+    /* open isn't called for the VMA created by mmap itself */
+    mapped_q_vm_open(vma);
+    return SUCCESS;
+}
+
+
 /*
  * Reinitialize the admin completion queue's public parameters, when
  * a controller is not completely disabled
@@ -621,6 +770,7 @@ static void reinit_admn_cq(struct  metrics_cq  *pmetrics_cq_list)
     pmetrics_cq_list->public_cq.head_ptr = 0;
     pmetrics_cq_list->public_cq.tail_ptr = 0;
     pmetrics_cq_list->public_cq.pbit_new_entry = 1;
+    pmetrics_cq_list->private_cq.num_scanned = 0;
     memset(pmetrics_cq_list->private_cq.vir_kern_addr, 0,
         pmetrics_cq_list->private_cq.size);
     pmetrics_cq_list->public_cq.irq_enabled = 1;
@@ -641,7 +791,6 @@ static void reinit_admn_sq(struct  metrics_sq  *pmetrics_sq_list,
     pmetrics_sq_list->public_sq.head_ptr = 0;
     pmetrics_sq_list->public_sq.tail_ptr = 0;
     pmetrics_sq_list->public_sq.tail_ptr_virt = 0;
-    pmetrics_sq_list->private_sq.unique_cmd_id = 0;
 }
 
 
@@ -696,6 +845,10 @@ void deallocate_all_queues(struct  metrics_device_list *pmetrics_device,
 
     /* if complete disable then reset the controller admin registers. */
     if (! preserve_admin_qs) {
+        /* Every Q is gone, so are the lookup table leaves */
+        qid_tbl_free(pmetrics_device->sq_tbl);
+        qid_tbl_free(pmetrics_device->cq_tbl);
+
         /* Set the Registers to default values. */
         /* Write 0 to AQA */
         writel(0x0, &pmetrics_device->metrics_device->private_dev.
@@ -710,19 +863,100 @@ void deallocate_all_queues(struct  metrics_device_list *pmetrics_device,
 }
 
 
+/*
+ * release_file_queues - Free the IO SQ's and CQ's prepared by the given file
+ * which were never created on the controller. Those which were may be DMA'd
+ * into at any time, along with the data of their outstanding cmds, they are
+ * handed to the controlling file which deletes them, or to no file if it is
+ * gone; either way they go once their delete cmd is reaped or the controller
+ * is disabled. Their rings are torn down, no one feeds them anymore. The
+ * admin Q's are never owned by a file. Returns the no. of SQ's handed over.
+ */
+static u32 release_file_queues(struct  metrics_device_list *pmetrics_device,
+    struct file *filp)
+{
+    u32 live_sqs = 0;
+    struct  metrics_sq  *pmetrics_sq_list;
+    struct  metrics_sq  *pmetrics_sq_next;
+    struct  metrics_cq  *pmetrics_cq_list;
+    struct  metrics_cq  *pmetrics_cq_next;
+    struct private_metrics_dev *pdev =
+        &pmetrics_device->metrics_device->private_dev;
+
+    list_for_each_entry_safe(pmetrics_sq_list, pmetrics_sq_next,
+        &pmetrics_device->metrics_sq_list, sq_list_hd) {
+
+        if (pmetrics_sq_list->owner != filp) {
+            continue;
+        } else if (pmetrics_sq_list->private_sq.bit_mask & UNIQUE_QID_FLAG) {
+            deallocate_metrics_sq(&pdev->pdev->dev, pmetrics_sq_list,
+                pmetrics_device);
+            continue;
+        }
+        LOG_DBG("Handing SQ ID = %d over", pmetrics_sq_list->public_sq.sq_id);
+        free_rings(pmetrics_sq_list);
+        pmetrics_sq_list->owner = pdev->ctrl_filp;
+        live_sqs++;
+    }
+    /* A CQ only created on the controller has no irq tracked yet */
+    list_for_each_entry_safe(pmetrics_cq_list, pmetrics_cq_next,
+        &pmetrics_device->metrics_cq_list, cq_list_hd) {
+
+        if (pmetrics_cq_list->owner != filp) {
+            continue;
+        } else if (pmetrics_cq_list->private_cq.bit_mask & UNIQUE_QID_FLAG) {
+            deallocate_metrics_cq(&pdev->pdev->dev, pmetrics_cq_list,
+                pmetrics_device);
+            continue;
+        }
+        LOG_DBG("Handing CQ ID = %d over", pmetrics_cq_list->public_cq.q_id);
+        pmetrics_cq_list->owner = pdev->ctrl_filp;
+    }
+    return live_sqs;
+}
+
+
+/*
+ * Sync a discontiguous CQ for the CPU from the byte offset given up to the
+ * end of the dma segment holding it; the mapped segments cover the CQ back
+ * to back. Returns the offset the CQ is now synced up to.
+ */
+static u32 cq_sync_for_cpu(struct metrics_cq *pmetrics_cq_node,
+    struct device *dev, u32 offset)
+{
+    u32 i;
+    u32 seg_start = 0;
+    struct scatterlist *sg;
+    struct nvme_prps *prps = &pmetrics_cq_node->private_cq.prp_persist;
+
+    for_each_sg(prps->sg, sg, prps->num_map_pgs, i) {
+        if (offset < (seg_start + sg_dma_len(sg))) {
+            dma_sync_single_range_for_cpu(dev, sg_dma_address(sg),
+                (offset - seg_start), (seg_start + sg_dma_len(sg) - offset),
+                prps->data_dir);
+            return (seg_start + sg_dma_len(sg));
+        }
+        seg_start += sg_dma_len(sg);
+    }
+    return pmetrics_cq_node->private_cq.size;
+}
+
+
 /*
  *  reap_inquiry - This generic function will try to inquire the number of
  *  commands in the Completion Queue that are waiting to be reaped for any
- *  given q_id.
+ *  given q_id. The CE's found posted by previous inquiries are remembered,
+ *  so the scan resumes right after them and only new CE's get examined.
  */
 u32 reap_inquiry(struct metrics_cq  *pmetrics_cq_node, struct device *dev)
 {
     u8 tmp_pbit;                    /* Local phase bit      */
-    /* mem head ptr in cq, base address for queue */
-    u8 *q_head_ptr, *queue_base_addr;
+    u8 *queue_base_addr;            /* base address for queue */
     struct cq_completion *cq_entry; /* cq entry format      */
     u32 comp_entry_size = 16;       /* acq entry size       */
-    u32 num_remaining = 0;          /* reap elem remaining  */
+    u32 num_remaining;              /* reap elem remaining  */
+    u32 scan_ptr;                   /* 1st CE not known to be posted */
+    u32 synced_end = 0;             /* discontig CQ synced up to offset */
 
 
     /* If IO CQ set the completion Q entry size */
@@ -731,57 +965,55 @@ u32 reap_inquiry(struct metrics_cq  *pmetrics_cq_node, struct device *dev)
             pmetrics_cq_node->public_cq.elements);
     }
 
-    /* local tmp phase bit */
-    tmp_pbit = pmetrics_cq_node->public_cq.pbit_new_entry;
-
-    /* point the address to corresponding head ptr */
     if (pmetrics_cq_node->private_cq.contig != 0) {
         queue_base_addr = pmetrics_cq_node->private_cq.vir_kern_addr;
-        q_head_ptr = pmetrics_cq_node->private_cq.vir_kern_addr +
-            (comp_entry_size * (u32)pmetrics_cq_node->public_cq.head_ptr);
     } else {
-        /* do sync and update when pointer to discontig Q is reaped inq */
-        dma_sync_sg_for_cpu(dev, pmetrics_cq_node->private_cq.prp_persist.sg,
-            pmetrics_cq_node->private_cq.prp_persist.num_map_pgs,
-            pmetrics_cq_node->private_cq.prp_persist.data_dir);
         queue_base_addr =
             pmetrics_cq_node->private_cq.prp_persist.vir_kern_addr;
-        q_head_ptr = queue_base_addr +
-            (comp_entry_size * (u32)pmetrics_cq_node->public_cq.head_ptr);
-
     }
 
-    /* Start from head ptr and update till phase bit incorrect */
-    pmetrics_cq_node->public_cq.tail_ptr =
-        pmetrics_cq_node->public_cq.head_ptr;
+    /* Resume after the CE's already found, with the phase they carry */
+    num_remaining = pmetrics_cq_node->private_cq.num_scanned;
+    scan_ptr = (u32)pmetrics_cq_node->public_cq.head_ptr + num_remaining;
+    tmp_pbit = pmetrics_cq_node->public_cq.pbit_new_entry;
+    if (scan_ptr >= pmetrics_cq_node->public_cq.elements) {
+        scan_ptr -= pmetrics_cq_node->public_cq.elements;
+        tmp_pbit = !tmp_pbit;
+    }
 
     LOG_DBG("Reap Inquiry on CQ_ID:PBit:EntrySize = %d:%d:%d",
         pmetrics_cq_node->public_cq.q_id, tmp_pbit, comp_entry_size);
     LOG_DBG("CQ Hd Ptr = %d", pmetrics_cq_node->public_cq.head_ptr);
-    LOG_DBG("Rp Inq. Tail Ptr before = %d", pmetrics_cq_node->public_cq.
-        tail_ptr);
+    LOG_DBG("Rp Inq. Tail Ptr before = %d", scan_ptr);
 
-    /* loop through the entries in the cq */
+    /* loop through the new entries in the cq */
     while (1) {
-        cq_entry = (struct cq_completion *)q_head_ptr;
-        if (cq_entry->phase_bit == tmp_pbit) {
+        /* Only sync what is about to be examined of a discontig Q */
+        if ((pmetrics_cq_node->private_cq.contig == 0) &&
+            ((scan_ptr * comp_entry_size) >= synced_end)) {
 
-            pmetrics_cq_node->public_cq.tail_ptr += 1;
-            q_head_ptr += comp_entry_size;
-            num_remaining += 1;
+            synced_end = cq_sync_for_cpu(pmetrics_cq_node, dev,
+                (scan_ptr * comp_entry_size));
+        }
 
-            /* Q wrapped around */
-            if (q_head_ptr >= (queue_base_addr +
-                pmetrics_cq_node->private_cq.size)) {
+        cq_entry = (struct cq_completion *)(queue_base_addr +
+            (comp_entry_size * scan_ptr));
+        if (cq_entry->phase_bit != tmp_pbit) {
+            break;  /* we reached stale element */
+        }
 
-                tmp_pbit = !tmp_pbit;
-                q_head_ptr = queue_base_addr;
-                pmetrics_cq_node->public_cq.tail_ptr = 0;
-            }
-        } else {    /* we reached stale element */
-            break;
+        scan_ptr += 1;
+        num_remaining += 1;
+
+        /* Q wrapped around */
+        if (scan_ptr >= pmetrics_cq_node->public_cq.elements) {
+            tmp_pbit = !tmp_pbit;
+            scan_ptr = 0;
+            synced_end = 0;
         }
     }
+    pmetrics_cq_node->private_cq.num_scanned = num_remaining;
+    pmetrics_cq_node->public_cq.tail_ptr = (u16)scan_ptr;
 
     LOG_DBG("Rp Inq. Tail Ptr After = %d", pmetrics_cq_node->public_cq.
         tail_ptr);
@@ -791,12 +1023,99 @@ u32 reap_inquiry(struct metrics_cq  *pmetrics_cq_node, struct device *dev)
 }
 
 
+/*
+ * Whether the CE at the head of the CQ has been posted by the controller,
+ * which is all a poll needs to look at instead of a full reap_inquiry scan.
+ */
+static u8 cq_head_posted(struct metrics_cq *pmetrics_cq_node,
+    struct device *dev)
+{
+    u8 *queue_base_addr;
+    u32 comp_entry_size = 16;
+    struct cq_completion *cq_entry;
+
+    if (pmetrics_cq_node->public_cq.q_id != 0) {
+        comp_entry_size = (pmetrics_cq_node->private_cq.size /
+            pmetrics_cq_node->public_cq.elements);
+    }
+
+    if (pmetrics_cq_node->private_cq.contig != 0) {
+        queue_base_addr = pmetrics_cq_node->private_cq.vir_kern_addr;
+    } else {
+        cq_sync_for_cpu(pmetrics_cq_node, dev, (comp_entry_size *
+            (u32)pmetrics_cq_node->public_cq.head_ptr));
+        queue_base_addr =
+            pmetrics_cq_node->private_cq.prp_persist.vir_kern_addr;
+    }
+
+    cq_entry = (struct cq_completion *)(queue_base_addr +
+        (comp_entry_size * (u32)pmetrics_cq_node->public_cq.head_ptr));
+    return (cq_entry->phase_bit == pmetrics_cq_node->public_cq.pbit_new_entry);
+}
+
+
+/*
+ * Busy-poll for at most poll_us until the CE at the head of the CQ is
+ * posted. A hybrid poll first sleeps for half of the average wait of the
+ * previous polls, as the hybrid polling of the block layer does, so the CPU
+ * only spins near the expected completion. The average is a moving one
+ * over the polls which had to wait; 1/8th weight per new wait. A signal
+ * ends the sleep and the poll, the reap goes on with what is posted.
+ * Called with the CQ locked, MAX_REAP_POLL_US bounds how long.
+ */
+static void reap_poll(struct metrics_cq *pmetrics_cq_node, struct device *dev,
+    u32 poll_us, u8 hybrid)
+{
+    s64 start_ns, now_ns, end_ns;
+    u64 wait_ns;
+    ktime_t sleep_time;
+    u8 posted;
+
+
+    if (cq_head_posted(pmetrics_cq_node, dev)) {
+        return;
+    }
+    start_ns = ktime_to_ns(ktime_get());
+    end_ns = start_ns + ((s64)poll_us * NSEC_PER_USEC);
+
+    wait_ns = pmetrics_cq_node->private_cq.poll_wait_ns;
+    if (hybrid && (wait_ns != 0)) {
+        sleep_time = ns_to_ktime(min_t(u64, (wait_ns >> 1),
+            ((u64)poll_us * NSEC_PER_USEC)));
+        set_current_state(TASK_INTERRUPTIBLE);
+        schedule_hrtimeout(&sleep_time, HRTIMER_MODE_REL);
+    }
+
+    do {
+        posted = cq_head_posted(pmetrics_cq_node, dev);
+        now_ns = ktime_to_ns(ktime_get());
+        if (posted || signal_pending(current)) {
+            break;
+        }
+        if (need_resched()) {
+            cond_resched();
+        }
+        cpu_relax();
+    } while (now_ns < end_ns);
+
+    if (posted) {
+        /* The CE must not be read ahead of its phase bit */
+        rmb();
+        wait_ns = (wait_ns == 0) ? (u64)(now_ns - start_ns) :
+            (wait_ns - (wait_ns >> 3) + ((u64)(now_ns - start_ns) >> 3));
+        pmetrics_cq_node->private_cq.poll_wait_ns = wait_ns;
+    }
+    LOG_DBG("Polled CQ ID = %d for %lld ns, CE %s", pmetrics_cq_node->
+        public_cq.q_id, (now_ns - start_ns), (posted ? "posted" : "pending"));
+}
+
+
 /*
  *  driver_reap_inquiry - This function will try to inquire the number of
  *  commands in the CQ that are waiting to be reaped.
  */
 int driver_reap_inquiry(struct metrics_device_list *pmetrics_device,
-    struct nvme_reap_inquiry *usr_reap_inq)
+    struct nvme_reap_inquiry *usr_reap_inq, struct file *filp)
 {
     int err = SUCCESS;
     struct metrics_cq *pmetrics_cq_node;   /* ptr to cq node */
@@ -825,7 +1144,15 @@ int driver_reap_inquiry(struct metrics_device_list *pmetrics_device,
         LOG_ERR("CQ ID = %d is not in list", user_data->q_id);
         err = -ENODEV;
         goto fail_out;
+    } else if ((user_data->q_id != 0) &&
+        !file_may_use(pmetrics_device, pmetrics_cq_node->owner, filp)) {
+
+        LOG_ERR("CQ ID = %d belongs to another file", user_data->q_id);
+        err = -EACCES;
+        goto fail_out;
     }
+    mutex_lock(&pmetrics_cq_node->q_mtx);
+
     /* Initializing ISR count for all the possible cases */
     user_data->isr_count = 0;
     /* Note: If ISR's are enabled then ACQ will always be attached to INT 0 */
@@ -851,21 +1178,18 @@ int driver_reap_inquiry(struct metrics_device_list *pmetrics_device,
         } else {
             LOG_DBG("ISR Reap Inq on CQ = %d",
                 pmetrics_cq_node->public_cq.q_id);
-            /* Lock onto irq mutex for reap inquiry. */
-            mutex_lock(&pmetrics_device->irq_process.irq_track_mtx);
             /* Process ISR based reap inquiry as isr is enabled */
             err = reap_inquiry_isr(pmetrics_cq_node, pmetrics_device,
                 &user_data->num_remaining, &user_data->isr_count);
-            /* unlock irq track mutex here */
-            mutex_unlock(&pmetrics_device->irq_process.irq_track_mtx);
-            /* delay err checking to return after mutex unlock */
             if (err < 0) {
                 LOG_ERR("ISR Reap Inquiry failed...");
                 err = -EINVAL;
+                mutex_unlock(&pmetrics_cq_node->q_mtx);
                 goto fail_out;
              }
          }
     }
+    mutex_unlock(&pmetrics_cq_node->q_mtx);
 
     /* Copy to user the remaining elements in this q */
     if (copy_to_user(usr_reap_inq, user_data,
@@ -893,60 +1217,285 @@ fail_out:
 
 
 /*
- * find sq node in the given device element node and given sq id. If found
- * returns the pointer to the sq node in the sq linked list. Otherwise returns
- * NULL.
+ *  driver_reap_wait - Sleep until the CQ holds enough CE's, woken by the ISR
+ *  of the irq of the CQ. Called with the device held shared, which is dropped
+ *  while sleeping, so the CQ is looked up again after every wake up.
  */
-struct metrics_sq *find_sq(struct metrics_device_list *pmetrics_device,
-    u16 sq_id)
+int driver_reap_wait(struct metrics_device_list *pmetrics_device,
+    struct nvme_reap_wait *usr_reap_wait, struct file *filp)
 {
-    struct  metrics_sq  *pmetrics_sq_list;
+    int err = SUCCESS;
+    long remaining;     /* jiffies left until the timeout */
+    long sleep;         /* jiffies to sleep this time around */
+    long left;
+    struct metrics_cq *pmetrics_cq_node;   /* ptr to cq node */
+    struct nvme_reap_wait *user_data = NULL;
+    struct reap_waiter waiter;
 
-    list_for_each_entry(pmetrics_sq_list, &pmetrics_device->
-            metrics_sq_list, sq_list_hd) {
-        if (sq_id == pmetrics_sq_list->public_sq.sq_id) {
-            return pmetrics_sq_list;
+
+    /* Allocating memory for user struct in kernel space */
+    user_data = kmalloc(sizeof(struct nvme_reap_wait), GFP_KERNEL);
+    if (user_data == NULL) {
+        LOG_ERR("Unable to alloc kernel memory to copy user data");
+        err = -ENOMEM;
+        goto fail_out;
+    }
+    if (copy_from_user(user_data, usr_reap_wait,
+        sizeof(struct nvme_reap_wait))) {
+
+        LOG_ERR("Unable to copy from user space");
+        err = -EFAULT;
+        goto fail_out;
+    }
+
+    if (user_data->min_elements == 0) {
+        user_data->min_elements = 1;
+    }
+    remaining = msecs_to_jiffies(user_data->timeout_ms);
+    INIT_LIST_HEAD(&waiter.waiter_hd);
+    init_waitqueue_head(&waiter.wait_q);
+
+    for (;;) {
+        /* Find given CQ in list, it may be gone after sleeping */
+        pmetrics_cq_node = find_cq(pmetrics_device, user_data->q_id);
+        if (pmetrics_cq_node == NULL) {
+            LOG_ERR("CQ ID = %d is not in list", user_data->q_id);
+            err = -ENODEV;
+            goto fail_out;
+        } else if ((user_data->q_id != 0) &&
+            !file_may_use(pmetrics_device, pmetrics_cq_node->owner, filp)) {
+
+            LOG_ERR("CQ ID = %d belongs to another file", user_data->q_id);
+            err = -EACCES;
+            goto fail_out;
+        }
+        if ((pmetrics_device->metrics_device->public_dev.irq_active.irq_type
+            == INT_NONE) || (pmetrics_cq_node->public_cq.irq_enabled == 0)) {
+
+            LOG_ERR("CQ ID = %d has no IRQ to wait for", user_data->q_id);
+            err = -EINVAL;
+            goto fail_out;
+        }
+
+        mutex_lock(&pmetrics_cq_node->q_mtx);
+        err = reap_wait_isr(pmetrics_cq_node, pmetrics_device, &waiter,
+            user_data->min_elements, &user_data->num_remaining,
+            &user_data->isr_count);
+        mutex_unlock(&pmetrics_cq_node->q_mtx);
+        if (err <= 0) {
+            break;
+        }
+        if (remaining <= 0) {
+            reap_wait_done(pmetrics_device, &waiter);
+            err = -ETIMEDOUT;
+            break;
         }
+
+        /* Once fired the irq stays masked until its CQ's are reaped, so any
+         * further CE's can only be noticed by checking again shortly */
+        sleep = (waiter.isr_fired) ? 1 : remaining;
+
+        up_read(&pmetrics_device->metrics_sem);
+        left = wait_event_interruptible_timeout(waiter.wait_q, waiter.woken,
+            sleep);
+        down_read(&pmetrics_device->metrics_sem);
+        reap_wait_done(pmetrics_device, &waiter);
+
+        if (left < 0) {
+            LOG_DBG("Reap wait on CQ = %d interrupted", user_data->q_id);
+            err = -EINTR;
+            goto fail_out;
+        }
+        remaining -= (sleep - left);
     }
-    return NULL;
+    if ((err < 0) && (err != -ETIMEDOUT)) {
+        goto fail_out;
+    }
+
+    /* Copy to user the remaining elements in this q */
+    if (copy_to_user(usr_reap_wait, user_data,
+        sizeof(struct nvme_reap_wait))) {
+
+        LOG_ERR("Unable to copy to user space");
+        err = -EFAULT;
+    }
+    /* Fall through is intended */
+
+fail_out:
+    if (user_data != NULL) {
+        kfree(user_data);
+    }
+    return err;
 }
 
 
 /*
- * find cq node in the given device element node and given cq id. If found
- * returns the pointer to the cq node in the cq linked list otherwise returns
- * NULL.
+ * Store node at q_id within a two level Q ID lookup table, allocating the
+ * leaf covering q_id if this is the first Q within its range.
  */
-struct metrics_cq *find_cq(struct metrics_device_list *pmetrics_device,
-    u16 cq_id)
+static int qid_tbl_insert(void **tbl[], u16 q_id, void *node)
 {
-    struct  metrics_cq  *pmetrics_cq_list;
+    u16 root = (q_id >> QID_TBL_SHIFT);
+
+    if (tbl[root] == NULL) {
+        tbl[root] = kmalloc(QID_TBL_LEAF_SZ * sizeof(void *),
+            GFP_KERNEL | __GFP_ZERO);
+        if (tbl[root] == NULL) {
+            LOG_ERR("Unable to alloc Q ID lookup table leaf");
+            return -ENOMEM;
+        }
+    }
+    tbl[root][q_id & (QID_TBL_LEAF_SZ - 1)] = node;
+    return SUCCESS;
+}
+
 
-    list_for_each_entry(pmetrics_cq_list, &pmetrics_device->
-            metrics_cq_list, cq_list_hd) {
-        if (cq_id == pmetrics_cq_list->public_cq.q_id) {
-            return pmetrics_cq_list;
+static inline void *qid_tbl_lookup(void **tbl[], u16 q_id)
+{
+    void **leaf = tbl[q_id >> QID_TBL_SHIFT];
+
+    return (leaf == NULL) ? NULL : leaf[q_id & (QID_TBL_LEAF_SZ - 1)];
+}
+
+
+static void qid_tbl_erase(void **tbl[], u16 q_id)
+{
+    void **leaf = tbl[q_id >> QID_TBL_SHIFT];
+
+    if (leaf != NULL) {
+        leaf[q_id & (QID_TBL_LEAF_SZ - 1)] = NULL;
+    }
+}
+
+
+/*
+ * Free every leaf of a Q ID lookup table. Only to be used once all the Q's
+ * which were stored in the table have been deallocated.
+ */
+static void qid_tbl_free(void **tbl[])
+{
+    u32 i;
+
+    for (i = 0; i < QID_TBL_ROOT_SZ; i++) {
+        if (tbl[i] != NULL) {
+            kfree(tbl[i]);
+            tbl[i] = NULL;
         }
     }
-    return NULL;
 }
 
 
 /*
- * Find the command node for the given sq node and cmd id. If the cmd node
- * is found in the list, returns pointer to the cmd node otherwise returns
- * NULL.
+ * Add the sq node to the lookup table and then to the end of the sq list,
+ * the list is retained for all those which need to iterate every SQ.
+ */
+int add_sq_node(struct metrics_device_list *pmetrics_device,
+    struct metrics_sq *pmetrics_sq_node)
+{
+    int err;
+
+    pmetrics_sq_node->perf = alloc_percpu(struct perf_counters);
+    if (pmetrics_sq_node->perf == NULL) {
+        LOG_ERR("Unable to allocate perf counters");
+        return -ENOMEM;
+    }
+    err = qid_tbl_insert(pmetrics_device->sq_tbl,
+        pmetrics_sq_node->public_sq.sq_id, pmetrics_sq_node);
+    if (err < 0) {
+        free_percpu(pmetrics_sq_node->perf);
+        pmetrics_sq_node->perf = NULL;
+        return err;
+    }
+    list_add_tail(&pmetrics_sq_node->sq_list_hd,
+        &pmetrics_device->metrics_sq_list);
+    return SUCCESS;
+}
+
+
+/*
+ * Add the cq node to the lookup table and then to the end of the cq list,
+ * the list is retained for all those which need to iterate every CQ.
+ */
+int add_cq_node(struct metrics_device_list *pmetrics_device,
+    struct metrics_cq *pmetrics_cq_node)
+{
+    int err;
+
+    pmetrics_cq_node->perf = alloc_percpu(struct perf_counters);
+    if (pmetrics_cq_node->perf == NULL) {
+        LOG_ERR("Unable to allocate perf counters");
+        return -ENOMEM;
+    }
+    err = qid_tbl_insert(pmetrics_device->cq_tbl,
+        pmetrics_cq_node->public_cq.q_id, pmetrics_cq_node);
+    if (err < 0) {
+        free_percpu(pmetrics_cq_node->perf);
+        pmetrics_cq_node->perf = NULL;
+        return err;
+    }
+    list_add_tail(&pmetrics_cq_node->cq_list_hd,
+        &pmetrics_device->metrics_cq_list);
+    return SUCCESS;
+}
+
+
+void unlink_sq_node(struct metrics_device_list *pmetrics_device,
+    struct metrics_sq *pmetrics_sq_node)
+{
+    qid_tbl_erase(pmetrics_device->sq_tbl, pmetrics_sq_node->public_sq.sq_id);
+    list_del(&pmetrics_sq_node->sq_list_hd);
+    free_percpu(pmetrics_sq_node->perf);
+    pmetrics_sq_node->perf = NULL;
+}
+
+
+void unlink_cq_node(struct metrics_device_list *pmetrics_device,
+    struct metrics_cq *pmetrics_cq_node)
+{
+    qid_tbl_erase(pmetrics_device->cq_tbl, pmetrics_cq_node->public_cq.q_id);
+    list_del(&pmetrics_cq_node->cq_list_hd);
+    free_percpu(pmetrics_cq_node->perf);
+    pmetrics_cq_node->perf = NULL;
+}
+
+
+/*
+ * find sq node in the given device element node and given sq id. If found
+ * returns the pointer to the sq node from the sq lookup table. Otherwise
+ * returns NULL.
+ */
+struct metrics_sq *find_sq(struct metrics_device_list *pmetrics_device,
+    u16 sq_id)
+{
+    return (struct metrics_sq *)qid_tbl_lookup(pmetrics_device->sq_tbl,
+        sq_id);
+}
+
+
+/*
+ * find cq node in the given device element node and given cq id. If found
+ * returns the pointer to the cq node from the cq lookup table otherwise
+ * returns NULL.
+ */
+struct metrics_cq *find_cq(struct metrics_device_list *pmetrics_device,
+    u16 cq_id)
+{
+    return (struct metrics_cq *)qid_tbl_lookup(pmetrics_device->cq_tbl,
+        cq_id);
+}
+
+
+/*
+ * Find the command node for the given sq node and cmd id. If the cmd id
+ * is outstanding, returns pointer to its cmd slot otherwise returns NULL.
  */
 struct cmd_track *find_cmd(struct metrics_sq *pmetrics_sq_node, u16 cmd_id)
 {
-    struct cmd_track *pcmd_track_list;
-    list_for_each_entry(pcmd_track_list, &pmetrics_sq_node->private_sq.
-            cmd_track_list, cmd_list_hd) {
-        if (cmd_id == pcmd_track_list->unique_id) {
-            return pcmd_track_list;
-        }
+    if ((cmd_id >= pmetrics_sq_node->private_sq.num_slots) ||
+        !test_bit(cmd_id, pmetrics_sq_node->private_sq.cmd_id_bmap)) {
+        return NULL;
     }
-    return NULL;
+    return &pmetrics_sq_node->private_sq.cmd_slots[cmd_id];
 }
 
 
@@ -970,6 +1519,36 @@ struct metrics_meta *find_meta_node(struct metrics_device_list
 }
 
 
+/*
+ * Finds the registered buffer of the given handle and if found returns
+ * the pointer to it otherwise returns NULL.
+ */
+struct metrics_reg_buf *find_reg_buf(struct metrics_device_list
+        *pmetrics_device_elem, u32 buf_id)
+{
+    if ((buf_id == 0) || (buf_id > MAX_REG_BUFS)) {
+        return NULL;
+    }
+    return pmetrics_device_elem->reg_bufs[buf_id - 1];
+}
+
+
+/*
+ * A Q, meta buffer or registered buffer is only used by the file which
+ * prepared it, and by the controlling file which may use every one of them.
+ * The admin Q's belong to no file, the callers leave them out.
+ */
+u8 file_may_use(struct metrics_device_list *pmetrics_device,
+    struct file *owner, struct file *filp)
+{
+    if (filp == NULL) {
+        return 0;
+    }
+    return ((owner == filp) ||
+        (filp == pmetrics_device->metrics_device->private_dev.ctrl_filp));
+}
+
+
 /*
  * Free the given cmd id node from the command track list.
  */
@@ -983,8 +1562,7 @@ static int remove_cmd_node(struct metrics_sq *pmetrics_sq_node, u16 cmd_id)
         return -EBADSLT; /* Invalid slot */
     }
 
-    list_del(&pcmd_node->cmd_list_hd);
-    kfree(pcmd_node);
+    del_cmd_track_node(pmetrics_sq_node, pcmd_node);
     return SUCCESS;
 }
 
@@ -1085,7 +1663,8 @@ static int process_algo_q(struct metrics_sq *pmetrics_sq_node,
 
 
 static int process_algo_gen(struct metrics_sq *pmetrics_sq_node,
-    u16 cmd_id, struct  metrics_device_list *pmetrics_device)
+    u16 cmd_id, struct  metrics_device_list *pmetrics_device,
+    struct reclaim_prps **ppreclaim)
 {
     int err;
     struct cmd_track *pcmd_node;
@@ -1097,7 +1676,8 @@ static int process_algo_gen(struct metrics_sq *pmetrics_sq_node,
         return -EBADSLT; /* Invalid slot */
     }
 
-    del_prps(pmetrics_device->metrics_device, &pcmd_node->prp_nonpersist);
+    /* Releasing the data pages is left to the reclaim worker */
+    defer_del_prps(pmetrics_device, ppreclaim, &pcmd_node->prp_nonpersist);
     err = remove_cmd_node(pmetrics_sq_node, cmd_id);
     return err;
 }
@@ -1105,7 +1685,8 @@ static int process_algo_gen(struct metrics_sq *pmetrics_sq_node,
 
 static int process_admin_cmd(struct metrics_sq *pmetrics_sq_node,
     struct cmd_track *pcmd_node, u16 status,
-    struct  metrics_device_list *pmetrics_device)
+    struct  metrics_device_list *pmetrics_device,
+    struct reclaim_prps **ppreclaim)
 {
     int err = SUCCESS;
 
@@ -1133,7 +1714,7 @@ static int process_admin_cmd(struct metrics_sq *pmetrics_sq_node,
     default:
         /* General algo */
         err = process_algo_gen(pmetrics_sq_node, pcmd_node->unique_id,
-            pmetrics_device);
+            pmetrics_device, ppreclaim);
         break;
     }
     return err;
@@ -1142,49 +1723,81 @@ static int process_admin_cmd(struct metrics_sq *pmetrics_sq_node,
 
 /*
  * Process various algorithms depending on the Completion entry in a CQ
- * This works for both Admin and IO CQ entries.
+ * This works for both Admin and IO CQ entries. The SQ of the CE is locked
+ * while its cmd is processed, the caller holds the lock of the CQ.
  */
-static int process_reap_algos(struct cq_completion *cq_entry,
-    struct  metrics_device_list *pmetrics_device)
+int process_reap_algos(struct cq_completion *cq_entry,
+    struct metrics_cq *pmetrics_cq_node,
+    struct  metrics_device_list *pmetrics_device,
+    struct reclaim_prps **ppreclaim)
 {
     int err = SUCCESS;
-    u16 ceStatus;
+    u16 ceStatus = (cq_entry->status_field & 0x7ff);
+    u8 opcode = 0;
     struct metrics_sq *pmetrics_sq_node = NULL;
     struct cmd_track *pcmd_node = NULL;
 
 
+    /* Admin cmds only complete to the ACQ, IO CQ's may be reaped shared */
+    if ((cq_entry->sq_identifier == 0) &&
+        (pmetrics_cq_node->public_cq.q_id != 0)) {
+
+        LOG_ERR("CE in IO CQ = %d names the ASQ",
+            pmetrics_cq_node->public_cq.q_id);
+        err = -EBADSLT; /* Invalid slot */
+        goto trace_out;
+    }
+
     /* Find sq node for given sq id in CE */
     pmetrics_sq_node = find_sq(pmetrics_device, cq_entry->sq_identifier);
     if (pmetrics_sq_node == NULL) {
         LOG_ERR("SQ ID = %d does not exist", cq_entry->sq_identifier);
         /* Error must be EBADSLT per design; user may want to reap all entry */
-        return -EBADSLT; /* Invalid slot */
+        err = -EBADSLT; /* Invalid slot */
+        goto trace_out;
     }
+    mutex_lock(&pmetrics_sq_node->q_mtx);
 
     /* Update our understanding of the corresponding hdw SQ head ptr */
     pmetrics_sq_node->public_sq.head_ptr = cq_entry->sq_head_ptr;
-    ceStatus = (cq_entry->status_field & 0x7ff);
     LOG_DBG("(SCT, SC) = 0x%04X", ceStatus);
 
     /* Find command in sq node */
     pcmd_node = find_cmd(pmetrics_sq_node, cq_entry->cmd_identifier);
     if (pcmd_node != NULL) {
+        /* Read before retiring the cmd frees its slot */
+        opcode = pcmd_node->opcode;
+        if (pmetrics_device->lat_enabled) {
+            lat_record_reap(pmetrics_device, pmetrics_cq_node,
+                pmetrics_sq_node, pcmd_node);
+        }
+
         /* A command node exists, now is it an admin cmd or not? */
         if (cq_entry->sq_identifier == 0) {
             LOG_DBG("Admin cmd set processing");
             err = process_admin_cmd(pmetrics_sq_node, pcmd_node, ceStatus,
-                pmetrics_device);
+                pmetrics_device, ppreclaim);
         } else {
             LOG_DBG("NVM or other cmd set processing");
             err = process_algo_gen(pmetrics_sq_node, pcmd_node->unique_id,
-                pmetrics_device);
+                pmetrics_device, ppreclaim);
         }
     }
+    /* A delete IOSQ cmd never removes the ASQ it was sent through */
+    mutex_unlock(&pmetrics_sq_node->q_mtx);
+
+trace_out:
+    trace_dnvme_reap(pmetrics_cq_node->public_cq.q_id,
+        cq_entry->sq_identifier, cq_entry->cmd_identifier, opcode, ceStatus,
+        err);
     return err;
 }
 
 /*
- * Copy the cq data to user buffer for the elements reaped.
+ * Copy the cq data to user buffer for the elements reaped. The CE's are
+ * copied first with one copy_to_user, or two when the batch wraps around the
+ * end of the Q, then only the cmds of the CE's copied completely are retired.
+ * num_should_reap returns the no. of CE's which were not reaped.
  */
 static int copy_cq_data(struct metrics_cq  *pmetrics_cq_node, u8 *cq_head_ptr,
     u32 comp_entry_size, u32 *num_should_reap, u8 *buffer,
@@ -1192,6 +1805,12 @@ static int copy_cq_data(struct metrics_cq  *pmetrics_cq_node, u8 *cq_head_ptr,
 {
     int latentErr = 0;
     u8 *queue_base_addr; /* Base address for Queue */
+    u8 *queue_end_addr;
+    u8 *cq_entry = cq_head_ptr;
+    u32 num_processed = 0;
+    u32 copy_len, first_len, num_copied;
+    unsigned long not_copied;
+    struct reclaim_prps *preclaim = NULL;
 
     if (pmetrics_cq_node->private_cq.contig != 0) {
         queue_base_addr = pmetrics_cq_node->private_cq.vir_kern_addr;
@@ -1200,45 +1819,62 @@ static int copy_cq_data(struct metrics_cq  *pmetrics_cq_node, u8 *cq_head_ptr,
         queue_base_addr =
             pmetrics_cq_node->private_cq.prp_persist.vir_kern_addr;
     }
+    queue_end_addr = queue_base_addr + pmetrics_cq_node->private_cq.size;
+
+    /* Copy the run of CE's, split only where the Q wraps */
+    copy_len = *num_should_reap * comp_entry_size;
+    first_len = min_t(u32, copy_len, (queue_end_addr - cq_head_ptr));
+    not_copied = copy_to_user(buffer, cq_head_ptr, first_len);
+    if ((not_copied == 0) && (copy_len > first_len)) {
+        not_copied = copy_to_user((buffer + first_len), queue_base_addr,
+            (copy_len - first_len));
+    }
+    /* Only CE's copied completely may be reaped */
+    num_copied = (copy_len - not_copied) / comp_entry_size;
 
-    while (*num_should_reap) {
-        LOG_DBG("Reaping CE's, %d left to reap", *num_should_reap);
+    while (num_processed < num_copied) {
+        LOG_DBG("Reaping CE's, %d left to reap",
+            (num_copied - num_processed));
 
         /* Call the process reap algos based on CE entry */
-        latentErr = process_reap_algos((struct cq_completion *)cq_head_ptr,
-            pmetrics_device);
+        latentErr = process_reap_algos((struct cq_completion *)cq_entry,
+            pmetrics_cq_node, pmetrics_device, &preclaim);
+        num_processed++;
         if (latentErr) {
+            /* The CE is still handed out, allows seeing the latent err */
             LOG_ERR("Unable to find CE.SQ_id in dnvme metrics");
+            PERF_ADD(pmetrics_cq_node->perf, latent_errs, 1);
+            PERF_ADD(pmetrics_device->perf, latent_errs, 1);
+            break;
         }
 
-        /* Copy to user even on err; allows seeing latent err */
-        if (copy_to_user(buffer, cq_head_ptr, comp_entry_size)) {
-            LOG_ERR("Unable to copy request data to user space");
-            return -EFAULT;
+        cq_entry += comp_entry_size;        /* Point to next CE entry */
+        if (cq_entry >= queue_end_addr) {
+            /* Q wrapped so point to base again */
+            cq_entry = queue_base_addr;
         }
+    }
 
-        cq_head_ptr += comp_entry_size;     /* Point to next CE entry */
-        buffer += comp_entry_size;          /* Prepare for next element */
-        *num_should_reap -= 1;              /* decrease for the one reaped. */
+    queue_reclaim_prps(pmetrics_device, preclaim);
 
-        if (cq_head_ptr >= (queue_base_addr +
-            pmetrics_cq_node->private_cq.size)) {
+    *num_should_reap -= num_processed;
+    PERF_ADD(pmetrics_cq_node->perf, ces_reaped, num_processed);
+    PERF_ADD(pmetrics_device->perf, ces_reaped, num_processed);
 
-            /* Q wrapped so point to base again */
-            cq_head_ptr = queue_base_addr;
-        }
-
-        if (latentErr) {
-            /* Latent errors were introduced to allow reaping CE's to user
-             * space and also counting them as reaped, because they were
-             * successfully copied. However, there was something about the CE
-             * that indicated an error, possibly malformed CE by hdw, thus the
-             * entire IOCTL should error, but we successfully reaped some CE's
-             * which allows tnvme to inspect and trust the copied CE's for debug
-             */
-            LOG_ERR("Detected a partial reap situation; some, not all reaped");
-            return latentErr;
-        }
+    if (latentErr) {
+        /* Latent errors were introduced to allow reaping CE's to user
+         * space and also counting them as reaped, because they were
+         * successfully copied. However, there was something about the CE
+         * that indicated an error, possibly malformed CE by hdw, thus the
+         * entire IOCTL should error, but we successfully reaped some CE's
+         * which allows tnvme to inspect and trust the copied CE's for debug
+         */
+        LOG_ERR("Detected a partial reap situation; some, not all reaped");
+        return latentErr;
+    }
+    if (not_copied != 0) {
+        LOG_ERR("Unable to copy request data to user space");
+        return -EFAULT;
     }
 
     return SUCCESS;
@@ -1248,11 +1884,18 @@ static int copy_cq_data(struct metrics_cq  *pmetrics_cq_node, u8 *cq_head_ptr,
  * move the cq head pointer to point to location of the elements that is
  * to be reaped.
  */
-static void pos_cq_head_ptr(struct metrics_cq  *pmetrics_cq_node,
+void pos_cq_head_ptr(struct metrics_cq  *pmetrics_cq_node,
     u32 num_reaped)
 {
     u32 temp_head_ptr = pmetrics_cq_node->public_cq.head_ptr;
 
+    /* The reaped CE's are no longer ahead of the head */
+    if (num_reaped < pmetrics_cq_node->private_cq.num_scanned) {
+        pmetrics_cq_node->private_cq.num_scanned -= num_reaped;
+    } else {
+        pmetrics_cq_node->private_cq.num_scanned = 0;
+    }
+
     temp_head_ptr += num_reaped;
     if (temp_head_ptr >= pmetrics_cq_node->public_cq.elements) {
         pmetrics_cq_node->public_cq.pbit_new_entry =
@@ -1272,7 +1915,7 @@ static void pos_cq_head_ptr(struct metrics_cq  *pmetrics_cq_node,
  * head_ptr is updated. The pbit_new_entry is inverted when Q wraps.
  */
 int driver_reap_cq(struct  metrics_device_list *pmetrics_device,
-    struct nvme_reap *usr_reap_data)
+    struct nvme_reap *usr_reap_data, struct file *filp)
 {
     int err;
     u32 num_will_fit;
@@ -1297,41 +1940,60 @@ int driver_reap_cq(struct  metrics_device_list *pmetrics_device,
         goto fail_out;
     }
 
+    /* Reaping the ACQ creates and deletes Q's, needs exclusive access */
+    if ((user_data->q_id == 0) &&
+        (pmetrics_device->metrics_sem_owner != current)) {
+
+        LOG_ERR("Reaping ACQ requires exclusive access to the device");
+        err = -EAGAIN;
+        goto fail_out;
+    } else if (user_data->poll_us > MAX_REAP_POLL_US) {
+        LOG_ERR("Poll time %d us exceeds %d us", user_data->poll_us,
+            MAX_REAP_POLL_US);
+        err = -EINVAL;
+        goto fail_out;
+    }
+
     /* Find CQ with given id from user */
     pmetrics_cq_node = find_cq(pmetrics_device, user_data->q_id);
     if (pmetrics_cq_node == NULL) {
         LOG_ERR("CQ ID = %d not found", user_data->q_id);
         err = -EBADSLT;
         goto fail_out;
+    } else if ((user_data->q_id != 0) &&
+        !file_may_use(pmetrics_device, pmetrics_cq_node->owner, filp)) {
+
+        LOG_ERR("CQ ID = %d belongs to another file", user_data->q_id);
+        err = -EACCES;
+        goto fail_out;
     }
+    mutex_lock(&pmetrics_cq_node->q_mtx);
 
     /* Initializing ISR count for all the possible cases */
     user_data->isr_count = 0;
 
     /* Call the reap inquiry on this CQ, see how many unreaped elements exist */
     /* Check if the IRQ is enabled and process accordingly */
-    if (pmetrics_device->metrics_device->public_dev.irq_active.irq_type
-        == INT_NONE) {
+    if ((pmetrics_device->metrics_device->public_dev.irq_active.irq_type
+        == INT_NONE) || (pmetrics_cq_node->public_cq.irq_enabled == 0)) {
+
+        /* Without an irq to wait for the CE may be polled for */
+        if (user_data->poll_us != 0) {
+            reap_poll(pmetrics_cq_node, &pmetrics_device->metrics_device->
+                private_dev.pdev->dev, user_data->poll_us,
+                user_data->poll_hybrid);
+        }
 
         /* Process reap inquiry for non-isr case */
         num_could_reap = reap_inquiry(pmetrics_cq_node, &pmetrics_device->
             metrics_device->private_dev.pdev->dev);
-    } else {
-        if (pmetrics_cq_node->public_cq.irq_enabled == 0) {
-            /* Process reap inquiry for non-isr case */
-            num_could_reap = reap_inquiry(pmetrics_cq_node, &pmetrics_device->
-                metrics_device->private_dev.pdev->dev);
-
-        } else { /* ISR Reap additions for IRQ support as irq_enabled is set */
-            /* Lock the IRQ mutex to guarantee coherence with bottom half. */
-            mutex_lock(&pmetrics_device->irq_process.irq_track_mtx);
-            /* Process ISR based reap inquiry as isr is enabled */
-            err = reap_inquiry_isr(pmetrics_cq_node, pmetrics_device,
-                &num_could_reap, &user_data->isr_count);
-            if (err < 0) {
-                LOG_ERR("ISR Reap Inquiry failed...");
-                goto mtx_unlk;
-            }
+    } else { /* ISR Reap additions for IRQ support as irq_enabled is set */
+        /* Process ISR based reap inquiry as isr is enabled */
+        err = reap_inquiry_isr(pmetrics_cq_node, pmetrics_device,
+            &num_could_reap, &user_data->isr_count);
+        if (err < 0) {
+            LOG_ERR("ISR Reap Inquiry failed...");
+            goto cq_unlk;
         }
     }
 
@@ -1339,7 +2001,7 @@ int driver_reap_cq(struct  metrics_device_list *pmetrics_device,
     if (num_could_reap >= pmetrics_cq_node->public_cq.elements) {
         LOG_ERR("HW violating full Q definition");
         err = -EINVAL;
-        goto mtx_unlk;
+        goto cq_unlk;
     }
 
     /* If this CQ is an IOCQ, not ACQ, then lookup the CE size */
@@ -1418,12 +2080,14 @@ int driver_reap_cq(struct  metrics_device_list *pmetrics_device,
     user_data->num_remaining += num_should_reap;
     LOG_DBG("num CE's reaped = %d, num CE's remaining = %d",
         user_data->num_reaped, user_data->num_remaining);
+    trace_dnvme_reap_cq(user_data->q_id, num_could_reap,
+        user_data->num_reaped, user_data->num_remaining, err);
 
     /* Updating the user structure */
     if (copy_to_user(usr_reap_data, user_data, sizeof(struct nvme_reap))) {
         LOG_ERR("Unable to copy request data to user space");
         err = (err == SUCCESS) ? -EFAULT : err;
-        goto mtx_unlk;
+        goto cq_unlk;
     }
 
     /* Update system with number actually reaped */
@@ -1438,8 +2102,7 @@ int driver_reap_cq(struct  metrics_device_list *pmetrics_device,
         INT_NONE)) {
 
         /* reset isr fired flag for the particular irq_no */
-        if (reset_isr_flag(pmetrics_device,
-            pmetrics_cq_node->public_cq.irq_no) < 0) {
+        if (reset_isr_flag(pmetrics_device, pmetrics_cq_node) < 0) {
 
             err = (err == SUCCESS) ? -EINVAL : err;
         }
@@ -1450,13 +2113,8 @@ int driver_reap_cq(struct  metrics_device_list *pmetrics_device,
         &pmetrics_device->irq_process);
     /* Fall through is intended */
 
-mtx_unlk:
-    if ((pmetrics_cq_node->public_cq.irq_enabled == 1) &&
-        (pmetrics_device->metrics_device->public_dev.irq_active.irq_type !=
-        INT_NONE)) {
-
-        mutex_unlock(&pmetrics_device->irq_process.irq_track_mtx);
-    }
+cq_unlk:
+    mutex_unlock(&pmetrics_cq_node->q_mtx);
 fail_out:
     if (user_data != NULL) {
         kfree(user_data);
@@ -43,6 +43,12 @@
  */
 #define MAX_AQ_ENTRIES   4096
 
+/* Number of distinct SQ ID's, i.e. bits needed to flag every SQ once */
+#define MAX_SQ_IDS       0x10000
+
+/* SQ entries up to this size are staged on the stack when sent */
+#define SQ_ENTRY_STACK_SIZE 64
+
 /*
  * Enumerating the different NVME Controller Capabilities of the
  * PCI Express device as per NVME Spec 1.0b.
@@ -126,6 +132,33 @@ int nvme_ctrl_disable(struct  metrics_device_list *pmetrics_device);
  */
 void device_cleanup(struct  metrics_device_list *pmetrics_device,
     enum nvme_state new_state);
+
+/**
+ * mmap_q - Tie the contiguous memory of a Q to the VMA it was just remapped
+ * into, it stays allocated until both the Q is freed and the VMA unmapped.
+ * Called with the device locked.
+ * @param dev
+ * @param pmapped mapped member of the Q, set by the 1st mapping
+ * @param vir_kern_addr
+ * @param dma_addr
+ * @param size
+ * @param vma
+ * @return 0 on success, else error code
+ */
+int mmap_q(struct device *dev, struct mapped_q **pmapped,
+    void *vir_kern_addr, dma_addr_t dma_addr, u32 size,
+    struct vm_area_struct *vma);
+
+/**
+ * file_cleanup - Will clean up what a file of a shared device which is being
+ * closed owns. Its IO Q's, meta buffers and registered buffers are freed,
+ * except for those the controller may still DMA to, which are handed to the
+ * controlling file.
+ * @param pmetrics_device
+ * @param filp
+ */
+void file_cleanup(struct  metrics_device_list *pmetrics_device,
+    struct file *filp);
 /**
  * identify_unique - verify if the q_id specified is unique. If not unique then
  * return fail.
@@ -167,6 +200,44 @@ int nvme_prepare_cq(struct  metrics_cq  *pmetrics_cq_list,
 int nvme_ring_sqx_dbl(u16 ring_sqx, struct  metrics_device_list
         *pmetrics_device);
 
+/**
+ * Adds the sq node to the sq list and the sq lookup table of the device,
+ * allocating its perf counters.
+ * @param pmetrics_device
+ * @param pmetrics_sq_node
+ * @return SUCCESS or FAIL
+ */
+int add_sq_node(struct metrics_device_list *pmetrics_device,
+        struct metrics_sq *pmetrics_sq_node);
+
+/**
+ * Adds the cq node to the cq list and the cq lookup table of the device,
+ * allocating its perf counters.
+ * @param pmetrics_device
+ * @param pmetrics_cq_node
+ * @return SUCCESS or FAIL
+ */
+int add_cq_node(struct metrics_device_list *pmetrics_device,
+        struct metrics_cq *pmetrics_cq_node);
+
+/**
+ * Unlinks the sq node from the sq list and the sq lookup table of the
+ * device and frees its perf counters. The node itself is not freed.
+ * @param pmetrics_device
+ * @param pmetrics_sq_node
+ */
+void unlink_sq_node(struct metrics_device_list *pmetrics_device,
+        struct metrics_sq *pmetrics_sq_node);
+
+/**
+ * Unlinks the cq node from the cq list and the cq lookup table of the
+ * device and frees its perf counters. The node itself is not freed.
+ * @param pmetrics_device
+ * @param pmetrics_cq_node
+ */
+void unlink_cq_node(struct metrics_device_list *pmetrics_device,
+        struct metrics_cq *pmetrics_cq_node);
+
 /**
  * finds the sq node in the given sq list for the given sq id
  * @param pmetrics_device
@@ -202,6 +273,25 @@ struct cmd_track *find_cmd(struct metrics_sq *pmetrics_sq_node, u16 cmd_id);
 struct metrics_meta *find_meta_node(struct metrics_device_list
         *pmetrics_device, u32 meta_id);
 
+/**
+ * Find the registered data buffer for the given handle and device.
+ * @param pmetrics_device
+ * @param buf_id
+ * @return pointer to metrics_reg_buf node.
+ */
+struct metrics_reg_buf *find_reg_buf(struct metrics_device_list
+        *pmetrics_device, u32 buf_id);
+
+/**
+ * Check whether the given file may use what the given owner prepared.
+ * @param pmetrics_device
+ * @param owner file which prepared the Q or buffer, or NULL
+ * @param filp file using it, NULL if no file is behind the use
+ * @return 1 if allowed, else 0
+ */
+u8 file_may_use(struct metrics_device_list *pmetrics_device,
+    struct file *owner, struct file *filp);
+
 /**
  * This function gives the device metrics when the user requests. This
  * routine works with Add Q's including Admin and IO.
@@ -223,4 +313,28 @@ int get_public_qmetrics(struct  metrics_device_list *pmetrics_device,
   */
 u32 reap_inquiry(struct metrics_cq  *pmetrics_cq_node, struct device *dev);
 
+/**
+ * process_reap_algos - Retire the cmd a CE completes from its SQ, and do
+ * what the cmd requires once completed, i.e. free the Q's it deleted.
+ * The caller holds the lock of the CQ.
+ * @param cq_entry
+ * @param pmetrics_cq_node
+ * @param pmetrics_device
+ * @param ppreclaim reclaim node of the reap, see defer_del_prps
+ * @return 0 on success, -EBADSLT when the CE does not name a known SQ
+ */
+int process_reap_algos(struct cq_completion *cq_entry,
+    struct metrics_cq *pmetrics_cq_node,
+    struct  metrics_device_list *pmetrics_device,
+    struct reclaim_prps **ppreclaim);
+
+/**
+ * pos_cq_head_ptr - Advance the CQ head ptr past the CE's reaped, inverting
+ * the expected phase bit when the CQ wraps.
+ * @param pmetrics_cq_node
+ * @param num_reaped
+ */
+void pos_cq_head_ptr(struct metrics_cq  *pmetrics_cq_node,
+    u32 num_reaped);
+
 #endif
@@ -0,0 +1,619 @@
+/*
+ * NVM Express Compliance Suite
+ * Copyright (c) 2011, Intel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/pci.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/sched.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+
+#include "definitions.h"
+#include "sysdnvme.h"
+#include "sysfuncproto.h"
+#include "dnvme_queue.h"
+#include "dnvme_cmds.h"
+#include "dnvme_irq.h"
+#include "dnvme_ring.h"
+#include "dnvme_trace.h"
+
+/* Both ring headers get a cache line of their own */
+#define RING_HDR_SIZE       64
+#define RING_SQ_HDR_OFF     0
+#define RING_CQ_HDR_OFF     RING_HDR_SIZE
+#define RING_SQ_RING_OFF    (2 * RING_HDR_SIZE)
+
+/* Static function declarations used for draining the rings. */
+static u32 ring_cq_space(struct metrics_rings *rings);
+static void ring_cmd_info(struct metrics_device_list *pmetrics_device,
+    struct cq_completion *cq_entry, struct nvme_ring_cqe *ring_cqe);
+static int ring_reap(struct metrics_rings *rings,
+    struct metrics_cq *pmetrics_cq, u32 *num_reaped);
+static void ring_submit(struct metrics_rings *rings, u32 *num_submitted);
+static int ring_drain(struct metrics_rings *rings, u32 *num_submitted,
+    u32 *num_reaped);
+static int ring_kthread(void *data);
+static void release_rings(struct kref *ref);
+static void rings_vm_open(struct vm_area_struct *vma);
+static void rings_vm_close(struct vm_area_struct *vma);
+
+static const struct vm_operations_struct rings_vm_ops = {
+    .open  = rings_vm_open,
+    .close = rings_vm_close,
+};
+
+
+/*
+ * Number of free entries in the completion ring, the head is re-read from
+ * the shared header as user space advances it behind our back.
+ */
+static u32 ring_cq_space(struct metrics_rings *rings)
+{
+    return rings->cq_entries -
+        (rings->cq_tail - ACCESS_ONCE(rings->cq_hdr->head));
+}
+
+
+/*
+ * Fill in the user tag and submission time of the cmd completed by the CE,
+ * as long as the cmd is still tracked; it is retired once the CE is
+ * processed. Called with the CQ locked, the SQ of the CE is locked here.
+ */
+static void ring_cmd_info(struct metrics_device_list *pmetrics_device,
+    struct cq_completion *cq_entry, struct nvme_ring_cqe *ring_cqe)
+{
+    struct metrics_sq *pmetrics_sq;
+    struct cmd_track *pcmd_node;
+
+    /* Only IO SQ's feed rings, the ASQ is never touched when shared */
+    if (cq_entry->sq_identifier == 0) {
+        return;
+    }
+    pmetrics_sq = find_sq(pmetrics_device, cq_entry->sq_identifier);
+    if (pmetrics_sq == NULL) {
+        return;
+    }
+    mutex_lock(&pmetrics_sq->q_mtx);
+    pcmd_node = find_cmd(pmetrics_sq, cq_entry->cmd_identifier);
+    if (pcmd_node != NULL) {
+        ring_cqe->user_tag = pcmd_node->user_tag;
+        ring_cqe->submit_ns = ktime_to_ns(pcmd_node->submit_time);
+    }
+    mutex_unlock(&pmetrics_sq->q_mtx);
+}
+
+
+/*
+ * Move the CE's waiting in the CQ into the completion ring, as many as fit,
+ * and ring the CQ's head doorbell. The new tail is published by the caller.
+ * Called with the CQ locked.
+ */
+static int ring_reap(struct metrics_rings *rings,
+    struct metrics_cq *pmetrics_cq, u32 *num_reaped)
+{
+    int err = SUCCESS;
+    u32 num_could_reap;
+    u32 isr_count;
+    u32 comp_entry_size;
+    u8 irq_path;
+    u8 *queue_base_addr;
+    struct cq_completion *cq_entry;
+    struct nvme_ring_cqe *ring_cqe;
+    struct reclaim_prps *preclaim = NULL;
+    struct metrics_device_list *pmetrics_device = rings->pmetrics_device;
+
+
+    irq_path = ((pmetrics_device->metrics_device->public_dev.irq_active.
+        irq_type != INT_NONE) && (pmetrics_cq->public_cq.irq_enabled != 0));
+    if (irq_path) {
+        err = reap_inquiry_isr(pmetrics_cq, pmetrics_device,
+            &num_could_reap, &isr_count);
+        if (err < 0) {
+            LOG_ERR("ISR Reap Inquiry failed...");
+            return err;
+        }
+    } else {
+        num_could_reap = reap_inquiry(pmetrics_cq,
+            &pmetrics_device->metrics_device->private_dev.pdev->dev);
+    }
+    if (num_could_reap == 0) {
+        return SUCCESS;
+    } else if (num_could_reap >= pmetrics_cq->public_cq.elements) {
+        LOG_ERR("HW violating full Q definition");
+        return -EINVAL;
+    }
+
+    comp_entry_size =
+        (pmetrics_cq->private_cq.size / pmetrics_cq->public_cq.elements);
+    if (pmetrics_cq->private_cq.contig != 0) {
+        queue_base_addr = pmetrics_cq->private_cq.vir_kern_addr;
+    } else {
+        queue_base_addr = pmetrics_cq->private_cq.prp_persist.vir_kern_addr;
+    }
+
+    while ((*num_reaped < num_could_reap) && (ring_cq_space(rings) != 0)) {
+        cq_entry = (struct cq_completion *)(queue_base_addr +
+            (comp_entry_size * (u32)pmetrics_cq->public_cq.head_ptr));
+        ring_cqe = &rings->cqes[rings->cq_tail & (rings->cq_entries - 1)];
+
+        memset(ring_cqe, 0, sizeof(struct nvme_ring_cqe));
+        memcpy(ring_cqe->cqe, cq_entry, sizeof(ring_cqe->cqe));
+        ring_cmd_info(pmetrics_device, cq_entry, ring_cqe);
+        ring_cqe->err = process_reap_algos(cq_entry, pmetrics_cq,
+            pmetrics_device, &preclaim);
+        if (ring_cqe->err != 0) {
+            PERF_ADD(pmetrics_cq->perf, latent_errs, 1);
+            PERF_ADD(pmetrics_device->perf, latent_errs, 1);
+        }
+        ring_cqe->complete_ns = ktime_to_ns(ktime_get());
+
+        rings->cq_tail++;
+        pos_cq_head_ptr(pmetrics_cq, 1);
+        (*num_reaped)++;
+    }
+    queue_reclaim_prps(pmetrics_device, preclaim);
+    trace_dnvme_reap_cq(pmetrics_cq->public_cq.q_id, num_could_reap,
+        *num_reaped, (num_could_reap - *num_reaped), SUCCESS);
+    if (*num_reaped == 0) {
+        return SUCCESS;
+    }
+    PERF_ADD(pmetrics_cq->perf, ces_reaped, *num_reaped);
+    PERF_ADD(pmetrics_device->perf, ces_reaped, *num_reaped);
+    writel(pmetrics_cq->public_cq.head_ptr, pmetrics_cq->private_cq.dbs);
+
+    if (irq_path) {
+        /* if 0 CE in a given cq, then reset the isr flag. */
+        if (*num_reaped == num_could_reap) {
+            err = reset_isr_flag(pmetrics_device, pmetrics_cq);
+        }
+        /* Unmask the irq for which it was masked in Top Half */
+        unmask_interrupts(pmetrics_cq->public_cq.irq_no,
+            &pmetrics_device->irq_process);
+    }
+    return (err < 0) ? err : SUCCESS;
+}
+
+
+/*
+ * Move the pending SQE's into the SQ, until either ring is empty or full.
+ * A SQE which is rejected is answered right away with an error CQE, so it
+ * is only consumed while the completion ring has room. The doorbell is left
+ * to the caller. Called with the CQ locked, the SQ is locked here.
+ */
+static void ring_submit(struct metrics_rings *rings, u32 *num_submitted)
+{
+    int err;
+    u32 sq_tail;
+    u32 cmd_buf_size;
+    u8 *queue_base_addr;
+    u8 *cmd_slot;
+    struct nvme_ring_sqe sqe;
+    struct nvme_64b_send send;
+    struct nvme_ring_cqe *ring_cqe;
+    struct cmd_track *pcmd_node;
+    struct metrics_sq *pmetrics_sq = rings->pmetrics_sq;
+
+
+    mutex_lock(&pmetrics_sq->q_mtx);
+
+    cmd_buf_size =
+        (pmetrics_sq->private_sq.size / pmetrics_sq->public_sq.elements);
+    if (pmetrics_sq->private_sq.contig != 0) {
+        queue_base_addr = pmetrics_sq->private_sq.vir_kern_addr;
+    } else {
+        queue_base_addr = pmetrics_sq->private_sq.prp_persist.vir_kern_addr;
+    }
+
+    /* Read the SQE's only after having seen the tail which published them */
+    sq_tail = ACCESS_ONCE(rings->sq_hdr->tail);
+    smp_rmb();
+
+    while ((rings->sq_head != sq_tail) && (ring_cq_space(rings) != 0)) {
+        /* Check for SQ is full */
+        if ((((u32)pmetrics_sq->public_sq.tail_ptr_virt + 1UL) %
+            pmetrics_sq->public_sq.elements) ==
+            (u32)pmetrics_sq->public_sq.head_ptr) {
+            break;
+        }
+
+        /* User space may scribble on the ring, work on a private copy */
+        memcpy(&sqe, &rings->sqes[rings->sq_head & (rings->sq_entries - 1)],
+            sizeof(struct nvme_ring_sqe));
+        rings->sq_head++;
+
+        memset(&send, 0, sizeof(struct nvme_64b_send));
+        send.bit_mask = (enum send_64b_bitmask)sqe.bit_mask;
+        send.data_dir = sqe.data_dir;
+        send.meta_buf_id = sqe.meta_buf_id;
+        send.data_buf_size = sqe.data_buf_size;
+        send.q_id = pmetrics_sq->public_sq.sq_id;
+        send.reg_buf_id = sqe.reg_buf_id;
+        send.reg_buf_offset = sqe.reg_buf_offset;
+
+        cmd_slot = queue_base_addr +
+            ((u32)pmetrics_sq->public_sq.tail_ptr_virt * cmd_buf_size);
+        memcpy(cmd_slot, sqe.cmd, cmd_buf_size);
+        err = track_64b_cmd(rings->pmetrics_device, pmetrics_sq, &send, NULL,
+            cmd_slot, pmetrics_sq->owner);
+        if (err < 0) {
+            ring_cqe = &rings->cqes[rings->cq_tail & (rings->cq_entries - 1)];
+            memset(ring_cqe, 0, sizeof(struct nvme_ring_cqe));
+            ring_cqe->user_tag = sqe.user_tag;
+            ring_cqe->submit_ns = ktime_to_ns(ktime_get());
+            ring_cqe->complete_ns = ring_cqe->submit_ns;
+            ring_cqe->err = err;
+            rings->cq_tail++;
+            continue;
+        }
+
+        pcmd_node = find_cmd(pmetrics_sq, send.unique_id);
+        if (pcmd_node != NULL) {
+            pcmd_node->user_tag = sqe.user_tag;
+            pcmd_node->submit_time = ktime_get();
+        }
+        pmetrics_sq->public_sq.tail_ptr_virt =
+            (u16)(((u32)pmetrics_sq->public_sq.tail_ptr_virt + 1UL) %
+            pmetrics_sq->public_sq.elements);
+        (*num_submitted)++;
+    }
+
+    if ((*num_submitted != 0) && (pmetrics_sq->private_sq.contig == 0)) {
+        dma_sync_sg_for_device(rings->pmetrics_device->metrics_device->
+            private_dev.dmadev, pmetrics_sq->private_sq.prp_persist.sg,
+            pmetrics_sq->private_sq.prp_persist.num_map_pgs,
+            pmetrics_sq->private_sq.prp_persist.data_dir);
+    }
+
+    /* Done reading the consumed SQE's before handing their slots back */
+    smp_mb();
+    rings->sq_hdr->head = rings->sq_head;
+    mutex_unlock(&pmetrics_sq->q_mtx);
+}
+
+
+/*
+ * Reap into the completion ring first, which frees up SQ slots, then
+ * submit from the submission ring. The CQ stays locked throughout since
+ * both steps produce into the completion ring. The device is held shared.
+ */
+static int ring_drain(struct metrics_rings *rings, u32 *num_submitted,
+    u32 *num_reaped)
+{
+    int err = SUCCESS;
+    u32 cq_tail;
+    struct metrics_cq *pmetrics_cq;
+
+
+    *num_submitted = 0;
+    *num_reaped = 0;
+    pmetrics_cq = find_cq(rings->pmetrics_device,
+        rings->pmetrics_sq->public_sq.cq_id);
+    if (pmetrics_cq == NULL) {
+        LOG_ERR("CQ ID = %d of SQ ID = %d does not exist",
+            rings->pmetrics_sq->public_sq.cq_id,
+            rings->pmetrics_sq->public_sq.sq_id);
+        return -EBADSLT;
+    }
+    mutex_lock(&pmetrics_cq->q_mtx);
+
+    cq_tail = rings->cq_tail;
+    err = ring_reap(rings, pmetrics_cq, num_reaped);
+    ring_submit(rings, num_submitted);
+
+    /* Publish the CQE's only once they are completely written */
+    if (rings->cq_tail != cq_tail) {
+        smp_wmb();
+        rings->cq_hdr->tail = rings->cq_tail;
+    }
+    mutex_unlock(&pmetrics_cq->q_mtx);
+
+    if (*num_submitted != 0) {
+        nvme_ring_sqx_dbl(rings->pmetrics_sq->public_sq.sq_id,
+            rings->pmetrics_device);
+    }
+    return err;
+}
+
+
+/*
+ * Kernel thread polling the rings of a SQ. The device is only tried for,
+ * as the thread is stopped by whoever holds it exclusively.
+ */
+static int ring_kthread(void *data)
+{
+    struct metrics_rings *rings = (struct metrics_rings *)data;
+    struct metrics_device_list *pmetrics_device = rings->pmetrics_device;
+    u32 num_submitted;
+    u32 num_reaped;
+
+    while (!kthread_should_stop()) {
+        num_submitted = 0;
+        num_reaped = 0;
+        if (down_read_trylock(&pmetrics_device->metrics_sem)) {
+            ring_drain(rings, &num_submitted, &num_reaped);
+            up_read(&pmetrics_device->metrics_sem);
+        }
+
+        if ((num_submitted == 0) && (num_reaped == 0)) {
+            schedule_timeout_interruptible(1);
+        } else {
+            cond_resched();
+        }
+    }
+    return SUCCESS;
+}
+
+
+static void release_rings(struct kref *ref)
+{
+    struct metrics_rings *rings =
+        container_of(ref, struct metrics_rings, ref);
+
+    free_pages((unsigned long)rings->vir_kern_addr, rings->order);
+    kfree(rings);
+}
+
+
+static void rings_vm_open(struct vm_area_struct *vma)
+{
+    struct metrics_rings *rings = vma->vm_private_data;
+
+    kref_get(&rings->ref);
+}
+
+
+/*
+ * Runs from munmap or exit without the device locked, the rings are only
+ * freed here once the SQ let go of them.
+ */
+static void rings_vm_close(struct vm_area_struct *vma)
+{
+    struct metrics_rings *rings = vma->vm_private_data;
+
+    kref_put(&rings->ref, release_rings);
+}
+
+
+void mmap_rings(struct metrics_rings *rings, struct vm_area_struct *vma)
+{
+    vma->vm_ops = &rings_vm_ops;
+    vma->vm_private_data = rings;
+    /* open isn't called for the VMA created by mmap itself */
+    rings_vm_open(vma);
+}
+
+
+u8 cq_feeds_rings(struct metrics_device_list *pmetrics_device, u16 cq_id)
+{
+    struct metrics_sq *pmetrics_sq;
+
+    list_for_each_entry(pmetrics_sq, &pmetrics_device->metrics_sq_list,
+        sq_list_hd) {
+
+        if ((pmetrics_sq->rings != NULL) &&
+            (pmetrics_sq->public_sq.cq_id == cq_id)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+void free_rings(struct metrics_sq *pmetrics_sq)
+{
+    struct metrics_rings *rings = pmetrics_sq->rings;
+
+    if (rings == NULL) {
+        return;
+    }
+    if (rings->kthread != NULL) {
+        kthread_stop(rings->kthread);
+        rings->kthread = NULL;
+    }
+    /* Still mapped rings are detached and outlive the SQ */
+    rings->pmetrics_sq = NULL;
+    rings->pmetrics_device = NULL;
+    pmetrics_sq->rings = NULL;
+    kref_put(&rings->ref, release_rings);
+}
+
+
+int driver_setup_rings(struct metrics_device_list *pmetrics_device,
+    struct nvme_rings_setup *rings_request, struct file *filp)
+{
+    int err = -EINVAL;
+    u32 cq_ring_off;
+    struct nvme_rings_setup user_data;
+    struct metrics_sq *pmetrics_sq;
+    struct metrics_sq *pother_sq;
+    struct metrics_cq *pmetrics_cq;
+    struct metrics_rings *rings = NULL;
+
+
+    if (copy_from_user(&user_data, rings_request,
+        sizeof(struct nvme_rings_setup))) {
+
+        LOG_ERR("Unable to copy from user space");
+        return -EFAULT;
+    }
+
+    /* Cmds to the ASQ create and delete Q's, they stay on the ioctl path */
+    if (user_data.sq_id == 0) {
+        LOG_ERR("Rings are only supported for IO SQ's");
+        return -EINVAL;
+    }
+    pmetrics_sq = find_sq(pmetrics_device, user_data.sq_id);
+    if (pmetrics_sq == NULL) {
+        LOG_ERR("SQ ID = %d does not exist", user_data.sq_id);
+        return -EBADSLT;
+    } else if (!file_may_use(pmetrics_device, pmetrics_sq->owner, filp)) {
+        LOG_ERR("SQ ID = %d belongs to another file", user_data.sq_id);
+        return -EACCES;
+    }
+    pmetrics_cq = find_cq(pmetrics_device, pmetrics_sq->public_sq.cq_id);
+
+    if (user_data.sq_entries == 0) {
+        LOG_DBG("Tearing down rings of SQ ID = %d", user_data.sq_id);
+        free_rings(pmetrics_sq);
+        return SUCCESS;
+    } else if (pmetrics_sq->rings != NULL) {
+        LOG_ERR("Rings of SQ ID = %d already set up", user_data.sq_id);
+        return -EBUSY;
+    } else if (!is_power_of_2(user_data.sq_entries) ||
+        !is_power_of_2(user_data.cq_entries) ||
+        (user_data.sq_entries > MAX_RING_ENTRIES) ||
+        (user_data.cq_entries > MAX_RING_ENTRIES)) {
+
+        LOG_ERR("Ring entries must be a power of 2 up to %d",
+            MAX_RING_ENTRIES);
+        return -EINVAL;
+    } else if ((pmetrics_sq->private_sq.size /
+        pmetrics_sq->public_sq.elements) != 64) {
+
+        LOG_ERR("Rings require the cmds of SQ ID = %d to be 64B",
+            user_data.sq_id);
+        return -EINVAL;
+    } else if ((pmetrics_sq->public_sq.cq_id == 0) ||
+        (pmetrics_cq == NULL)) {
+
+        LOG_ERR("SQ ID = %d is not associated with an IO CQ",
+            user_data.sq_id);
+        return -EINVAL;
+    } else if (!file_may_use(pmetrics_device, pmetrics_cq->owner, filp)) {
+        LOG_ERR("CQ ID = %d belongs to another file",
+            pmetrics_sq->public_sq.cq_id);
+        return -EACCES;
+    }
+
+    /* The rings drain every CE of the CQ, none may belong to another SQ */
+    list_for_each_entry(pother_sq, &pmetrics_device->metrics_sq_list,
+        sq_list_hd) {
+
+        if ((pother_sq != pmetrics_sq) &&
+            (pother_sq->public_sq.cq_id == pmetrics_sq->public_sq.cq_id)) {
+
+            LOG_ERR("CQ ID = %d is shared with SQ ID = %d",
+                pmetrics_sq->public_sq.cq_id, pother_sq->public_sq.sq_id);
+            return -EBUSY;
+        }
+    }
+
+    rings = kzalloc(sizeof(struct metrics_rings), GFP_KERNEL);
+    if (rings == NULL) {
+        LOG_ERR("Unable to alloc kernel memory for rings");
+        return -ENOMEM;
+    }
+    cq_ring_off = ALIGN(RING_SQ_RING_OFF +
+        (user_data.sq_entries * sizeof(struct nvme_ring_sqe)), RING_HDR_SIZE);
+    rings->size = cq_ring_off +
+        (user_data.cq_entries * sizeof(struct nvme_ring_cqe));
+    rings->order = get_order(rings->size);
+    rings->vir_kern_addr = (void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO,
+        rings->order);
+    if (rings->vir_kern_addr == NULL) {
+        LOG_ERR("Unable to alloc %d bytes for rings", rings->size);
+        err = -ENOMEM;
+        goto fail_out;
+    }
+
+    rings->sq_hdr = rings->vir_kern_addr + RING_SQ_HDR_OFF;
+    rings->sqes = rings->vir_kern_addr + RING_SQ_RING_OFF;
+    rings->sq_entries = user_data.sq_entries;
+    rings->sq_hdr->entries = user_data.sq_entries;
+    rings->cq_hdr = rings->vir_kern_addr + RING_CQ_HDR_OFF;
+    rings->cqes = rings->vir_kern_addr + cq_ring_off;
+    rings->cq_entries = user_data.cq_entries;
+    rings->cq_hdr->entries = user_data.cq_entries;
+    rings->pmetrics_sq = pmetrics_sq;
+    rings->pmetrics_device = pmetrics_device;
+    kref_init(&rings->ref);
+
+    user_data.mmap_size = PAGE_SIZE << rings->order;
+    user_data.sq_hdr_off = RING_SQ_HDR_OFF;
+    user_data.sq_ring_off = RING_SQ_RING_OFF;
+    user_data.cq_hdr_off = RING_CQ_HDR_OFF;
+    user_data.cq_ring_off = cq_ring_off;
+    if (copy_to_user(rings_request, &user_data,
+        sizeof(struct nvme_rings_setup))) {
+
+        LOG_ERR("Unable to copy to user space");
+        err = -EFAULT;
+        goto fail_out;
+    }
+
+    if (user_data.use_kthread) {
+        rings->kthread = kthread_run(ring_kthread, rings, "dnvme%d_sq%d",
+            pmetrics_device->metrics_device->private_dev.minor_no,
+            user_data.sq_id);
+        if (IS_ERR(rings->kthread)) {
+            LOG_ERR("Unable to start the thread draining the rings");
+            err = PTR_ERR(rings->kthread);
+            goto fail_out;
+        }
+    }
+    pmetrics_sq->rings = rings;
+    return SUCCESS;
+
+fail_out:
+    if (rings->vir_kern_addr != NULL) {
+        free_pages((unsigned long)rings->vir_kern_addr, rings->order);
+    }
+    kfree(rings);
+    return err;
+}
+
+
+int driver_ring_enter(struct metrics_device_list *pmetrics_device,
+    struct nvme_ring_enter *enter_request, struct file *filp)
+{
+    int err;
+    struct nvme_ring_enter user_data;
+    struct metrics_sq *pmetrics_sq;
+
+
+    if (copy_from_user(&user_data, enter_request,
+        sizeof(struct nvme_ring_enter))) {
+
+        LOG_ERR("Unable to copy from user space");
+        return -EFAULT;
+    }
+
+    pmetrics_sq = find_sq(pmetrics_device, user_data.sq_id);
+    if ((pmetrics_sq == NULL) || (pmetrics_sq->rings == NULL)) {
+        LOG_ERR("SQ ID = %d has no rings set up", user_data.sq_id);
+        return -EBADSLT;
+    } else if (!file_may_use(pmetrics_device, pmetrics_sq->owner, filp)) {
+        LOG_ERR("SQ ID = %d belongs to another file", user_data.sq_id);
+        return -EACCES;
+    }
+
+    err = ring_drain(pmetrics_sq->rings, &user_data.num_submitted,
+        &user_data.num_reaped);
+
+    if (copy_to_user(enter_request, &user_data,
+        sizeof(struct nvme_ring_enter))) {
+
+        LOG_ERR("Unable to copy to user space");
+        err = (err == SUCCESS) ? -EFAULT : err;
+    }
+    return err;
+}
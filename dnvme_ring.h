@@ -0,0 +1,63 @@
+/*
+ * NVM Express Compliance Suite
+ * Copyright (c) 2011, Intel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _DNVME_RING_H_
+#define _DNVME_RING_H_
+
+#include "dnvme_ds.h"
+
+/*
+ * driver_setup_rings allocates the pair of shared memory rings of an IO SQ,
+ * and optionally starts the kernel thread draining them, or tears them down
+ * when no entries are requested. Called with the device locked exclusively.
+ * The SQ and its CQ must be usable by filp, the rings act on behalf of the
+ * owner of the SQ.
+ */
+int driver_setup_rings(struct metrics_device_list *pmetrics_device,
+    struct nvme_rings_setup *rings_request, struct file *filp);
+
+/*
+ * driver_ring_enter drains the rings of an IO SQ from the calling thread;
+ * the CE's of the SQ's CQ move into the completion ring, then the pending
+ * submissions move into the SQ and its doorbell is rung. The SQ must be
+ * usable by filp.
+ */
+int driver_ring_enter(struct metrics_device_list *pmetrics_device,
+    struct nvme_ring_enter *enter_request, struct file *filp);
+
+/*
+ * mmap_rings ties the lifetime of the rings to the VMA they were just
+ * remapped into, they stay allocated until it is unmapped. Called with the
+ * device locked exclusively.
+ */
+void mmap_rings(struct metrics_rings *rings, struct vm_area_struct *vma);
+
+/*
+ * cq_feeds_rings returns 1 if the rings of a SQ drain the given CQ, which
+ * then may not be shared with any other SQ.
+ */
+u8 cq_feeds_rings(struct metrics_device_list *pmetrics_device, u16 cq_id);
+
+/*
+ * free_rings stops the kernel thread of the SQ's rings, if any, and detaches
+ * them from the SQ. They are freed at once unless user space still maps
+ * them, then with the last VMA. Called with the device locked exclusively.
+ */
+void free_rings(struct metrics_sq *pmetrics_sq);
+
+#endif
@@ -0,0 +1,355 @@
+/*
+ * NVM Express Compliance Suite
+ * Copyright (c) 2011, Intel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/ktime.h>
+#include <linux/bitops.h>
+
+#include "definitions.h"
+#include "sysdnvme.h"
+#include "dnvme_queue.h"
+#include "dnvme_stats.h"
+
+/* Latencies of 2^(LAT_MAX_MSB + 1) ns and longer go to the last bucket */
+#define LAT_MAX_MSB         33
+
+/* Static function declarations used for recording latencies. */
+static u32 lat_bucket(s64 lat_ns);
+static void lat_add(struct lat_hists *plat_hists, enum nvme_lat_hist hist,
+    s64 from_ns, s64 to_ns);
+static void perf_sum(struct perf_counters __percpu *perf,
+    struct nvme_perf_counters *counters);
+static void perf_reset(struct perf_counters __percpu *perf);
+
+
+/*
+ * The bucket of a latency; linear below 8 ns, above that every power of 2
+ * is split into 8 linear buckets by the 3 bits following the msb.
+ */
+static u32 lat_bucket(s64 lat_ns)
+{
+    u32 msb;
+
+    if (lat_ns < 8) {
+        return (lat_ns < 0) ? 0 : (u32)lat_ns;
+    }
+    msb = fls64(lat_ns) - 1;
+    if (msb > LAT_MAX_MSB) {
+        return (LAT_HIST_BUCKETS - 1);
+    }
+    return (((msb - 2) << 3) | (u32)((lat_ns >> (msb - 3)) & 0x7));
+}
+
+
+/*
+ * Count the latency between two ktimes in ns, 0 meaning not recorded.
+ */
+static void lat_add(struct lat_hists *plat_hists, enum nvme_lat_hist hist,
+    s64 from_ns, s64 to_ns)
+{
+    if ((from_ns == 0) || (to_ns == 0) || (to_ns < from_ns)) {
+        return;
+    }
+    plat_hists->hist[hist][lat_bucket(to_ns - from_ns)]++;
+}
+
+
+void lat_stamp_send(struct metrics_sq *pmetrics_sq, u16 cmd_id)
+{
+    struct cmd_track *pcmd_node;
+
+    pcmd_node = find_cmd(pmetrics_sq, cmd_id);
+    if (pcmd_node != NULL) {
+        pcmd_node->submit_time = ktime_get();
+    }
+}
+
+
+void lat_stamp_ring(struct metrics_sq *pmetrics_sq)
+{
+    u32 slot;
+    u32 cmd_buf_size;
+    u8 *queue_base_addr;
+    ktime_t now = ktime_get();
+    struct nvme_gen_cmd *nvme_gen_cmd;
+    struct cmd_track *pcmd_node;
+
+    cmd_buf_size =
+        (pmetrics_sq->private_sq.size / pmetrics_sq->public_sq.elements);
+    if (pmetrics_sq->private_sq.contig != 0) {
+        queue_base_addr = pmetrics_sq->private_sq.vir_kern_addr;
+    } else {
+        queue_base_addr = pmetrics_sq->private_sq.prp_persist.vir_kern_addr;
+    }
+
+    /* The cmds about to be rung in sit from the tail up to the virt tail */
+    for (slot = pmetrics_sq->public_sq.tail_ptr;
+        slot != pmetrics_sq->public_sq.tail_ptr_virt;
+        slot = ((slot + 1) % pmetrics_sq->public_sq.elements)) {
+
+        nvme_gen_cmd = (struct nvme_gen_cmd *)(queue_base_addr +
+            (slot * cmd_buf_size));
+        pcmd_node = find_cmd(pmetrics_sq, nvme_gen_cmd->command_id);
+        if (pcmd_node != NULL) {
+            pcmd_node->ring_time = now;
+        }
+    }
+}
+
+
+void lat_record_reap(struct metrics_device_list *pmetrics_device,
+    struct metrics_cq *pmetrics_cq, struct metrics_sq *pmetrics_sq,
+    struct cmd_track *pcmd_node)
+{
+    s64 now_ns, submit_ns, ring_ns;
+    s64 isr_ns = 0;
+    struct lat_hists *plat_hists = pmetrics_sq->lat_hists;
+
+    if (plat_hists == NULL) {
+        plat_hists = kzalloc(sizeof(struct lat_hists), GFP_KERNEL);
+        if (plat_hists == NULL) {
+            return;
+        }
+        pmetrics_sq->lat_hists = plat_hists;
+    }
+
+    now_ns = ktime_to_ns(ktime_get());
+    if ((pmetrics_cq->public_cq.irq_enabled != 0) &&
+        (pmetrics_device->metrics_device->public_dev.irq_active.irq_type !=
+        INT_NONE) && (pmetrics_cq->public_cq.irq_no <
+        pmetrics_device->irq_process.num_vec_stats)) {
+
+        isr_ns = atomic64_read(&pmetrics_device->irq_process.
+            vec_stats[pmetrics_cq->public_cq.irq_no].isr_ns);
+    }
+
+    submit_ns = ktime_to_ns(pcmd_node->submit_time);
+    ring_ns = ktime_to_ns(pcmd_node->ring_time);
+    lat_add(plat_hists, LAT_SUBMIT_REAP, submit_ns, now_ns);
+    lat_add(plat_hists, LAT_RING_ISR, ring_ns, isr_ns);
+    /* An irq which fired before the cmd was sent did not complete it */
+    if (isr_ns >= max(submit_ns, ring_ns)) {
+        lat_add(plat_hists, LAT_ISR_REAP, isr_ns, now_ns);
+    }
+}
+
+
+int driver_lat_stats(struct metrics_device_list *pmetrics_device,
+    struct nvme_lat_stats *lat_request)
+{
+    int err = SUCCESS;
+    struct nvme_lat_stats user_data;
+    struct metrics_sq *pmetrics_sq;
+
+
+    if (copy_from_user(&user_data, lat_request,
+        sizeof(struct nvme_lat_stats))) {
+
+        LOG_ERR("Unable to copy from user space");
+        return -EFAULT;
+    }
+
+    if (user_data.ctl == LAT_CTL_ON) {
+        pmetrics_device->lat_enabled = 1;
+    } else if (user_data.ctl == LAT_CTL_OFF) {
+        pmetrics_device->lat_enabled = 0;
+    } else if (user_data.ctl != LAT_CTL_KEEP) {
+        LOG_ERR("Invalid latency recording control = %d", user_data.ctl);
+        return -EINVAL;
+    }
+    user_data.enabled = pmetrics_device->lat_enabled;
+
+    if ((user_data.buffer != NULL) || (user_data.reset != 0)) {
+        pmetrics_sq = find_sq(pmetrics_device, user_data.sq_id);
+        if (pmetrics_sq == NULL) {
+            LOG_ERR("SQ ID = %d does not exist", user_data.sq_id);
+            return -EBADSLT;
+        }
+        mutex_lock(&pmetrics_sq->q_mtx);
+
+        if (user_data.buffer != NULL) {
+            if (pmetrics_sq->lat_hists == NULL) {
+                err = clear_user(user_data.buffer,
+                    sizeof(struct lat_hists)) ? -EFAULT : SUCCESS;
+            } else if (copy_to_user(user_data.buffer,
+                pmetrics_sq->lat_hists->hist, sizeof(struct lat_hists))) {
+
+                err = -EFAULT;
+            }
+        }
+        if ((err == SUCCESS) && (user_data.reset != 0) &&
+            (pmetrics_sq->lat_hists != NULL)) {
+
+            memset(pmetrics_sq->lat_hists, 0, sizeof(struct lat_hists));
+        }
+        mutex_unlock(&pmetrics_sq->q_mtx);
+        if (err < 0) {
+            LOG_ERR("Unable to copy to user space");
+            return err;
+        }
+    }
+
+    if (copy_to_user(lat_request, &user_data,
+        sizeof(struct nvme_lat_stats))) {
+
+        LOG_ERR("Unable to copy to user space");
+        return -EFAULT;
+    }
+    return SUCCESS;
+}
+
+
+/*
+ * Sum up the per CPU shares of perf counters.
+ */
+static void perf_sum(struct perf_counters __percpu *perf,
+    struct nvme_perf_counters *counters)
+{
+    int cpu;
+    struct perf_counters *pcpu;
+
+    memset(counters, 0, sizeof(struct nvme_perf_counters));
+    if (perf == NULL) {
+        return;
+    }
+    for_each_possible_cpu(cpu) {
+        pcpu = per_cpu_ptr(perf, cpu);
+        counters->cmds_sent += pcpu->cmds_sent;
+        counters->bytes_sent += pcpu->bytes_sent;
+        counters->dbs_rung += pcpu->dbs_rung;
+        counters->sq_full += pcpu->sq_full;
+        counters->ces_reaped += pcpu->ces_reaped;
+        counters->latent_errs += pcpu->latent_errs;
+    }
+}
+
+
+/*
+ * Zero the per CPU shares of perf counters. Counts racing with the reset
+ * on other CPU's may survive it, the counters are statistics only.
+ */
+static void perf_reset(struct perf_counters __percpu *perf)
+{
+    int cpu;
+
+    if (perf == NULL) {
+        return;
+    }
+    for_each_possible_cpu(cpu) {
+        memset(per_cpu_ptr(perf, cpu), 0, sizeof(struct perf_counters));
+    }
+}
+
+
+int driver_perf_stats(struct metrics_device_list *pmetrics_device,
+    struct nvme_perf_stats *perf_request)
+{
+    int err = SUCCESS;
+    u32 i, num_vecs = 0;
+    u32 data_size;
+    u64 *irq_counts;
+    struct nvme_perf_stats user_data;
+    struct nvme_perf_data *perf_data;
+    struct perf_counters __percpu *perf;
+    struct metrics_sq *pmetrics_sq;
+    struct metrics_cq *pmetrics_cq;
+    struct irq_vec_stat *pvec_stat;
+
+
+    if (copy_from_user(&user_data, perf_request,
+        sizeof(struct nvme_perf_stats))) {
+
+        LOG_ERR("Unable to copy from user space");
+        return -EFAULT;
+    }
+
+    switch (user_data.scope) {
+    case PERF_DEVICE:
+        perf = pmetrics_device->perf;
+        num_vecs = pmetrics_device->irq_process.num_vec_stats;
+        break;
+    case PERF_SQ:
+        pmetrics_sq = find_sq(pmetrics_device, user_data.q_id);
+        if (pmetrics_sq == NULL) {
+            LOG_ERR("SQ ID = %d does not exist", user_data.q_id);
+            return -EBADSLT;
+        }
+        perf = pmetrics_sq->perf;
+        break;
+    case PERF_CQ:
+        pmetrics_cq = find_cq(pmetrics_device, user_data.q_id);
+        if (pmetrics_cq == NULL) {
+            LOG_ERR("CQ ID = %d does not exist", user_data.q_id);
+            return -EBADSLT;
+        }
+        perf = pmetrics_cq->perf;
+        break;
+    default:
+        LOG_ERR("Invalid perf counter scope = %d", user_data.scope);
+        return -EINVAL;
+    }
+
+    data_size = sizeof(struct nvme_perf_data) + (num_vecs * sizeof(u64));
+    perf_data = kzalloc(data_size, GFP_KERNEL);
+    if (perf_data == NULL) {
+        LOG_ERR("Unable to allocate kernel memory");
+        return -ENOMEM;
+    }
+    perf_sum(perf, &perf_data->counters);
+    perf_data->num_vecs = num_vecs;
+    irq_counts = (u64 *)(perf_data + 1);
+    for (i = 0; i < num_vecs; i++) {
+        pvec_stat = &pmetrics_device->irq_process.vec_stats[i];
+        irq_counts[i] = (u32)(atomic_read(&pvec_stat->isr_count) -
+            pvec_stat->isr_count_base);
+    }
+
+    user_data.version = NVME_PERF_VERSION;
+    if (user_data.buffer == NULL) {
+        user_data.size = 0;
+    } else {
+        user_data.size = min_t(u32, user_data.size, data_size);
+        if (copy_to_user(user_data.buffer, perf_data, user_data.size)) {
+            LOG_ERR("Unable to copy to user space");
+            err = -EFAULT;
+            goto free_out;
+        }
+    }
+
+    if (user_data.reset != 0) {
+        perf_reset(perf);
+        for (i = 0; i < num_vecs; i++) {
+            pvec_stat = &pmetrics_device->irq_process.vec_stats[i];
+            pvec_stat->isr_count_base = atomic_read(&pvec_stat->isr_count);
+        }
+    }
+
+    if (copy_to_user(perf_request, &user_data,
+        sizeof(struct nvme_perf_stats))) {
+
+        LOG_ERR("Unable to copy to user space");
+        err = -EFAULT;
+    }
+
+free_out:
+    kfree(perf_data);
+    return err;
+}
@@ -0,0 +1,60 @@
+/*
+ * NVM Express Compliance Suite
+ * Copyright (c) 2011, Intel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _DNVME_STATS_H_
+#define _DNVME_STATS_H_
+
+#include "dnvme_ds.h"
+
+/*
+ * lat_stamp_send records when the cmd with the given ID was put into the
+ * SQ. Called with the SQ locked, only while latency recording is on.
+ */
+void lat_stamp_send(struct metrics_sq *pmetrics_sq, u16 cmd_id);
+
+/*
+ * lat_stamp_ring records when the doorbell is rung for the cmds between the
+ * SQ's tail_ptr and tail_ptr_virt. Called with the SQ locked, right before
+ * the doorbell write, only while latency recording is on.
+ */
+void lat_stamp_ring(struct metrics_sq *pmetrics_sq);
+
+/*
+ * lat_record_reap adds the latencies of a cmd which is being reaped to the
+ * histograms of its SQ. Called with the CQ and SQ locked, only while
+ * latency recording is on.
+ */
+void lat_record_reap(struct metrics_device_list *pmetrics_device,
+    struct metrics_cq *pmetrics_cq, struct metrics_sq *pmetrics_sq,
+    struct cmd_track *pcmd_node);
+
+/*
+ * driver_lat_stats turns latency recording on or off and reads or resets
+ * the latency histograms of a SQ.
+ */
+int driver_lat_stats(struct metrics_device_list *pmetrics_device,
+    struct nvme_lat_stats *lat_request);
+
+/*
+ * driver_perf_stats reads the perf counters of the device, a SQ or a CQ
+ * and optionally resets them.
+ */
+int driver_perf_stats(struct metrics_device_list *pmetrics_device,
+    struct nvme_perf_stats *perf_request);
+
+#endif
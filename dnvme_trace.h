@@ -0,0 +1,193 @@
+/*
+ * NVM Express Compliance Suite
+ * Copyright (c) 2011, Intel Corporation.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM dnvme
+
+#if !defined(_DNVME_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _DNVME_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+/*
+ * Tracepoints of the submit, doorbell, irq and reap paths. They cost a
+ * not taken branch while disabled, enable them through ftrace or perf,
+ * e.g. "perf record -e 'dnvme:*'". Exactly one file defines
+ * CREATE_TRACE_POINTS before including this header.
+ */
+
+/*
+ * A cmd was put into a SQ, the doorbell is not rung yet.
+ */
+TRACE_EVENT(dnvme_send,
+    TP_PROTO(u16 sq_id, u16 cmd_id, u8 opcode, u32 prp_type, u32 data_len),
+    TP_ARGS(sq_id, cmd_id, opcode, prp_type, data_len),
+    TP_STRUCT__entry(
+        __field(u16, sq_id)
+        __field(u16, cmd_id)
+        __field(u8, opcode)
+        __field(u32, prp_type)
+        __field(u32, data_len)
+    ),
+    TP_fast_assign(
+        __entry->sq_id = sq_id;
+        __entry->cmd_id = cmd_id;
+        __entry->opcode = opcode;
+        __entry->prp_type = prp_type;
+        __entry->data_len = data_len;
+    ),
+    TP_printk("sq_id=%u cmd_id=%u opcode=0x%02x prp_type=%u data_len=%u",
+        __entry->sq_id, __entry->cmd_id, __entry->opcode,
+        __entry->prp_type, __entry->data_len)
+);
+
+/*
+ * The tail doorbell of a SQ is rung, publishing the cmds from the old tail
+ * up to the new one.
+ */
+TRACE_EVENT(dnvme_ring_sq,
+    TP_PROTO(u16 sq_id, u16 old_tail, u16 new_tail),
+    TP_ARGS(sq_id, old_tail, new_tail),
+    TP_STRUCT__entry(
+        __field(u16, sq_id)
+        __field(u16, old_tail)
+        __field(u16, new_tail)
+    ),
+    TP_fast_assign(
+        __entry->sq_id = sq_id;
+        __entry->old_tail = old_tail;
+        __entry->new_tail = new_tail;
+    ),
+    TP_printk("sq_id=%u old_tail=%u new_tail=%u", __entry->sq_id,
+        __entry->old_tail, __entry->new_tail)
+);
+
+/*
+ * The top half serviced an irq, int_vec being the kernel's irq no.
+ */
+TRACE_EVENT(dnvme_isr,
+    TP_PROTO(int int_vec, u16 irq_no),
+    TP_ARGS(int_vec, irq_no),
+    TP_STRUCT__entry(
+        __field(int, int_vec)
+        __field(u16, irq_no)
+    ),
+    TP_fast_assign(
+        __entry->int_vec = int_vec;
+        __entry->irq_no = irq_no;
+    ),
+    TP_printk("int_vec=%d irq_no=%u", __entry->int_vec, __entry->irq_no)
+);
+
+/*
+ * A CE was reaped and the cmd it completes retired, by NVME_IOCTL_REAP or a
+ * completion ring alike. opcode is 0 when the cmd is unknown, err is the
+ * latent error of the CE.
+ */
+TRACE_EVENT(dnvme_reap,
+    TP_PROTO(u16 cq_id, u16 sq_id, u16 cmd_id, u8 opcode, u16 status,
+        int err),
+    TP_ARGS(cq_id, sq_id, cmd_id, opcode, status, err),
+    TP_STRUCT__entry(
+        __field(u16, cq_id)
+        __field(u16, sq_id)
+        __field(u16, cmd_id)
+        __field(u8, opcode)
+        __field(u16, status)
+        __field(int, err)
+    ),
+    TP_fast_assign(
+        __entry->cq_id = cq_id;
+        __entry->sq_id = sq_id;
+        __entry->cmd_id = cmd_id;
+        __entry->opcode = opcode;
+        __entry->status = status;
+        __entry->err = err;
+    ),
+    TP_printk("cq_id=%u sq_id=%u cmd_id=%u opcode=0x%02x status=0x%04x "
+        "err=%d", __entry->cq_id, __entry->sq_id, __entry->cmd_id,
+        __entry->opcode, __entry->status, __entry->err)
+);
+
+/*
+ * A batch of CE's was reaped from a CQ, by NVME_IOCTL_REAP or into a
+ * completion ring, each CE is also reported by dnvme_reap.
+ */
+TRACE_EVENT(dnvme_reap_cq,
+    TP_PROTO(u16 cq_id, u32 num_could_reap, u32 num_reaped,
+        u32 num_remaining, int err),
+    TP_ARGS(cq_id, num_could_reap, num_reaped, num_remaining, err),
+    TP_STRUCT__entry(
+        __field(u16, cq_id)
+        __field(u32, num_could_reap)
+        __field(u32, num_reaped)
+        __field(u32, num_remaining)
+        __field(int, err)
+    ),
+    TP_fast_assign(
+        __entry->cq_id = cq_id;
+        __entry->num_could_reap = num_could_reap;
+        __entry->num_reaped = num_reaped;
+        __entry->num_remaining = num_remaining;
+        __entry->err = err;
+    ),
+    TP_printk("cq_id=%u could_reap=%u reaped=%u remaining=%u err=%d",
+        __entry->cq_id, __entry->num_could_reap, __entry->num_reaped,
+        __entry->num_remaining, __entry->err)
+);
+
+/*
+ * The PRP's describing the data buffer of a cmd were set up, reg_buf is set
+ * when the data lies within a registered buffer.
+ */
+TRACE_EVENT(dnvme_setup_prps,
+    TP_PROTO(u16 sq_id, u16 cmd_id, u8 opcode, u32 prp_type, u32 buf_len,
+        u32 num_list_pgs, u8 reg_buf),
+    TP_ARGS(sq_id, cmd_id, opcode, prp_type, buf_len, num_list_pgs, reg_buf),
+    TP_STRUCT__entry(
+        __field(u16, sq_id)
+        __field(u16, cmd_id)
+        __field(u8, opcode)
+        __field(u32, prp_type)
+        __field(u32, buf_len)
+        __field(u32, num_list_pgs)
+        __field(u8, reg_buf)
+    ),
+    TP_fast_assign(
+        __entry->sq_id = sq_id;
+        __entry->cmd_id = cmd_id;
+        __entry->opcode = opcode;
+        __entry->prp_type = prp_type;
+        __entry->buf_len = buf_len;
+        __entry->num_list_pgs = num_list_pgs;
+        __entry->reg_buf = reg_buf;
+    ),
+    TP_printk("sq_id=%u cmd_id=%u opcode=0x%02x prp_type=%u buf_len=%u "
+        "num_list_pgs=%u reg_buf=%u", __entry->sq_id, __entry->cmd_id,
+        __entry->opcode, __entry->prp_type, __entry->buf_len,
+        __entry->num_list_pgs, __entry->reg_buf)
+);
+
+#endif
+
+/* This part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE dnvme_trace
+#include <trace/define_trace.h>
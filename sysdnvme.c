@@ -27,6 +27,8 @@
 #include <linux/errno.h>
 #include <linux/mman.h>
 #include <linux/dma-mapping.h>
+#include <linux/poll.h>
+#include <linux/sched.h>
 
 #include "dnvme_interface.h"
 #include "definitions.h"
@@ -39,6 +41,12 @@
 #include "version.h"
 #include "dnvme_cmds.h"
 #include "dnvme_irq.h"
+#include "dnvme_ring.h"
+#include "dnvme_stats.h"
+#include "dnvme_debugfs.h"
+
+#define CREATE_TRACE_POINTS
+#include "dnvme_trace.h"
 
 #define DRV_NAME                "dnvme"
 #define NVME_DEVICE_NAME        "nvme"
@@ -52,21 +60,30 @@ static int __init dnvme_init(void);
 static void __exit dnvme_exit(void);
 static int dnvme_probe(struct pci_dev *pdev, const struct pci_device_id *id);
 static void dnvme_remove(struct pci_dev *dev);
-static struct metrics_device_list *lock_device(struct inode *inode);
-static void unlock_device(struct  metrics_device_list *pmetrics_device);
-static struct metrics_device_list *find_device(struct inode *inode);
+static struct metrics_device_list *lock_device(struct file *filp, u8 excl);
+static void unlock_device(struct  metrics_device_list *pmetrics_device,
+    u8 excl);
+static u8 ioctl_needs_excl(unsigned int ioctl_num, unsigned long ioctl_param);
+static u8 ioctl_needs_ctrl(unsigned int ioctl_num);
+static void free_device(struct kref *ref);
 int dnvme_open(struct inode *inode, struct file *filp);
 int dnvme_release(struct inode *inode, struct file *filp);
 int dnvme_mmap(struct file *filp, struct vm_area_struct *vma);
+unsigned int dnvme_poll(struct file *filp, poll_table *wait);
 long dnvme_ioctl(struct file *filp, unsigned int ioctl_num,
     unsigned long ioctl_param);
 
 /* Module globals */
 static int nvme_major;
-LIST_HEAD(metrics_dev_ll);
+DEFINE_IDR(metrics_dev_idr);
+DEFINE_MUTEX(metrics_dev_mtx);
 static struct class *class_nvme;
 struct metrics_driver g_metrics_drv;
 
+unsigned int dnvme_log_level = LOG_LVL_DEFAULT;
+module_param_named(log_level, dnvme_log_level, uint, 0644);
+MODULE_PARM_DESC(log_level, "0 = none, 1 = errors, 2 = normal, 3 = debug");
+
 MODULE_LICENSE("GPL");
 MODULE_ALIAS("platform:"DRV_NAME);
 MODULE_AUTHOR("nvmecompliance@intel.com");
@@ -95,6 +112,7 @@ static const struct file_operations dnvme_fops = {
     .open           = dnvme_open,
     .release        = dnvme_release,
     .mmap           = dnvme_mmap,
+    .poll           = dnvme_poll,
 };
 
 
@@ -121,6 +139,9 @@ static int __init dnvme_init(void)
         goto unreg_chrdrv_fail_out;
     }
 
+    /* Devices add themselves to it while being probed */
+    dbgfs_init();
+
     /* Register this driver */
     err = pci_register_driver(&dnvme_driver);
     if (err) {
@@ -130,6 +151,7 @@ static int __init dnvme_init(void)
     return err;
 
 class_create_fail_out:
+    dbgfs_exit();
     class_destroy(class_nvme);
 unreg_chrdrv_fail_out:
     unregister_chrdev(nvme_major, NVME_DEVICE_NAME);
@@ -140,6 +162,8 @@ unreg_chrdrv_fail_out:
 static void __exit dnvme_exit(void)
 {
     pci_unregister_driver(&dnvme_driver);
+    dbgfs_exit();
+    idr_destroy(&metrics_dev_idr);
     class_destroy(class_nvme);
     unregister_chrdev(nvme_major, NVME_DEVICE_NAME);
     LOG_NRM("dnvme EXIT; version: %d.%d", VER_MAJOR, VER_MINOR);
@@ -152,8 +176,8 @@ static int dnvme_probe(struct pci_dev *pdev, const struct pci_device_id *id)
     void __iomem *bar0 = NULL;
     void __iomem *bar1 = NULL;
     void __iomem *bar2 = NULL;
-    static int nvme_minor = 0;
-    dev_t devno = MKDEV(nvme_major, nvme_minor);
+    int nvme_minor = -1;
+    dev_t devno;
     struct metrics_device_list *pmetrics_device = NULL;
     int bars = 0;
 
@@ -165,6 +189,35 @@ static int dnvme_probe(struct pci_dev *pdev, const struct pci_device_id *id)
         err = -ENOMEM;
         goto fail_out;
     }
+    pmetrics_device->perf = alloc_percpu(struct perf_counters);
+    if (pmetrics_device->perf == NULL) {
+        LOG_ERR("Failed alloc mem for the device's perf counters");
+        err = -ENOMEM;
+        goto fail_out;
+    }
+
+    /* Reserve the lowest free minor, the device is only published once it
+     * is completely set up, until then lookups find NULL */
+    mutex_lock(&metrics_dev_mtx);
+    do {
+        if (idr_pre_get(&metrics_dev_idr, GFP_KERNEL) == 0) {
+            err = -ENOMEM;
+            break;
+        }
+        err = idr_get_new(&metrics_dev_idr, NULL, &nvme_minor);
+    } while (err == -EAGAIN);
+    mutex_unlock(&metrics_dev_mtx);
+    if (err < 0) {
+        LOG_ERR("Failed to allocate a minor no.");
+        nvme_minor = -1;
+        goto fail_out;
+    } else if (nvme_minor >= NVME_MINORS) {
+        LOG_ERR("All %d minor no.'s are in use", NVME_MINORS);
+        err = -ENOSPC;
+        goto fail_out;
+    }
+    devno = MKDEV(nvme_major, nvme_minor);
+    err = -EINVAL;
 
     /* Get the bitmask value of the BAR's supported by device */
     bars = pci_select_bars(pdev, IORESOURCE_MEM);
@@ -239,8 +292,15 @@ static int dnvme_probe(struct pci_dev *pdev, const struct pci_device_id *id)
         goto remap_fail_out;
     }
 
-    mutex_init(&pmetrics_device->metrics_mtx);
-    pmetrics_device->metrics_device->private_dev.open_flag = 0;
+    init_rwsem(&pmetrics_device->metrics_sem);
+    pmetrics_device->metrics_sem_owner = NULL;
+    INIT_LIST_HEAD(&pmetrics_device->reclaim_list);
+    spin_lock_init(&pmetrics_device->reclaim_lock);
+    INIT_WORK(&pmetrics_device->reclaim_work, reclaim_prps_work);
+    kref_init(&pmetrics_device->ref);
+    pmetrics_device->metrics_device->private_dev.open_cnt = 0;
+    pmetrics_device->metrics_device->private_dev.shared = 0;
+    pmetrics_device->metrics_device->private_dev.ctrl_filp = NULL;
     pmetrics_device->metrics_device->private_dev.minor_no = nvme_minor;
 
     /* Create an NVMe special device */
@@ -264,8 +324,11 @@ static int dnvme_probe(struct pci_dev *pdev, const struct pci_device_id *id)
         PCI_SLOT(pdev->devfn));
     LOG_DBG("NVMe func: 0x%x, class: 0x%x", PCI_FUNC(pdev->devfn),
         pdev->class);
-    list_add_tail(&pmetrics_device->metrics_device_hd, &metrics_dev_ll);
-    nvme_minor++;
+    pci_set_drvdata(pdev, pmetrics_device);
+    mutex_lock(&metrics_dev_mtx);
+    idr_replace(&metrics_dev_idr, pmetrics_device, nvme_minor);
+    mutex_unlock(&metrics_dev_mtx);
+    dbgfs_add_device(pmetrics_device);
     return 0;
 
 
@@ -288,7 +351,13 @@ remap_fail_out:
             pci_resource_len(pdev, BAR4_BAR5));
     }
 fail_out:
+    if (nvme_minor >= 0) {
+        mutex_lock(&metrics_dev_mtx);
+        idr_remove(&metrics_dev_idr, nvme_minor);
+        mutex_unlock(&metrics_dev_mtx);
+    }
     if (pmetrics_device != NULL) {
+        free_percpu(pmetrics_device->perf);
         kfree(pmetrics_device);
     }
     return err;
@@ -297,152 +366,258 @@ fail_out:
 
 static void dnvme_remove(struct pci_dev *dev)
 {
-    struct pci_dev *pdev;
-    struct metrics_device_list *pmetrics_device;
+    struct pci_dev *pdev = dev;
+    struct metrics_device_list *pmetrics_device = pci_get_drvdata(dev);
 
 
-    /* Loop through the devices available in the metrics list */
-    list_for_each_entry(pmetrics_device, &metrics_dev_ll, metrics_device_hd) {
+    if (pmetrics_device == NULL) {
+        return;
+    }
 
-        pdev = pmetrics_device->metrics_device->private_dev.pdev;
-        if (pdev == dev) {
+    LOG_DBG("Removing device: 0x%x, vendor: 0x%x",
+        pdev->device, pdev->vendor);
+    LOG_DBG("PCIe bus #%d, slot: %d", pdev->bus->number,
+        PCI_SLOT(pdev->devfn));
+    LOG_DBG("PCIe func: 0x%x, class: 0x%x", PCI_FUNC(pdev->devfn),
+        pdev->class);
 
-            LOG_DBG("Removing device: 0x%x, vendor: 0x%x",
-                pdev->device, pdev->vendor);
-            LOG_DBG("PCIe bus #%d, slot: %d", pdev->bus->number,
-                PCI_SLOT(pdev->devfn));
-            LOG_DBG("PCIe func: 0x%x, class: 0x%x", PCI_FUNC(pdev->devfn),
-                pdev->class);
+    /* No more opens, the minor is free for the next device probed */
+    mutex_lock(&metrics_dev_mtx);
+    idr_remove(&metrics_dev_idr,
+        pmetrics_device->metrics_device->private_dev.minor_no);
+    mutex_unlock(&metrics_dev_mtx);
+    pci_set_drvdata(dev, NULL);
+    dbgfs_del_device(pmetrics_device);
+
+    /* Wait for any other dnvme access to finish, then stop further
+     * before we free resources to prevent circular issues */
+    down_write(&pmetrics_device->metrics_sem);
+    device_cleanup(pmetrics_device, ST_DISABLE_COMPLETELY);
+    pci_disable_device(pdev);
 
-            /* Wait for any other dnvme access to finish, then stop further
-             * before we free resources to prevent circular issues */
-            mutex_lock(&pmetrics_device->metrics_mtx);
-            device_cleanup(pmetrics_device, ST_DISABLE_COMPLETELY);
-            pci_disable_device(pdev);
+    /* Release the selected memory regions that were reserved */
+    if (pmetrics_device->metrics_device->private_dev.bar0 != NULL) {
+        destroy_dma_pool(pmetrics_device->metrics_device);
+        iounmap(pmetrics_device->metrics_device->private_dev.bar0);
+        release_mem_region(pci_resource_start(pdev, BAR0_BAR1),
+            pci_resource_len(pdev, BAR0_BAR1));
+    }
+    if (pmetrics_device->metrics_device->private_dev.bar1 != NULL) {
+        iounmap(pmetrics_device->metrics_device->private_dev.bar1);
+        release_mem_region(pci_resource_start(pdev, BAR2_BAR3),
+            pci_resource_len(pdev, BAR2_BAR3));
+    }
+    if (pmetrics_device->metrics_device->private_dev.bar2 != NULL) {
+        iounmap(pmetrics_device->metrics_device->private_dev.bar2);
+        release_mem_region(pci_resource_start(pdev, BAR4_BAR5),
+            pci_resource_len(pdev, BAR4_BAR5));
+    }
+    device_del(pmetrics_device->metrics_device->private_dev.spcl_dev);
 
-            /* Release the selected memory regions that were reserved */
-            if (pmetrics_device->metrics_device->private_dev.bar0 != NULL) {
-                destroy_dma_pool(pmetrics_device->metrics_device);
-                iounmap(pmetrics_device->metrics_device->private_dev.bar0);
-                release_mem_region(pci_resource_start(pdev, BAR0_BAR1),
-                    pci_resource_len(pdev, BAR0_BAR1));
-            }
-            if (pmetrics_device->metrics_device->private_dev.bar1 != NULL) {
-                iounmap(pmetrics_device->metrics_device->private_dev.bar1);
-                release_mem_region(pci_resource_start(pdev, BAR2_BAR3),
-                    pci_resource_len(pdev, BAR2_BAR3));
-            }
-            if (pmetrics_device->metrics_device->private_dev.bar2 != NULL) {
-                iounmap(pmetrics_device->metrics_device->private_dev.bar2);
-                release_mem_region(pci_resource_start(pdev, BAR4_BAR5),
-                    pci_resource_len(pdev, BAR4_BAR5));
-            }
+    /* Files still open keep the device until the last one is released */
+    pmetrics_device->metrics_device->private_dev.removed = 1;
+    up_write(&pmetrics_device->metrics_sem);
+    put_device_ref(pmetrics_device);
+}
 
-            /* Free up the linked list */
-            list_del(&pmetrics_device->metrics_cq_list);
-            list_del(&pmetrics_device->metrics_sq_list);
 
-            /* Unlock, then destroy all mutexes */
-            mutex_unlock(&pmetrics_device->metrics_mtx);
-            mutex_destroy(pmetrics_device->metrics_mtx);
-            mutex_destroy(pmetrics_device->irq_process->irq_track_mtx);
+/*
+ * free_device - Free the tracking of a removed device which no file or
+ * lookup references anymore.
+ */
+static void free_device(struct kref *ref)
+{
+    struct metrics_device_list *pmetrics_device =
+        container_of(ref, struct metrics_device_list, ref);
 
-            device_del(pmetrics_device->metrics_device->private_dev.spcl_dev);
-        }
-    }
+    mutex_destroy(&pmetrics_device->irq_process.irq_track_mtx);
+    kfree(pmetrics_device->metrics_device);
+    free_percpu(pmetrics_device->perf);
+    kfree(pmetrics_device);
+}
+
+
+struct metrics_device_list *get_device_ref(int minor)
+{
+    struct metrics_device_list *pmetrics_device;
 
-    /* Free up the device linked list if there are not items left */
-    if (list_empty(&metrics_dev_ll)) {
-        list_del(&metrics_dev_ll);
+    mutex_lock(&metrics_dev_mtx);
+    pmetrics_device = idr_find(&metrics_dev_idr, minor);
+    if (pmetrics_device != NULL) {
+        kref_get(&pmetrics_device->ref);
     }
+    mutex_unlock(&metrics_dev_mtx);
+    return pmetrics_device;
 }
 
 
-/*
- * find device from the device linked list. Returns pointer to the
- * device if found otherwise returns NULL.
- */
-static struct metrics_device_list *find_device(struct inode *inode)
+void put_device_ref(struct metrics_device_list *pmetrics_device)
 {
-    int dev_found = 1;
-    struct metrics_device_list *pmetrics_device;
+    kref_put(&pmetrics_device->ref, free_device);
+}
 
-    /* Loop through the devices available in the metrics list */
-    list_for_each_entry(pmetrics_device, &metrics_dev_ll, metrics_device_hd) {
 
-        if (iminor(inode) == pmetrics_device->metrics_device->
-                private_dev.minor_no) {
+/*
+ * lock_device function will take the device of the file, found once by
+ * dnvme_open, and lock it by taking the semaphore, exclusively if excl is
+ * set otherwise shared. This function returns a pointer to the locked
+ * device, or NULL if it has been hot removed in the meantime.
+ */
+static struct metrics_device_list *lock_device(struct file *filp, u8 excl)
+{
+    struct  metrics_device_list *pmetrics_device = filp->private_data;
 
-            return pmetrics_device;
-        } else {
-            dev_found = 0;
-        }
+    /* Grab the semaphore for this device */
+    if (excl) {
+        down_write(&pmetrics_device->metrics_sem);
+        pmetrics_device->metrics_sem_owner = current;
+    } else {
+        down_read(&pmetrics_device->metrics_sem);
     }
 
-    /* The specified device could not be found in the list */
-    if (dev_found == 0) {
-        LOG_ERR("Cannot find the device with minor no. %d", iminor(inode));
+    if (pmetrics_device->metrics_device->private_dev.removed) {
+        unlock_device(pmetrics_device, excl);
         return NULL;
     }
-    return NULL;
+    return pmetrics_device;
 }
 
 
-/*
- * lock_device function will call find_device and if found device locks my
- * taking the mutex. This function returns a pointer to successfully found
- * device.
- */
-static struct metrics_device_list *lock_device(struct inode *inode)
+static void unlock_device(struct  metrics_device_list *pmetrics_device,
+    u8 excl)
 {
-    struct  metrics_device_list *pmetrics_device;
-    pmetrics_device = find_device(inode);
     if (pmetrics_device == NULL) {
-        LOG_ERR("Cannot find the device with minor no. %d", iminor(inode));
-        return NULL;
+        return;
     }
+    if (excl) {
+        pmetrics_device->metrics_sem_owner = NULL;
+        up_write(&pmetrics_device->metrics_sem);
+    } else {
+        up_read(&pmetrics_device->metrics_sem);
+    }
+}
 
-    /* Grab the Mutex for this device in the linked list */
-    mutex_lock(&pmetrics_device->metrics_mtx);
-    return pmetrics_device;
+
+/*
+ * ioctl_needs_excl - The send/ring/reap fast paths of IO Q's only lock the
+ * SQ or CQ they touch and get the device shared. Cmds to the ASQ and reaping
+ * the ACQ create and delete IO Q's, so they need the device exclusively, as
+ * does any other ioctl. The Q ID's are peeked here to pick the mode; the
+ * ioctls check again once they copied the request in.
+ */
+static u8 ioctl_needs_excl(unsigned int ioctl_num, unsigned long ioctl_param)
+{
+    u16 q_id;
+    u32 num_cmds;
+    struct nvme_64b_send *cmds;
+    struct nvme_64b_batch *batch = (struct nvme_64b_batch *)ioctl_param;
+
+    switch (ioctl_num) {
+    case NVME_IOCTL_RING_SQ_DOORBELL:
+    case NVME_IOCTL_REAP_INQUIRY:
+    case NVME_IOCTL_REAP_WAIT:
+    case NVME_IOCTL_RING_ENTER:
+    case NVME_IOCTL_LAT_STATS:
+    case NVME_IOCTL_PERF_STATS:
+    case NVME_IOCTL_COMMIT_SQ:
+        return 0;
+
+    case NVME_IOCTL_SEND_64B_CMD:
+        if (get_user(q_id, &((struct nvme_64b_send *)ioctl_param)->q_id)) {
+            return 1;
+        }
+        return (q_id == 0);
+
+    case NVME_IOCTL_REAP:
+        if (get_user(q_id, &((struct nvme_reap *)ioctl_param)->q_id)) {
+            return 1;
+        }
+        return (q_id == 0);
+
+    case NVME_IOCTL_SEND_64B_BATCH:
+        /* Only the 1st cmd picks the mode, any later ASQ cmd of a batch
+         * which got the device shared fails with -EAGAIN in its status */
+        if (get_user(num_cmds, &batch->num_cmds) ||
+            get_user(cmds, &batch->cmds) || (num_cmds == 0) ||
+            get_user(q_id, &cmds[0].q_id)) {
+            return 1;
+        }
+        return (q_id == 0);
+
+    default:
+        return 1;
+    }
 }
 
 
-static void unlock_device(struct  metrics_device_list *pmetrics_device)
+/*
+ * ioctl_needs_ctrl - Whether the ioctl changes device wide state, which
+ * only the controlling file of a shared device is allowed to.
+ */
+static u8 ioctl_needs_ctrl(unsigned int ioctl_num)
 {
-    if (mutex_is_locked(&pmetrics_device->metrics_mtx)) {
-        mutex_unlock(&pmetrics_device->metrics_mtx);
+    switch (ioctl_num) {
+    case NVME_IOCTL_WRITE_GENERIC:
+    case NVME_IOCTL_CREATE_ADMN_Q:
+    case NVME_IOCTL_DEVICE_STATE:
+    case NVME_IOCTL_TOXIC_64B_DWORD:
+    case NVME_IOCTL_METABUF_CREATE:
+    case NVME_IOCTL_SET_IRQ:
+    case NVME_IOCTL_SHARE_DEVICE:
+        return 1;
+
+    default:
+        return 0;
     }
 }
 
 
 /*
  * This operation is always the first operation performed on the device file.
- * when the user call open fd, this is where it lands.
+ * when the user call open fd, this is where it lands. The 1st open resets
+ * the device and becomes its controlling file, further opens are only
+ * allowed after it shared the device and leave the device as it is.
  */
 int dnvme_open(struct inode *inode, struct file *filp)
 {
     struct metrics_device_list *pmetrics_device;
+    struct private_metrics_dev *pdev;
     int err = SUCCESS;
 
     LOG_DBG("Opening NVMe device");
-    pmetrics_device = lock_device(inode);
+
+    /* Resolve the device once, the ref keeps it allocated until this file
+     * is released even if it is hot removed meanwhile */
+    filp->private_data = get_device_ref(iminor(inode));
+    if (filp->private_data == NULL) {
+        LOG_ERR("Cannot find the device with minor no. %d", iminor(inode));
+        return -ENODEV;
+    }
+    pmetrics_device = lock_device(filp, 1);
     if (pmetrics_device == NULL) {
         LOG_ERR("Cannot lock on this device with minor no. %d", iminor(inode));
         err = -ENODEV;
         goto op_exit;
     }
 
-    if (pmetrics_device->metrics_device->private_dev.open_flag == 0) {
-        pmetrics_device->metrics_device->private_dev.open_flag = 1;
+    pdev = &pmetrics_device->metrics_device->private_dev;
+    if (pdev->open_cnt == 0) {
+        pdev->open_cnt = 1;
+        pdev->shared = 0;
+        pdev->ctrl_filp = filp;
         device_cleanup(pmetrics_device, ST_DISABLE_COMPLETELY);
+    } else if (pdev->shared && (pdev->ctrl_filp != NULL)) {
+        pdev->open_cnt++;
     } else {
         LOG_ERR("Attempt to open device multiple times not allowed!");
         err = -EPERM;
     }
+    unlock_device(pmetrics_device, 1);
 
 op_exit:
-    unlock_device(pmetrics_device);
+    if (err < 0) {
+        put_device_ref(filp->private_data);
+    }
     return err;
 }
 
@@ -451,30 +626,69 @@ op_exit:
  * This operation is invoked when the file structure is being released. When
  * the user app close a device then this is where the entry point is. The
  * driver cleans up any memory it has reference to. This ensures a clean state
- * of the device.
+ * of the device. Closing a file other than the last one of a shared device
+ * only cleans up what that file owns. The others may still map Q's, thus
+ * closing the controlling file only defers the full clean up until the last
+ * file is closed.
  */
 int dnvme_release(struct inode *inode, struct file *filp)
 {
     /* Metrics device */
-    struct  metrics_device_list *pmetrics_device;
-    int err = SUCCESS;
+    struct  metrics_device_list *pmetrics_device = filp->private_data;
+    struct private_metrics_dev *pdev;
 
     LOG_DBG("Call to Release the device");
-    pmetrics_device = lock_device(inode);
-    if (pmetrics_device == NULL) {
-        LOG_ERR("Cannot lock on this device with minor # %d", iminor(inode));
-        err = -ENODEV;
-        goto rel_exit;
-    }
 
-    /* Set the device open flag to false */
-    pmetrics_device->metrics_device->private_dev.open_flag = 0;
-    device_cleanup(pmetrics_device, ST_DISABLE_COMPLETELY);
+    /* Locked by hand, a hot removed device is released all the same */
+    down_write(&pmetrics_device->metrics_sem);
+    pmetrics_device->metrics_sem_owner = current;
+
+    pdev = &pmetrics_device->metrics_device->private_dev;
+    pdev->open_cnt--;
+    if (pdev->removed) {
+        /* Everything was cleaned up by dnvme_remove */
+    } else if (pdev->open_cnt == 0) {
+        pdev->ctrl_filp = NULL;
+        pdev->shared = 0;
+        device_cleanup(pmetrics_device, ST_DISABLE_COMPLETELY);
+    } else if (filp == pdev->ctrl_filp) {
+        /* No more opens until all the files left are closed, what the
+         * controlling file leaves on the controller belongs to no file */
+        pdev->ctrl_filp = NULL;
+        file_cleanup(pmetrics_device, filp);
+    } else {
+        file_cleanup(pmetrics_device, filp);
+    }
 
-rel_exit:
     LOG_DBG("NVMe device closed");
-    unlock_device(pmetrics_device);
-    return err;
+    unlock_device(pmetrics_device, 1);
+    /* The last ref of a hot removed device frees it */
+    put_device_ref(pmetrics_device);
+    return SUCCESS;
+}
+
+
+/*
+ * dnvme_poll - The device is readable once the irq of any IRQ enabled CQ the
+ * file may reap has fired and not all CQ's of that irq have been reaped. The
+ * device is locked shared, a sleeping NVME_IOCTL_REAP_WAIT doesn't hold it.
+ */
+unsigned int dnvme_poll(struct file *filp, poll_table *wait)
+{
+    struct  metrics_device_list *pmetrics_device;
+    unsigned int mask = 0;
+
+    pmetrics_device = lock_device(filp, 0);
+    if (pmetrics_device == NULL) {
+        return POLLERR;
+    }
+
+    poll_wait(filp, &pmetrics_device->irq_process.poll_wq, wait);
+    if (irq_cqs_ready(pmetrics_device, filp)) {
+        mask |= (POLLIN | POLLRDNORM);
+    }
+    unlock_device(pmetrics_device, 0);
+    return mask;
 }
 
 
@@ -488,6 +702,7 @@ int dnvme_mmap(struct file *filp, struct vm_area_struct *vma)
     struct  metrics_sq  *pmetrics_sq_list;  /* SQ linked list               */
     struct  metrics_cq  *pmetrics_cq_list;  /* CQ linked list               */
     struct  metrics_meta *pmeta_data;       /* pointer to meta node         */
+    struct device *dev;
     u8 *vir_kern_addr;
     unsigned long pfn = 0;
     struct inode *inode = filp->f_dentry->d_inode;
@@ -499,7 +714,7 @@ int dnvme_mmap(struct file *filp, struct vm_area_struct *vma)
 
     LOG_DBG("Device Calling mmap function...");
 
-    pmetrics_device = lock_device(inode);
+    pmetrics_device = lock_device(filp, 1);
     if (pmetrics_device == NULL) {
         LOG_ERR("Cannot lock on this device with minor no. %d", iminor(inode));
         err = -ENODEV;
@@ -515,7 +730,7 @@ int dnvme_mmap(struct file *filp, struct vm_area_struct *vma)
     LOG_DBG("Type = %d", type);
     LOG_DBG("ID = 0x%x", id);
 
-    /* If type is 1 implies SQ, 0 implies CQ and 2 implies meta data */
+    /* Type 1 implies SQ, 0 implies CQ, 2 meta data and 3 the rings of a SQ */
     if (type == 0x1) {
         /* Process for SQ */
         if (id > USHRT_MAX) { /* 16 bits */
@@ -528,6 +743,12 @@ int dnvme_mmap(struct file *filp, struct vm_area_struct *vma)
         if (pmetrics_sq_list == NULL) {
             err = -EBADSLT;
             goto mmap_exit;
+        } else if ((id != 0) && !file_may_use(pmetrics_device,
+            pmetrics_sq_list->owner, filp)) {
+
+            LOG_ERR("SQ ID = %d belongs to another file", id);
+            err = -EACCES;
+            goto mmap_exit;
         }
         if (pmetrics_sq_list->private_sq.contig == 0) {
             LOG_ERR("MMAP does not work on non contig SQ's");
@@ -552,6 +773,12 @@ int dnvme_mmap(struct file *filp, struct vm_area_struct *vma)
         if (pmetrics_cq_list == NULL) {
             err = -EBADSLT;
             goto mmap_exit;
+        } else if ((id != 0) && !file_may_use(pmetrics_device,
+            pmetrics_cq_list->owner, filp)) {
+
+            LOG_ERR("CQ ID = %d belongs to another file", id);
+            err = -EACCES;
+            goto mmap_exit;
         }
         if (pmetrics_cq_list->private_cq.contig == 0) {
             LOG_ERR("MMAP does not work on non contig CQ's");
@@ -576,9 +803,35 @@ int dnvme_mmap(struct file *filp, struct vm_area_struct *vma)
         if (pmeta_data == NULL) {
             err = -EBADSLT;
             goto mmap_exit;
+        } else if (pmeta_data->owner != filp) {
+            /* Not refcounted like Q memory, only the owner may map it */
+            LOG_ERR("Meta ID = %d belongs to another file", id);
+            err = -EACCES;
+            goto mmap_exit;
         }
         vir_kern_addr = pmeta_data->vir_kern_addr;
         mmap_range = pmetrics_device->metrics_meta.meta_buf_size;
+    } else if (type == 0x3) {
+        /* Process for the rings of a SQ */
+        if (id > USHRT_MAX) { /* 16 bits */
+            LOG_ERR("SQ Id is greater than 16 bits..");
+            err = -EINVAL;
+            goto mmap_exit;
+        }
+        pmetrics_sq_list = find_sq(pmetrics_device, id);
+        if ((pmetrics_sq_list == NULL) || (pmetrics_sq_list->rings == NULL)) {
+            err = -EBADSLT;
+            goto mmap_exit;
+        } else if (!file_may_use(pmetrics_device, pmetrics_sq_list->owner,
+            filp)) {
+
+            LOG_ERR("SQ ID = %d belongs to another file", id);
+            err = -EACCES;
+            goto mmap_exit;
+        }
+        vir_kern_addr = pmetrics_sq_list->rings->vir_kern_addr;
+        /* All the pages of the allocation, but not a page more */
+        mmap_range = (PAGE_SIZE << pmetrics_sq_list->rings->order) - 1;
     } else {
         err = -EINVAL;
         goto mmap_exit;
@@ -605,9 +858,24 @@ int dnvme_mmap(struct file *filp, struct vm_area_struct *vma)
     /* remap kernel memory to userspace */
     err = remap_pfn_range(vma, vma->vm_start, pfn,
                     vma->vm_end - vma->vm_start, vma->vm_page_prot);
+    if (err != SUCCESS) {
+        goto mmap_exit;
+    }
+    dev = &pmetrics_device->metrics_device->private_dev.pdev->dev;
+    if (type == 0x0) {
+        err = mmap_q(dev, &pmetrics_cq_list->mapped, vir_kern_addr,
+            pmetrics_cq_list->private_cq.cq_dma_addr,
+            pmetrics_cq_list->private_cq.size, vma);
+    } else if (type == 0x1) {
+        err = mmap_q(dev, &pmetrics_sq_list->mapped, vir_kern_addr,
+            pmetrics_sq_list->private_sq.sq_dma_addr,
+            pmetrics_sq_list->private_sq.size, vma);
+    } else if (type == 0x3) {
+        mmap_rings(pmetrics_sq_list->rings, vma);
+    }
 
 mmap_exit:
-    unlock_device(pmetrics_device);
+    unlock_device(pmetrics_device, 1);
     return err;
 }
 
@@ -627,17 +895,28 @@ long dnvme_ioctl(struct file *filp, unsigned int ioctl_num,
     int err = -EINVAL;
     struct metrics_device_list *pmetrics_device;
     struct nvme_create_admn_q *create_admn_q;
+    struct metrics_sq *pmetrics_sq;
     struct inode *inode = inode = filp->f_dentry->d_inode;
+    u8 excl = ioctl_needs_excl(ioctl_num, ioctl_param);
 
 
     LOG_DBG("Processing IOCTL 0x%08x", ioctl_num);
-    pmetrics_device = lock_device(inode);
+    pmetrics_device = lock_device(filp, excl);
     if (pmetrics_device == NULL) {
         LOG_ERR("Unable to lock DUT; minor #%d", iminor(inode));
         err = -ENODEV;
         goto ioctl_exit;
     }
 
+    if (ioctl_needs_ctrl(ioctl_num) && (filp !=
+        pmetrics_device->metrics_device->private_dev.ctrl_filp)) {
+
+        LOG_ERR("IOCTL 0x%08x only allowed to the controlling file",
+            ioctl_num);
+        err = -EPERM;
+        goto ioctl_exit;
+    }
+
     switch (ioctl_num) {
 
     case NVME_IOCTL_ERR_CHK:
@@ -718,24 +997,68 @@ long dnvme_ioctl(struct file *filp, unsigned int ioctl_num,
     case NVME_IOCTL_PREPARE_SQ_CREATION:
         LOG_DBG("NVME_IOCTL_PREPARE_SQ_CREATION");
         err = driver_nvme_prep_sq((struct nvme_prep_sq *)ioctl_param,
-            pmetrics_device);
+            pmetrics_device, filp);
         break;
 
     case NVME_IOCTL_PREPARE_CQ_CREATION:
         LOG_DBG("NVME_IOCTL_PREPARE_CQ_CREATION");
         err = driver_nvme_prep_cq((struct nvme_prep_cq *)ioctl_param,
-            pmetrics_device);
+            pmetrics_device, filp);
         break;
 
     case NVME_IOCTL_RING_SQ_DOORBELL:
         LOG_DBG("NVME_IOCTL_RING_SQ_DOORBELL");
+        pmetrics_sq = find_sq(pmetrics_device, (u16)ioctl_param);
+        if ((pmetrics_sq != NULL) && ((u16)ioctl_param != 0) &&
+            !file_may_use(pmetrics_device, pmetrics_sq->owner, filp)) {
+
+            LOG_ERR("SQ ID = %d belongs to another file", (u16)ioctl_param);
+            err = -EACCES;
+            break;
+        }
         err = nvme_ring_sqx_dbl((u16)ioctl_param, pmetrics_device);
         break;
 
     case NVME_IOCTL_SEND_64B_CMD:
         LOG_DBG("NVME_IOCTL_SEND_64B_CMD");
         err = driver_send_64b(pmetrics_device,
-            (struct nvme_64b_send *)ioctl_param);
+            (struct nvme_64b_send *)ioctl_param, filp);
+        break;
+
+    case NVME_IOCTL_SEND_64B_BATCH:
+        LOG_DBG("NVME_IOCTL_SEND_64B_BATCH");
+        err = driver_send_64b_batch(pmetrics_device,
+            (struct nvme_64b_batch *)ioctl_param, filp);
+        break;
+
+    case NVME_IOCTL_COMMIT_SQ:
+        LOG_DBG("NVME_IOCTL_COMMIT_SQ");
+        err = driver_commit_sq(pmetrics_device,
+            (struct nvme_sq_commit *)ioctl_param, filp);
+        break;
+
+    case NVME_IOCTL_SETUP_RINGS:
+        LOG_DBG("NVME_IOCTL_SETUP_RINGS");
+        err = driver_setup_rings(pmetrics_device,
+            (struct nvme_rings_setup *)ioctl_param, filp);
+        break;
+
+    case NVME_IOCTL_RING_ENTER:
+        LOG_DBG("NVME_IOCTL_RING_ENTER");
+        err = driver_ring_enter(pmetrics_device,
+            (struct nvme_ring_enter *)ioctl_param, filp);
+        break;
+
+    case NVME_IOCTL_LAT_STATS:
+        LOG_DBG("NVME_IOCTL_LAT_STATS");
+        err = driver_lat_stats(pmetrics_device,
+            (struct nvme_lat_stats *)ioctl_param);
+        break;
+
+    case NVME_IOCTL_PERF_STATS:
+        LOG_DBG("NVME_IOCTL_PERF_STATS");
+        err = driver_perf_stats(pmetrics_device,
+            (struct nvme_perf_stats *)ioctl_param);
         break;
 
     case NVME_IOCTL_TOXIC_64B_DWORD:
@@ -744,20 +1067,40 @@ long dnvme_ioctl(struct file *filp, unsigned int ioctl_num,
             (struct backdoor_inject *)ioctl_param);
         break;
 
-    case NVME_IOCTL_DUMP_METRICS:
-        LOG_DBG("NVME_IOCTL_DUMP_METRICS");
-        err = driver_log((struct nvme_file *)ioctl_param);
+    case NVME_IOCTL_SNAPSHOT:
+        LOG_DBG("NVME_IOCTL_SNAPSHOT");
+        err = driver_snapshot(pmetrics_device,
+            (struct nvme_snapshot *)ioctl_param);
         break;
 
     case NVME_IOCTL_REAP_INQUIRY:
         LOG_DBG("NVME_IOCTL_REAP_INQUIRY");
         err = driver_reap_inquiry(pmetrics_device,
-            (struct nvme_reap_inquiry *)ioctl_param);
+            (struct nvme_reap_inquiry *)ioctl_param, filp);
         break;
 
     case NVME_IOCTL_REAP:
         LOG_DBG("NVME_IOCTL_REAP");
-        err = driver_reap_cq(pmetrics_device, (struct nvme_reap *)ioctl_param);
+        err = driver_reap_cq(pmetrics_device, (struct nvme_reap *)ioctl_param,
+            filp);
+        break;
+
+    case NVME_IOCTL_REAP_WAIT:
+        LOG_DBG("NVME_IOCTL_REAP_WAIT");
+        err = driver_reap_wait(pmetrics_device,
+            (struct nvme_reap_wait *)ioctl_param, filp);
+        break;
+
+    case NVME_IOCTL_GET_READY_CQS:
+        LOG_DBG("NVME_IOCTL_GET_READY_CQS");
+        err = driver_ready_cqs(pmetrics_device,
+            (struct nvme_ready_cqs *)ioctl_param, filp);
+        break;
+
+    case NVME_IOCTL_SET_CQ_EVENTFD:
+        LOG_DBG("NVME_IOCTL_SET_CQ_EVENTFD");
+        err = driver_cq_eventfd(pmetrics_device,
+            (struct nvme_cq_eventfd *)ioctl_param, filp);
         break;
 
     case NVME_IOCTL_GET_DRIVER_METRICS:
@@ -785,12 +1128,23 @@ long dnvme_ioctl(struct file *filp, unsigned int ioctl_num,
 
     case NVME_IOCTL_METABUF_ALLOC:
         LOG_DBG("NVME_IOCTL_METABUF_ALLOC");
-        err = metabuff_alloc(pmetrics_device, (u32)ioctl_param);
+        err = metabuff_alloc(pmetrics_device, (u32)ioctl_param, filp);
         break;
 
     case NVME_IOCTL_METABUF_DELETE:
         LOG_DBG("NVME_IOCTL_METABUF_DELETE");
-        err = metabuff_del(pmetrics_device, (u32)ioctl_param);
+        err = metabuff_del(pmetrics_device, (u32)ioctl_param, filp);
+        break;
+
+    case NVME_IOCTL_REG_BUF:
+        LOG_DBG("NVME_IOCTL_REG_BUF");
+        err = driver_reg_buf(pmetrics_device,
+            (struct nvme_reg_buf *)ioctl_param, filp);
+        break;
+
+    case NVME_IOCTL_UNREG_BUF:
+        LOG_DBG("NVME_IOCTL_UNREG_BUF");
+        err = driver_unreg_buf(pmetrics_device, (u32)ioctl_param, filp);
         break;
 
     case NVME_IOCTL_SET_IRQ:
@@ -816,12 +1170,19 @@ long dnvme_ioctl(struct file *filp, unsigned int ioctl_num,
         err = driver_logstr((struct nvme_logstr *)ioctl_param);
         break;
 
+    case NVME_IOCTL_SHARE_DEVICE:
+        LOG_DBG("NVME_IOCTL_SHARE_DEVICE");
+        pmetrics_device->metrics_device->private_dev.shared =
+            (ioctl_param != 0);
+        err = SUCCESS;
+        break;
+
     default:
         LOG_DBG("Unknown IOCTL");
         break;
     }
 
 ioctl_exit:
-    unlock_device(pmetrics_device);
+    unlock_device(pmetrics_device, excl);
     return err;
 }
@@ -19,9 +19,26 @@
 #ifndef _SYSDNVME_H_
 #define _SYSDNVME_H_
 
+#include <linux/kernel.h>
+
 #define APPNAME         "dnvme"
 #define LEVEL           APPNAME
 
+/* Log levels of the log_level module parameter, each includes those below */
+#define LOG_LVL_NONE    0       /* Nothing at all */
+#define LOG_LVL_ERR     1       /* LOG_ERR */
+#define LOG_LVL_NRM     2       /* LOG_ERR, LOG_NRM */
+#define LOG_LVL_DBG     3       /* Everything, LOG_DBG at every site */
+
+#ifdef DEBUG
+#define LOG_LVL_DEFAULT LOG_LVL_DBG
+#else
+#define LOG_LVL_DEFAULT LOG_LVL_NRM
+#endif
+
+/* Log level in effect, writable at /sys/module/dnvme/parameters/log_level */
+extern unsigned int dnvme_log_level;
+
 /* LOG_NRM() macro should be used with caution. It was originally peppered
  * throughout the code and enough latency was introduced while running within
  * QEMU that tnmve would sometimes miss CE's arriving from the simulated hdw.
@@ -30,17 +47,38 @@
  * that the dnvme should be as efficient as possible made this issue disappear.
  */
 #define LOG_NRM(fmt, ...)    \
-    printk("%s: " fmt "\n", LEVEL, ## __VA_ARGS__)
+    do { \
+        if (dnvme_log_level >= LOG_LVL_NRM) { \
+            printk(KERN_INFO "%s: " fmt "\n", LEVEL, ## __VA_ARGS__); \
+        } \
+    } while (0)
+
+/* Errors are rate limited per call site, an error storm of failing cmds or
+ * latent CE's must not flood the console and stall the box.
+ */
 #define LOG_ERR(fmt, ...)    \
-    printk("%s-err:%s:%d: " fmt "\n", \
-    LEVEL, __FILE__, __LINE__, ## __VA_ARGS__)
-#ifdef DEBUG
+    do { \
+        if (dnvme_log_level >= LOG_LVL_ERR) { \
+            printk_ratelimited(KERN_ERR "%s-err:%s:%d: " fmt "\n", \
+                LEVEL, __FILE__, __LINE__, ## __VA_ARGS__); \
+        } \
+    } while (0)
+
+/* Debug output is compiled in always. It prints at every site when the log
+ * level is LOG_LVL_DBG, otherwise single sites can be turned on through
+ * dynamic_debug when the kernel has CONFIG_DYNAMIC_DEBUG, e.g.
+ * echo "file dnvme_queue.c +p" > <debugfs>/dynamic_debug/control
+ */
 #define LOG_DBG(fmt, ...)    \
-    printk("%s-dbg:%s:%d: " fmt "\n", \
-    LEVEL, __FILE__, __LINE__, ## __VA_ARGS__)
-#else
-#define LOG_DBG(fmt, ...)
-#endif
+    do { \
+        if (unlikely(dnvme_log_level >= LOG_LVL_DBG)) { \
+            printk(KERN_DEBUG "%s-dbg:%s:%d: " fmt "\n", \
+                LEVEL, __FILE__, __LINE__, ## __VA_ARGS__); \
+        } else { \
+            dynamic_pr_debug("%s-dbg:%s:%d: " fmt "\n", \
+                LEVEL, __FILE__, __LINE__, ## __VA_ARGS__); \
+        } \
+    } while (0)
 
 /* Debug flag for IOCT_SEND_64B module */
 #define TEST_PRP_DEBUG
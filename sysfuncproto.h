@@ -100,30 +100,72 @@ int driver_create_acq(struct nvme_create_admn_q *create_admn_q,
  * for prepating the IO SQ.
  * @param prep_sq
  * @param pmetrics_device
+ * @param filp file which owns the SQ
  * @return allocation of contig mem SUCCESS or FAIL.
  */
 int driver_nvme_prep_sq(struct nvme_prep_sq *prep_sq,
-    struct  metrics_device_list *pmetrics_device);
+    struct  metrics_device_list *pmetrics_device, struct file *filp);
 
 /**
  * driver_nvme_prep_cq - Driver routine to set up user parameters into metrics
  * for prepating the IO CQ.
  * @param prep_cq
  * @param pmetrics_device
+ * @param filp file which owns the CQ
  * @return allocation of contig mem SUCCESS or FAIL.
  */
 int driver_nvme_prep_cq(struct nvme_prep_cq *prep_cq,
-    struct  metrics_device_list *pmetrics_device);
+    struct  metrics_device_list *pmetrics_device, struct file *filp);
 
 /**
  * driver_send_64b - Routine for sending 64 bytes command into
  * admin/IO SQ/CQ's
  * @param pmetrics_device
  * @param nvme_64b_send
+ * @param filp file sending the cmd
  * @return Error Codes
  */
 int driver_send_64b(struct metrics_device_list *pmetrics_device,
-    struct nvme_64b_send *cmd_request);
+    struct nvme_64b_send *cmd_request, struct file *filp);
+
+/**
+ * driver_send_64b_batch - Routine for sending an array of 64 bytes commands
+ * into admin/IO SQ's while holding the device lock only once.
+ * @param pmetrics_device
+ * @param batch_request
+ * @param filp file sending the cmds
+ * @return 0 when all cmds were sent, else error code of the 1st failing cmd
+ */
+int driver_send_64b_batch(struct metrics_device_list *pmetrics_device,
+    struct nvme_64b_batch *batch_request, struct file *filp);
+
+/**
+ * driver_commit_sq - Routine for committing 64 bytes commands which user
+ * space wrote into a mmap'ed contiguous SQ, without copying them.
+ * @param pmetrics_device
+ * @param commit_request
+ * @param filp file which owns the SQ
+ * @return 0 when all cmds were committed, else error code of the 1st
+ * failing cmd
+ */
+int driver_commit_sq(struct metrics_device_list *pmetrics_device,
+    struct nvme_sq_commit *commit_request, struct file *filp);
+
+/**
+ * track_64b_cmd - Assign a unique ID to a 64 bytes command which already
+ * resides where it will be sent from, and set up the buffers it references.
+ * The caller holds the lock of the SQ.
+ * @param pmetrics_device
+ * @param pmetrics_sq
+ * @param user_data
+ * @param cmd_request user space descriptor receiving the unique ID, or NULL
+ * @param nvme_cmd_ker
+ * @param filp file on whose behalf the cmd is sent
+ * @return 0 on success, else error code
+ */
+int track_64b_cmd(struct metrics_device_list *pmetrics_device,
+    struct metrics_sq *pmetrics_sq, struct nvme_64b_send *user_data,
+    struct nvme_64b_send *cmd_request, void *nvme_cmd_ker, struct file *filp);
 
 /**
  * driver_toxic_dword - Please refer to the header file comment for
@@ -136,13 +178,6 @@ int driver_send_64b(struct metrics_device_list *pmetrics_device,
 int driver_toxic_dword(struct metrics_device_list *pmetrics_device,
     struct backdoor_inject *err_inject);
 
-/**
- * driver_log - Driver routine to log data into file from metrics
- * @param n_file
- * @return allocation of contig mem SUCCESS or FAIL.
- */
-int driver_log(struct nvme_file *n_file);
-
 /**
  * driver_logstr - Driver routine to log a custom string to the system log
  * @param logStr
@@ -150,6 +185,17 @@ int driver_log(struct nvme_file *n_file);
  */
 int driver_logstr(struct nvme_logstr *logStr);
 
+/**
+ * driver_snapshot - Driver routine to copy a binary snapshot of the device,
+ * its Q's, cmds outstanding, irqs and meta data buffers to user space.
+ * Called with the device locked exclusively.
+ * @param pmetrics_device
+ * @param snap_request
+ * @return SUCCESS, -ENOSPC with the size needed returned, or FAIL.
+ */
+int driver_snapshot(struct metrics_device_list *pmetrics_device,
+    struct nvme_snapshot *snap_request);
+
 /**
  * deallocate_all_queues - This function will start freeing up the memory for
  * the queues (SQ and CQ) allocated during the prepare queues. This function
@@ -169,10 +215,11 @@ void deallocate_all_queues(struct metrics_device_list *pmetrics_device,
  * for the corresponding CQ.
  * @param pmetrics_device
  * @param usr_reap_inq
+ * @param filp file inquiring
  * @return success or failure based on reap_inquiry
  */
 int driver_reap_inquiry(struct metrics_device_list *pmetrics_device,
-    struct nvme_reap_inquiry *usr_reap_inq);
+    struct nvme_reap_inquiry *usr_reap_inq, struct file *filp);
 
 /**
  * dnvme_device_open - This operation is always the first operation performed
@@ -208,10 +255,23 @@ int dnvme_device_mmap(struct file *filp, struct vm_area_struct *vma);
  * Return the CQ entry data in the buffer specified.
  * @param pmetrics_device
  * @param usr_reap_data
+ * @param filp file reaping
  * @return Success of Failure based on Reap Success or failure.
  */
 int driver_reap_cq(struct metrics_device_list *pmetrics_device,
-    struct nvme_reap *usr_reap_data);
+    struct nvme_reap *usr_reap_data, struct file *filp);
+
+/**
+ * driver_reap_wait - Sleep until the given CQ holds at least the requested
+ * number of CE's or the timeout expires. The device is unlocked while
+ * sleeping.
+ * @param pmetrics_device
+ * @param usr_reap_wait
+ * @param filp file waiting
+ * @return Success, ETIMEDOUT or failure.
+ */
+int driver_reap_wait(struct metrics_device_list *pmetrics_device,
+    struct nvme_reap_wait *usr_reap_wait, struct file *filp);
 
 /**
  * Create a dma pool for the requested size. Initialize the DMA pool pointer
@@ -229,20 +289,22 @@ int metabuff_create(struct metrics_device_list *pmetrics_device,
  * linked list.
  * @param pmetrics_device
  * @param meta_id
+ * @param filp file which owns the meta buffer
  * @return Success of Failure based on dma alloc Success or failure.
  */
 int metabuff_alloc(struct metrics_device_list *pmetrics_device,
-    u32 meta_id);
+    u32 meta_id, struct file *filp);
 
 /**
  * Delete a meta buffer node when user requests and deallocate a consistent
  * dma memory. Delete this node from the meta data linked list.
  * @param pmetrics_device
  * @param meta_id
+ * @param filp file deleting it
  * @return Success of Failure based on metabuff delete
  */
 int metabuff_del(struct metrics_device_list *pmetrics_device,
-    u32 meta_id);
+    u32 meta_id, struct file *filp);
 
 /*
  * deallocate_mb will free up the memory and nodes for the meta buffers
@@ -252,6 +314,72 @@ int metabuff_del(struct metrics_device_list *pmetrics_device,
  */
 void deallocate_mb(struct metrics_device_list *pmetrics_device);
 
+/*
+ * release_file_mb will free the meta buffers allocated by the given file, or
+ * hand them to the controlling file while cmds still outstanding may
+ * transfer to them. Those are freed along with the other meta buffers once
+ * the controller is disabled.
+ * @param pmetrics_device
+ * @param filp
+ * @param in_use set if outstanding cmds may use the buffers
+ */
+void release_file_mb(struct metrics_device_list *pmetrics_device,
+    struct file *filp, u8 in_use);
+
+/**
+ * Register a user space data buffer, it is pinned down and mapped for DMA
+ * once and a handle to reference it from 64B cmds is returned to user space.
+ * @param pmetrics_device
+ * @param reg_buf_request
+ * @param filp file which owns the buffer
+ * @return Error codes
+ */
+int driver_reg_buf(struct metrics_device_list *pmetrics_device,
+    struct nvme_reg_buf *reg_buf_request, struct file *filp);
+
+/**
+ * Unregister the data buffer of the given handle, unpinning and unmapping it.
+ * @param pmetrics_device
+ * @param buf_id
+ * @param filp file unregistering it
+ * @return Error codes, EBUSY while outstanding cmds reference the buffer
+ */
+int driver_unreg_buf(struct metrics_device_list *pmetrics_device,
+    u32 buf_id, struct file *filp);
+
+/**
+ * deallocate_reg_bufs will unpin, unmap and free every registered buffer
+ * of the device.
+ * @param pmetrics_device
+ */
+void deallocate_reg_bufs(struct metrics_device_list *pmetrics_device);
+
+/**
+ * deallocate_file_reg_bufs will unpin, unmap and free the registered buffers
+ * of the given file which no outstanding cmd references anymore.
+ * @param pmetrics_device
+ * @param filp
+ */
+void deallocate_file_reg_bufs(struct metrics_device_list *pmetrics_device,
+    struct file *filp);
+
+/**
+ * get_device_ref will look up the device of the given minor no. in the
+ * registry and take a ref on it, so that it stays allocated after the
+ * registry mutex is dropped. The device may be hot removed meanwhile, which
+ * callers check once they locked it.
+ * @param minor
+ * @return the device, or NULL if no device has the minor no.
+ */
+struct metrics_device_list *get_device_ref(int minor);
+
+/**
+ * put_device_ref will drop a ref taken by get_device_ref or dnvme_open, the
+ * last one frees the device. Must not be called with the device locked.
+ * @param pmetrics_device
+ */
+void put_device_ref(struct metrics_device_list *pmetrics_device);
+
 int check_cntlr_cap(struct pci_dev *pdev, enum nvme_irq_type cap_type,
     u16 *offset);
 
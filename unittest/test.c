@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
@@ -19,6 +20,7 @@
 
 #include "test_metrics.h"
 #include "test_irq.h"
+#include "test_fastpath.h"
 
 #define DEVICE_FILE_NAME "/dev/nvme0"
 #define RANDOM_VAL      10
@@ -304,26 +306,45 @@ void tst_ring_dbl(int file_desc)
     ioctl_tst_ring_dbl(file_desc, 0);
 }
 
+/* Concatenate the debugfs files of the device into tmpfile */
 void ioctl_dump(int file_desc, char *tmpfile)
 {
-    int ret_val = -1;
-    struct nvme_file pfile;
-
-    pfile.flen = strlen(tmpfile);
-
-    //printf("size = %d\n", pfile.flen);
-
-    pfile.file_name = malloc(pfile.flen);
-    strcpy((char *)pfile.file_name, tmpfile);
+    static const char *files[] = { "device", "queues", "commands", "irqs",
+        "meta" };
+    char path[64];
+    char buf[4096];
+    struct stat st;
+    FILE *in, *out;
+    size_t n, i;
 
-    printf("File name = %s\n", pfile.file_name);
+    printf("File name = %s\n", tmpfile);
 
-    ret_val = ioctl(file_desc, NVME_IOCTL_DUMP_METRICS, &pfile);
-    if(ret_val < 0)
+    if (fstat(file_desc, &st) < 0) {
         printf("Dump Metrics failed!\n");
-    else
-        printf("Dump Metrics SUCCESS\n");
-
+        return;
+    }
+    out = fopen(tmpfile, "w");
+    if (out == NULL) {
+        printf("Dump Metrics failed!\n");
+        return;
+    }
+    for (i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+        snprintf(path, sizeof(path), "/sys/kernel/debug/dnvme/nvme%d/%s",
+            minor(st.st_rdev), files[i]);
+        in = fopen(path, "r");
+        if (in == NULL) {
+            printf("Dump Metrics failed, is debugfs mounted?\n");
+            fclose(out);
+            return;
+        }
+        fprintf(out, "%s:\n", files[i]);
+        while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+            fwrite(buf, 1, n, out);
+        }
+        fclose(in);
+    }
+    fclose(out);
+    printf("Dump Metrics SUCCESS\n");
 }
 
 int test_prp(int file_desc)
@@ -814,10 +835,64 @@ int main()
             ioctl_write_data(file_desc);
             ioctl_dump(file_desc, "/tmp/temp_irq35.txt");
             break;
+        /* Cases from 36 on need the IO Q's of case 30 and irqs of case 17 */
+        case 36:
+            printf("Test to send batches of 64B cmds\n");
+            test_batch(file_desc);
+            break;
+        case 37:
+            printf("Test to send cmds using registered buffers\n");
+            test_reg_buf(file_desc);
+            break;
+        case 38:
+            printf("Test to sleep until CE's arrive with Reap Wait\n");
+            test_reap_wait(file_desc);
+            break;
+        case 39:
+            printf("Test poll() on the device and Get Ready CQ's\n");
+            test_ready_cqs(file_desc);
+            break;
+        case 40:
+            printf("Test the eventfd of an IRQ enabled CQ\n");
+            test_cq_eventfd(file_desc);
+            break;
+        case 41:
+            printf("Test to commit cmds written into a mmap'ed SQ\n");
+            test_commit_sq(file_desc);
+            break;
+        case 42:
+            printf("Test shared memory rings drained by Ring Enter\n");
+            test_rings(file_desc, 0);
+            break;
+        case 43:
+            printf("Test shared memory rings drained by a kernel thread\n");
+            test_rings(file_desc, 1);
+            break;
+        case 44:
+            printf("Test reaping with busy and hybrid polling\n");
+            test_reap_poll(file_desc);
+            break;
+        case 45:
+            printf("Test latency histograms\n");
+            test_lat_stats(file_desc);
+            break;
+        case 46:
+            printf("Test perf counters\n");
+            test_perf_stats(file_desc);
+            break;
+        case 47:
+            printf("Test binary snapshot of the device\n");
+            test_snapshot(file_desc);
+            ioctl_dump(file_desc, "/tmp/temp_snapshot47.txt");
+            break;
+        case 48:
+            printf("Test sharing the device with a 2nd file\n");
+            test_share(file_desc, DEVICE_FILE_NAME);
+            break;
         default:
             printf("\nUndefined case!\n");
         }
-    } while (test_case < 36);
+    } while (test_case < 49);
 
     printf("\nCalling Dump Metrics to closefile\n");
     ioctl_dump(file_desc, closefile);
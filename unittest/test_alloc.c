@@ -121,6 +121,8 @@ void ioctl_reap_cq(int file_desc, int cq_id, int elements, int size, int display
     rp_cq.q_id = cq_id;
     rp_cq.elements = elements;
     rp_cq.size = (size * elements);
+    rp_cq.poll_us = 0;
+    rp_cq.poll_hybrid = 0;
     rp_cq.buffer = malloc(sizeof(char) * rp_cq.size);
     if (rp_cq.buffer == NULL) {
         printf("Malloc Failed");
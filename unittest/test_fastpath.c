@@ -0,0 +1,1065 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include "../dnvme_interface.h"
+#include "../dnvme_ioctls.h"
+
+#include "test_metrics.h"
+#include "test_irq.h"
+#include "test_fastpath.h"
+
+/*
+ * The ioctl helpers of the fast path return -errno on failure, the tests
+ * check for the exact error the driver has to report.
+ */
+
+/* Fill a read of 16 LBA's of NSID 1 into addr, addr NULL leaves no data */
+void fill_nvme_read(struct nvme_64b_send *user_cmd,
+    struct nvme_user_io *nvme_read, uint16_t sq_id, void *addr)
+{
+    memset(nvme_read, 0, sizeof(struct nvme_user_io));
+    nvme_read->opcode = 0x02;
+    nvme_read->nsid = 1;
+    nvme_read->slba = 0;
+    nvme_read->nlb = 15;
+
+    memset(user_cmd, 0, sizeof(struct nvme_64b_send));
+    user_cmd->q_id = sq_id;
+    user_cmd->bit_mask = (MASK_PRP1_PAGE | MASK_PRP1_LIST |
+        MASK_PRP2_PAGE | MASK_PRP2_LIST);
+    user_cmd->cmd_buf_ptr = (u_int8_t *) nvme_read;
+    user_cmd->data_buf_size = (addr != NULL) ? READ_BUFFER_SIZE : 0;
+    user_cmd->data_buf_ptr = addr;
+    user_cmd->reg_buf_id = 0;
+    user_cmd->data_dir = 0;
+}
+
+int ioctl_send_batch(int file_desc, struct nvme_64b_send *cmds,
+    struct nvme_64b_status *sts, uint32_t num_cmds, uint8_t ring_dbl)
+{
+    int ret_val;
+    uint32_t i;
+    struct nvme_64b_batch batch;
+
+    batch.num_cmds = num_cmds;
+    batch.ring_dbl = ring_dbl;
+    batch.cmds = cmds;
+    batch.status = sts;
+
+    ret_val = ioctl(file_desc, NVME_IOCTL_SEND_64B_BATCH, &batch);
+    ret_val = (ret_val < 0) ? -errno : ret_val;
+    printf("\tBatch of %u cmds returned %d\n", num_cmds, ret_val);
+    if ((ret_val == 0) || (ret_val == -EFAULT) || (num_cmds == 0) ||
+        (num_cmds > MAX_64B_BATCH_CMDS)) {
+        return ret_val;
+    }
+    for (i = 0; i < num_cmds; i++) {
+        printf("\t\tCmd %u: SQ ID = %d, Err = %d, Unique ID = %d\n", i,
+            sts[i].q_id, sts[i].err, sts[i].unique_id);
+    }
+    return ret_val;
+}
+
+int ioctl_reg_buf(int file_desc, void *addr, uint32_t size, uint8_t data_dir,
+    uint32_t *buf_id)
+{
+    int ret_val;
+    struct nvme_reg_buf reg_buf;
+
+    reg_buf.buf_ptr = addr;
+    reg_buf.buf_size = size;
+    reg_buf.data_dir = data_dir;
+    reg_buf.buf_id = 0;
+
+    ret_val = ioctl(file_desc, NVME_IOCTL_REG_BUF, &reg_buf);
+    if (ret_val < 0) {
+        ret_val = -errno;
+        printf("\tRegistering %u bytes failed = %d\n", size, ret_val);
+    } else {
+        *buf_id = reg_buf.buf_id;
+        printf("\tRegistered %u bytes, Buf ID = %u\n", size, *buf_id);
+    }
+    return ret_val;
+}
+
+int ioctl_unreg_buf(int file_desc, uint32_t buf_id)
+{
+    int ret_val;
+
+    ret_val = ioctl(file_desc, NVME_IOCTL_UNREG_BUF, buf_id);
+    ret_val = (ret_val < 0) ? -errno : ret_val;
+    printf("\tUnregistering Buf ID = %u returned %d\n", buf_id, ret_val);
+    return ret_val;
+}
+
+/* Returns the no. of CE's waiting in the CQ */
+int ioctl_reap_wait(int file_desc, uint16_t cq_id, uint32_t min_elements,
+    uint32_t timeout_ms)
+{
+    int ret_val;
+    struct nvme_reap_wait rp_wait;
+
+    rp_wait.q_id = cq_id;
+    rp_wait.min_elements = min_elements;
+    rp_wait.timeout_ms = timeout_ms;
+    rp_wait.num_remaining = 0;
+    rp_wait.isr_count = 0;
+
+    ret_val = ioctl(file_desc, NVME_IOCTL_REAP_WAIT, &rp_wait);
+    if (ret_val < 0) {
+        ret_val = -errno;
+        printf("\tReap Wait on CQ ID = %d failed = %d, Num_Remaining = %d\n",
+            cq_id, ret_val, rp_wait.num_remaining);
+        return ret_val;
+    }
+    printf("\tReap Wait on CQ ID = %d, Num_Remaining = %d, ISR_count = %d\n",
+        cq_id, rp_wait.num_remaining, rp_wait.isr_count);
+    return rp_wait.num_remaining;
+}
+
+/* Returns the no. of CQ's set in bitmap */
+int ioctl_get_ready_cqs(int file_desc, uint8_t *bitmap, uint32_t num_cq_ids)
+{
+    int ret_val;
+    struct nvme_ready_cqs ready_cqs;
+
+    ready_cqs.num_cq_ids = num_cq_ids;
+    ready_cqs.num_ready = 0;
+    ready_cqs.bitmap = bitmap;
+
+    ret_val = ioctl(file_desc, NVME_IOCTL_GET_READY_CQS, &ready_cqs);
+    if (ret_val < 0) {
+        ret_val = -errno;
+        printf("\tGet Ready CQ's failed = %d\n", ret_val);
+        return ret_val;
+    }
+    printf("\tNo. of ready CQ's = %d\n", ready_cqs.num_ready);
+    return ready_cqs.num_ready;
+}
+
+int ioctl_set_cq_eventfd(int file_desc, uint16_t cq_id, int efd)
+{
+    int ret_val;
+    struct nvme_cq_eventfd cq_eventfd;
+
+    cq_eventfd.q_id = cq_id;
+    cq_eventfd.fd = efd;
+
+    ret_val = ioctl(file_desc, NVME_IOCTL_SET_CQ_EVENTFD, &cq_eventfd);
+    ret_val = (ret_val < 0) ? -errno : ret_val;
+    printf("\tSetting eventfd %d of CQ ID = %d returned %d\n", efd, cq_id,
+        ret_val);
+    return ret_val;
+}
+
+/* Returns the no. of cmds committed */
+int ioctl_commit_sq(int file_desc, uint16_t sq_id, uint16_t new_tail,
+    struct nvme_64b_send *cmds, uint8_t ring_dbl)
+{
+    int ret_val;
+    struct nvme_sq_commit commit;
+
+    commit.q_id = sq_id;
+    commit.new_tail = new_tail;
+    commit.ring_dbl = ring_dbl;
+    commit.cmds = cmds;
+    commit.num_committed = 0;
+
+    ret_val = ioctl(file_desc, NVME_IOCTL_COMMIT_SQ, &commit);
+    ret_val = (ret_val < 0) ? -errno : commit.num_committed;
+    printf("\tCommit up to tail %d of SQ ID = %d returned %d\n", new_tail,
+        sq_id, ret_val);
+    return ret_val;
+}
+
+int ioctl_setup_rings(int file_desc, struct nvme_rings_setup *setup)
+{
+    int ret_val;
+
+    ret_val = ioctl(file_desc, NVME_IOCTL_SETUP_RINGS, setup);
+    ret_val = (ret_val < 0) ? -errno : ret_val;
+    printf("\tSetup rings %u:%u of SQ ID = %d returned %d\n",
+        setup->sq_entries, setup->cq_entries, setup->sq_id, ret_val);
+    return ret_val;
+}
+
+int ioctl_ring_enter(int file_desc, uint16_t sq_id, uint32_t *num_submitted,
+    uint32_t *num_reaped)
+{
+    int ret_val;
+    struct nvme_ring_enter enter;
+
+    enter.sq_id = sq_id;
+    enter.num_submitted = 0;
+    enter.num_reaped = 0;
+
+    ret_val = ioctl(file_desc, NVME_IOCTL_RING_ENTER, &enter);
+    ret_val = (ret_val < 0) ? -errno : ret_val;
+    *num_submitted = enter.num_submitted;
+    *num_reaped = enter.num_reaped;
+    return ret_val;
+}
+
+/* Returns the no. of CE's reaped */
+int ioctl_reap_poll(int file_desc, uint16_t cq_id, uint32_t elements,
+    uint32_t poll_us, uint8_t poll_hybrid)
+{
+    int ret_val;
+    struct nvme_reap rp_cq;
+
+    rp_cq.q_id = cq_id;
+    rp_cq.elements = elements;
+    rp_cq.size = (16 * elements);
+    rp_cq.poll_us = poll_us;
+    rp_cq.poll_hybrid = poll_hybrid;
+    rp_cq.buffer = malloc(sizeof(char) * rp_cq.size);
+    if (rp_cq.buffer == NULL) {
+        printf("Malloc Failed");
+        return -ENOMEM;
+    }
+    ret_val = ioctl(file_desc, NVME_IOCTL_REAP, &rp_cq);
+    if (ret_val < 0) {
+        ret_val = -errno;
+        printf("\tReap polling %u us failed = %d\n", poll_us, ret_val);
+    } else {
+        ret_val = rp_cq.num_reaped;
+        printf("\tReaped on CQ ID = %d polling %u us, No Reaped = %d,"
+            " No Rem = %d\n", cq_id, poll_us, rp_cq.num_reaped,
+            rp_cq.num_remaining);
+    }
+    free(rp_cq.buffer);
+    return ret_val;
+}
+
+int ioctl_lat_stats(int file_desc, uint16_t sq_id, uint8_t ctl, uint8_t reset,
+    uint32_t *buffer)
+{
+    int ret_val;
+    struct nvme_lat_stats lat;
+
+    lat.sq_id = sq_id;
+    lat.ctl = ctl;
+    lat.reset = reset;
+    lat.enabled = 0;
+    lat.buffer = buffer;
+
+    ret_val = ioctl(file_desc, NVME_IOCTL_LAT_STATS, &lat);
+    if (ret_val < 0) {
+        ret_val = -errno;
+        printf("\tLatency stats of SQ ID = %d failed = %d\n", sq_id, ret_val);
+        return ret_val;
+    }
+    printf("\tLatency recording is %s\n", lat.enabled ? "on" : "off");
+    return ret_val;
+}
+
+/* Returns the no. of bytes written to buffer */
+int ioctl_perf_stats(int file_desc, uint8_t scope, uint16_t q_id,
+    uint8_t reset, void *buffer, uint32_t size)
+{
+    int ret_val;
+    struct nvme_perf_stats perf;
+
+    perf.version = 0;
+    perf.scope = scope;
+    perf.reset = reset;
+    perf.q_id = q_id;
+    perf.size = size;
+    perf.buffer = buffer;
+
+    ret_val = ioctl(file_desc, NVME_IOCTL_PERF_STATS, &perf);
+    if (ret_val < 0) {
+        ret_val = -errno;
+        printf("\tPerf stats of scope %d failed = %d\n", scope, ret_val);
+        return ret_val;
+    }
+    printf("\tPerf stats version %u, %u bytes\n", perf.version, perf.size);
+    return perf.size;
+}
+
+/* size passes the size of buffer in and returns the size of the snapshot */
+int ioctl_snapshot(int file_desc, void *buffer, uint32_t *size)
+{
+    int ret_val;
+    struct nvme_snapshot snap;
+
+    snap.size = *size;
+    snap.buffer = buffer;
+
+    ret_val = ioctl(file_desc, NVME_IOCTL_SNAPSHOT, &snap);
+    ret_val = (ret_val < 0) ? -errno : ret_val;
+    *size = snap.size;
+    printf("\tSnapshot returned %d, size = %u\n", ret_val, *size);
+    return ret_val;
+}
+
+/* Reap whatever is waiting in the CQ, so the tests start from an empty CQ */
+static void drain_cq(int file_desc, uint16_t cq_id)
+{
+    int num;
+
+    num = ioctl_reap_inquiry(file_desc, cq_id);
+    if (num > 0) {
+        ioctl_reap_cq(file_desc, cq_id, num, 16, 0);
+    }
+}
+
+static void wait_and_reap(int file_desc, uint16_t cq_id, uint32_t elements)
+{
+    if (ioctl_reap_wait(file_desc, cq_id, elements, 1000) < (int)elements) {
+        printf("\tCE's did not arrive in time!\n");
+    }
+    ioctl_reap_cq(file_desc, cq_id, elements, 16, 0);
+}
+
+static void report(const char *name, int pass)
+{
+    printf("%s %s\n", name, pass ? "PASS" : "FAIL");
+}
+
+void test_batch(int file_desc)
+{
+    int ret_val;
+    uint32_t i;
+    void *addr;
+    struct nvme_64b_send cmds[3];
+    struct nvme_user_io nvme_read[3];
+    struct nvme_64b_status sts[3];
+
+    if (posix_memalign(&addr, 4096, 3 * READ_BUFFER_SIZE)) {
+        printf("Memalign Failed");
+        return;
+    }
+    drain_cq(file_desc, FP_CQ_ID);
+    drain_cq(file_desc, FP_CQ2_ID);
+
+    printf("\nTEST: Batch of 3 reads, the 2nd one lacks its data buffer\n");
+    for (i = 0; i < 3; i++) {
+        fill_nvme_read(&cmds[i], &nvme_read[i], FP_SQ_ID,
+            addr + (i * READ_BUFFER_SIZE));
+    }
+    cmds[1].data_buf_ptr = NULL;
+    ret_val = ioctl_send_batch(file_desc, cmds, sts, 3, 1);
+    report("Bad cmd in the middle of a batch",
+        (ret_val == -EINVAL) && (sts[0].err == 0) &&
+        (sts[1].err == -EINVAL) && (sts[2].err == 0) &&
+        (sts[0].unique_id != sts[2].unique_id));
+    wait_and_reap(file_desc, FP_CQ_ID, 2);
+
+    printf("\nTEST: Batch of 3 cmds, the 2nd one to the ASQ\n");
+    for (i = 0; i < 3; i++) {
+        fill_nvme_read(&cmds[i], &nvme_read[i], FP_SQ_ID,
+            addr + (i * READ_BUFFER_SIZE));
+    }
+    cmds[1].q_id = 0;
+    ret_val = ioctl_send_batch(file_desc, cmds, sts, 3, 1);
+    report("ASQ cmd not leading a batch",
+        (ret_val == -EAGAIN) && (sts[0].err == 0) &&
+        (sts[1].err == -EAGAIN) && (sts[2].err == 0));
+    wait_and_reap(file_desc, FP_CQ_ID, 2);
+
+    printf("\nTEST: Batch of 3 reads to 2 SQ's, each doorbell rung once\n");
+    for (i = 0; i < 3; i++) {
+        fill_nvme_read(&cmds[i], &nvme_read[i], (i == 1) ? FP_SQ2_ID :
+            FP_SQ_ID, addr + (i * READ_BUFFER_SIZE));
+    }
+    ret_val = ioctl_send_batch(file_desc, cmds, sts, 3, 1);
+    report("Batch to 2 SQ's", (ret_val == 0) && (sts[0].err == 0) &&
+        (sts[1].err == 0) && (sts[2].err == 0));
+    wait_and_reap(file_desc, FP_CQ_ID, 2);
+    wait_and_reap(file_desc, FP_CQ2_ID, 1);
+
+    printf("\nTEST: Batches of 0 and of too many cmds\n");
+    ret_val = ioctl_send_batch(file_desc, cmds, sts, 0, 1);
+    report("Empty batch", ret_val == -EINVAL);
+    ret_val = ioctl_send_batch(file_desc, cmds, sts, MAX_64B_BATCH_CMDS + 1,
+        1);
+    report("Oversized batch", ret_val == -EINVAL);
+
+    free(addr);
+}
+
+void test_reg_buf(int file_desc)
+{
+    int ret_val;
+    uint32_t i, buf_id, buf_size;
+    void *addr;
+    struct nvme_64b_send user_cmd;
+    struct nvme_user_io nvme_read;
+    /* Offset and size of the data within the buffer, the expected result */
+    struct {
+        uint32_t offset;
+        uint32_t size;
+        int err;
+    } bounds[] = {
+        { 0, READ_BUFFER_SIZE, 0 },
+        { 3 * READ_BUFFER_SIZE, READ_BUFFER_SIZE, 0 },
+        { 4 * READ_BUFFER_SIZE, READ_BUFFER_SIZE, -EINVAL },
+        { (4 * READ_BUFFER_SIZE) - 4, READ_BUFFER_SIZE, -EINVAL },
+        { READ_BUFFER_SIZE, 0xFFFFFFFF, -EINVAL },
+        { READ_BUFFER_SIZE, 0, -EINVAL },
+    };
+
+    buf_size = 4 * READ_BUFFER_SIZE;
+    if (posix_memalign(&addr, 4096, buf_size)) {
+        printf("Memalign Failed");
+        return;
+    }
+    drain_cq(file_desc, FP_CQ_ID);
+
+    printf("\nTEST: Register misaligned and empty buffers\n");
+    ret_val = ioctl_reg_buf(file_desc, addr + 1, buf_size - 4, 2, &buf_id);
+    report("Misaligned buffer", ret_val == -EINVAL);
+    ret_val = ioctl_reg_buf(file_desc, addr, 0, 2, &buf_id);
+    report("Empty buffer", ret_val == -EINVAL);
+
+    printf("\nTEST: Send reads at the bounds of a registered buffer\n");
+    ret_val = ioctl_reg_buf(file_desc, addr, buf_size, 2, &buf_id);
+    if (ret_val < 0) {
+        free(addr);
+        return;
+    }
+    for (i = 0; i < sizeof(bounds) / sizeof(bounds[0]); i++) {
+        fill_nvme_read(&user_cmd, &nvme_read, FP_SQ_ID, NULL);
+        user_cmd.reg_buf_id = buf_id;
+        user_cmd.reg_buf_offset = bounds[i].offset;
+        user_cmd.data_buf_size = bounds[i].size;
+        ret_val = ioctl(file_desc, NVME_IOCTL_SEND_64B_CMD, &user_cmd);
+        ret_val = (ret_val < 0) ? -errno : ret_val;
+        printf("\tOffset = %u, Size = %u returned %d\n", bounds[i].offset,
+            bounds[i].size, ret_val);
+        report("Registered buffer bounds", ret_val == bounds[i].err);
+    }
+
+    fill_nvme_read(&user_cmd, &nvme_read, FP_SQ_ID, addr);
+    user_cmd.reg_buf_id = buf_id;
+    ret_val = ioctl(file_desc, NVME_IOCTL_SEND_64B_CMD, &user_cmd);
+    ret_val = (ret_val < 0) ? -errno : ret_val;
+    report("Registered and data buffer both given", ret_val == -EINVAL);
+
+    ioctl_tst_ring_dbl(file_desc, FP_SQ_ID);
+    ret_val = ioctl_unreg_buf(file_desc, buf_id);
+    report("Unregister while cmds are outstanding", ret_val == -EBUSY);
+
+    wait_and_reap(file_desc, FP_CQ_ID, 2);
+    ret_val = ioctl_unreg_buf(file_desc, buf_id);
+    report("Unregister once reaped", ret_val == 0);
+
+    free(addr);
+}
+
+void test_reap_wait(int file_desc)
+{
+    int ret_val;
+    uint32_t i;
+    void *addr;
+    struct nvme_64b_send user_cmd;
+    struct nvme_user_io nvme_read;
+
+    if (posix_memalign(&addr, 4096, READ_BUFFER_SIZE)) {
+        printf("Memalign Failed");
+        return;
+    }
+    drain_cq(file_desc, FP_CQ_ID);
+
+    printf("\nTEST: Reap Wait on an empty CQ times out\n");
+    ret_val = ioctl_reap_wait(file_desc, FP_CQ_ID, 1, 10);
+    report("Reap Wait timeout", ret_val == -ETIMEDOUT);
+    ret_val = ioctl_reap_wait(file_desc, FP_CQ_ID, 1, 0);
+    report("Reap Wait check once", ret_val == -ETIMEDOUT);
+    ret_val = ioctl_reap_wait(file_desc, 0xFFFF, 1, 10);
+    report("Reap Wait on missing CQ", ret_val == -ENODEV);
+
+    printf("\nTEST: Reap Wait for 2 reads\n");
+    for (i = 0; i < 2; i++) {
+        fill_nvme_read(&user_cmd, &nvme_read, FP_SQ_ID, addr);
+        if (ioctl(file_desc, NVME_IOCTL_SEND_64B_CMD, &user_cmd) < 0) {
+            printf("Sending of Command Failed!\n");
+        }
+    }
+    ioctl_tst_ring_dbl(file_desc, FP_SQ_ID);
+    ret_val = ioctl_reap_wait(file_desc, FP_CQ_ID, 2, 1000);
+    report("Reap Wait for 2 CE's", ret_val >= 2);
+    ioctl_reap_cq(file_desc, FP_CQ_ID, 2, 16, 0);
+
+    free(addr);
+}
+
+void test_ready_cqs(int file_desc)
+{
+    int ret_val;
+    uint32_t i;
+    /* The CQ's of cases 17 and 30 */
+    uint16_t cq_ids[] = { 0, 20, 21, 22, 23 };
+    void *addr;
+    uint8_t bitmap[FP_NUM_CQ_IDS / 8];
+    struct pollfd pfd;
+    struct nvme_64b_send user_cmd;
+    struct nvme_user_io nvme_read;
+
+    if (posix_memalign(&addr, 4096, READ_BUFFER_SIZE)) {
+        printf("Memalign Failed");
+        return;
+    }
+    /* Any CQ holding CE's makes the device readable */
+    for (i = 0; i < sizeof(cq_ids) / sizeof(cq_ids[0]); i++) {
+        drain_cq(file_desc, cq_ids[i]);
+    }
+    pfd.fd = file_desc;
+    pfd.events = POLLIN;
+
+    printf("\nTEST: poll() and Get Ready CQ's with nothing to reap\n");
+    ret_val = poll(&pfd, 1, 0);
+    report("poll() of an idle device", ret_val == 0);
+    memset(bitmap, 0xFF, sizeof(bitmap));
+    ret_val = ioctl_get_ready_cqs(file_desc, bitmap, FP_NUM_CQ_IDS);
+    report("No ready CQ's", (ret_val == 0) &&
+        ((bitmap[FP_CQ_ID / 8] & (1 << (FP_CQ_ID % 8))) == 0));
+    ret_val = ioctl_get_ready_cqs(file_desc, bitmap, 0);
+    report("Bitmap of 0 CQ ID's", ret_val == -EINVAL);
+
+    printf("\nTEST: poll() and Get Ready CQ's with a read to reap\n");
+    fill_nvme_read(&user_cmd, &nvme_read, FP_SQ_ID, addr);
+    if (ioctl(file_desc, NVME_IOCTL_SEND_64B_CMD, &user_cmd) < 0) {
+        printf("Sending of Command Failed!\n");
+    }
+    ioctl_tst_ring_dbl(file_desc, FP_SQ_ID);
+    ret_val = poll(&pfd, 1, 1000);
+    report("poll() reports the device readable",
+        (ret_val == 1) && (pfd.revents & POLLIN));
+    ret_val = ioctl_get_ready_cqs(file_desc, bitmap, FP_NUM_CQ_IDS);
+    report("CQ is ready", (ret_val >= 1) &&
+        (bitmap[FP_CQ_ID / 8] & (1 << (FP_CQ_ID % 8))));
+    ioctl_reap_cq(file_desc, FP_CQ_ID, 1, 16, 0);
+
+    free(addr);
+}
+
+void test_cq_eventfd(int file_desc)
+{
+    int ret_val, efd;
+    uint64_t count = 0;
+    void *addr;
+    struct pollfd pfd;
+    struct nvme_64b_send user_cmd;
+    struct nvme_user_io nvme_read;
+
+    if (posix_memalign(&addr, 4096, READ_BUFFER_SIZE)) {
+        printf("Memalign Failed");
+        return;
+    }
+    efd = eventfd(0, EFD_NONBLOCK);
+    if (efd < 0) {
+        printf("eventfd Failed");
+        free(addr);
+        return;
+    }
+    drain_cq(file_desc, FP_CQ_ID);
+
+    printf("\nTEST: Attach an eventfd to a missing CQ\n");
+    ret_val = ioctl_set_cq_eventfd(file_desc, 0xFFFF, efd);
+    report("eventfd of missing CQ", ret_val < 0);
+
+    printf("\nTEST: eventfd is signalled by the irq of its CQ\n");
+    ret_val = ioctl_set_cq_eventfd(file_desc, FP_CQ_ID, efd);
+    report("Attach eventfd", ret_val == 0);
+    fill_nvme_read(&user_cmd, &nvme_read, FP_SQ_ID, addr);
+    if (ioctl(file_desc, NVME_IOCTL_SEND_64B_CMD, &user_cmd) < 0) {
+        printf("Sending of Command Failed!\n");
+    }
+    ioctl_tst_ring_dbl(file_desc, FP_SQ_ID);
+    pfd.fd = efd;
+    pfd.events = POLLIN;
+    ret_val = poll(&pfd, 1, 1000);
+    if ((ret_val == 1) && (read(efd, &count, sizeof(count)) != sizeof(count))) {
+        count = 0;
+    }
+    printf("\teventfd count = %lu\n", (unsigned long)count);
+    report("eventfd signalled", count >= 1);
+    wait_and_reap(file_desc, FP_CQ_ID, 1);
+
+    printf("\nTEST: Detached eventfd is no longer signalled\n");
+    ret_val = ioctl_set_cq_eventfd(file_desc, FP_CQ_ID, -1);
+    report("Detach eventfd", ret_val == 0);
+    if (ioctl(file_desc, NVME_IOCTL_SEND_64B_CMD, &user_cmd) < 0) {
+        printf("Sending of Command Failed!\n");
+    }
+    ioctl_tst_ring_dbl(file_desc, FP_SQ_ID);
+    wait_and_reap(file_desc, FP_CQ_ID, 1);
+    ret_val = poll(&pfd, 1, 0);
+    report("eventfd not signalled", ret_val == 0);
+
+    close(efd);
+    free(addr);
+}
+
+void test_commit_sq(int file_desc)
+{
+    int ret_val;
+    uint32_t i, slot, sq_size;
+    uint16_t tail;
+    uint8_t *sq;
+    void *addr;
+    struct nvme_gen_cmd *gen_cmd;
+    struct nvme_gen_sq gen_sq;
+    struct nvme_get_q_metrics get_q_metrics;
+    struct nvme_64b_send cmds[2];
+    struct nvme_user_io nvme_read;
+
+    if (posix_memalign(&addr, 4096, 2 * READ_BUFFER_SIZE)) {
+        printf("Memalign Failed");
+        return;
+    }
+    drain_cq(file_desc, FP_COMMIT_CQ_ID);
+
+    get_q_metrics.q_id = FP_COMMIT_SQ_ID;
+    get_q_metrics.type = METRICS_SQ;
+    get_q_metrics.nBytes = sizeof(struct nvme_gen_sq);
+    get_q_metrics.buffer = (uint8_t *)&gen_sq;
+    if (ioctl(file_desc, NVME_IOCTL_GET_Q_METRICS, &get_q_metrics) < 0) {
+        printf("\tQ metrics could not be checked!\n");
+        free(addr);
+        return;
+    }
+    sq_size = gen_sq.elements * 64;
+    sq = mmap(0, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED, file_desc,
+        (off_t)((1 << 0x12) | FP_COMMIT_SQ_ID) * PAGE_SIZE_I);
+    if (sq == MAP_FAILED) {
+        printf("mapping failed\n");
+        free(addr);
+        return;
+    }
+
+    /* Write 2 reads into the slots following tail_ptr_virt */
+    tail = gen_sq.tail_ptr_virt;
+    for (i = 0; i < 2; i++) {
+        fill_nvme_read(&cmds[i], &nvme_read, FP_COMMIT_SQ_ID,
+            addr + (i * READ_BUFFER_SIZE));
+        slot = (tail + i) % gen_sq.elements;
+        memcpy(sq + (slot * 64), &nvme_read, sizeof(struct nvme_user_io));
+    }
+
+    printf("\nTEST: Commit to the ASQ and past the end of the SQ\n");
+    ret_val = ioctl_commit_sq(file_desc, 0, 1, NULL, 0);
+    report("Commit to the ASQ", ret_val == -EINVAL);
+    ret_val = ioctl_commit_sq(file_desc, FP_COMMIT_SQ_ID, gen_sq.elements,
+        cmds, 0);
+    report("Commit past the end of the SQ", ret_val == -EINVAL);
+
+    printf("\nTEST: Commit 2 reads written into the mmap'ed SQ\n");
+    ret_val = ioctl_commit_sq(file_desc, FP_COMMIT_SQ_ID,
+        (tail + 2) % gen_sq.elements, cmds, 1);
+    report("Commit 2 cmds", ret_val == 2);
+    for (i = 0; i < 2; i++) {
+        slot = (tail + i) % gen_sq.elements;
+        gen_cmd = (struct nvme_gen_cmd *)(sq + (slot * 64));
+        printf("\tSlot %u: Cmd Id = 0x%x, PRP1 = 0x%lx\n", slot,
+            gen_cmd->command_id, (unsigned long)gen_cmd->prp1);
+    }
+    wait_and_reap(file_desc, FP_COMMIT_CQ_ID, 2);
+
+    munmap(sq, sq_size);
+    free(addr);
+}
+
+void test_rings(int file_desc, uint8_t use_kthread)
+{
+    int ret_val;
+    uint32_t i, j, num_submitted, num_reaped, num_ok, num_err, buf_id;
+    uint8_t *rings;
+    void *addr;
+    struct nvme_rings_setup setup;
+    struct nvme_ring_hdr *sq_hdr, *cq_hdr;
+    struct nvme_ring_sqe *sqes, *sqe;
+    struct nvme_ring_cqe *cqes, *cqe;
+    struct nvme_64b_send user_cmd;
+    struct nvme_user_io nvme_read;
+
+    if (posix_memalign(&addr, 4096, 4 * READ_BUFFER_SIZE)) {
+        printf("Memalign Failed");
+        return;
+    }
+    if (ioctl_reg_buf(file_desc, addr, 4 * READ_BUFFER_SIZE, 2, &buf_id) < 0) {
+        free(addr);
+        return;
+    }
+    drain_cq(file_desc, FP_RING_CQ_ID);
+
+    printf("\nTEST: Rings for the ASQ, of bad sizes and without rings\n");
+    memset(&setup, 0, sizeof(setup));
+    setup.sq_entries = 8;
+    setup.cq_entries = 8;
+    ret_val = ioctl_setup_rings(file_desc, &setup);
+    report("Rings for the ASQ", ret_val == -EINVAL);
+    setup.sq_id = FP_RING_SQ_ID;
+    setup.sq_entries = 6;
+    ret_val = ioctl_setup_rings(file_desc, &setup);
+    report("Rings not a power of 2", ret_val == -EINVAL);
+    ret_val = ioctl_ring_enter(file_desc, FP_RING_SQ_ID, &num_submitted,
+        &num_reaped);
+    report("Ring Enter without rings", ret_val == -EBADSLT);
+
+    printf("\nTEST: 4 reads and 1 bad one through the rings, %s\n",
+        use_kthread ? "kernel thread" : "Ring Enter");
+    setup.sq_entries = 8;
+    setup.use_kthread = use_kthread;
+    ret_val = ioctl_setup_rings(file_desc, &setup);
+    if (ret_val < 0) {
+        ioctl_unreg_buf(file_desc, buf_id);
+        free(addr);
+        return;
+    }
+    /* The rings would reap the CE's of any other SQ on their CQ */
+    ret_val = ioctl_prep_sq(file_desc, FP_NEW_SQ_ID, FP_RING_CQ_ID, 64, 1);
+    report("Prepare a SQ on the CQ of rings",
+        (ret_val < 0) && (errno == EBUSY));
+    rings = mmap(0, setup.mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+        file_desc, (off_t)((0x3 << 0x12) | FP_RING_SQ_ID) * PAGE_SIZE_I);
+    if (rings == MAP_FAILED) {
+        printf("mapping failed\n");
+        goto teardown;
+    }
+    sq_hdr = (struct nvme_ring_hdr *)(rings + setup.sq_hdr_off);
+    sqes = (struct nvme_ring_sqe *)(rings + setup.sq_ring_off);
+    cq_hdr = (struct nvme_ring_hdr *)(rings + setup.cq_hdr_off);
+    cqes = (struct nvme_ring_cqe *)(rings + setup.cq_ring_off);
+
+    /* The 5th read lies outside of the registered buffer */
+    for (i = 0; i < 5; i++) {
+        fill_nvme_read(&user_cmd, &nvme_read, FP_RING_SQ_ID, NULL);
+        sqe = &sqes[(sq_hdr->tail + i) & (sq_hdr->entries - 1)];
+        memset(sqe, 0, sizeof(struct nvme_ring_sqe));
+        memcpy(sqe->cmd, &nvme_read, sizeof(sqe->cmd));
+        sqe->user_tag = i + 1;
+        sqe->bit_mask = user_cmd.bit_mask;
+        sqe->reg_buf_id = buf_id;
+        sqe->reg_buf_offset = i * READ_BUFFER_SIZE;
+        sqe->data_buf_size = READ_BUFFER_SIZE;
+        sqe->data_dir = 2;
+    }
+    __sync_synchronize();
+    sq_hdr->tail += 5;
+
+    for (j = 0; (j < 1000) && ((cq_hdr->tail - cq_hdr->head) < 5); j++) {
+        if (!use_kthread) {
+            ret_val = ioctl_ring_enter(file_desc, FP_RING_SQ_ID,
+                &num_submitted, &num_reaped);
+            if (ret_val < 0) {
+                printf("\tRing Enter failed = %d\n", ret_val);
+                break;
+            }
+        }
+        usleep(1000);
+    }
+    __sync_synchronize();
+
+    num_ok = num_err = 0;
+    while (cq_hdr->head != cq_hdr->tail) {
+        cqe = &cqes[cq_hdr->head & (cq_hdr->entries - 1)];
+        printf("\tUser tag = %lu, Err = %d, Latency = %lu ns\n",
+            (unsigned long)cqe->user_tag, cqe->err,
+            (unsigned long)(cqe->complete_ns - cqe->submit_ns));
+        if ((cqe->err == 0) && (cqe->user_tag <= 4)) {
+            num_ok++;
+        } else if ((cqe->err == -EINVAL) && (cqe->user_tag == 5)) {
+            num_err++;
+        }
+        cq_hdr->head++;
+    }
+    report("Completions through the rings", (num_ok == 4) && (num_err == 1));
+    munmap(rings, setup.mmap_size);
+
+teardown:
+    setup.sq_entries = 0;
+    ret_val = ioctl_setup_rings(file_desc, &setup);
+    report("Tear down rings", ret_val == 0);
+    ioctl_unreg_buf(file_desc, buf_id);
+    free(addr);
+}
+
+void test_reap_poll(int file_desc)
+{
+    int ret_val;
+    void *addr;
+    struct nvme_64b_send user_cmd;
+    struct nvme_user_io nvme_read;
+
+    if (posix_memalign(&addr, 4096, READ_BUFFER_SIZE)) {
+        printf("Memalign Failed");
+        return;
+    }
+    drain_cq(file_desc, FP_CQ_ID);
+
+    printf("\nTEST: Reap polling longer than allowed\n");
+    ret_val = ioctl_reap_poll(file_desc, FP_CQ_ID, 1, MAX_REAP_POLL_US + 1, 0);
+    report("Poll time too long", ret_val == -EINVAL);
+
+    printf("\nTEST: Reap a read right after ringing, busy and hybrid poll\n");
+    fill_nvme_read(&user_cmd, &nvme_read, FP_SQ_ID, addr);
+    if (ioctl(file_desc, NVME_IOCTL_SEND_64B_CMD, &user_cmd) < 0) {
+        printf("Sending of Command Failed!\n");
+    }
+    ioctl_tst_ring_dbl(file_desc, FP_SQ_ID);
+    ret_val = ioctl_reap_poll(file_desc, FP_CQ_ID, 1, MAX_REAP_POLL_US, 0);
+    report("Busy poll reaped the CE", ret_val == 1);
+
+    if (ioctl(file_desc, NVME_IOCTL_SEND_64B_CMD, &user_cmd) < 0) {
+        printf("Sending of Command Failed!\n");
+    }
+    ioctl_tst_ring_dbl(file_desc, FP_SQ_ID);
+    ret_val = ioctl_reap_poll(file_desc, FP_CQ_ID, 1, MAX_REAP_POLL_US, 1);
+    report("Hybrid poll reaped the CE", ret_val == 1);
+
+    drain_cq(file_desc, FP_CQ_ID);
+    free(addr);
+}
+
+void test_lat_stats(int file_desc)
+{
+    int ret_val;
+    uint32_t i, sum;
+    uint32_t *hists;
+    void *addr;
+    struct nvme_64b_send user_cmd;
+    struct nvme_user_io nvme_read;
+
+    hists = malloc(LAT_HIST_MAX * LAT_HIST_BUCKETS * sizeof(uint32_t));
+    if (hists == NULL) {
+        printf("Malloc Failed");
+        return;
+    }
+    if (posix_memalign(&addr, 4096, READ_BUFFER_SIZE)) {
+        printf("Memalign Failed");
+        free(hists);
+        return;
+    }
+    drain_cq(file_desc, FP_CQ_ID);
+
+    printf("\nTEST: Bad recording control and missing SQ\n");
+    ret_val = ioctl_lat_stats(file_desc, FP_SQ_ID, LAT_CTL_ON + 1, 0, NULL);
+    report("Bad recording control", ret_val == -EINVAL);
+    ret_val = ioctl_lat_stats(file_desc, 0xFFFF, LAT_CTL_KEEP, 0, hists);
+    report("Latency stats of missing SQ", ret_val == -EBADSLT);
+
+    printf("\nTEST: Record the latency of 4 reads\n");
+    ret_val = ioctl_lat_stats(file_desc, FP_SQ_ID, LAT_CTL_ON, 1, NULL);
+    report("Recording on, histograms reset", ret_val == 0);
+    for (i = 0; i < 4; i++) {
+        fill_nvme_read(&user_cmd, &nvme_read, FP_SQ_ID, addr);
+        if (ioctl(file_desc, NVME_IOCTL_SEND_64B_CMD, &user_cmd) < 0) {
+            printf("Sending of Command Failed!\n");
+        }
+    }
+    ioctl_tst_ring_dbl(file_desc, FP_SQ_ID);
+    wait_and_reap(file_desc, FP_CQ_ID, 4);
+
+    ret_val = ioctl_lat_stats(file_desc, FP_SQ_ID, LAT_CTL_OFF, 1, hists);
+    for (i = 0, sum = 0; i < LAT_HIST_BUCKETS; i++) {
+        sum += hists[(LAT_SUBMIT_REAP * LAT_HIST_BUCKETS) + i];
+    }
+    printf("\tSubmit to reap histogram counts %u cmds\n", sum);
+    report("All 4 reads recorded", (ret_val == 0) && (sum == 4));
+
+    ret_val = ioctl_lat_stats(file_desc, FP_SQ_ID, LAT_CTL_KEEP, 0, hists);
+    for (i = 0, sum = 0; i < LAT_HIST_MAX * LAT_HIST_BUCKETS; i++) {
+        sum += hists[i];
+    }
+    report("Histograms reset", (ret_val == 0) && (sum == 0));
+
+    free(addr);
+    free(hists);
+}
+
+void test_perf_stats(int file_desc)
+{
+    int ret_val;
+    uint32_t i, size;
+    uint64_t *irq_counts;
+    void *addr;
+    struct nvme_perf_data *perf_data;
+    struct nvme_64b_send user_cmd;
+    struct nvme_user_io nvme_read;
+
+    /* Room for the irq counts of up to 2048 vectors, the MSI-X max */
+    size = sizeof(struct nvme_perf_data) + (2048 * sizeof(uint64_t));
+    perf_data = malloc(size);
+    if (perf_data == NULL) {
+        printf("Malloc Failed");
+        return;
+    }
+    if (posix_memalign(&addr, 4096, READ_BUFFER_SIZE)) {
+        printf("Memalign Failed");
+        free(perf_data);
+        return;
+    }
+    drain_cq(file_desc, FP_CQ_ID);
+
+    printf("\nTEST: Bad scope and missing Q's\n");
+    ret_val = ioctl_perf_stats(file_desc, PERF_CQ + 1, 0, 0, perf_data, size);
+    report("Bad scope", ret_val == -EINVAL);
+    ret_val = ioctl_perf_stats(file_desc, PERF_SQ, 0xFFFF, 0, perf_data, size);
+    report("Perf stats of missing SQ", ret_val == -EBADSLT);
+
+    printf("\nTEST: Device counters and irq counts\n");
+    ret_val = ioctl_perf_stats(file_desc, PERF_DEVICE, 0, 0, perf_data, size);
+    report("Device perf stats", ret_val >= (int)sizeof(struct nvme_perf_data));
+    if (ret_val >= (int)sizeof(struct nvme_perf_data)) {
+        printf("\tCmds sent = %lu, Bytes sent = %lu, Doorbells = %lu\n",
+            (unsigned long)perf_data->counters.cmds_sent,
+            (unsigned long)perf_data->counters.bytes_sent,
+            (unsigned long)perf_data->counters.dbs_rung);
+        printf("\tSQ full = %lu, CE's reaped = %lu, Latent errors = %lu\n",
+            (unsigned long)perf_data->counters.sq_full,
+            (unsigned long)perf_data->counters.ces_reaped,
+            (unsigned long)perf_data->counters.latent_errs);
+        irq_counts = (uint64_t *)(perf_data + 1);
+        for (i = 0; i < perf_data->num_vecs; i++) {
+            printf("\tVector %u fired %lu times\n", i,
+                (unsigned long)irq_counts[i]);
+        }
+    }
+    ret_val = ioctl_perf_stats(file_desc, PERF_DEVICE, 0, 0, perf_data,
+        sizeof(struct nvme_perf_counters));
+    report("Truncated to the buffer",
+        ret_val == (int)sizeof(struct nvme_perf_counters));
+
+    printf("\nTEST: SQ and CQ counters of 1 read\n");
+    ioctl_perf_stats(file_desc, PERF_SQ, FP_SQ_ID, 1, NULL, 0);
+    ioctl_perf_stats(file_desc, PERF_CQ, FP_CQ_ID, 1, NULL, 0);
+    fill_nvme_read(&user_cmd, &nvme_read, FP_SQ_ID, addr);
+    if (ioctl(file_desc, NVME_IOCTL_SEND_64B_CMD, &user_cmd) < 0) {
+        printf("Sending of Command Failed!\n");
+    }
+    ioctl_tst_ring_dbl(file_desc, FP_SQ_ID);
+    wait_and_reap(file_desc, FP_CQ_ID, 1);
+    ret_val = ioctl_perf_stats(file_desc, PERF_SQ, FP_SQ_ID, 0, perf_data,
+        size);
+    report("SQ counters", (ret_val == (int)sizeof(struct nvme_perf_data)) &&
+        (perf_data->counters.cmds_sent == 1) &&
+        (perf_data->counters.bytes_sent == READ_BUFFER_SIZE) &&
+        (perf_data->counters.dbs_rung == 1) && (perf_data->num_vecs == 0));
+    ret_val = ioctl_perf_stats(file_desc, PERF_CQ, FP_CQ_ID, 0, perf_data,
+        size);
+    report("CQ counters", (ret_val == (int)sizeof(struct nvme_perf_data)) &&
+        (perf_data->counters.ces_reaped == 1));
+
+    free(addr);
+    free(perf_data);
+}
+
+void test_snapshot(int file_desc)
+{
+    int ret_val;
+    uint32_t size, needed;
+    void *buffer;
+    struct nvme_snap_hdr *hdr;
+
+    printf("\nTEST: Snapshot into no and too small buffers\n");
+    size = 0;
+    ret_val = ioctl_snapshot(file_desc, NULL, &size);
+    report("Snapshot without buffer returns ENOSPC",
+        (ret_val == -ENOSPC) && (size >= sizeof(struct nvme_snap_hdr)));
+    needed = size;
+
+    buffer = malloc(needed);
+    if (buffer == NULL) {
+        printf("Malloc Failed");
+        return;
+    }
+    size = needed - 1;
+    ret_val = ioctl_snapshot(file_desc, buffer, &size);
+    report("Snapshot 1 byte short returns ENOSPC",
+        (ret_val == -ENOSPC) && (size == needed));
+
+    printf("\nTEST: Snapshot into a buffer of the size needed\n");
+    size = needed;
+    ret_val = ioctl_snapshot(file_desc, buffer, &size);
+    hdr = (struct nvme_snap_hdr *)buffer;
+    report("Snapshot", (ret_val == 0) && (size == needed) &&
+        (hdr->version == NVME_SNAPSHOT_VERSION) && (hdr->size == needed));
+    if (ret_val == 0) {
+        printf("\tCQ's = %u, SQ's = %u, Cmds = %u, IRQ's = %u, Meta = %u\n",
+            hdr->num_cqs, hdr->num_sqs, hdr->num_cmds, hdr->num_irqs,
+            hdr->num_metas);
+    }
+    free(buffer);
+}
+
+void test_share(int file_desc, const char *dev_name)
+{
+    int ret_val, file_desc2;
+    void *addr;
+    uint8_t bitmap[FP_NUM_CQ_IDS / 8];
+    struct nvme_64b_send user_cmd;
+    struct nvme_user_io nvme_read;
+
+    if (posix_memalign(&addr, 4096, READ_BUFFER_SIZE)) {
+        printf("Memalign Failed");
+        return;
+    }
+    drain_cq(file_desc, FP_CQ_ID);
+
+    printf("\nTEST: Open the device again, unshared and shared\n");
+    file_desc2 = open(dev_name, 0);
+    report("2nd open of an unshared device", file_desc2 < 0);
+    if (file_desc2 >= 0) {
+        close(file_desc2);
+    }
+    ret_val = ioctl(file_desc, NVME_IOCTL_SHARE_DEVICE, 1);
+    report("Share the device", ret_val == 0);
+    file_desc2 = open(dev_name, 0);
+    report("2nd open of a shared device", file_desc2 >= 0);
+    if (file_desc2 < 0) {
+        ioctl(file_desc, NVME_IOCTL_SHARE_DEVICE, 0);
+        free(addr);
+        return;
+    }
+
+    printf("\nTEST: The 2nd file uses the Q's of the controlling file\n");
+    ret_val = ioctl(file_desc2, NVME_IOCTL_SHARE_DEVICE, 0);
+    ret_val = (ret_val < 0) ? -errno : ret_val;
+    report("Share from the 2nd file", ret_val == -EPERM);
+    fill_nvme_read(&user_cmd, &nvme_read, FP_SQ_ID, addr);
+    ret_val = ioctl(file_desc2, NVME_IOCTL_SEND_64B_CMD, &user_cmd);
+    ret_val = (ret_val < 0) ? -errno : ret_val;
+    report("Send to another file's SQ", ret_val == -EACCES);
+    ret_val = ioctl_reap_wait(file_desc2, FP_CQ_ID, 1, 10);
+    report("Reap Wait on another file's CQ", ret_val == -EACCES);
+
+    /* Only the controlling file sees the CE of its read */
+    if (ioctl(file_desc, NVME_IOCTL_SEND_64B_CMD, &user_cmd) < 0) {
+        printf("Sending of Command Failed!\n");
+    }
+    ioctl_tst_ring_dbl(file_desc, FP_SQ_ID);
+    if (ioctl_reap_wait(file_desc, FP_CQ_ID, 1, 1000) < 1) {
+        printf("\tCE's did not arrive in time!\n");
+    }
+    memset(bitmap, 0xFF, sizeof(bitmap));
+    ret_val = ioctl_get_ready_cqs(file_desc2, bitmap, FP_NUM_CQ_IDS);
+    report("Another file's CQ is not ready", (ret_val >= 0) &&
+        ((bitmap[FP_CQ_ID / 8] & (1 << (FP_CQ_ID % 8))) == 0));
+    ioctl_reap_cq(file_desc, FP_CQ_ID, 1, 16, 0);
+
+    printf("\nTEST: Close the 2nd file and stop sharing\n");
+    close(file_desc2);
+    ret_val = ioctl(file_desc, NVME_IOCTL_SHARE_DEVICE, 0);
+    report("Stop sharing the device", ret_val == 0);
+    file_desc2 = open(dev_name, 0);
+    report("Open once no longer shared", file_desc2 < 0);
+    if (file_desc2 >= 0) {
+        close(file_desc2);
+    }
+
+    free(addr);
+}
@@ -0,0 +1,51 @@
+/*
+ * The fast path tests expect the IO Q's of test case 30 with the MSI-X irqs
+ * of test case 17, i.e. contig SQ:CQ 32:21, 33:22 and 34:23.
+ */
+#define FP_SQ_ID        33  /* SQ of the batch, reg buf and reap tests */
+#define FP_CQ_ID        22
+#define FP_SQ2_ID       32  /* 2nd SQ of the batch tests */
+#define FP_CQ2_ID       21
+#define FP_NUM_CQ_IDS   64  /* CQ ID's covered by the ready CQ's bitmap */
+#define FP_COMMIT_SQ_ID FP_SQ2_ID /* SQ mmap'ed and committed to */
+#define FP_COMMIT_CQ_ID FP_CQ2_ID
+#define FP_RING_SQ_ID   34  /* SQ fed by shared memory rings */
+#define FP_RING_CQ_ID   23
+#define FP_NEW_SQ_ID    60  /* SQ ID no case creates */
+
+void fill_nvme_read(struct nvme_64b_send *user_cmd,
+    struct nvme_user_io *nvme_read, uint16_t sq_id, void *addr);
+int ioctl_send_batch(int file_desc, struct nvme_64b_send *cmds,
+    struct nvme_64b_status *sts, uint32_t num_cmds, uint8_t ring_dbl);
+int ioctl_reg_buf(int file_desc, void *addr, uint32_t size, uint8_t data_dir,
+    uint32_t *buf_id);
+int ioctl_unreg_buf(int file_desc, uint32_t buf_id);
+int ioctl_reap_wait(int file_desc, uint16_t cq_id, uint32_t min_elements,
+    uint32_t timeout_ms);
+int ioctl_get_ready_cqs(int file_desc, uint8_t *bitmap, uint32_t num_cq_ids);
+int ioctl_set_cq_eventfd(int file_desc, uint16_t cq_id, int efd);
+int ioctl_commit_sq(int file_desc, uint16_t sq_id, uint16_t new_tail,
+    struct nvme_64b_send *cmds, uint8_t ring_dbl);
+int ioctl_setup_rings(int file_desc, struct nvme_rings_setup *setup);
+int ioctl_ring_enter(int file_desc, uint16_t sq_id, uint32_t *num_submitted,
+    uint32_t *num_reaped);
+int ioctl_reap_poll(int file_desc, uint16_t cq_id, uint32_t elements,
+    uint32_t poll_us, uint8_t poll_hybrid);
+int ioctl_lat_stats(int file_desc, uint16_t sq_id, uint8_t ctl, uint8_t reset,
+    uint32_t *buffer);
+int ioctl_perf_stats(int file_desc, uint8_t scope, uint16_t q_id,
+    uint8_t reset, void *buffer, uint32_t size);
+int ioctl_snapshot(int file_desc, void *buffer, uint32_t *size);
+
+void test_batch(int file_desc);
+void test_reg_buf(int file_desc);
+void test_reap_wait(int file_desc);
+void test_ready_cqs(int file_desc);
+void test_cq_eventfd(int file_desc);
+void test_commit_sq(int file_desc);
+void test_rings(int file_desc, uint8_t use_kthread);
+void test_reap_poll(int file_desc);
+void test_lat_stats(int file_desc);
+void test_perf_stats(int file_desc);
+void test_snapshot(int file_desc);
+void test_share(int file_desc, const char *dev_name);
@@ -33,6 +33,7 @@ void ioctl_create_prp_more_than_two_page(int file_desc)
     user_cmd.cmd_buf_ptr = NULL;
     user_cmd.data_buf_size = 8200; /* more than 2 page */
     user_cmd.data_buf_ptr = addr;
+    user_cmd.reg_buf_id = 0;
 
 
     printf("User Call to Create PRP more than one page:\n");
@@ -60,6 +61,7 @@ void ioctl_create_prp_less_than_one_page(int file_desc)
     user_cmd.cmd_buf_ptr = NULL;
     user_cmd.data_buf_size = 95;
     user_cmd.data_buf_ptr = addr;
+    user_cmd.reg_buf_id = 0;
 
 
     printf("User Call to Create PRP less than one page:\n");
@@ -87,6 +89,7 @@ void ioctl_create_prp_one_page(int file_desc)
     user_cmd.cmd_buf_ptr = NULL;
     user_cmd.data_buf_size = 4096;
     user_cmd.data_buf_ptr = addr;
+    user_cmd.reg_buf_id = 0;
 
     printf("User Call to Create PRP single page:\n");
 
@@ -115,6 +118,7 @@ void ioctl_create_list_of_prp(int file_desc)
     user_cmd.cmd_buf_ptr = NULL;
     user_cmd.data_buf_size = (512 * 4096) + 4096;
     user_cmd.data_buf_ptr = addr;
+    user_cmd.reg_buf_id = 0;
     printf("User Call to Create Lists of PRP's\n");
 
     ret_val = ioctl(file_desc, NVME_IOCTL_SEND_64B_CMD, &user_cmd);
@@ -141,6 +145,7 @@ void ioctl_create_fill_list_of_prp(int file_desc)
     user_cmd.cmd_buf_ptr = NULL;
     user_cmd.data_buf_size = 1023 * 4096;
     user_cmd.data_buf_ptr = addr;
+    user_cmd.reg_buf_id = 0;
 
     printf("User Call to Create Lists of PRP's\n");
 
@@ -174,6 +179,7 @@ void ioctl_create_discontig_iosq(int file_desc, void *addr)
     user_cmd.cmd_buf_ptr = (u_int8_t *) &create_sq_cmd;
     user_cmd.data_buf_size = DISCONTIG_IO_SQ_SIZE;
     user_cmd.data_buf_ptr = addr;
+    user_cmd.reg_buf_id = 0;
     user_cmd.data_dir = 2;
 
     printf("User Call to send command\n");
@@ -203,6 +209,7 @@ void ioctl_delete_ioq(int file_desc, uint8_t opcode, uint16_t qid)
     user_cmd.cmd_buf_ptr = (u_int8_t *) &del_q_cmd;
     user_cmd.data_buf_size = 0;
     user_cmd.data_buf_ptr = NULL;
+    user_cmd.reg_buf_id = 0;
     user_cmd.data_dir = 2;
 
     printf("User Call to send command\n");
@@ -236,6 +243,7 @@ void ioctl_create_contig_iosq(int file_desc)
     user_cmd.cmd_buf_ptr = (u_int8_t *) &create_sq_cmd;
     user_cmd.data_buf_size = 0;
     user_cmd.data_buf_ptr = NULL;
+    user_cmd.reg_buf_id = 0;
     user_cmd.data_dir = 2;
 
     printf("User Call to send command\n");
@@ -267,6 +275,7 @@ void ioctl_create_contig_iocq(int file_desc)
     user_cmd.cmd_buf_ptr = (u_int8_t *) &create_cq_cmd;
     user_cmd.data_buf_size = 0;
     user_cmd.data_buf_ptr = NULL;
+    user_cmd.reg_buf_id = 0;
     user_cmd.data_dir = 0;
 
     printf("User Call to send command\n");
@@ -299,6 +308,7 @@ void ioctl_create_discontig_iocq(int file_desc, void *addr)
     user_cmd.cmd_buf_ptr = (u_int8_t *) &create_cq_cmd;
     user_cmd.data_buf_size = DISCONTIG_IO_CQ_SIZE;
     user_cmd.data_buf_ptr = addr;
+    user_cmd.reg_buf_id = 0;
     user_cmd.data_dir = 0;
 
     printf("User Call to send command\n");
@@ -341,6 +351,7 @@ void ioctl_send_identify_cmd(int file_desc, void* addr)
     user_cmd.cmd_buf_ptr = (u_int8_t *) &nvme_identify;
     user_cmd.data_buf_size = 4096;
     user_cmd.data_buf_ptr = addr;
+    user_cmd.reg_buf_id = 0;
     user_cmd.data_dir = 0;
 
     printf("User Call to send command\n");
@@ -393,6 +404,7 @@ void ioctl_send_nvme_write(int file_desc, void *addr)
     user_cmd.cmd_buf_ptr = (u_int8_t *) &nvme_write;
     user_cmd.data_buf_size = READ_BUFFER_SIZE;
     user_cmd.data_buf_ptr = addr;
+    user_cmd.reg_buf_id = 0;
     user_cmd.data_dir = 2;
 
     printf("User Call to send command\n");
@@ -443,6 +455,7 @@ void ioctl_send_nvme_read(int file_desc, void* addr)
     user_cmd.cmd_buf_ptr = (u_int8_t *) &nvme_read;
     user_cmd.data_buf_size = READ_BUFFER_SIZE;
     user_cmd.data_buf_ptr = addr;
+    user_cmd.reg_buf_id = 0;
     user_cmd.data_dir = 0;
 
     printf("User Call to send command\n");
@@ -495,6 +508,7 @@ void ioctl_send_nvme_write_using_metabuff(int file_desc, uint32_t meta_id, void*
     user_cmd.cmd_buf_ptr = (u_int8_t *) &nvme_write;
     user_cmd.data_buf_size = READ_BUFFER_SIZE;
     user_cmd.data_buf_ptr = addr;
+    user_cmd.reg_buf_id = 0;
     user_cmd.meta_buf_id = meta_id;
     user_cmd.data_dir = 2;
 
@@ -545,6 +559,7 @@ void ioctl_send_nvme_read_using_metabuff(int file_desc, void* addr, uint32_t met
     user_cmd.cmd_buf_ptr = (u_int8_t *) &nvme_read;
     user_cmd.data_buf_size = READ_BUFFER_SIZE;
     user_cmd.data_buf_ptr = addr;
+    user_cmd.reg_buf_id = 0;
     user_cmd.meta_buf_id = meta_id;
     user_cmd.data_dir = 0;
 